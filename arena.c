@@ -0,0 +1,119 @@
+#include "arena.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+arena*
+arena_new(void)
+{
+  arena* a = calloc(1, sizeof(arena));
+  if (a != NULL) {
+    pthread_mutex_init(&a->lock, NULL);
+  }
+  return a;
+}
+
+static arena_block*
+arena_new_block(arena* a, size_t size)
+{
+  arena_block* b = malloc(sizeof(arena_block) + size);
+  if (b == NULL) {
+    return NULL;
+  }
+  b->size = size;
+  b->used = 0;
+  b->next = a->blocks;
+  a->blocks = b;
+  a->memory_usage += sizeof(arena_block) + size;
+  return b;
+}
+
+// arena_alloc_block serves an allocation that doesn't fit in the current
+// block. Large allocations get a block of their own so the rest of the
+// current block isn't wasted, others start a new current block.
+static void*
+arena_alloc_block(arena* a, size_t size)
+{
+  bool large = size > ARENA_BLOCK_SIZE / 4;
+  arena_block* b = arena_new_block(a, large ? size : ARENA_BLOCK_SIZE);
+  if (b == NULL) {
+    return NULL;
+  }
+  b->used = size;
+  if (!large) {
+    __atomic_store_n(&a->current, b, __ATOMIC_RELEASE);
+  }
+  return b->data;
+}
+
+// arena_alloc returns size bytes aligned to ARENA_ALIGN, or NULL when out of
+// memory.
+void*
+arena_alloc(arena* a, size_t size)
+{
+  size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+  arena_block* b = a->current;
+  if (b != NULL && b->used <= b->size && size <= b->size - b->used) {
+    void* p = b->data + b->used;
+    b->used += size;
+    return p;
+  }
+  return arena_alloc_block(a, size);
+}
+
+// arena_alloc_concurrent is arena_alloc for arenas shared between threads.
+// The current block is bumped with an atomic add, the lock is only taken to
+// add a block once it's full. A thread whose add went past the end leaves
+// the rest of the block unused.
+void*
+arena_alloc_concurrent(arena* a, size_t size)
+{
+  size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+  for (;;) {
+    arena_block* b = __atomic_load_n(&a->current, __ATOMIC_ACQUIRE);
+    if (b != NULL && size <= ARENA_BLOCK_SIZE / 4) {
+      size_t offset = __atomic_fetch_add(&b->used, size, __ATOMIC_RELAXED);
+      if (offset + size <= b->size) {
+        return b->data + offset;
+      }
+    }
+
+    // another thread may have added a block while this one waited for the
+    // lock, then the allocation is tried in that one
+    pthread_mutex_lock(&a->lock);
+    bool retry = __atomic_load_n(&a->current, __ATOMIC_RELAXED) != b;
+    void* p = retry ? NULL : arena_alloc_block(a, size);
+    pthread_mutex_unlock(&a->lock);
+    if (!retry) {
+      return p;
+    }
+  }
+}
+
+char*
+arena_strdup(arena* a, const char* str)
+{
+  size_t len = strlen(str) + 1;
+  char* p = arena_alloc(a, len);
+  if (p != NULL) {
+    memcpy(p, str, len);
+  }
+  return p;
+}
+
+void
+arena_free(arena* a)
+{
+  if (a == NULL) {
+    return;
+  }
+
+  arena_block* b = a->blocks;
+  while (b != NULL) {
+    arena_block* next = b->next;
+    free(b);
+    b = next;
+  }
+  pthread_mutex_destroy(&a->lock);
+  free(a);
+}
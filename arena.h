@@ -0,0 +1,33 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <pthread.h>
+#include <stddef.h>
+
+#define ARENA_BLOCK_SIZE  (64 * 1024)
+#define ARENA_ALIGN       sizeof(void*)
+
+typedef struct arena_block_s {
+  struct arena_block_s* next;
+  size_t size;
+  size_t used; // bumped atomically by arena_alloc_concurrent, can go past size
+  char data[];
+} arena_block;
+
+// arena hands out memory from large blocks by bumping a pointer, everything
+// is released at once by arena_free. arena_alloc is not thread safe,
+// arena_alloc_concurrent can be called from several threads.
+typedef struct arena_s {
+  pthread_mutex_t lock; // taken by arena_alloc_concurrent to add a block
+  arena_block* blocks; // newest first
+  arena_block* current; // block that small allocations are bumped in
+  size_t memory_usage; // bytes taken from malloc
+} arena;
+
+arena* arena_new(void);
+void* arena_alloc(arena* a, size_t size);
+void* arena_alloc_concurrent(arena* a, size_t size);
+char* arena_strdup(arena* a, const char* str);
+void arena_free(arena* a);
+
+#endif
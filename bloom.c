@@ -1,83 +1,76 @@
 #include "bloom.h"
 #include "utils.h"
-#include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-// TODO: test different hash functions here
-uint32_t
-hash_djb2(const void* buff, size_t length)
+static bloom_filter*
+bloom_filter_alloc(size_t num_bits, size_t num_probes)
 {
-  uint32_t hash = 5381;
-  const uint8_t* data = buff;
-  for (size_t i = 0; i < length; i++) {
-    hash = ((hash << 5) + hash) + data[i];
+  bloom_filter* filter = malloc(sizeof(*filter));
+  if (NULL == filter) {
+    fprintf(stderr, "Out of memory.\n");
+    exit(EXIT_FAILURE);
   }
-  return hash;
+
+  filter->num_items = 0;
+  filter->num_probes = num_probes;
+  filter->vec = bit_vec_new(num_bits);
+  return filter;
 }
 
-uint32_t
-hash_sdbm(const void* buff, size_t length)
+// bloom_filter_new creates a filter of num_bits bits that sets num_probes bits
+// per key.
+bloom_filter*
+bloom_filter_new(size_t num_bits, size_t num_probes)
 {
-  uint32_t hash = 0;
-  const uint8_t* data = buff;
-  for (size_t i = 0; i < length; i++) {
-    hash = data[i] + (hash << 6) + (hash << 16) - hash;
+  if (num_probes < 1) {
+    num_probes = 1;
+  } else if (num_probes > BLOOM_MAX_PROBES) {
+    num_probes = BLOOM_MAX_PROBES;
   }
-  return hash;
+  return bloom_filter_alloc(num_bits ? num_bits : 64, num_probes);
 }
 
+// bloom_filter_new_bits_per_key sizes the filter for expected_items keys,
+// the amount of probes that minimizes false positives for bits_per_key is
+// bits_per_key * ln(2).
 bloom_filter*
-bloom_filter_new(size_t size, size_t num_functions, ...)
+bloom_filter_new_bits_per_key(size_t expected_items, size_t bits_per_key)
 {
-  va_list argp;
-  bloom_filter* filter = malloc(sizeof(*filter));
-  if (NULL == filter) {
-    fprintf(stderr, "Out of memory.\n");
-    exit(EXIT_FAILURE);
-  }
-
-  filter->num_items = 0;
-  filter->vec = bit_vec_new(size);
-  filter->num_functions = num_functions;
-  filter->hash_functions = malloc(sizeof(hash32_func) * num_functions);
-  if (NULL == filter->hash_functions) {
-    fprintf(stderr, "Out of memory.\n");
-    exit(EXIT_FAILURE);
-  }
-  va_start(argp, num_functions);
-  for (int i = 0; i < num_functions; i++) {
-    filter->hash_functions[i] = va_arg(argp, hash32_func);
+  size_t num_bits = expected_items * bits_per_key;
+  if (num_bits < 64) {
+    num_bits = 64;
   }
-  va_end(argp);
-  return filter;
+  return bloom_filter_new(num_bits, (size_t)(bits_per_key * 0.69 + 0.5));
 }
 
 bloom_filter*
 bloom_filter_new_default(size_t size)
 {
-  return bloom_filter_new(size, 2, hash_djb2, hash_sdbm);
+  return bloom_filter_new(size, 2);
 }
 
 void
 bloom_filter_free(bloom_filter* filter)
 {
   bit_vec_free(filter->vec);
-  free(filter->hash_functions);
   free(filter);
 }
 
+// the probes are derived from a single hash with double hashing
+// (Kirsch-Mitzenmacher), probe i is h1 + i * h2.
 void
 bloom_filter_put(bloom_filter* filter, const void* data, size_t length)
 {
-  for (int i = 0; i < filter->num_functions; i++) {
-    uint32_t cur_hash = filter->hash_functions[i](data, length);
-    bit_vec_set(filter->vec, cur_hash % filter->vec->size, true);
+  uint64_t hash = hash64(data, length, BLOOM_HASH_SEED);
+  uint64_t h1 = (uint32_t)hash, h2 = hash >> 32;
+  for (size_t i = 0; i < filter->num_probes; i++) {
+    bit_vec_set(filter->vec, (h1 + i * h2) % filter->vec->size, true);
   }
-  filter->num_items++;
+  __atomic_add_fetch(&filter->num_items, 1, __ATOMIC_RELAXED);
 }
 
 void
@@ -87,23 +80,49 @@ bloom_filter_put_str(bloom_filter* filter, const char* str)
 }
 
 bool
-bloom_filter_test(bloom_filter* filter, const void* data, size_t lentgth)
+bloom_filter_test(bloom_filter* filter, const void* data, size_t length)
+{
+  return bloom_filter_test_hash(filter, hash64(data, length, BLOOM_HASH_SEED));
+}
+
+bool
+bloom_filter_test_hash(bloom_filter* filter, uint64_t hash)
 {
-  for (int i = 0; i < filter->num_functions; i++) {
-    uint32_t cur_hash = filter->hash_functions[i](data, lentgth);
-    if (!bit_vec_get(filter->vec, cur_hash % filter->vec->size)) {
+  uint64_t h1 = (uint32_t)hash, h2 = hash >> 32;
+  for (size_t i = 0; i < filter->num_probes; i++) {
+    if (!bit_vec_get(filter->vec, (h1 + i * h2) % filter->vec->size)) {
       return false;
     }
   }
   return true;
 }
 
+// bloom_filter_test_batch tests n keys by their hashes. The word of the first
+// probe of every key is prefetched before any key is tested, so the cache
+// misses of the batch overlap instead of being paid one after the other.
+void
+bloom_filter_test_batch(bloom_filter* filter, const uint64_t* hashes, size_t n, bool* out)
+{
+  for (size_t i = 0; i < n; i++) {
+    size_t bit = (uint32_t)hashes[i] % filter->vec->size;
+    __builtin_prefetch(&filter->vec->mem[bit / BITS_IN_TYPE(uint32_t)]);
+  }
+  for (size_t i = 0; i < n; i++) {
+    out[i] = bloom_filter_test_hash(filter, hashes[i]);
+  }
+}
+
 bool
 bloom_filter_test_str(bloom_filter* filter, const char* str)
 {
   return bloom_filter_test(filter, str, strlen(str));
 }
 
+// dumps start with a magic and version, files written before the filters
+// hashed keys with hash64 have neither and would give false negatives.
+#define BLOOM_FILE_MAGIC    0x424C4F4D
+#define BLOOM_FILE_VERSION  2
+
 int
 bloom_filter_dump(bloom_filter* filter, const char* path)
 {
@@ -112,7 +131,8 @@ bloom_filter_dump(bloom_filter* filter, const char* path)
     return -1;
   }
 
-  if (fwrite(&filter->num_functions, sizeof(size_t), 1, fp) != 1 ||
+  uint32_t header[2] = { BLOOM_FILE_MAGIC, BLOOM_FILE_VERSION };
+  if (fwrite(header, sizeof(header), 1, fp) != 1 || fwrite(&filter->num_probes, sizeof(size_t), 1, fp) != 1 ||
       fwrite(&filter->num_items, sizeof(size_t), 1, fp) != 1 ||
       fwrite(&filter->vec->size, sizeof(size_t), 1, fp) != 1) {
     fclose(fp);
@@ -141,13 +161,20 @@ bloom_filter_from_file(const char* path)
     return NULL;
   }
 
+  uint32_t header[2];
+  if (fread(header, sizeof(header), 1, fp) != 1 || header[0] != BLOOM_FILE_MAGIC ||
+      header[1] != BLOOM_FILE_VERSION) {
+    fclose(fp);
+    return NULL;
+  }
+
   bloom_filter* filter = malloc(sizeof(bloom_filter));
   if (!filter) {
     fclose(fp);
     return NULL;
   }
 
-  if (fread(&filter->num_functions, sizeof(size_t), 1, fp) != 1 ||
+  if (fread(&filter->num_probes, sizeof(size_t), 1, fp) != 1 ||
       fread(&filter->num_items, sizeof(size_t), 1, fp) != 1) {
     free(filter);
     fclose(fp);
@@ -189,12 +216,211 @@ bloom_filter_from_file(const char* path)
     fclose(fp);
     return NULL;
   }
-
-  // TODO: maybe support different hash functions here
-  filter->hash_functions = malloc(sizeof(hash32_func) * 2);
-  filter->hash_functions[0] = hash_djb2;
-  filter->hash_functions[1] = hash_sdbm;
   fclose(fp);
 
+  if (filter->num_probes < 1 || filter->num_probes > BLOOM_MAX_PROBES || num_bits == 0) {
+    bloom_filter_free(filter);
+    return NULL;
+  }
+
+  return filter;
+}
+
+// blocked filters set and test all bits of a key inside one 64 byte block,
+// one bit in each of its 8 words. The upper half of the key's hash picks the
+// block, the lower half is multiplied with a salt per word and the top 6 bits
+// of the product pick the bit.
+static const uint32_t blocked_bloom_salt[BLOCKED_BLOOM_WORDS] = {
+  0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+  0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U
+};
+
+static uint64_t*
+blocked_bloom_block(blocked_bloom* filter, uint64_t hash)
+{
+  // maps the upper 32 bits onto [0, num_blocks) without a division
+  size_t idx = ((hash >> 32) * filter->num_blocks) >> 32;
+  return filter->blocks + idx * BLOCKED_BLOOM_WORDS;
+}
+
+static void
+blocked_bloom_put_scalar(uint64_t* block, uint32_t h)
+{
+  for (size_t i = 0; i < BLOCKED_BLOOM_WORDS; i++) {
+    block[i] |= (uint64_t)1 << ((h * blocked_bloom_salt[i]) >> 26);
+  }
+}
+
+static bool
+blocked_bloom_test_scalar(const uint64_t* block, uint32_t h)
+{
+  for (size_t i = 0; i < BLOCKED_BLOOM_WORDS; i++) {
+    uint64_t mask = (uint64_t)1 << ((h * blocked_bloom_salt[i]) >> 26);
+    if ((block[i] & mask) == 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void (*blocked_bloom_put_impl)(uint64_t* block, uint32_t h) = blocked_bloom_put_scalar;
+static bool (*blocked_bloom_test_impl)(const uint64_t* block, uint32_t h) = blocked_bloom_test_scalar;
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+
+// blocked_bloom_masks computes the masks for the 8 words of a block, words
+// 0-3 in lo and 4-7 in hi.
+__attribute__((target("avx2"))) static inline void
+blocked_bloom_masks(uint32_t h, __m256i* lo, __m256i* hi)
+{
+  __m256i salt = _mm256_loadu_si256((const __m256i*)blocked_bloom_salt);
+  __m256i bits = _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_set1_epi32(h), salt), 26);
+  __m256i one = _mm256_set1_epi64x(1);
+  *lo = _mm256_sllv_epi64(one, _mm256_cvtepu32_epi64(_mm256_castsi256_si128(bits)));
+  *hi = _mm256_sllv_epi64(one, _mm256_cvtepu32_epi64(_mm256_extracti128_si256(bits, 1)));
+}
+
+__attribute__((target("avx2"))) static void
+blocked_bloom_put_avx2(uint64_t* block, uint32_t h)
+{
+  __m256i lo, hi;
+  blocked_bloom_masks(h, &lo, &hi);
+  __m256i* b = (__m256i*)block;
+  _mm256_store_si256(b, _mm256_or_si256(_mm256_load_si256(b), lo));
+  _mm256_store_si256(b + 1, _mm256_or_si256(_mm256_load_si256(b + 1), hi));
+}
+
+__attribute__((target("avx2"))) static bool
+blocked_bloom_test_avx2(const uint64_t* block, uint32_t h)
+{
+  __m256i lo, hi;
+  blocked_bloom_masks(h, &lo, &hi);
+  const __m256i* b = (const __m256i*)block;
+  // testc is set when every bit of the mask is set in the block
+  return _mm256_testc_si256(_mm256_load_si256(b), lo) && _mm256_testc_si256(_mm256_load_si256(b + 1), hi);
+}
+
+__attribute__((constructor)) static void
+blocked_bloom_init(void)
+{
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    blocked_bloom_put_impl = blocked_bloom_put_avx2;
+    blocked_bloom_test_impl = blocked_bloom_test_avx2;
+  }
+}
+#endif
+
+static blocked_bloom*
+blocked_bloom_alloc(size_t num_blocks)
+{
+  blocked_bloom* filter = malloc(sizeof(blocked_bloom));
+  if (filter == NULL) {
+    return NULL;
+  }
+
+  // blocks are aligned to cache lines so a probe touches a single line
+  size_t size = num_blocks * BLOCKED_BLOOM_BLOCK_SIZE;
+  filter->blocks = aligned_alloc(BLOCKED_BLOOM_BLOCK_SIZE, size);
+  if (filter->blocks == NULL) {
+    free(filter);
+    return NULL;
+  }
+  memset(filter->blocks, 0, size);
+  filter->num_blocks = num_blocks;
+  filter->num_items = 0;
+  return filter;
+}
+
+// blocked_bloom_new sizes the filter for expected_items keys at bits_per_key
+// bits each.
+blocked_bloom*
+blocked_bloom_new(size_t expected_items, size_t bits_per_key)
+{
+  size_t bits = expected_items * bits_per_key;
+  size_t num_blocks = (bits + BLOCKED_BLOOM_BLOCK_SIZE * 8 - 1) / (BLOCKED_BLOOM_BLOCK_SIZE * 8);
+  return blocked_bloom_alloc(num_blocks ? num_blocks : 1);
+}
+
+void
+blocked_bloom_free(blocked_bloom* filter)
+{
+  if (filter) {
+    free(filter->blocks);
+    free(filter);
+  }
+}
+
+void
+blocked_bloom_put(blocked_bloom* filter, const void* data, size_t length)
+{
+  uint64_t hash = hash64(data, length, BLOOM_HASH_SEED);
+  blocked_bloom_put_impl(blocked_bloom_block(filter, hash), (uint32_t)hash);
+  filter->num_items++;
+}
+
+bool
+blocked_bloom_test(blocked_bloom* filter, const void* data, size_t length)
+{
+  return blocked_bloom_test_hash(filter, hash64(data, length, BLOOM_HASH_SEED));
+}
+
+bool
+blocked_bloom_test_hash(blocked_bloom* filter, uint64_t hash)
+{
+  return blocked_bloom_test_impl(blocked_bloom_block(filter, hash), (uint32_t)hash);
+}
+
+// blocked_bloom_test_batch prefetches the block of every key before testing
+// them, a key only ever touches its own block.
+void
+blocked_bloom_test_batch(blocked_bloom* filter, const uint64_t* hashes, size_t n, bool* out)
+{
+  for (size_t i = 0; i < n; i++) {
+    __builtin_prefetch(blocked_bloom_block(filter, hashes[i]));
+  }
+  for (size_t i = 0; i < n; i++) {
+    out[i] = blocked_bloom_test_impl(blocked_bloom_block(filter, hashes[i]), (uint32_t)hashes[i]);
+  }
+}
+
+// the encoding is [u64 num_blocks][u64 num_items][blocks]
+size_t
+blocked_bloom_encoded_size(blocked_bloom* filter)
+{
+  return 2 * sizeof(uint64_t) + filter->num_blocks * BLOCKED_BLOOM_BLOCK_SIZE;
+}
+
+void
+blocked_bloom_encode(blocked_bloom* filter, char* buf)
+{
+  uint64_t num_blocks = filter->num_blocks;
+  uint64_t num_items = filter->num_items;
+  memcpy(buf, &num_blocks, sizeof(uint64_t));
+  memcpy(buf + sizeof(uint64_t), &num_items, sizeof(uint64_t));
+  memcpy(buf + 2 * sizeof(uint64_t), filter->blocks, filter->num_blocks * BLOCKED_BLOOM_BLOCK_SIZE);
+}
+
+blocked_bloom*
+blocked_bloom_decode(const char* buf, size_t size)
+{
+  if (size < 2 * sizeof(uint64_t)) {
+    return NULL;
+  }
+
+  uint64_t num_blocks, num_items;
+  memcpy(&num_blocks, buf, sizeof(uint64_t));
+  memcpy(&num_items, buf + sizeof(uint64_t), sizeof(uint64_t));
+  if (num_blocks == 0 || size != 2 * sizeof(uint64_t) + num_blocks * BLOCKED_BLOOM_BLOCK_SIZE) {
+    return NULL;
+  }
+
+  blocked_bloom* filter = blocked_bloom_alloc(num_blocks);
+  if (filter == NULL) {
+    return NULL;
+  }
+  filter->num_items = num_items;
+  memcpy(filter->blocks, buf + 2 * sizeof(uint64_t), num_blocks * BLOCKED_BLOOM_BLOCK_SIZE);
   return filter;
 }
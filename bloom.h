@@ -5,22 +5,50 @@
 #include <stddef.h>
 #include <stdint.h>
 
-typedef uint32_t (*hash32_func)(const void* data, size_t length);
+#define BLOOM_MAX_PROBES 30
+
+// the filters hash keys with hash64(key, size, BLOOM_HASH_SEED), callers that
+// probe several filters for the same key hash it once and use the _hash calls.
+#define BLOOM_HASH_SEED  0
+
 typedef struct bloom_filter_s {
   bit_vec* vec;
-  hash32_func* hash_functions;
-  size_t num_functions;
+  size_t num_probes; // bits set per key
   size_t num_items;
 } bloom_filter;
 
-bloom_filter* bloom_filter_new(size_t size, size_t num_functions, ...);
+bloom_filter* bloom_filter_new(size_t num_bits, size_t num_probes);
+bloom_filter* bloom_filter_new_bits_per_key(size_t expected_items, size_t bits_per_key);
 bloom_filter* bloom_filter_new_default(size_t size);
 void bloom_filter_free(bloom_filter* filter);
 void bloom_filter_put(bloom_filter* filter, const void* data, size_t length);
 void bloom_filter_put_str(bloom_filter* filter, const char* str);
 bool bloom_filter_test(bloom_filter* filter, const void* data, size_t lentgth);
 bool bloom_filter_test_str(bloom_filter* filter, const char* str);
+bool bloom_filter_test_hash(bloom_filter* filter, uint64_t hash);
+void bloom_filter_test_batch(bloom_filter* filter, const uint64_t* hashes, size_t n, bool* out);
 bloom_filter* bloom_filter_from_file(const char* path);
 int bloom_filter_dump(bloom_filter* filter, const char* path);
 
+#define BLOCKED_BLOOM_BLOCK_SIZE  64 // one cache line
+#define BLOCKED_BLOOM_WORDS       (BLOCKED_BLOOM_BLOCK_SIZE / sizeof(uint64_t))
+
+// blocked_bloom keeps every bit of a key in one cache line sized block, a
+// lookup costs at most one cache miss. Probes use AVX2 when the cpu has it.
+typedef struct blocked_bloom_s {
+  uint64_t* blocks;
+  size_t num_blocks;
+  size_t num_items;
+} blocked_bloom;
+
+blocked_bloom* blocked_bloom_new(size_t expected_items, size_t bits_per_key);
+void blocked_bloom_free(blocked_bloom* filter);
+void blocked_bloom_put(blocked_bloom* filter, const void* data, size_t length);
+bool blocked_bloom_test(blocked_bloom* filter, const void* data, size_t length);
+bool blocked_bloom_test_hash(blocked_bloom* filter, uint64_t hash);
+void blocked_bloom_test_batch(blocked_bloom* filter, const uint64_t* hashes, size_t n, bool* out);
+size_t blocked_bloom_encoded_size(blocked_bloom* filter);
+void blocked_bloom_encode(blocked_bloom* filter, char* buf);
+blocked_bloom* blocked_bloom_decode(const char* buf, size_t size);
+
 #endif
@@ -0,0 +1,327 @@
+#include "cache.h"
+#include "utils.h"
+#include <stdlib.h>
+
+#define SHARD_INITIAL_BUCKETS 64
+
+static block_cache* default_cache;
+static pthread_once_t default_cache_once = PTHREAD_ONCE_INIT;
+
+static uint64_t
+cache_hash(uint64_t id, uint64_t offset)
+{
+  uint64_t key[2] = { id, offset };
+  return hash64(key, sizeof(key), 0);
+}
+
+// shards are picked by the top bits of the hash, buckets by the bottom ones
+static block_cache_shard*
+shard_for(block_cache* cache, uint64_t hash)
+{
+  return &cache->shards[hash >> (64 - BLOCK_CACHE_SHARD_BITS)];
+}
+
+block_cache*
+block_cache_new(size_t capacity)
+{
+  block_cache* cache = calloc(1, sizeof(block_cache));
+  if (cache == NULL) {
+    return NULL;
+  }
+
+  for (int i = 0; i < 1 << BLOCK_CACHE_SHARD_BITS; i++) {
+    block_cache_shard* shard = &cache->shards[i];
+    shard->buckets = calloc(SHARD_INITIAL_BUCKETS, sizeof(block_cache_handle*));
+    if (shard->buckets == NULL) {
+      block_cache_free(cache);
+      return NULL;
+    }
+    shard->num_buckets = SHARD_INITIAL_BUCKETS;
+    shard->capacity = capacity >> BLOCK_CACHE_SHARD_BITS;
+    pthread_mutex_init(&shard->lock, NULL);
+  }
+  return cache;
+}
+
+static void
+default_cache_init()
+{
+  default_cache = block_cache_new(BLOCK_CACHE_DEFAULT_CAPACITY);
+}
+
+// block_cache_default returns the cache shared by every tree of the process,
+// created on first use. It's never freed.
+block_cache*
+block_cache_default()
+{
+  pthread_once(&default_cache_once, default_cache_init);
+  return default_cache;
+}
+
+// block_cache_free frees the cache with every block in it, no handles can be
+// pinned anymore.
+void
+block_cache_free(block_cache* cache)
+{
+  for (int i = 0; i < 1 << BLOCK_CACHE_SHARD_BITS; i++) {
+    block_cache_shard* shard = &cache->shards[i];
+    if (shard->buckets == NULL) {
+      continue;
+    }
+    for (size_t b = 0; b < shard->num_buckets; b++) {
+      block_cache_handle* h = shard->buckets[b];
+      while (h != NULL) {
+        block_cache_handle* next = h->next_hash;
+        free(h->data);
+        free(h);
+        h = next;
+      }
+    }
+    free(shard->buckets);
+    pthread_mutex_destroy(&shard->lock);
+  }
+  free(cache);
+}
+
+// block_cache_new_id returns a key prefix no other table uses, file numbers
+// repeat across the trees sharing a cache.
+uint64_t
+block_cache_new_id(block_cache* cache)
+{
+  return __atomic_add_fetch(&cache->next_id, 1, __ATOMIC_RELAXED);
+}
+
+static block_cache_handle*
+shard_find(block_cache_shard* shard, uint64_t hash, uint64_t id, uint64_t offset)
+{
+  block_cache_handle* h = shard->buckets[hash & (shard->num_buckets - 1)];
+  while (h != NULL && (h->hash != hash || h->id != id || h->offset != offset)) {
+    h = h->next_hash;
+  }
+  return h;
+}
+
+// shard_grow doubles the buckets once the shard holds more blocks than it
+// has buckets, a failed resize keeps the longer chains.
+static void
+shard_grow(block_cache_shard* shard)
+{
+  size_t num_buckets = shard->num_buckets * 2;
+  block_cache_handle** buckets = calloc(num_buckets, sizeof(block_cache_handle*));
+  if (buckets == NULL) {
+    return;
+  }
+
+  for (size_t b = 0; b < shard->num_buckets; b++) {
+    block_cache_handle* h = shard->buckets[b];
+    while (h != NULL) {
+      block_cache_handle* next = h->next_hash;
+      block_cache_handle** bucket = &buckets[h->hash & (num_buckets - 1)];
+      h->next_hash = *bucket;
+      *bucket = h;
+      h = next;
+    }
+  }
+  free(shard->buckets);
+  shard->buckets = buckets;
+  shard->num_buckets = num_buckets;
+}
+
+// shard_remove takes h out of the hash table and the ring.
+static void
+shard_remove(block_cache_shard* shard, block_cache_handle* h)
+{
+  block_cache_handle** p = &shard->buckets[h->hash & (shard->num_buckets - 1)];
+  while (*p != h) {
+    p = &(*p)->next_hash;
+  }
+  *p = h->next_hash;
+
+  if (h->next == h) {
+    shard->hand = NULL;
+  } else {
+    h->prev->next = h->next;
+    h->next->prev = h->prev;
+    if (shard->hand == h) {
+      shard->hand = h->next;
+    }
+  }
+
+  shard->usage -= h->size;
+  if (h->high_priority) {
+    shard->high_priority_usage -= h->size;
+  }
+  shard->count--;
+}
+
+// shard_evict sweeps the ring until the shard is within its capacity. Two
+// passes clear every reference bit, so the sweep gives up after those if
+// everything left is pinned or reserved.
+static void
+shard_evict(block_cache_shard* shard)
+{
+  size_t reserved = shard->capacity / 100 * BLOCK_CACHE_HIGH_PRIORITY_RATIO;
+  size_t limit = 2 * shard->count;
+  for (size_t steps = 0; shard->usage > shard->capacity && shard->hand != NULL && steps < limit; steps++) {
+    block_cache_handle* h = shard->hand;
+    shard->hand = h->next;
+    if (h->refs > 1 || (h->high_priority && shard->high_priority_usage <= reserved)) {
+      continue;
+    }
+    if (h->referenced) {
+      h->referenced = false;
+      continue;
+    }
+
+    shard_remove(shard, h);
+    shard->evictions++;
+    free(h->data);
+    free(h);
+  }
+}
+
+// block_cache_lookup returns a pinned handle to the block, or NULL if it's
+// not cached.
+block_cache_handle*
+block_cache_lookup(block_cache* cache, uint64_t id, uint64_t offset)
+{
+  uint64_t hash = cache_hash(id, offset);
+  block_cache_shard* shard = shard_for(cache, hash);
+
+  pthread_mutex_lock(&shard->lock);
+  block_cache_handle* h = shard_find(shard, hash, id, offset);
+  if (h != NULL) {
+    h->refs++;
+    h->referenced = true;
+    shard->hits++;
+  } else {
+    shard->misses++;
+  }
+  pthread_mutex_unlock(&shard->lock);
+  return h;
+}
+
+// block_cache_insert hands a malloc'd block over to the cache and returns a
+// pinned handle to it. If another reader cached the block first, data is
+// freed and the handle points to the cached copy. Returns NULL and leaves
+// data with the caller if the handle can't be allocated.
+block_cache_handle*
+block_cache_insert(block_cache* cache, uint64_t id, uint64_t offset, char* data, size_t size, bool high_priority)
+{
+  block_cache_handle* h = calloc(1, sizeof(block_cache_handle));
+  if (h == NULL) {
+    return NULL;
+  }
+  uint64_t hash = cache_hash(id, offset);
+  block_cache_shard* shard = shard_for(cache, hash);
+
+  pthread_mutex_lock(&shard->lock);
+  block_cache_handle* existing = shard_find(shard, hash, id, offset);
+  if (existing != NULL) {
+    existing->refs++;
+    pthread_mutex_unlock(&shard->lock);
+    free(h);
+    free(data);
+    return existing;
+  }
+
+  h->id = id;
+  h->offset = offset;
+  h->hash = hash;
+  h->data = data;
+  h->size = size;
+  h->refs = 2;
+  h->referenced = true;
+  h->high_priority = high_priority;
+  h->shard = shard;
+
+  if (shard->count >= shard->num_buckets) {
+    shard_grow(shard);
+  }
+  block_cache_handle** bucket = &shard->buckets[hash & (shard->num_buckets - 1)];
+  h->next_hash = *bucket;
+  *bucket = h;
+
+  // new blocks go right behind the hand, the sweep reaches them last
+  if (shard->hand == NULL) {
+    h->next = h->prev = h;
+    shard->hand = h;
+  } else {
+    h->next = shard->hand;
+    h->prev = shard->hand->prev;
+    shard->hand->prev->next = h;
+    shard->hand->prev = h;
+  }
+  shard->count++;
+  shard->usage += size;
+  if (high_priority) {
+    shard->high_priority_usage += size;
+  }
+
+  shard_evict(shard);
+  pthread_mutex_unlock(&shard->lock);
+  return h;
+}
+
+// block_cache_release unpins a block, it can be evicted once no handle to it
+// is left.
+void
+block_cache_release(block_cache_handle* h)
+{
+  block_cache_shard* shard = h->shard;
+  pthread_mutex_lock(&shard->lock);
+  h->refs--;
+  pthread_mutex_unlock(&shard->lock);
+}
+
+// block_cache_erase removes a block that will never be looked up again,
+// unless a handle still pins it. Then it's left to the sweep.
+void
+block_cache_erase(block_cache* cache, uint64_t id, uint64_t offset)
+{
+  uint64_t hash = cache_hash(id, offset);
+  block_cache_shard* shard = shard_for(cache, hash);
+
+  pthread_mutex_lock(&shard->lock);
+  block_cache_handle* h = shard_find(shard, hash, id, offset);
+  bool erase = h != NULL && h->refs == 1;
+  if (erase) {
+    shard_remove(shard, h);
+  }
+  pthread_mutex_unlock(&shard->lock);
+  if (erase) {
+    free(h->data);
+    free(h);
+  }
+}
+
+// block_cache_set_capacity changes the budget and evicts what no longer fits.
+void
+block_cache_set_capacity(block_cache* cache, size_t capacity)
+{
+  for (int i = 0; i < 1 << BLOCK_CACHE_SHARD_BITS; i++) {
+    block_cache_shard* shard = &cache->shards[i];
+    pthread_mutex_lock(&shard->lock);
+    shard->capacity = capacity >> BLOCK_CACHE_SHARD_BITS;
+    shard_evict(shard);
+    pthread_mutex_unlock(&shard->lock);
+  }
+}
+
+void
+block_cache_get_stats(block_cache* cache, block_cache_stats* stats)
+{
+  *stats = (block_cache_stats) { 0 };
+  for (int i = 0; i < 1 << BLOCK_CACHE_SHARD_BITS; i++) {
+    block_cache_shard* shard = &cache->shards[i];
+    pthread_mutex_lock(&shard->lock);
+    stats->capacity += shard->capacity;
+    stats->usage += shard->usage;
+    stats->high_priority_usage += shard->high_priority_usage;
+    stats->count += shard->count;
+    stats->hits += shard->hits;
+    stats->misses += shard->misses;
+    stats->evictions += shard->evictions;
+    pthread_mutex_unlock(&shard->lock);
+  }
+}
@@ -0,0 +1,85 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define BLOCK_CACHE_SHARD_BITS        4 // 16 shards, picked by the hash of the block's key
+#define BLOCK_CACHE_DEFAULT_CAPACITY  (32 * 1024 * 1024)
+#define BLOCK_CACHE_HIGH_PRIORITY_RATIO  50 // percent of a shard kept for high priority blocks
+
+// The block cache holds decoded table blocks under a key of the table's
+// cache id and the block's offset, with a budget in bytes. Every shard has its
+// own lock, hash table and CLOCK ring: a lookup sets the block's reference
+// bit and eviction sweeps the ring, clearing bits and evicting the first
+// unpinned block it finds without one. High priority blocks, like index and
+// filter blocks, are passed over by the sweep as long as they take no more
+// than BLOCK_CACHE_HIGH_PRIORITY_RATIO of the shard, so a scan over data
+// blocks can't push them out. Tables keep their index and filter here, so the
+// budget covers them as well as the data blocks, and read them again if they
+// were evicted after all.
+//
+// Readers get a pinned handle and use the block in place until they release
+// it, pinned blocks are never evicted. A shard can go over its budget while
+// all of its blocks are pinned.
+
+typedef struct block_cache_handle_s {
+  uint64_t id;
+  uint64_t offset;
+  uint64_t hash;
+  char* data; // owned, freed once the block is evicted
+  size_t size;
+  int refs; // one per handle plus one while the block is in the cache
+  bool referenced; // set by lookups, cleared by the sweep
+  bool high_priority;
+  struct block_cache_shard_s* shard;
+  struct block_cache_handle_s* next_hash;
+  struct block_cache_handle_s* prev; // CLOCK ring
+  struct block_cache_handle_s* next;
+} block_cache_handle;
+
+typedef struct block_cache_shard_s {
+  pthread_mutex_t lock;
+  block_cache_handle** buckets;
+  size_t num_buckets;
+  size_t count;
+  block_cache_handle* hand; // next block the sweep looks at
+  size_t capacity;
+  size_t usage;
+  size_t high_priority_usage;
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+} block_cache_shard;
+
+typedef struct block_cache_stats_s {
+  size_t capacity;
+  size_t usage;
+  size_t high_priority_usage;
+  size_t count;
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+} block_cache_stats;
+
+typedef struct block_cache_s {
+  block_cache_shard shards[1 << BLOCK_CACHE_SHARD_BITS];
+  uint64_t next_id;
+} block_cache;
+
+block_cache* block_cache_new(size_t capacity);
+block_cache* block_cache_default();
+void block_cache_free(block_cache* cache);
+void block_cache_set_capacity(block_cache* cache, size_t capacity);
+uint64_t block_cache_new_id(block_cache* cache);
+
+block_cache_handle* block_cache_lookup(block_cache* cache, uint64_t id, uint64_t offset);
+block_cache_handle* block_cache_insert(block_cache* cache, uint64_t id, uint64_t offset, char* data, size_t size,
+    bool high_priority);
+void block_cache_release(block_cache_handle* h);
+void block_cache_erase(block_cache* cache, uint64_t id, uint64_t offset);
+void block_cache_get_stats(block_cache* cache, block_cache_stats* stats);
+
+#endif
@@ -0,0 +1,727 @@
+#include "compaction.h"
+#include "lsmt.h"
+#include "sstable.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// level_target returns the size in bytes that L1+ levels are kept under.
+static uint64_t
+level_target(lsm_tree* tree, int level)
+{
+  uint64_t target = tree->opts.level1_size;
+  for (int i = 1; i < level; i++) {
+    target *= tree->opts.level_size_ratio;
+  }
+  return target;
+}
+
+// compaction_score returns how urgently a level needs to be compacted, a
+// level with a score of at least 1 is over its target. L0 is scored by its
+// table count since every L0 table has to be checked on reads.
+double
+compaction_score(lsm_tree* tree, int level)
+{
+  if (level >= LSM_NUM_LEVELS - 1) {
+    return 0;
+  }
+
+  if (level == 0) {
+    return (double)tree->levels[0].num_tables / tree->opts.level0_compaction_trigger;
+  }
+  return (double)tree->levels[level].size / level_target(tree, level);
+}
+
+// tiered_window finds runs of similar size to merge, L0 is ordered newest
+// first so every window of adjacent runs holds a continuous range of writes.
+static bool
+tiered_window(lsm_tree* tree, size_t* first, size_t* count)
+{
+  lsm_level* l0 = &tree->levels[0];
+  lsm_options* opts = &tree->opts;
+  size_t n = l0->num_tables;
+  if (n < opts->level0_compaction_trigger || n < 2) {
+    return false;
+  }
+
+  // rewrite everything once the newer runs take up too much space compared
+  // to the oldest one, the oldest run is where most of the data ends up.
+  bool any_compacting = false;
+  for (size_t i = 0; i < n; i++) {
+    any_compacting |= l0->tables[i]->compacting;
+  }
+  sstable* oldest = l0->tables[n - 1];
+  if (!any_compacting && (l0->size - oldest->file_size) * 100 >= oldest->file_size * opts->tiered_max_size_amp) {
+    *first = 0;
+    *count = n;
+    return true;
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    if (l0->tables[i]->compacting) {
+      continue;
+    }
+
+    uint64_t size = l0->tables[i]->file_size;
+    size_t j = i + 1;
+    while (j < n && j - i < opts->tiered_max_merge_width && !l0->tables[j]->compacting &&
+        l0->tables[j]->file_size * 100 <= size * (100 + opts->tiered_size_ratio)) {
+      size += l0->tables[j]->file_size;
+      j++;
+    }
+
+    if (j - i >= opts->tiered_min_merge_width) {
+      *first = i;
+      *count = j - i;
+      return true;
+    }
+  }
+
+  // nothing is of similar size, before writers start to stall merge just
+  // enough of the newest runs to get back under the trigger.
+  if (any_compacting || n + 1 < opts->level0_stop_trigger) {
+    return false;
+  }
+  *first = 0;
+  *count = n - opts->level0_compaction_trigger + 1;
+  if (*count < 2) {
+    *count = 2;
+  }
+  return true;
+}
+
+bool
+compaction_needed(lsm_tree* tree)
+{
+  if (tree->opts.compaction_style == LSM_COMPACTION_TIERED) {
+    size_t first, count;
+    return tiered_window(tree, &first, &count);
+  }
+
+  for (int i = 0; i < LSM_NUM_LEVELS - 1; i++) {
+    if (compaction_score(tree, i) >= 1) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool
+tables_overlap(sstable* sst, slice smallest, slice largest)
+{
+  return slice_compare(sst->largest, smallest) >= 0 && slice_compare(sst->smallest, largest) <= 0;
+}
+
+static compaction*
+compaction_new(int level)
+{
+  compaction* c = calloc(1, sizeof(compaction));
+  if (c == NULL) {
+    return NULL;
+  }
+  c->level = level;
+  c->output_level = level + 1;
+  c->split_outputs = true;
+  return c;
+}
+
+static int
+add_input(compaction* c, sstable* sst)
+{
+  sstable** n = realloc(c->inputs, (c->num_inputs + 1) * sizeof(sstable*));
+  if (n == NULL) {
+    return 1;
+  }
+  c->inputs = n;
+  c->inputs[c->num_inputs++] = sst;
+  if (sst->max_seq > c->max_seq) {
+    c->max_seq = sst->max_seq;
+  }
+
+  if (c->num_inputs == 1 || slice_compare(sst->smallest, c->smallest) < 0) {
+    slice_free(c->smallest);
+    c->smallest = slice_copy(sst->smallest);
+  }
+  if (c->num_inputs == 1 || slice_compare(sst->largest, c->largest) > 0) {
+    slice_free(c->largest);
+    c->largest = slice_copy(sst->largest);
+  }
+  return c->smallest.data == NULL || c->largest.data == NULL;
+}
+
+// add_overlapping adds every table of the output level that overlaps the
+// inputs picked so far, it fails if one of them is already being compacted or
+// another compaction is writing into the same key range.
+static int
+add_overlapping(lsm_tree* tree, compaction* c)
+{
+  for (compaction* r = tree->running; r != NULL; r = r->next) {
+    if (r->output_level == c->output_level && slice_compare(r->largest, c->smallest) >= 0 &&
+        slice_compare(r->smallest, c->largest) <= 0) {
+      return 1;
+    }
+  }
+
+  // adding a table can widen the range, L1+ tables are sorted and disjoint so
+  // a single pass over the level is enough.
+  lsm_level* out = &tree->levels[c->output_level];
+  size_t first = out->num_tables, last = 0;
+  for (size_t i = 0; i < out->num_tables; i++) {
+    if (tables_overlap(out->tables[i], c->smallest, c->largest)) {
+      if (first == out->num_tables) {
+        first = i;
+      }
+      last = i;
+    }
+  }
+
+  for (size_t i = first; i < out->num_tables && i <= last; i++) {
+    if (out->tables[i]->compacting || add_input(c, out->tables[i]) != 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static compaction*
+pick_level0(lsm_tree* tree)
+{
+  lsm_level* l0 = &tree->levels[0];
+
+  // L0 tables overlap each other, so they have to be merged down together
+  // to keep newer tables from ending up below older ones.
+  for (size_t i = 0; i < l0->num_tables; i++) {
+    if (l0->tables[i]->compacting) {
+      return NULL;
+    }
+  }
+
+  compaction* c = compaction_new(0);
+  if (c == NULL) {
+    return NULL;
+  }
+  for (size_t i = 0; i < l0->num_tables; i++) {
+    if (add_input(c, l0->tables[i]) != 0) {
+      compaction_free(c);
+      return NULL;
+    }
+  }
+
+  if (c->num_inputs == 0 || add_overlapping(tree, c) != 0) {
+    compaction_free(c);
+    return NULL;
+  }
+  return c;
+}
+
+static compaction*
+pick_level(lsm_tree* tree, int level)
+{
+  lsm_level* l = &tree->levels[level];
+  if (l->num_tables == 0) {
+    return NULL;
+  }
+
+  // tables are picked round robin starting after the last compacted key, so
+  // the whole key range of the level gets rewritten over time.
+  size_t start = 0;
+  if (tree->compact_pointer[level].data != NULL) {
+    while (start < l->num_tables && slice_compare(l->tables[start]->smallest, tree->compact_pointer[level]) <= 0) {
+      start++;
+    }
+  }
+
+  for (size_t n = 0; n < l->num_tables; n++) {
+    sstable* sst = l->tables[(start + n) % l->num_tables];
+    if (sst->compacting) {
+      continue;
+    }
+
+    compaction* c = compaction_new(level);
+    if (c == NULL) {
+      return NULL;
+    }
+    if (add_input(c, sst) == 0 && add_overlapping(tree, c) == 0) {
+      slice_free(tree->compact_pointer[level]);
+      tree->compact_pointer[level] = slice_copy(sst->largest);
+      return c;
+    }
+    compaction_free(c);
+  }
+  return NULL;
+}
+
+// pick_tiered merges a window of adjacent runs into a single run that takes
+// their place in L0.
+static compaction*
+pick_tiered(lsm_tree* tree)
+{
+  size_t first, count;
+  if (!tiered_window(tree, &first, &count)) {
+    return NULL;
+  }
+
+  compaction* c = compaction_new(0);
+  if (c == NULL) {
+    return NULL;
+  }
+  c->output_level = 0;
+  c->split_outputs = false;
+  for (size_t i = first; i < first + count; i++) {
+    if (add_input(c, tree->levels[0].tables[i]) != 0) {
+      compaction_free(c);
+      return NULL;
+    }
+  }
+  return c;
+}
+
+// set_bottommost checks whether the outputs end up below every older version
+// of their keys.
+static void
+set_bottommost(lsm_tree* tree, compaction* c)
+{
+  c->bottommost = true;
+  if (c->output_level == 0) {
+    // a merge of L0 runs stays above the runs older than its window
+    lsm_level* l0 = &tree->levels[0];
+    c->bottommost = c->inputs[c->num_inputs - 1] == l0->tables[l0->num_tables - 1];
+  }
+  for (int l = c->output_level + 1; l < LSM_NUM_LEVELS && c->bottommost; l++) {
+    lsm_level* level = &tree->levels[l];
+    for (size_t i = 0; i < level->num_tables; i++) {
+      if (tables_overlap(level->tables[i], c->smallest, c->largest)) {
+        c->bottommost = false;
+        break;
+      }
+    }
+  }
+}
+
+// compaction_pick chooses the level with the highest score and the tables to
+// merge from it, the picked tables are marked as compacting. Called with
+// tree->lock held, returns NULL if there is nothing to do.
+compaction*
+compaction_pick(lsm_tree* tree)
+{
+  bool tried[LSM_NUM_LEVELS] = { false };
+
+  if (tree->opts.compaction_style == LSM_COMPACTION_TIERED) {
+    compaction* c = pick_tiered(tree);
+    for (size_t i = 0; c != NULL && i < c->num_inputs; i++) {
+      c->inputs[i]->compacting = true;
+    }
+    if (c != NULL) {
+      set_bottommost(tree, c);
+    }
+    return c;
+  }
+
+  for (;;) {
+    int best = -1;
+    double best_score = 1;
+    for (int i = 0; i < LSM_NUM_LEVELS - 1; i++) {
+      double score = compaction_score(tree, i);
+      if (!tried[i] && score >= best_score) {
+        best = i;
+        best_score = score;
+      }
+    }
+    if (best < 0) {
+      return NULL;
+    }
+    tried[best] = true;
+
+    compaction* c = best == 0 ? pick_level0(tree) : pick_level(tree, best);
+    if (c != NULL) {
+      for (size_t i = 0; i < c->num_inputs; i++) {
+        c->inputs[i]->compacting = true;
+      }
+      set_bottommost(tree, c);
+      return c;
+    }
+  }
+}
+
+typedef struct {
+  sstable_iter** iters;
+  size_t* heap; // indexes into iters, ties are broken by the newer input
+  size_t len;
+} merge_heap;
+
+static bool
+heap_less(merge_heap* h, size_t a, size_t b)
+{
+  sstable_iter* x = h->iters[a];
+  sstable_iter* y = h->iters[b];
+  int cmp = key_compare(x->key, x->key_size, y->key, y->key_size);
+  return cmp < 0 || (cmp == 0 && a < b);
+}
+
+static void
+heap_sift_down(merge_heap* h, size_t i)
+{
+  for (;;) {
+    size_t smallest = i;
+    size_t l = 2 * i + 1, r = 2 * i + 2;
+    if (l < h->len && heap_less(h, h->heap[l], h->heap[smallest])) {
+      smallest = l;
+    }
+    if (r < h->len && heap_less(h, h->heap[r], h->heap[smallest])) {
+      smallest = r;
+    }
+    if (smallest == i) {
+      return;
+    }
+    size_t tmp = h->heap[i];
+    h->heap[i] = h->heap[smallest];
+    h->heap[smallest] = tmp;
+    i = smallest;
+  }
+}
+
+static int
+add_output(compaction* c, sstable* sst)
+{
+  if (c->num_outputs == c->outputs_cap) {
+    size_t new_cap = c->outputs_cap ? c->outputs_cap * 2 : 4;
+    sstable** n = realloc(c->outputs, new_cap * sizeof(sstable*));
+    if (n == NULL) {
+      return 1;
+    }
+    c->outputs = n;
+    c->outputs_cap = new_cap;
+  }
+  c->outputs[c->num_outputs++] = sst;
+  return 0;
+}
+
+static int
+finish_output(lsm_tree* tree, compaction* c, sstable_writer* w, uint64_t file_num)
+{
+  char* path = strdup(w->filename);
+  if (path == NULL) {
+    sstable_writer_abandon(w);
+    return 1;
+  }
+
+  sstable* sst = NULL;
+  if (sstable_writer_finish(w) == 0) {
+    sst = sstable_open(path, file_num, tree->opts.block_cache, tree->opts.use_mmap_reads);
+    if (sst == NULL) {
+      unlink(path);
+    }
+  }
+  free(path);
+
+  if (sst == NULL || add_output(c, sst) != 0) {
+    if (sst != NULL) {
+      sst->obsolete = true;
+      sstable_unref(sst);
+    }
+    return 1;
+  }
+  c->bytes_written += sst->file_size;
+  return 0;
+}
+
+static sstable_writer*
+open_output(lsm_tree* tree, compaction* c, size_t expected, uint64_t* file_num)
+{
+  char path[1024];
+  *file_num = lsm_tree_new_file_num(tree);
+  lsm_tree_file_path(tree, *file_num, "sst", path, sizeof(path));
+  sstable_writer* w = sstable_writer_new(path, expected);
+  if (w != NULL) {
+    w->level = c->output_level;
+    w->max_seq = c->max_seq;
+    w->codec = tree->opts.compression[c->output_level];
+  }
+  return w;
+}
+
+// input_range_deleted tells if a range deletion of an input newer than input
+// hides key.
+static bool
+input_range_deleted(compaction* c, size_t input, slice key)
+{
+  for (size_t i = 0; i < input; i++) {
+    if (sstable_range_deleted(c->inputs[i], key)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// merge_range_dels returns the range deletions of all inputs merged, the
+// slices point into the inputs. NULL with n set to 0 if there are none.
+static range_del*
+merge_range_dels(compaction* c, size_t* n, int* res)
+{
+  size_t total = 0;
+  for (size_t i = 0; i < c->num_inputs; i++) {
+    total += c->inputs[i]->num_range_dels;
+  }
+  *n = 0;
+  if (total == 0) {
+    return NULL;
+  }
+
+  range_del* dels = malloc(total * sizeof(range_del));
+  if (dels == NULL) {
+    *res = 1;
+    return NULL;
+  }
+  for (size_t i = 0; i < c->num_inputs; i++) {
+    if (c->inputs[i]->num_range_dels == 0) {
+      continue;
+    }
+    memcpy(dels + *n, c->inputs[i]->range_dels, c->inputs[i]->num_range_dels * sizeof(range_del));
+    *n += c->inputs[i]->num_range_dels;
+  }
+  *n = range_dels_merge(dels, *n);
+  return dels;
+}
+
+// add_range_dels writes the ranges from *next on that start before limit to
+// w, or all of them if limit is empty.
+static int
+add_range_dels(sstable_writer* w, const range_del* dels, size_t n, size_t* next, slice limit)
+{
+  for (; *next < n && (limit.data == NULL || slice_compare(dels[*next].start, limit) < 0); (*next)++) {
+    if (sstable_writer_delete_range(w, dels[*next].start, dels[*next].end) != 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// compaction_run merges the inputs into new tables of the output level, only
+// the newest version of every key is kept. Keys a range deletion of a newer
+// input covers are dropped, the ranges themselves are carried into the
+// outputs. Deletions and ranges are only dropped once nothing older is left
+// below the outputs. Runs without tree->lock held.
+int
+compaction_run(lsm_tree* tree, compaction* c)
+{
+  merge_heap h = { 0 };
+  h.iters = calloc(c->num_inputs, sizeof(sstable_iter*));
+  h.heap = calloc(c->num_inputs, sizeof(size_t));
+  if (h.iters == NULL || h.heap == NULL) {
+    free(h.iters);
+    free(h.heap);
+    return 1;
+  }
+
+  int res = 0;
+  uint64_t input_entries = 0, input_bytes = 0;
+  for (size_t i = 0; i < c->num_inputs; i++) {
+    h.iters[i] = sstable_iter_new(c->inputs[i]);
+    if (h.iters[i] == NULL) {
+      res = 1;
+      break;
+    }
+    // the inputs are read once and replaced, caching them would only push
+    // out blocks that readers use
+    h.iters[i]->fill_cache = false;
+    sstable_iter_seek_to_first(h.iters[i]);
+    if (h.iters[i]->valid) {
+      h.heap[h.len++] = i;
+    }
+    res |= h.iters[i]->error;
+    input_entries += c->inputs[i]->num_entries;
+    input_bytes += c->inputs[i]->file_size;
+  }
+  c->bytes_read = input_bytes;
+  for (size_t i = h.len / 2; i-- > 0;) {
+    heap_sift_down(&h, i);
+  }
+
+  // size the filter of each output for the share of entries it will hold
+  size_t expected = input_entries;
+  if (c->split_outputs && input_bytes > tree->opts.table_file_size) {
+    expected = input_entries * tree->opts.table_file_size / input_bytes + 1;
+  }
+
+  // every range goes to the output its start falls into. An output never
+  // ends inside a range, or its largest key couldn't cover the range without
+  // overlapping the next output.
+  size_t num_dels;
+  range_del* dels = merge_range_dels(c, &num_dels, &res);
+  bool has_dels = num_dels > 0;
+  if (c->bottommost) {
+    num_dels = 0;
+  }
+  size_t next_del = 0; // first range not written yet
+  size_t open_del = 0; // first range that doesn't end before the current key
+
+  sstable_writer* w = NULL;
+  uint64_t file_num = 0;
+  slice last_key = slice_new(NULL, 0);
+
+  while (res == 0 && h.len > 0) {
+    if (__atomic_load_n(&tree->closing, __ATOMIC_RELAXED)) {
+      res = 1;
+      break;
+    }
+
+    sstable_iter* it = h.iters[h.heap[0]];
+    slice key = slice_new(it->key, it->key_size);
+    bool shadowed = last_key.data != NULL && slice_compare(last_key, key) == 0;
+    bool dropped = (it->deleted && c->bottommost) || (has_dels && input_range_deleted(c, h.heap[0], key));
+
+    if (!shadowed && !dropped) {
+      while (open_del < num_dels && slice_compare(dels[open_del].end, key) < 0) {
+        open_del++;
+      }
+      bool in_range = open_del < num_dels && slice_compare(dels[open_del].start, key) <= 0;
+      if (w != NULL && c->split_outputs && sstable_writer_size(w) >= tree->opts.table_file_size && !in_range) {
+        res = add_range_dels(w, dels, num_dels, &next_del, key);
+        if (res == 0) {
+          res = finish_output(tree, c, w, file_num);
+        } else {
+          sstable_writer_abandon(w);
+        }
+        w = NULL;
+        if (res != 0) {
+          break;
+        }
+      }
+
+      if (w == NULL) {
+        w = open_output(tree, c, expected, &file_num);
+        if (w == NULL) {
+          res = 1;
+          break;
+        }
+      }
+
+      int added = it->deleted ? sstable_writer_delete(w, key)
+                              : sstable_writer_add(w, key, slice_new(it->value, it->value_size));
+      if (added != 0) {
+        res = 1;
+        break;
+      }
+    }
+
+    // a dropped version still hides the older ones
+    if (!shadowed) {
+      slice_free(last_key);
+      last_key = slice_copy(key);
+      if (last_key.data == NULL) {
+        res = 1;
+        break;
+      }
+    }
+
+    sstable_iter_next(it);
+    if (it->error) {
+      res = 1;
+    } else if (!it->valid) {
+      h.heap[0] = h.heap[--h.len];
+    }
+    heap_sift_down(&h, 0);
+  }
+
+  // the last output takes the remaining ranges, even if every key was
+  // dropped
+  if (res == 0 && next_del < num_dels && w == NULL) {
+    w = open_output(tree, c, expected, &file_num);
+    res = w == NULL;
+  }
+  if (w != NULL && res == 0) {
+    res = add_range_dels(w, dels, num_dels, &next_del, slice_new(NULL, 0));
+  }
+  if (w != NULL) {
+    if (res == 0) {
+      res = finish_output(tree, c, w, file_num);
+    } else {
+      sstable_writer_abandon(w);
+    }
+  }
+
+  free(dels);
+  slice_free(last_key);
+  for (size_t i = 0; i < c->num_inputs; i++) {
+    if (h.iters[i] != NULL) {
+      sstable_iter_free(h.iters[i]);
+    }
+  }
+  free(h.iters);
+  free(h.heap);
+  return res;
+}
+
+// compaction_install replaces the inputs with the outputs of a finished
+// compaction, once the change is recorded in the manifest. Called with
+// tree->lock held, returns 1 if the change couldn't be recorded and the
+// compaction has to be aborted.
+int
+compaction_install(lsm_tree* tree, compaction* c)
+{
+  manifest_edit e;
+  manifest_edit_init(&e);
+  for (size_t i = 0; i < c->num_inputs; i++) {
+    manifest_edit_delete_table(&e, c->inputs[i]->file_num);
+  }
+  for (size_t i = 0; i < c->num_outputs; i++) {
+    lsm_edit_add_table(&e, c->outputs[i]);
+  }
+  int res = lsm_tree_log_edit(tree, &e);
+  manifest_edit_free(&e);
+  if (res != 0) {
+    return 1;
+  }
+
+  tree->stats.compaction_bytes_read += c->bytes_read;
+  tree->stats.compaction_bytes_written += c->bytes_written;
+  tree->stats.num_compactions++;
+
+  for (size_t i = 0; i < c->num_inputs; i++) {
+    sstable* sst = c->inputs[i];
+    lsm_level_remove(&tree->levels[sst->level], sst);
+    sst->obsolete = true;
+    sstable_unref(sst);
+  }
+  free(c->inputs);
+  c->inputs = NULL;
+  c->num_inputs = 0;
+
+  for (size_t i = 0; i < c->num_outputs; i++) {
+    if (lsm_level_add(&tree->levels[c->output_level], c->output_level, c->outputs[i]) != 0) {
+      // the manifest holds the table, it's picked up again on the next open
+      fprintf(stderr, "failed to add table %s to level %d\n", c->outputs[i]->filename, c->output_level);
+      sstable_unref(c->outputs[i]);
+      tree->bg_error = 1;
+    }
+  }
+  c->num_outputs = 0;
+  return 0;
+}
+
+// compaction_abort releases the inputs of a failed compaction and removes the
+// tables it wrote. Called with tree->lock held.
+void
+compaction_abort(compaction* c)
+{
+  for (size_t i = 0; i < c->num_inputs; i++) {
+    c->inputs[i]->compacting = false;
+  }
+  for (size_t i = 0; i < c->num_outputs; i++) {
+    c->outputs[i]->obsolete = true;
+    sstable_unref(c->outputs[i]);
+  }
+  c->num_outputs = 0;
+}
+
+void
+compaction_free(compaction* c)
+{
+  free(c->inputs);
+  free(c->outputs);
+  slice_free(c->smallest);
+  slice_free(c->largest);
+  free(c);
+}
@@ -0,0 +1,34 @@
+#ifndef __COMPACTION_H__
+#define __COMPACTION_H__
+
+#include "lsmt.h"
+#include "sstable.h"
+#include <stddef.h>
+
+typedef struct compaction_s {
+  int level;
+  int output_level;
+  sstable** inputs; // ordered from the newest to the oldest data
+  size_t num_inputs;
+  sstable** outputs;
+  size_t num_outputs;
+  size_t outputs_cap;
+  slice smallest; // key range covered by the inputs, owned copies
+  slice largest;
+  uint64_t max_seq; // newest write among the inputs
+  bool split_outputs; // start a new table every table_file_size bytes
+  bool bottommost; // no older data overlaps the inputs, so deletions have nothing left to hide
+  uint64_t bytes_read;
+  uint64_t bytes_written;
+  struct compaction_s* next;
+} compaction;
+
+double compaction_score(lsm_tree* tree, int level);
+bool compaction_needed(lsm_tree* tree);
+compaction* compaction_pick(lsm_tree* tree);
+int compaction_run(lsm_tree* tree, compaction* c);
+int compaction_install(lsm_tree* tree, compaction* c);
+void compaction_abort(compaction* c);
+void compaction_free(compaction* c);
+
+#endif
@@ -0,0 +1,261 @@
+#include "compress.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MIN_MATCH           4
+#define LAST_LITERALS       5 // the last bytes of the input are always literals
+#define MF_LIMIT            12 // no match starts this close to the end of the input
+#define MAX_OFFSET          65535
+#define FAST_HASH_LOG       12
+#define HIGH_HASH_LOG       15
+#define HIGH_MAX_ATTEMPTS   64 // candidates the high level checks per position
+
+static uint32_t
+read_u32(const char* p)
+{
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint32_t
+hash4(const char* p, int hash_log)
+{
+  return (read_u32(p) * 2654435761u) >> (32 - hash_log);
+}
+
+// match_length counts how many bytes at a and b match, the first MIN_MATCH
+// are known to.
+static size_t
+match_length(const char* a, const char* b, const char* end)
+{
+  size_t n = MIN_MATCH;
+  while (a + n < end && a[n] == b[n]) {
+    n++;
+  }
+  return n;
+}
+
+static char*
+emit_length(char* op, size_t len)
+{
+  while (len >= 255) {
+    *op++ = (char)255;
+    len -= 255;
+  }
+  *op++ = len;
+  return op;
+}
+
+// emit_sequence writes lit_len literals followed by a match, the last
+// sequence of a block has no match and match_len 0.
+static char*
+emit_sequence(char* op, const char* lit, size_t lit_len, size_t offset, size_t match_len)
+{
+  unsigned char* token = (unsigned char*)op++;
+  *token = (lit_len >= 15 ? 15 : lit_len) << 4;
+  if (lit_len >= 15) {
+    op = emit_length(op, lit_len - 15);
+  }
+  memcpy(op, lit, lit_len);
+  op += lit_len;
+  if (match_len == 0) {
+    return op;
+  }
+
+  uint16_t off = offset;
+  memcpy(op, &off, sizeof(off));
+  op += sizeof(off);
+  size_t ml = match_len - MIN_MATCH;
+  *token |= ml >= 15 ? 15 : ml;
+  if (ml >= 15) {
+    op = emit_length(op, ml - 15);
+  }
+  return op;
+}
+
+// compress_fast takes the last position with the same hash as the only match
+// candidate, and skips ahead faster the longer it finds none.
+static size_t
+compress_fast(const char* src, size_t size, char* dst)
+{
+  uint32_t table[1 << FAST_HASH_LOG] = { 0 }; // position + 1, 0 if empty
+  const char* ip = src;
+  const char* anchor = src;
+  const char* match_limit = size > MF_LIMIT ? src + size - MF_LIMIT : src;
+  const char* match_end = src + size - LAST_LITERALS;
+  char* op = dst;
+
+  while (ip < match_limit) {
+    uint32_t h = hash4(ip, FAST_HASH_LOG);
+    uint32_t cand = table[h];
+    table[h] = ip - src + 1;
+    const char* m = src + cand - 1;
+    if (cand == 0 || ip - m > MAX_OFFSET || read_u32(m) != read_u32(ip)) {
+      ip += 1 + ((ip - anchor) >> 6);
+      continue;
+    }
+
+    size_t len = match_length(ip, m, match_end);
+    op = emit_sequence(op, anchor, ip - anchor, ip - m, len);
+    ip += len;
+    anchor = ip;
+  }
+  return emit_sequence(op, anchor, src + size - anchor, 0, 0) - dst;
+}
+
+// compress_high chains every position to the previous one with the same hash
+// and takes the longest match among the candidates.
+static size_t
+compress_high(const char* src, size_t size, char* dst)
+{
+  uint32_t* head = calloc(1 << HIGH_HASH_LOG, sizeof(uint32_t));
+  uint32_t* chain = malloc((size + 1) * sizeof(uint32_t));
+  if (head == NULL || chain == NULL) {
+    free(head);
+    free(chain);
+    return compress_fast(src, size, dst);
+  }
+
+  const char* ip = src;
+  const char* anchor = src;
+  const char* match_limit = size > MF_LIMIT ? src + size - MF_LIMIT : src;
+  const char* match_end = src + size - LAST_LITERALS;
+  char* op = dst;
+  size_t next_insert = 0;
+
+  while (ip < match_limit) {
+    // positions skipped by the last match are added to the chains too
+    size_t pos = ip - src;
+    for (; next_insert <= pos; next_insert++) {
+      uint32_t h = hash4(src + next_insert, HIGH_HASH_LOG);
+      chain[next_insert] = head[h];
+      head[h] = next_insert + 1;
+    }
+
+    const char* best = NULL;
+    size_t best_len = 0;
+    uint32_t cand = chain[pos];
+    for (int attempts = 0; cand != 0 && attempts < HIGH_MAX_ATTEMPTS; attempts++) {
+      const char* m = src + cand - 1;
+      if (ip - m > MAX_OFFSET) {
+        break;
+      }
+      if (read_u32(m) == read_u32(ip)) {
+        size_t len = match_length(ip, m, match_end);
+        if (len > best_len) {
+          best = m;
+          best_len = len;
+        }
+      }
+      cand = chain[cand - 1];
+    }
+
+    if (best == NULL) {
+      ip++;
+      continue;
+    }
+    op = emit_sequence(op, anchor, ip - anchor, ip - best, best_len);
+    ip += best_len;
+    anchor = ip;
+  }
+
+  free(head);
+  free(chain);
+  return emit_sequence(op, anchor, src + size - anchor, 0, 0) - dst;
+}
+
+// compress_bound is the most compress_block can write for size bytes.
+size_t
+compress_bound(size_t size)
+{
+  return size + size / 255 + 16;
+}
+
+// compress_block compresses size bytes of src into dst, which needs room for
+// compress_bound(size) bytes, and returns the compressed size.
+size_t
+compress_block(compress_codec codec, const char* src, size_t size, char* dst)
+{
+  switch (codec) {
+  case COMPRESS_FAST:
+    return compress_fast(src, size, dst);
+  case COMPRESS_HIGH:
+    return compress_high(src, size, dst);
+  case COMPRESS_NONE:
+    break;
+  }
+  memcpy(dst, src, size);
+  return size;
+}
+
+static int
+read_length(const unsigned char** ip, const unsigned char* end, size_t* len)
+{
+  unsigned char b;
+  do {
+    if (*ip >= end) {
+      return 1;
+    }
+    b = *(*ip)++;
+    *len += b;
+  } while (b == 255);
+  return 0;
+}
+
+// decompress_block decodes size bytes of src into dst. Returns 1 unless the
+// input is well formed and decodes to exactly dst_size bytes.
+int
+decompress_block(const char* src, size_t size, char* dst, size_t dst_size)
+{
+  const unsigned char* ip = (const unsigned char*)src;
+  const unsigned char* end = ip + size;
+  char* op = dst;
+  char* oend = dst + dst_size;
+
+  while (ip < end) {
+    unsigned token = *ip++;
+    size_t lit_len = token >> 4;
+    if (lit_len == 15 && read_length(&ip, end, &lit_len) != 0) {
+      return 1;
+    }
+    if (lit_len > (size_t)(end - ip) || lit_len > (size_t)(oend - op)) {
+      return 1;
+    }
+    memcpy(op, ip, lit_len);
+    op += lit_len;
+    ip += lit_len;
+    if (ip == end) {
+      break;
+    }
+
+    uint16_t offset;
+    if (end - ip < (ptrdiff_t)sizeof(offset)) {
+      return 1;
+    }
+    memcpy(&offset, ip, sizeof(offset));
+    ip += sizeof(offset);
+    size_t match_len = token & 15;
+    if (match_len == 15 && read_length(&ip, end, &match_len) != 0) {
+      return 1;
+    }
+    match_len += MIN_MATCH;
+    if (offset == 0 || offset > op - dst || match_len > (size_t)(oend - op)) {
+      return 1;
+    }
+
+    // the match can overlap the bytes it produces, then it's copied a byte
+    // at a time.
+    const char* m = op - offset;
+    if (offset >= match_len) {
+      memcpy(op, m, match_len);
+    } else {
+      for (size_t i = 0; i < match_len; i++) {
+        op[i] = m[i];
+      }
+    }
+    op += match_len;
+  }
+  return op == oend ? 0 : 1;
+}
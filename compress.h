@@ -0,0 +1,25 @@
+#ifndef __COMPRESS_H__
+#define __COMPRESS_H__
+
+#include <stddef.h>
+
+// An LZ77 codec using the LZ4 block format: sequences of
+//
+//   [token][literal length bytes][literals][u16 offset][match length bytes]
+//
+// where the token holds 4 bits of literal length and 4 bits of match length.
+// Both compression levels produce the same format and share the decoder, the
+// high level searches harder for matches and is meant for cold data.
+//
+// The values are stored on disk, don't reorder them.
+typedef enum {
+  COMPRESS_NONE = 0,
+  COMPRESS_FAST = 1,
+  COMPRESS_HIGH = 2,
+} compress_codec;
+
+size_t compress_bound(size_t size);
+size_t compress_block(compress_codec codec, const char* src, size_t size, char* dst);
+int decompress_block(const char* src, size_t size, char* dst, size_t dst_size);
+
+#endif
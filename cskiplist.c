@@ -0,0 +1,318 @@
+#include "cskiplist.h"
+#include "utils.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static csk_node*
+node_next(csk_node* node, int level)
+{
+  return __atomic_load_n(&node->next[level], __ATOMIC_ACQUIRE);
+}
+
+cskiplist*
+cskiplist_new(arena* a)
+{
+  cskiplist* list = malloc(sizeof(cskiplist));
+  if (list == NULL) {
+    return NULL;
+  }
+
+  list->arena = a;
+  list->height = 1;
+  list->count = 0;
+  list->head = arena_alloc_concurrent(a, sizeof(csk_node) + CSKIPLIST_MAX_HEIGHT * sizeof(csk_node*));
+  if (list->head == NULL) {
+    free(list);
+    return NULL;
+  }
+  memset(list->head, 0, sizeof(csk_node) + CSKIPLIST_MAX_HEIGHT * sizeof(csk_node*));
+  list->head->height = CSKIPLIST_MAX_HEIGHT;
+  return list;
+}
+
+// cskiplist_free only frees the list itself, the nodes belong to the arena.
+void
+cskiplist_free(cskiplist* list)
+{
+  free(list);
+}
+
+// random_height picks heights with a 1/4 chance of going up a level. Every
+// thread keeps its own generator state.
+static int
+random_height(void)
+{
+  static __thread uint32_t state;
+  if (state == 0) {
+    state = (uint32_t)(uintptr_t)&state ^ (uint32_t)time(NULL) ^ 0x9E3779B9;
+  }
+
+  int height = 1;
+  while (height < CSKIPLIST_MAX_HEIGHT) {
+    // xorshift32
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    if ((state & 3) != 0) {
+      break;
+    }
+    height++;
+  }
+  return height;
+}
+
+static int
+node_compare(csk_node* node, slice key)
+{
+  return key_compare(node->key, node->key_size, key.data, key.size);
+}
+
+// find_splice_for_level walks level from before and returns the last node
+// with a smaller key in prev and the node after it in next.
+static void
+find_splice_for_level(slice key, csk_node* before, int level, csk_node** prev, csk_node** next)
+{
+  csk_node* x = before;
+  while (1) {
+    csk_node* n = node_next(x, level);
+    if (n == NULL || node_compare(n, key) >= 0) {
+      *prev = x;
+      *next = n;
+      return;
+    }
+    x = n;
+  }
+}
+
+// update_value links value into the values of the node, which are kept
+// newest first. A write that lost the race to a newer one goes behind it.
+static void
+update_value(csk_node* node, csk_value* value)
+{
+  csk_value** link = &node->value;
+  csk_value* cur = __atomic_load_n(link, __ATOMIC_ACQUIRE);
+  while (1) {
+    while (cur != NULL && cur->seq > value->seq) {
+      link = &cur->prev;
+      cur = __atomic_load_n(link, __ATOMIC_ACQUIRE);
+    }
+    __atomic_store_n(&value->prev, cur, __ATOMIC_RELAXED);
+    if (__atomic_compare_exchange_n(link, &cur, value, false, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+      return;
+    }
+  }
+}
+
+// cskiplist_insert adds key or, if the key exists, a new value for it that
+// readers see once they read at seq. Safe to call from several threads at once.
+int
+cskiplist_insert(cskiplist* list, slice key, slice value, uint64_t seq, bool deleted)
+{
+  if (key.size > UINT16_MAX || value.size > UINT32_MAX) {
+    return 1;
+  }
+
+  csk_value* v = arena_alloc_concurrent(list->arena, sizeof(csk_value) + value.size + 1);
+  if (v == NULL) {
+    return 1;
+  }
+  v->seq = seq;
+  v->prev = NULL;
+  v->size = value.size;
+  v->deleted = deleted;
+  memcpy(v->data, value.data, value.size);
+  v->data[value.size] = '\0';
+
+  int height = random_height();
+  int list_height = __atomic_load_n(&list->height, __ATOMIC_RELAXED);
+  while (height > list_height) {
+    if (__atomic_compare_exchange_n(&list->height, &list_height, height, false, __ATOMIC_RELAXED,
+            __ATOMIC_RELAXED)) {
+      list_height = height;
+      break;
+    }
+  }
+
+  csk_node* prev[CSKIPLIST_MAX_HEIGHT];
+  csk_node* next[CSKIPLIST_MAX_HEIGHT];
+  csk_node* x = list->head;
+  for (int level = list_height - 1; level >= 0; level--) {
+    find_splice_for_level(key, x, level, &prev[level], &next[level]);
+    x = prev[level];
+  }
+  if (next[0] != NULL && node_compare(next[0], key) == 0) {
+    update_value(next[0], v);
+    return 0;
+  }
+
+  csk_node* node = arena_alloc_concurrent(list->arena, sizeof(csk_node) + height * sizeof(csk_node*) + key.size + 1);
+  if (node == NULL) {
+    return 1;
+  }
+  node->value = v;
+  node->key_size = key.size;
+  node->height = height;
+  node->key = (char*)&node->next[height];
+  memcpy(node->key, key.data, key.size);
+  node->key[key.size] = '\0';
+
+  for (int level = 0; level < height; level++) {
+    while (1) {
+      __atomic_store_n(&node->next[level], next[level], __ATOMIC_RELAXED);
+      if (__atomic_compare_exchange_n(&prev[level]->next[level], &next[level], node, false, __ATOMIC_RELEASE,
+              __ATOMIC_RELAXED)) {
+        break;
+      }
+
+      // another writer linked a node in between, look for the new position
+      // starting from the old predecessor.
+      find_splice_for_level(key, prev[level], level, &prev[level], &next[level]);
+      if (level == 0 && next[0] != NULL && node_compare(next[0], key) == 0) {
+        // the same key was inserted concurrently, the node we allocated
+        // stays unused in the arena.
+        update_value(next[0], v);
+        return 0;
+      }
+    }
+  }
+
+  __atomic_add_fetch(&list->count, 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+// cskiplist_seek returns the first node with a key that is not smaller than
+// key, or NULL.
+csk_node*
+cskiplist_seek(cskiplist* list, slice key)
+{
+  csk_node* x = list->head;
+  csk_node* n = NULL;
+  for (int level = __atomic_load_n(&list->height, __ATOMIC_RELAXED) - 1; level >= 0; level--) {
+    find_splice_for_level(key, x, level, &x, &n);
+  }
+  return n;
+}
+
+// cskiplist_seek_before returns the last node with a key that is smaller than
+// key, or NULL. Nodes have no back links, so walking backwards is a search
+// from the head for every step.
+csk_node*
+cskiplist_seek_before(cskiplist* list, slice key)
+{
+  csk_node* x = list->head;
+  csk_node* n = NULL;
+  for (int level = __atomic_load_n(&list->height, __ATOMIC_RELAXED) - 1; level >= 0; level--) {
+    find_splice_for_level(key, x, level, &x, &n);
+  }
+  return x == list->head ? NULL : x;
+}
+
+csk_node*
+cskiplist_last(cskiplist* list)
+{
+  csk_node* x = list->head;
+  for (int level = __atomic_load_n(&list->height, __ATOMIC_RELAXED) - 1; level >= 0; level--) {
+    csk_node* n;
+    while ((n = node_next(x, level)) != NULL) {
+      x = n;
+    }
+  }
+  return x == list->head ? NULL : x;
+}
+
+void
+cskiplist_finger_init(cskiplist* list, csk_finger* f)
+{
+  for (int i = 0; i < CSKIPLIST_MAX_HEIGHT; i++) {
+    f->prev[i] = list->head;
+  }
+}
+
+// node_after tells if a comes after b in the list
+static bool
+node_after(cskiplist* list, csk_node* a, csk_node* b)
+{
+  if (a == b || a == list->head) {
+    return false;
+  }
+  return b == list->head || key_compare(a->key, a->key_size, b->key, b->key_size) > 0;
+}
+
+// cskiplist_seek_finger works like cskiplist_seek but starts from the nodes
+// the previous search through f ended at, keys have to be passed in
+// increasing order. It climbs from the bottom level while the finger is
+// behind key and walks down from there, so a key close to the previous one
+// costs a few steps instead of a search from the top.
+csk_node*
+cskiplist_seek_finger(cskiplist* list, csk_finger* f, slice key)
+{
+  int height = __atomic_load_n(&list->height, __ATOMIC_RELAXED);
+  int top = 0;
+  while (top < height - 1) {
+    csk_node* n = node_next(f->prev[top], top);
+    if (n == NULL || node_compare(n, key) >= 0) {
+      break;
+    }
+    top++;
+  }
+
+  csk_node* x = f->prev[top];
+  csk_node* n = NULL;
+  for (int level = top; level >= 0; level--) {
+    // the finger of a lower level can be further ahead than the node the
+    // walk came down from
+    if (node_after(list, f->prev[level], x)) {
+      x = f->prev[level];
+    }
+    find_splice_for_level(key, x, level, &f->prev[level], &n);
+    x = f->prev[level];
+  }
+  return n;
+}
+
+csk_node*
+cskiplist_find(cskiplist* list, slice key)
+{
+  csk_node* n = cskiplist_seek(list, key);
+  if (n == NULL || node_compare(n, key) != 0) {
+    return NULL;
+  }
+  return n;
+}
+
+csk_node*
+cskiplist_first(cskiplist* list)
+{
+  return node_next(list->head, 0);
+}
+
+csk_node*
+cskiplist_next(csk_node* node)
+{
+  return node_next(node, 0);
+}
+
+csk_value*
+csk_node_value(csk_node* node)
+{
+  return __atomic_load_n(&node->value, __ATOMIC_ACQUIRE);
+}
+
+// csk_node_value_at returns the newest value of the node written at or before
+// seq, or NULL if every value is newer.
+csk_value*
+csk_node_value_at(csk_node* node, uint64_t seq)
+{
+  csk_value* v = csk_node_value(node);
+  while (v != NULL && v->seq > seq) {
+    v = __atomic_load_n(&v->prev, __ATOMIC_ACQUIRE);
+  }
+  return v;
+}
+
+size_t
+cskiplist_count(cskiplist* list)
+{
+  return __atomic_load_n(&list->count, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,63 @@
+#ifndef __CSKIPLIST_H__
+#define __CSKIPLIST_H__
+
+#include "arena.h"
+#include "utils.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// cskiplist is a skiplist that can be read and written by several threads at
+// once without locks. Nodes are only ever linked in, never unlinked, so
+// readers just follow the forward pointers. Writers link a new node level by
+// level with a CAS on the predecessor's pointer, and link a new value of an
+// existing key into the node's values with a CAS, so readers that don't see
+// the newest writes yet still find the value they do see.
+
+#define CSKIPLIST_MAX_HEIGHT 12 // enough for a few million entries with p = 1/4
+
+typedef struct csk_value_s {
+  uint64_t seq; // sequence number of the write that set the value
+  struct csk_value_s* prev; // the older value of the key, updated atomically
+  uint32_t size;
+  bool deleted;
+  char data[]; // size bytes followed by a terminator
+} csk_value;
+
+typedef struct csk_node_s {
+  csk_value* value; // the newest value, updated atomically
+  char* key; // terminated, key_size doesn't include the terminator
+  uint16_t key_size;
+  int height;
+  struct csk_node_s* next[]; // updated atomically, height entries
+} csk_node;
+
+typedef struct cskiplist_s {
+  arena* arena;
+  csk_node* head;
+  int height; // highest height of any node, updated atomically
+  size_t count; // updated atomically
+} cskiplist;
+
+// csk_finger remembers where the last search ended on every level, so a
+// search for a larger key resumes from there instead of the head.
+typedef struct csk_finger_s {
+  csk_node* prev[CSKIPLIST_MAX_HEIGHT];
+} csk_finger;
+
+cskiplist* cskiplist_new(arena* a);
+void cskiplist_free(cskiplist* list);
+int cskiplist_insert(cskiplist* list, slice key, slice value, uint64_t seq, bool deleted);
+csk_node* cskiplist_find(cskiplist* list, slice key);
+csk_node* cskiplist_seek(cskiplist* list, slice key);
+csk_node* cskiplist_seek_before(cskiplist* list, slice key);
+csk_node* cskiplist_last(cskiplist* list);
+void cskiplist_finger_init(cskiplist* list, csk_finger* f);
+csk_node* cskiplist_seek_finger(cskiplist* list, csk_finger* f, slice key);
+csk_node* cskiplist_first(cskiplist* list);
+csk_node* cskiplist_next(csk_node* node);
+csk_value* csk_node_value(csk_node* node);
+csk_value* csk_node_value_at(csk_node* node, uint64_t seq);
+size_t cskiplist_count(cskiplist* list);
+
+#endif
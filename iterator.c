@@ -0,0 +1,400 @@
+#include "iterator.h"
+#include "cskiplist.h"
+#include "memtable.h"
+#include "sstable.h"
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct lsm_iter_source_s {
+  memtable* mem; // set for memtables
+  cskiplist* list;
+  csk_node* node;
+  sstable_iter* table; // set for tables
+  bool valid;
+  slice key;
+  slice value;
+  bool deleted;
+} lsm_iter_source;
+
+// source_update copies the position of the underlying iterator into s.
+static void
+source_update(lsm_iter* it, lsm_iter_source* s)
+{
+  if (s->table != NULL) {
+    it->error |= s->table->error;
+    s->valid = s->table->valid;
+    if (s->valid) {
+      s->key = slice_new(s->table->key, s->table->key_size);
+      s->value = slice_new(s->table->value, s->table->value_size);
+      s->deleted = s->table->deleted;
+    }
+    return;
+  }
+
+  // keys that were only written after the iterator was created are skipped
+  csk_value* v = NULL;
+  while (s->node != NULL && (v = csk_node_value_at(s->node, it->seq)) == NULL) {
+    slice key = slice_new(s->node->key, s->node->key_size);
+    s->node = it->forward ? cskiplist_next(s->node) : cskiplist_seek_before(s->list, key);
+  }
+  s->valid = s->node != NULL;
+  if (s->valid) {
+    s->key = slice_new(s->node->key, s->node->key_size);
+    s->value = slice_new(v->data, v->size);
+    s->deleted = v->deleted || (it->range_dels && memtable_range_seq(s->mem, s->key, it->seq) > v->seq);
+  }
+}
+
+static void
+source_seek_to_first(lsm_iter* it, lsm_iter_source* s)
+{
+  if (s->table != NULL) {
+    sstable_iter_seek_to_first(s->table);
+  } else {
+    s->node = cskiplist_first(s->list);
+  }
+  source_update(it, s);
+}
+
+static void
+source_seek_to_last(lsm_iter* it, lsm_iter_source* s)
+{
+  if (s->table != NULL) {
+    sstable_iter_seek_to_last(s->table);
+  } else {
+    s->node = cskiplist_last(s->list);
+  }
+  source_update(it, s);
+}
+
+static void
+source_seek(lsm_iter* it, lsm_iter_source* s, slice key)
+{
+  if (s->table != NULL) {
+    sstable_iter_seek(s->table, key);
+  } else {
+    s->node = cskiplist_seek(s->list, key);
+  }
+  source_update(it, s);
+}
+
+// source_seek_before moves s to the last key that is smaller than key.
+static void
+source_seek_before(lsm_iter* it, lsm_iter_source* s, slice key)
+{
+  if (s->table != NULL) {
+    sstable_iter_seek(s->table, key);
+    if (s->table->valid) {
+      sstable_iter_prev(s->table);
+    } else if (!s->table->error) {
+      sstable_iter_seek_to_last(s->table);
+    }
+  } else {
+    s->node = cskiplist_seek_before(s->list, key);
+  }
+  source_update(it, s);
+}
+
+static void
+source_step(lsm_iter* it, lsm_iter_source* s)
+{
+  if (s->table != NULL) {
+    if (it->forward) {
+      sstable_iter_next(s->table);
+    } else {
+      sstable_iter_prev(s->table);
+    }
+  } else {
+    s->node = it->forward ? cskiplist_next(s->node) : cskiplist_seek_before(s->list, s->key);
+  }
+  source_update(it, s);
+}
+
+// heap_before orders the heap by the smallest key going forward and by the
+// largest going backward, the newer source goes first for equal keys.
+static bool
+heap_before(lsm_iter* it, size_t a, size_t b)
+{
+  int cmp = slice_compare(it->sources[a].key, it->sources[b].key);
+  if (!it->forward) {
+    cmp = -cmp;
+  }
+  return cmp < 0 || (cmp == 0 && a < b);
+}
+
+static void
+heap_sift_down(lsm_iter* it, size_t i)
+{
+  for (;;) {
+    size_t first = i;
+    size_t l = 2 * i + 1, r = 2 * i + 2;
+    if (l < it->heap_len && heap_before(it, it->heap[l], it->heap[first])) {
+      first = l;
+    }
+    if (r < it->heap_len && heap_before(it, it->heap[r], it->heap[first])) {
+      first = r;
+    }
+    if (first == i) {
+      return;
+    }
+    size_t tmp = it->heap[i];
+    it->heap[i] = it->heap[first];
+    it->heap[first] = tmp;
+    i = first;
+  }
+}
+
+static void
+heap_build(lsm_iter* it)
+{
+  it->heap_len = 0;
+  for (size_t i = 0; i < it->num_sources; i++) {
+    if (it->sources[i].valid) {
+      it->heap[it->heap_len++] = i;
+    }
+  }
+  for (size_t i = it->heap_len / 2; i-- > 0;) {
+    heap_sift_down(it, i);
+  }
+}
+
+// save_key copies key into key_buf, the memory key points to goes away once
+// the source holding it moves.
+static int
+save_key(lsm_iter* it, slice key)
+{
+  if (key.size > it->key_buf_cap) {
+    char* n = realloc(it->key_buf, key.size);
+    if (n == NULL) {
+      it->error = 1;
+      it->valid = false;
+      return 1;
+    }
+    it->key_buf = n;
+    it->key_buf_cap = key.size;
+  }
+  memcpy(it->key_buf, key.data, key.size);
+  it->key_buf_size = key.size;
+  return 0;
+}
+
+// skip_saved_key steps every source that is on the saved key past it. They're
+// all at the top of the heap.
+static void
+skip_saved_key(lsm_iter* it)
+{
+  slice saved = slice_new(it->key_buf, it->key_buf_size);
+  while (it->heap_len > 0 && !it->error) {
+    lsm_iter_source* top = &it->sources[it->heap[0]];
+    if (slice_compare(top->key, saved) != 0) {
+      return;
+    }
+
+    source_step(it, top);
+    if (!top->valid) {
+      it->heap[0] = it->heap[--it->heap_len];
+    }
+    heap_sift_down(it, 0);
+  }
+}
+
+// range_deleted tells if a range deletion of a source newer than source s
+// hides key.
+static bool
+range_deleted(lsm_iter* it, size_t s, slice key)
+{
+  for (size_t i = 0; i < s; i++) {
+    lsm_iter_source* src = &it->sources[i];
+    if ((src->table != NULL && sstable_range_deleted(src->table->sst, key)) ||
+        (src->table == NULL && memtable_range_seq(src->mem, key, it->seq) > 0)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// find_visible settles on the next key in the current direction whose newest
+// version isn't a deletion or covered by a range deletion. Older versions are
+// only skipped once the iterator moves past their key.
+static void
+find_visible(lsm_iter* it)
+{
+  while (it->heap_len > 0 && !it->error) {
+    lsm_iter_source* top = &it->sources[it->heap[0]];
+    if (!top->deleted && !(it->range_dels && range_deleted(it, it->heap[0], top->key))) {
+      it->key = top->key;
+      it->value = top->value;
+      it->valid = true;
+      return;
+    }
+
+    if (save_key(it, top->key) != 0) {
+      return;
+    }
+    skip_saved_key(it);
+  }
+  it->valid = false;
+}
+
+lsm_iter*
+lsm_iter_new(lsm_tree* tree)
+{
+  lsm_iter* it = calloc(1, sizeof(lsm_iter));
+  if (it == NULL) {
+    return NULL;
+  }
+
+  pthread_mutex_lock(&tree->lock);
+  size_t max_tables = 0;
+  for (int l = 0; l < LSM_NUM_LEVELS; l++) {
+    max_tables += tree->levels[l].num_tables;
+  }
+  it->mems = malloc((tree->num_old_memtables + 1) * sizeof(memtable*));
+  it->tables = malloc((max_tables + 1) * sizeof(sstable*));
+  it->sources = calloc(tree->num_old_memtables + 1 + max_tables, sizeof(lsm_iter_source));
+  it->heap = malloc((tree->num_old_memtables + 1 + max_tables) * sizeof(size_t));
+  if (it->mems == NULL || it->tables == NULL || it->sources == NULL || it->heap == NULL) {
+    pthread_mutex_unlock(&tree->lock);
+    lsm_iter_free(it);
+    return NULL;
+  }
+
+  // the order of the sources decides which version of a key wins, so it
+  // follows the order lsm_tree_get searches in.
+  it->mems[it->num_mems++] = tree->active;
+  for (memtable* mt = tree->old_memtables; mt != NULL; mt = mt->next) {
+    it->mems[it->num_mems++] = mt;
+  }
+  for (int l = 0; l < LSM_NUM_LEVELS; l++) {
+    for (size_t i = 0; i < tree->levels[l].num_tables; i++) {
+      it->tables[it->num_tables++] = tree->levels[l].tables[i];
+    }
+  }
+  for (size_t i = 0; i < it->num_mems; i++) {
+    memtable_ref(it->mems[i]);
+  }
+  for (size_t i = 0; i < it->num_tables; i++) {
+    sstable_ref(it->tables[i]);
+  }
+  it->seq = tree->visible_seq;
+  pthread_mutex_unlock(&tree->lock);
+
+  for (size_t i = 0; i < it->num_mems; i++) {
+    lsm_iter_source* s = &it->sources[it->num_sources++];
+    s->mem = it->mems[i];
+    s->list = it->mems[i]->skiplist;
+    it->range_dels |= memtable_range_dels(it->mems[i]) != NULL;
+  }
+  for (size_t i = 0; i < it->num_tables; i++) {
+    it->range_dels |= it->tables[i]->num_range_dels > 0;
+    lsm_iter_source* s = &it->sources[it->num_sources++];
+    s->table = sstable_iter_new(it->tables[i]);
+    if (s->table == NULL) {
+      lsm_iter_free(it);
+      return NULL;
+    }
+  }
+  it->forward = true;
+  return it;
+}
+
+void
+lsm_iter_seek_to_first(lsm_iter* it)
+{
+  it->error = 0;
+  it->forward = true;
+  for (size_t i = 0; i < it->num_sources; i++) {
+    source_seek_to_first(it, &it->sources[i]);
+  }
+  heap_build(it);
+  find_visible(it);
+}
+
+void
+lsm_iter_seek_to_last(lsm_iter* it)
+{
+  it->error = 0;
+  it->forward = false;
+  for (size_t i = 0; i < it->num_sources; i++) {
+    source_seek_to_last(it, &it->sources[i]);
+  }
+  heap_build(it);
+  find_visible(it);
+}
+
+// lsm_iter_seek moves to the first key that is not smaller than key, a range
+// scan seeks to its start and calls lsm_iter_next until the end is passed.
+void
+lsm_iter_seek(lsm_iter* it, slice key)
+{
+  it->error = 0;
+  it->forward = true;
+  for (size_t i = 0; i < it->num_sources; i++) {
+    source_seek(it, &it->sources[i], key);
+  }
+  heap_build(it);
+  find_visible(it);
+}
+
+void
+lsm_iter_next(lsm_iter* it)
+{
+  if (!it->valid || save_key(it, it->key) != 0) {
+    return;
+  }
+
+  if (!it->forward) {
+    // the other sources are before the current key, move them onto it first
+    it->forward = true;
+    slice saved = slice_new(it->key_buf, it->key_buf_size);
+    for (size_t i = 0; i < it->num_sources; i++) {
+      source_seek(it, &it->sources[i], saved);
+    }
+    heap_build(it);
+  }
+  skip_saved_key(it);
+  find_visible(it);
+}
+
+void
+lsm_iter_prev(lsm_iter* it)
+{
+  if (!it->valid || save_key(it, it->key) != 0) {
+    return;
+  }
+
+  if (it->forward) {
+    // the other sources are on or after the current key
+    it->forward = false;
+    slice saved = slice_new(it->key_buf, it->key_buf_size);
+    for (size_t i = 0; i < it->num_sources; i++) {
+      source_seek_before(it, &it->sources[i], saved);
+    }
+    heap_build(it);
+  } else {
+    skip_saved_key(it);
+  }
+  find_visible(it);
+}
+
+void
+lsm_iter_free(lsm_iter* it)
+{
+  for (size_t i = 0; i < it->num_sources; i++) {
+    if (it->sources[i].table != NULL) {
+      sstable_iter_free(it->sources[i].table);
+    }
+  }
+  for (size_t i = 0; i < it->num_mems; i++) {
+    memtable_unref(it->mems[i]);
+  }
+  for (size_t i = 0; i < it->num_tables; i++) {
+    sstable_unref(it->tables[i]);
+  }
+  free(it->mems);
+  free(it->tables);
+  free(it->sources);
+  free(it->heap);
+  free(it->key_buf);
+  free(it);
+}
@@ -0,0 +1,52 @@
+#ifndef __ITERATOR_H__
+#define __ITERATOR_H__
+
+#include "lsmt.h"
+#include "utils.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+// lsm_iter walks the keys of a tree in either direction. Every memtable and
+// table is a sorted source, the sources are merged with a heap and for a key
+// that is in several of them only the newest version is returned. Keys whose
+// newest version is a deletion, or that a range deletion of a newer source
+// covers, are skipped.
+//
+// The iterator references the memtables and tables that existed when it was
+// created, so flushes and compactions don't disturb it. It sees the writes
+// that were published by then, later ones are skipped.
+
+struct lsm_iter_source_s;
+
+typedef struct lsm_iter_s {
+  memtable** mems;
+  size_t num_mems;
+  sstable** tables;
+  size_t num_tables;
+  struct lsm_iter_source_s* sources; // memtables then tables, newest first
+  size_t num_sources;
+  size_t* heap; // indexes into sources, ties are broken by the newer source
+  size_t heap_len;
+  uint64_t seq; // the tree's visible_seq when the iterator was created
+  bool forward;
+  bool range_dels; // some source has range deletions, only then are they checked
+  char* key_buf; // copy of the key that is being moved past
+  size_t key_buf_size;
+  size_t key_buf_cap;
+
+  // key and value stay valid until the iterator is moved or freed
+  slice key;
+  slice value;
+  bool valid;
+  int error;
+} lsm_iter;
+
+lsm_iter* lsm_iter_new(lsm_tree* tree);
+void lsm_iter_seek_to_first(lsm_iter* it);
+void lsm_iter_seek_to_last(lsm_iter* it);
+void lsm_iter_seek(lsm_iter* it, slice key);
+void lsm_iter_next(lsm_iter* it);
+void lsm_iter_prev(lsm_iter* it);
+void lsm_iter_free(lsm_iter* it);
+
+#endif
@@ -1,5 +1,8 @@
 #include "lsmt.h"
+#include "compaction.h"
+#include "manifest.h"
 #include "memtable.h"
+#include "sstable.h"
 #include "utils.h"
 #include <dirent.h>
 #include <stdio.h>
@@ -7,12 +10,236 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+void
+lsm_options_default(lsm_options* opts)
+{
+  opts->compaction_style = LSM_COMPACTION_LEVELED;
+  opts->memtable_size = 4 * 1024 * 1024;
+  opts->table_file_size = 2 * 1024 * 1024;
+  opts->level0_compaction_trigger = 4;
+  opts->level0_stop_trigger = 12;
+  opts->level1_size = 10 * 1024 * 1024;
+  opts->level_size_ratio = 10;
+  opts->compaction_threads = 2;
+  opts->wal_sync = WAL_SYNC_ALWAYS;
+  opts->wal_sync_interval_ms = 100;
+  opts->block_cache = block_cache_default();
+  opts->use_mmap_reads = false;
+  for (int i = 0; i < LSM_NUM_LEVELS; i++) {
+    opts->compression[i] = COMPRESS_FAST;
+  }
+  opts->tiered_size_ratio = 20;
+  opts->tiered_min_merge_width = 2;
+  opts->tiered_max_merge_width = 16;
+  opts->tiered_max_size_amp = 200;
+}
+
+void
+lsm_tree_file_path(lsm_tree* tree, uint64_t file_num, const char* ext, char* buf, size_t size)
+{
+  snprintf(buf, size, "%s/%06llu.%s", tree->data_dir_path, (unsigned long long)file_num, ext);
+}
+
+uint64_t
+lsm_tree_new_file_num(lsm_tree* tree)
+{
+  return __atomic_fetch_add(&tree->next_file_num, 1, __ATOMIC_RELAXED);
+}
+
+// lsm_level_add inserts sst into a level. L0 tables overlap so they're kept
+// ordered newest first, other levels are kept sorted by key.
+int
+lsm_level_add(lsm_level* level, int level_num, sstable* sst)
+{
+  if (level->num_tables == level->cap) {
+    size_t new_cap = level->cap ? level->cap * 2 : 16;
+    sstable** n = realloc(level->tables, new_cap * sizeof(sstable*));
+    if (n == NULL) {
+      return 1;
+    }
+    level->tables = n;
+    level->cap = new_cap;
+  }
+
+  size_t pos = 0;
+  size_t hi = level->num_tables;
+  while (pos < hi) {
+    size_t mid = pos + (hi - pos) / 2;
+    sstable* t = level->tables[mid];
+    bool before = level_num > 0 ? slice_compare(t->smallest, sst->smallest) < 0 : t->max_seq > sst->max_seq;
+    if (before) {
+      pos = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  memmove(&level->tables[pos + 1], &level->tables[pos],
+      (level->num_tables - pos) * sizeof(sstable*));
+  level->tables[pos] = sst;
+  level->num_tables++;
+  level->size += sst->file_size;
+  return 0;
+}
+
+void
+lsm_level_remove(lsm_level* level, sstable* sst)
+{
+  for (size_t i = 0; i < level->num_tables; i++) {
+    if (level->tables[i] == sst) {
+      memmove(&level->tables[i], &level->tables[i + 1],
+          (level->num_tables - i - 1) * sizeof(sstable*));
+      level->num_tables--;
+      level->size -= sst->file_size;
+      return;
+    }
+  }
+}
+
+// parse_file_num extracts the number from names like 000012.sst, files that
+// don't follow that pattern are skipped by the caller.
+static int
+parse_file_num(const char* name, uint64_t* file_num)
+{
+  char* end;
+  *file_num = strtoull(name, &end, 10);
+  return end == name || *end != '.';
+}
+
+static int
+cmp_file_num(const void* a, const void* b)
+{
+  uint64_t x = *(const uint64_t*)a;
+  uint64_t y = *(const uint64_t*)b;
+  return (x > y) - (x < y);
+}
+
 static int
-init_memtable_from_file(const char* path, memtable* mem)
+push_file_num(uint64_t** nums, size_t* len, size_t* cap, uint64_t num)
 {
+  if (*len == *cap) {
+    size_t new_cap = *cap ? *cap * 2 : 16;
+    uint64_t* n = realloc(*nums, new_cap * sizeof(uint64_t));
+    if (n == NULL) {
+      return 1;
+    }
+    *nums = n;
+    *cap = new_cap;
+  }
+  (*nums)[(*len)++] = num;
   return 0;
 }
 
+// memtable_expected_keys estimates how many keys fit in a memtable, its
+// filter is sized for that many.
+static size_t
+memtable_expected_keys(lsm_tree* tree)
+{
+  return tree->opts.memtable_size / tree->entry_size + 1;
+}
+
+typedef struct recovery_s {
+  lsm_tree* tree;
+  const uint64_t* file_nums;
+  memtable** mems;
+  size_t n;
+  size_t next; // next log to replay, updated atomically
+} recovery;
+
+static void*
+recovery_thread_main(void* arg)
+{
+  recovery* r = arg;
+  char path[1024];
+  size_t i;
+  while ((i = __atomic_fetch_add(&r->next, 1, __ATOMIC_RELAXED)) < r->n) {
+    lsm_tree_file_path(r->tree, r->file_nums[i], "mem", path, sizeof(path));
+    r->mems[i] = memtable_recover_from_wal(memtable_expected_keys(r->tree), path);
+  }
+  return NULL;
+}
+
+// recover_memtables replays the logs with the given file numbers into mems,
+// on up to LSM_RECOVERY_THREADS threads. A log that can't be replayed leaves
+// its slot NULL.
+static void
+recover_memtables(lsm_tree* tree, const uint64_t* file_nums, size_t n, memtable** mems)
+{
+  recovery r = { .tree = tree, .file_nums = file_nums, .mems = mems, .n = n };
+  pthread_t threads[LSM_RECOVERY_THREADS];
+  size_t num_threads = 0;
+
+  // the calling thread replays logs too, so failing to start a thread only
+  // makes recovery slower.
+  while (num_threads + 1 < LSM_RECOVERY_THREADS && num_threads + 1 < n &&
+      pthread_create(&threads[num_threads], NULL, recovery_thread_main, &r) == 0) {
+    num_threads++;
+  }
+  recovery_thread_main(&r);
+  for (size_t i = 0; i < num_threads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+}
+
+// recover_logs replays the logs with the given file numbers, sorted oldest
+// first, into the tree's frozen memtables.
+static int
+recover_logs(lsm_tree* tree, const uint64_t* file_nums, size_t n)
+{
+  char fullpath[1024];
+  int res = 0;
+
+  if (n == 0) {
+    return 0;
+  }
+
+  // the logs are independent, so they're replayed in parallel and only
+  // linked into the tree in order afterwards.
+  memtable** recovered = calloc(n, sizeof(memtable*));
+  if (recovered == NULL) {
+    return 1;
+  }
+  recover_memtables(tree, file_nums, n, recovered);
+
+  // old_memtables is kept newest first, so the logs are linked oldest first.
+  // Their writes are newer than anything in the tables.
+  for (size_t i = 0; res == 0 && i < n; i++) {
+    memtable* mt = recovered[i];
+    recovered[i] = NULL;
+    lsm_tree_file_path(tree, file_nums[i], "mem", fullpath, sizeof(fullpath));
+    if (mt == NULL) {
+      fprintf(stderr, "failed to recover memtable from %s\n", fullpath);
+      res = 1;
+      break;
+    }
+
+    // keep the log attached so it is removed once the memtable is flushed.
+    mt->wal = wal_create(fullpath);
+    if (mt->wal == NULL) {
+      memtable_free(mt);
+      res = 1;
+      break;
+    }
+    mt->wal->sync_mode = tree->opts.wal_sync;
+    mt->log_num = file_nums[i];
+    tree->last_seq += mt->max_seq;
+    mt->max_seq = tree->last_seq;
+    mt->next = tree->old_memtables;
+    tree->old_memtables = mt;
+    tree->num_old_memtables++;
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    if (recovered[i] != NULL) {
+      memtable_free(recovered[i]);
+    }
+  }
+  free(recovered);
+  return res;
+}
+
+// init_tree_from_path rebuilds the state of a tree written before it had a
+// manifest from the names of its files.
 static int
 init_tree_from_path(lsm_tree* tree)
 {
@@ -23,94 +250,1248 @@ init_tree_from_path(lsm_tree* tree)
   }
 
   struct dirent* entry;
-  struct stat file_stat;
   char fullpath[1024];
-  char basename[1024];
+  uint64_t *mems = NULL, *tables = NULL;
+  size_t num_mems = 0, mems_cap = 0, num_tables = 0, tables_cap = 0;
+  int res = 0;
 
   while ((entry = readdir(dir)) != NULL) {
     if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
       continue;
     }
 
+    uint64_t file_num;
+    if (parse_file_num(entry->d_name, &file_num) != 0) {
+      continue;
+    }
+
     const char* ext = get_file_ext(entry->d_name);
     if (strcmp(ext, "mem") == 0) {
-      strncpy(basename, entry->d_name, strlen(entry->d_name) - 4);
-      basename[strlen(entry->d_name) - 4] = '\0';
+      res = push_file_num(&mems, &num_mems, &mems_cap, file_num);
+    } else if (strcmp(ext, "sst") == 0) {
+      res = push_file_num(&tables, &num_tables, &tables_cap, file_num);
+    } else if (strcmp(ext, "sst.tmp") == 0) {
+      // left behind by a flush that never finished, the data is still in the
+      // memtable's log.
+      snprintf(fullpath, sizeof(fullpath), "%s/%s", tree->data_dir_path, entry->d_name);
+      unlink(fullpath);
+    }
 
-      char mem_path[1024], filter_path[1024];
-      snprintf(mem_path, sizeof(mem_path), "%s/%s.mem", tree->data_dir_path, basename);
-      snprintf(filter_path, sizeof(filter_path), "%s/%s.filter", tree->data_dir_path, basename);
+    if (res != 0) {
+      break;
+    }
+    if (file_num >= tree->next_file_num) {
+      tree->next_file_num = file_num + 1;
+    }
+  }
+  closedir(dir);
+
+  if (num_mems > 1) {
+    qsort(mems, num_mems, sizeof(uint64_t), cmp_file_num);
+  }
+  if (num_tables > 1) {
+    qsort(tables, num_tables, sizeof(uint64_t), cmp_file_num);
+  }
 
-      if (access(mem_path, F_OK) != 0 || access(filter_path, F_OK) != 0) {
-        fprintf(stderr, "missing matching .mem or .filter file for %s\n", basename);
-        closedir(dir);
-        return 1;
+  for (size_t i = 0; res == 0 && i < num_tables; i++) {
+    lsm_tree_file_path(tree, tables[i], "sst", fullpath, sizeof(fullpath));
+    sstable* sst = sstable_open(fullpath, tables[i], tree->opts.block_cache, tree->opts.use_mmap_reads);
+    if (sst == NULL || sst->level >= LSM_NUM_LEVELS) {
+      fprintf(stderr, "failed to open table %s\n", fullpath);
+      if (sst != NULL) {
+        sstable_close(sst);
       }
+      res = 1;
+      break;
+    }
+    if (lsm_level_add(&tree->levels[sst->level], sst->level, sst) != 0) {
+      sstable_close(sst);
+      res = 1;
+    }
+    if (sst->max_seq > tree->last_seq) {
+      tree->last_seq = sst->max_seq;
+    }
+  }
 
-      memtable* mt = memtable_new(1024);
-      if (mt == NULL) {
-        fprintf(stderr, "failed to create memtable\n");
-        closedir(dir);
-        return 1;
+  // tables in L1+ never overlap. If they do a compaction was interrupted after
+  // writing some of its outputs, its inputs are all still there so the newer
+  // tables are dropped.
+  for (int l = 1; res == 0 && l < LSM_NUM_LEVELS; l++) {
+    lsm_level* level = &tree->levels[l];
+    for (size_t i = 1; i < level->num_tables;) {
+      sstable* prev = level->tables[i - 1];
+      sstable* curr = level->tables[i];
+      if (slice_compare(prev->largest, curr->smallest) < 0) {
+        i++;
+        continue;
       }
 
-      bloom_filter* filter = bloom_filter_from_file(filter_path);
-      if (filter == NULL) {
-        fprintf(stderr, "failed to load bloom filter from %s\n", filter_path);
-        memtable_free(mt);
-        closedir(dir);
-        return 1;
+      sstable* drop = prev->file_num > curr->file_num ? prev : curr;
+      lsm_level_remove(level, drop);
+      drop->obsolete = true;
+      sstable_unref(drop);
+      i = 1;
+    }
+  }
+
+  if (res == 0) {
+    res = recover_logs(tree, mems, num_mems);
+  }
+
+  free(mems);
+  free(tables);
+  return res;
+}
+
+// init_tree_from_manifest opens the tables and replays the logs the manifest
+// lists, nothing else in the directory is looked at.
+static int
+init_tree_from_manifest(lsm_tree* tree, manifest_state* state)
+{
+  char fullpath[1024];
+  int res = 0;
+  tree->next_file_num = state->next_file_num;
+  tree->last_seq = state->last_seq;
+
+  for (size_t i = 0; res == 0 && i < state->num_tables; i++) {
+    manifest_table* t = &state->tables[i];
+    lsm_tree_file_path(tree, t->file_num, "sst", fullpath, sizeof(fullpath));
+    sstable* sst = sstable_open(fullpath, t->file_num, tree->opts.block_cache, tree->opts.use_mmap_reads);
+    if (sst == NULL || t->level >= LSM_NUM_LEVELS || sst->file_size != t->file_size) {
+      fprintf(stderr, "failed to open table %s\n", fullpath);
+      if (sst != NULL) {
+        sstable_close(sst);
       }
+      res = 1;
+      break;
+    }
+
+    // the manifest decides the level
+    sst->level = t->level;
+    if (lsm_level_add(&tree->levels[sst->level], sst->level, sst) != 0) {
+      sstable_close(sst);
+      res = 1;
+    }
+    if (sst->max_seq > tree->last_seq) {
+      tree->last_seq = sst->max_seq;
+    }
+    if (t->file_num >= tree->next_file_num) {
+      tree->next_file_num = t->file_num + 1;
+    }
+  }
+
+  qsort(state->logs, state->num_logs, sizeof(uint64_t), cmp_file_num);
+  for (size_t i = 0; i < state->num_logs; i++) {
+    if (state->logs[i] >= tree->next_file_num) {
+      tree->next_file_num = state->logs[i] + 1;
+    }
+  }
+  if (res == 0) {
+    res = recover_logs(tree, state->logs, state->num_logs);
+  }
+  return res;
+}
+
+// init_tree loads the tree's state from its manifest. A directory without one
+// was written before the manifest existed, its files are scanned instead.
+static int
+init_tree(lsm_tree* tree)
+{
+  manifest_state state;
+  manifest_res mres = manifest_load(tree->data_dir_path, &state);
+  if (mres == MANIFEST_NOT_FOUND) {
+    return init_tree_from_path(tree);
+  }
+  if (mres != MANIFEST_OK) {
+    return 1;
+  }
+
+  int res = init_tree_from_manifest(tree, &state);
+  manifest_state_free(&state);
+  return res;
+}
+
+void
+lsm_edit_add_table(manifest_edit* e, sstable* sst)
+{
+  manifest_table t = {
+    .file_num = sst->file_num,
+    .level = sst->level,
+    .file_size = sst->file_size,
+    .max_seq = sst->max_seq,
+    .smallest = sst->smallest,
+    .largest = sst->largest,
+  };
+  manifest_edit_add_table(e, &t);
+}
+
+// write_snapshot starts a new manifest holding the tree's current state and
+// removes the old one. Called with tree->lock held.
+static int
+write_snapshot(lsm_tree* tree)
+{
+  uint64_t file_num = lsm_tree_new_file_num(tree);
+  manifest_edit e;
+  manifest_edit_init(&e);
+  manifest_edit_set_next_file_num(&e, __atomic_load_n(&tree->next_file_num, __ATOMIC_RELAXED));
+  manifest_edit_set_last_seq(&e, tree->last_seq);
+  for (int l = 0; l < LSM_NUM_LEVELS; l++) {
+    for (size_t i = 0; i < tree->levels[l].num_tables; i++) {
+      lsm_edit_add_table(&e, tree->levels[l].tables[i]);
+    }
+  }
+  for (memtable* mt = tree->old_memtables; mt != NULL; mt = mt->next) {
+    manifest_edit_add_log(&e, mt->log_num);
+  }
+  manifest_edit_add_log(&e, tree->active->log_num);
+
+  char name[64];
+  snprintf(name, sizeof(name), "%06llu.manifest", (unsigned long long)file_num);
+  manifest* m = manifest_create(tree->data_dir_path, name, &e);
+  manifest_edit_free(&e);
+  if (m == NULL) {
+    return 1;
+  }
+
+  if (tree->manifest != NULL) {
+    unlink(tree->manifest->filename);
+    manifest_close(tree->manifest);
+  }
+  tree->manifest = m;
+  return 0;
+}
+
+// lsm_tree_log_edit makes e durable in the manifest, along with the current
+// file number and sequence number. The state e changes must be applied to the
+// tree in the same hold of tree->lock, a manifest that grew too large is
+// replaced by a snapshot of that state before the next edit.
+int
+lsm_tree_log_edit(lsm_tree* tree, manifest_edit* e)
+{
+  if (tree->manifest->size >= LSM_MANIFEST_SNAPSHOT_SIZE && write_snapshot(tree) != 0) {
+    return 1;
+  }
+  manifest_edit_set_next_file_num(e, __atomic_load_n(&tree->next_file_num, __ATOMIC_RELAXED));
+  manifest_edit_set_last_seq(e, tree->last_seq);
+  return manifest_append(tree->manifest, e);
+}
+
+static int
+cmp_u64(const void* a, const void* b)
+{
+  uint64_t x = *(const uint64_t*)a;
+  uint64_t y = *(const uint64_t*)b;
+  return (x > y) - (x < y);
+}
+
+// remove_obsolete_files deletes the files the manifest doesn't reference,
+// like the outputs of a flush or compaction that crashed before it was
+// recorded. Only the names in the directory are read.
+static void
+remove_obsolete_files(lsm_tree* tree)
+{
+  size_t n = 0;
+  size_t max = tree->num_old_memtables + 2;
+  for (int l = 0; l < LSM_NUM_LEVELS; l++) {
+    max += tree->levels[l].num_tables;
+  }
+  uint64_t* live = malloc(max * sizeof(uint64_t));
+  DIR* dir = opendir(tree->data_dir_path);
+  if (live == NULL || dir == NULL) {
+    free(live);
+    if (dir != NULL) {
+      closedir(dir);
+    }
+    return;
+  }
+
+  for (int l = 0; l < LSM_NUM_LEVELS; l++) {
+    for (size_t i = 0; i < tree->levels[l].num_tables; i++) {
+      live[n++] = tree->levels[l].tables[i]->file_num;
+    }
+  }
+  for (memtable* mt = tree->old_memtables; mt != NULL; mt = mt->next) {
+    live[n++] = mt->log_num;
+  }
+  live[n++] = tree->active->log_num;
+  parse_file_num(strrchr(tree->manifest->filename, '/') + 1, &live[n++]);
+  qsort(live, n, sizeof(uint64_t), cmp_u64);
+
+  struct dirent* entry;
+  char fullpath[1024];
+  while ((entry = readdir(dir)) != NULL) {
+    uint64_t file_num;
+    if (parse_file_num(entry->d_name, &file_num) != 0) {
+      continue;
+    }
+    const char* ext = get_file_ext(entry->d_name);
+    if ((strcmp(ext, "sst") == 0 || strcmp(ext, "sst.tmp") == 0 || strcmp(ext, "mem") == 0 ||
+            strcmp(ext, "manifest") == 0) &&
+        bsearch(&file_num, live, n, sizeof(uint64_t), cmp_u64) == NULL) {
+      snprintf(fullpath, sizeof(fullpath), "%s/%s", tree->data_dir_path, entry->d_name);
+      unlink(fullpath);
+    }
+  }
+  closedir(dir);
+  free(live);
+}
 
-      mt->bloom_filter = filter;
+// new_active_memtable creates a memtable with a new log. The log is durable
+// with its header when it's recorded in the manifest, which happens before
+// anything is written to it, unless the tree is still being opened and the
+// first snapshot will hold it. Called with tree->lock held.
+static memtable*
+new_active_memtable(lsm_tree* tree)
+{
+  char path[1024];
+  uint64_t file_num = lsm_tree_new_file_num(tree);
+  lsm_tree_file_path(tree, file_num, "mem", path, sizeof(path));
+  memtable* mt = memtable_new_wal(memtable_expected_keys(tree), path);
+  if (mt == NULL) {
+    return NULL;
+  }
+  mt->wal->sync_mode = tree->opts.wal_sync;
+  mt->log_num = file_num;
+
+  if (tree->manifest != NULL) {
+    manifest_edit e;
+    manifest_edit_init(&e);
+    manifest_edit_add_log(&e, file_num);
+    int res = lsm_tree_log_edit(tree, &e);
+    manifest_edit_free(&e);
+    if (res != 0) {
+      unlink(path);
+      memtable_free(mt);
+      return NULL;
+    }
+  }
+  return mt;
+}
+
+// flush_memtable writes the oldest frozen memtable into a new table and drops
+// its log. Called with tree->lock held, the lock is released while the table
+// is written so writers and readers keep going.
+static int
+flush_memtable(lsm_tree* tree, memtable* mt)
+{
+  // puts that started before the memtable was frozen might still be adding
+  // to it.
+  while (__atomic_load_n(&mt->writers, __ATOMIC_SEQ_CST) > 0) {
+    pthread_cond_wait(&tree->flush_cond, &tree->lock);
+  }
+
+  sstable* sst = NULL;
+  if (!memtable_empty(mt)) {
+    char path[1024];
+    uint64_t file_num = lsm_tree_new_file_num(tree);
+    lsm_tree_file_path(tree, file_num, "sst", path, sizeof(path));
+
+    pthread_mutex_unlock(&tree->lock);
+    if (sstable_flush_memtable(mt, path, tree->opts.compression[0]) == 0) {
+      sst = sstable_open(path, file_num, tree->opts.block_cache, tree->opts.use_mmap_reads);
+    }
+    pthread_mutex_lock(&tree->lock);
+
+    if (sst == NULL) {
+      return 1;
+    }
+  }
+
+  // the table replaces the log in a single edit
+  manifest_edit e;
+  manifest_edit_init(&e);
+  if (sst != NULL) {
+    lsm_edit_add_table(&e, sst);
+  }
+  manifest_edit_delete_log(&e, mt->log_num);
+  int res = lsm_tree_log_edit(tree, &e);
+  manifest_edit_free(&e);
+  if (res != 0) {
+    if (sst != NULL) {
+      sst->obsolete = true;
+      sstable_unref(sst);
+    }
+    return 1;
+  }
+
+  if (sst != NULL) {
+    if (lsm_level_add(&tree->levels[0], 0, sst) != 0) {
+      sstable_unref(sst);
+      return 1;
+    }
+    tree->stats.flush_bytes_written += sst->file_size;
+    tree->stats.num_flushes++;
+    pthread_cond_broadcast(&tree->compaction_cond);
+  }
+
+  memtable** pp = &tree->old_memtables;
+  while (*pp != mt) {
+    pp = &(*pp)->next;
+  }
+  *pp = mt->next;
+  tree->num_old_memtables--;
+
+  if (mt->wal) {
+    unlink(mt->wal->filename);
+  }
+  memtable_unref(mt);
+  return 0;
+}
+
+static void*
+flush_thread_main(void* arg)
+{
+  lsm_tree* tree = arg;
+
+  pthread_mutex_lock(&tree->lock);
+  while (!tree->closing && !tree->bg_error) {
+    if (tree->old_memtables == NULL) {
+      pthread_cond_wait(&tree->flush_cond, &tree->lock);
+      continue;
+    }
+
+    memtable* oldest = tree->old_memtables;
+    while (oldest->next != NULL) {
+      oldest = oldest->next;
+    }
 
-      int ret = init_memtable_from_file(mem_path, mt);
-      if (ret != 0) {
-        fprintf(stderr, "failed to init memtable from %s\n", mem_path);
-        memtable_free(mt);
-        closedir(dir);
-        return 1;
+    if (flush_memtable(tree, oldest) != 0) {
+      fprintf(stderr, "failed to flush memtable\n");
+      tree->bg_error = 1;
+    }
+    pthread_cond_broadcast(&tree->done_cond);
+  }
+  pthread_mutex_unlock(&tree->lock);
+
+  return NULL;
+}
+
+static void*
+compaction_thread_main(void* arg)
+{
+  lsm_tree* tree = arg;
+
+  pthread_mutex_lock(&tree->lock);
+  while (!tree->closing && !tree->bg_error) {
+    compaction* c = compaction_pick(tree);
+    if (c == NULL) {
+      pthread_cond_wait(&tree->compaction_cond, &tree->lock);
+      continue;
+    }
+
+    c->next = tree->running;
+    tree->running = c;
+    pthread_mutex_unlock(&tree->lock);
+
+    int res = compaction_run(tree, c);
+
+    pthread_mutex_lock(&tree->lock);
+    compaction** pp = &tree->running;
+    while (*pp != c) {
+      pp = &(*pp)->next;
+    }
+    *pp = c->next;
+
+    if (res == 0) {
+      res = compaction_install(tree, c);
+    }
+    if (res != 0) {
+      compaction_abort(c);
+      if (!tree->closing) {
+        fprintf(stderr, "failed to compact level %d\n", c->level);
+        tree->bg_error = 1;
       }
+    }
+    compaction_free(c);
 
-      if (tree->active == NULL) {
-        tree->active = mt;
-      } else {
-        mt->next = tree->old_memtables;
-        tree->old_memtables = mt;
+    // the result might make another level eligible for compaction
+    pthread_cond_broadcast(&tree->compaction_cond);
+    pthread_cond_broadcast(&tree->done_cond);
+  }
+  pthread_mutex_unlock(&tree->lock);
+
+  return NULL;
+}
+
+// wal_sync_thread_main syncs the logs of every unflushed memtable each
+// wal_sync_interval_ms when the tree uses WAL_SYNC_PERIODIC.
+static void*
+wal_sync_thread_main(void* arg)
+{
+  lsm_tree* tree = arg;
+  memtable** mts = NULL;
+  size_t cap = 0;
+
+  pthread_mutex_lock(&tree->lock);
+  while (!tree->closing) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += tree->opts.wal_sync_interval_ms / 1000;
+    deadline.tv_nsec += (long)(tree->opts.wal_sync_interval_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&tree->wal_sync_cond, &tree->lock, &deadline);
+    if (tree->closing) {
+      break;
+    }
+
+    // the memtables are referenced so the logs are synced without the lock
+    if (tree->num_old_memtables + 1 > cap) {
+      memtable** n = realloc(mts, (tree->num_old_memtables + 1) * sizeof(memtable*));
+      if (n == NULL) {
+        continue;
+      }
+      mts = n;
+      cap = tree->num_old_memtables + 1;
+    }
+    size_t num = 0;
+    mts[num++] = tree->active;
+    for (memtable* mt = tree->old_memtables; mt != NULL; mt = mt->next) {
+      mts[num++] = mt;
+    }
+    for (size_t i = 0; i < num; i++) {
+      memtable_ref(mts[i]);
+    }
+    pthread_mutex_unlock(&tree->lock);
+
+    int res = 0;
+    for (size_t i = 0; i < num; i++) {
+      if (wal_flush(mts[i]->wal) != 0) {
+        res = 1;
       }
+      memtable_unref(mts[i]);
+    }
+
+    pthread_mutex_lock(&tree->lock);
+    if (res != 0) {
+      fprintf(stderr, "failed to sync the log\n");
+      tree->bg_error = 1;
     }
   }
+  pthread_mutex_unlock(&tree->lock);
+  free(mts);
 
-  closedir(dir);
+  return NULL;
+}
+
+// freeze_active moves the active memtable to old_memtables and wakes up the
+// flush thread. Called with tree->lock held.
+static int
+freeze_active(lsm_tree* tree)
+{
+  // the next filter is sized after what this memtable ended up holding,
+  // updates to the same key make the estimate larger as they should.
+  size_t count = cskiplist_count(tree->active->skiplist);
+  if (count > 0) {
+    size_t entry_size = __atomic_load_n(&tree->active->taken_size, __ATOMIC_RELAXED) / count;
+    tree->entry_size = entry_size > 8 ? entry_size : 8;
+  }
+
+  memtable* mt = new_active_memtable(tree);
+  if (mt == NULL) {
+    return 1;
+  }
+
+  __atomic_store_n(&tree->active->frozen, true, __ATOMIC_SEQ_CST);
+  tree->active->next = tree->old_memtables;
+  tree->old_memtables = tree->active;
+  tree->num_old_memtables++;
+  tree->active = mt;
+  pthread_cond_signal(&tree->flush_cond);
   return 0;
 }
 
 lsm_tree*
-lsm_tree_new(const char* data_dir_path)
+lsm_tree_open(const char* data_dir_path, const lsm_options* opts)
 {
-  lsm_tree* tree = malloc(sizeof(lsm_tree));
+  lsm_tree* tree = calloc(1, sizeof(lsm_tree));
+  if (tree == NULL) {
+    return NULL;
+  }
   tree->data_dir_path = strdup(data_dir_path);
+  tree->opts = *opts;
+  tree->next_file_num = 1;
+  tree->entry_size = LSM_ENTRY_SIZE_GUESS;
+  pthread_mutex_init(&tree->lock, NULL);
+  pthread_cond_init(&tree->flush_cond, NULL);
+  pthread_cond_init(&tree->compaction_cond, NULL);
+  pthread_cond_init(&tree->done_cond, NULL);
+  pthread_cond_init(&tree->publish_cond, NULL);
+  pthread_cond_init(&tree->wal_sync_cond, NULL);
 
   if (dir_exists(data_dir_path)) {
+    if (init_tree(tree) != 0) {
+      lsm_tree_free(tree);
+      return NULL;
+    }
   } else {
     mkdir(data_dir_path, 0777);
   }
+  tree->visible_seq = tree->last_seq;
+
+  // every open starts a new manifest, which also keeps it from growing
+  // across restarts.
+  tree->active = new_active_memtable(tree);
+  if (tree->active == NULL || write_snapshot(tree) != 0) {
+    lsm_tree_free(tree);
+    return NULL;
+  }
+  remove_obsolete_files(tree);
+
+  // memtables recovered from old logs are picked up by the flush thread.
+  if (pthread_create(&tree->flush_thread, NULL, flush_thread_main, tree) != 0) {
+    lsm_tree_free(tree);
+    return NULL;
+  }
+  tree->flush_thread_started = true;
+
+  tree->compaction_threads = calloc(opts->compaction_threads, sizeof(pthread_t));
+  if (tree->compaction_threads == NULL) {
+    lsm_tree_free(tree);
+    return NULL;
+  }
+  for (int i = 0; i < opts->compaction_threads; i++) {
+    if (pthread_create(&tree->compaction_threads[i], NULL, compaction_thread_main, tree) != 0) {
+      lsm_tree_free(tree);
+      return NULL;
+    }
+    tree->num_compaction_threads++;
+  }
+
+  if (opts->wal_sync == WAL_SYNC_PERIODIC) {
+    if (pthread_create(&tree->wal_sync_thread, NULL, wal_sync_thread_main, tree) != 0) {
+      lsm_tree_free(tree);
+      return NULL;
+    }
+    tree->wal_sync_thread_started = true;
+  }
 
   return tree;
 }
 
+lsm_tree*
+lsm_tree_new(const char* data_dir_path)
+{
+  lsm_options opts;
+  lsm_options_default(&opts);
+  return lsm_tree_open(data_dir_path, &opts);
+}
+
+// lsm_tree_free stops the background threads without draining old_memtables,
+// their logs are replayed the next time the tree is opened. Running
+// compactions are abandoned and their inputs kept.
 void
 lsm_tree_free(lsm_tree* tree)
 {
-  memtable_free(tree->active);
+  pthread_mutex_lock(&tree->lock);
+  tree->closing = true;
+  pthread_cond_broadcast(&tree->flush_cond);
+  pthread_cond_broadcast(&tree->compaction_cond);
+  pthread_cond_broadcast(&tree->wal_sync_cond);
+  pthread_mutex_unlock(&tree->lock);
+
+  if (tree->flush_thread_started) {
+    pthread_join(tree->flush_thread, NULL);
+  }
+  if (tree->wal_sync_thread_started) {
+    pthread_join(tree->wal_sync_thread, NULL);
+  }
+  for (int i = 0; i < tree->num_compaction_threads; i++) {
+    pthread_join(tree->compaction_threads[i], NULL);
+  }
+  free(tree->compaction_threads);
+
+  if (tree->active) {
+    memtable_unref(tree->active);
+  }
 
   memtable* curr = tree->old_memtables;
   while (curr != NULL) {
     memtable* next = curr->next;
-    memtable_free(curr);
+    memtable_unref(curr);
     curr = next;
   }
 
+  for (int i = 0; i < LSM_NUM_LEVELS; i++) {
+    for (size_t j = 0; j < tree->levels[i].num_tables; j++) {
+      sstable_unref(tree->levels[i].tables[j]);
+    }
+    free(tree->levels[i].tables);
+    slice_free(tree->compact_pointer[i]);
+  }
+
+  manifest_close(tree->manifest);
+  pthread_mutex_destroy(&tree->lock);
+  pthread_cond_destroy(&tree->flush_cond);
+  pthread_cond_destroy(&tree->compaction_cond);
+  pthread_cond_destroy(&tree->done_cond);
+  pthread_cond_destroy(&tree->publish_cond);
+  pthread_cond_destroy(&tree->wal_sync_cond);
   free(tree->data_dir_path);
   free(tree);
 }
+
+// finish_write drops a put from the memtable's writers, a flush waiting for
+// the memtable to settle is woken up by the last one.
+static void
+finish_write(lsm_tree* tree, memtable* mt)
+{
+  if (__atomic_sub_fetch(&mt->writers, 1, __ATOMIC_SEQ_CST) == 0 &&
+      __atomic_load_n(&mt->frozen, __ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock(&tree->lock);
+    pthread_cond_broadcast(&tree->flush_cond);
+    pthread_mutex_unlock(&tree->lock);
+  }
+}
+
+// begin_write hands out count sequence numbers from the active memtable and
+// counts the caller as one of its writers. Called with tree->lock held, the
+// memtable is referenced so it stays around until end_write, even if it's
+// frozen and flushed in the meantime.
+static memtable*
+begin_write(lsm_tree* tree, uint64_t count, uint64_t* first_seq)
+{
+  memtable* mt = tree->active;
+  memtable_ref(mt);
+  __atomic_add_fetch(&mt->writers, 1, __ATOMIC_SEQ_CST);
+  *first_seq = tree->last_seq + 1;
+  tree->last_seq += count;
+  mt->max_seq = tree->last_seq;
+  return mt;
+}
+
+// publish_write makes the writes first_seq to last_seq visible to reads once
+// every earlier write is, so a read sees all of a batch or none of it. Writers
+// that finished out of order wait for the ones before them.
+static void
+publish_write(lsm_tree* tree, uint64_t first_seq, uint64_t last_seq)
+{
+  pthread_mutex_lock(&tree->lock);
+  while (tree->visible_seq != first_seq - 1) {
+    pthread_cond_wait(&tree->publish_cond, &tree->lock);
+  }
+  tree->visible_seq = last_seq;
+  pthread_cond_broadcast(&tree->publish_cond);
+  pthread_mutex_unlock(&tree->lock);
+}
+
+// end_write is called once the write is in the memtable, even if it failed,
+// with the sequence numbers begin_write handed out. It publishes the write,
+// freezes the memtable if it's full and waits for the log. A memtable is only
+// flushed once its writes are published.
+static lsm_res
+end_write(lsm_tree* tree, memtable* mt, uint64_t first_seq, uint64_t count, uint64_t ticket, lsm_res res)
+{
+  publish_write(tree, first_seq, first_seq + count - 1);
+  finish_write(tree, mt);
+
+  if (res == LSM_OK && __atomic_load_n(&mt->taken_size, __ATOMIC_RELAXED) >= tree->opts.memtable_size) {
+    pthread_mutex_lock(&tree->lock);
+    // stall the writer if flushes or L0 compactions can't keep up, otherwise
+    // frozen memtables or L0 tables would pile up.
+    while (tree->active == mt &&
+        (tree->num_old_memtables >= LSM_MAX_OLD_MEMTABLES ||
+            tree->levels[0].num_tables >= tree->opts.level0_stop_trigger) &&
+        !tree->bg_error) {
+      pthread_cond_wait(&tree->done_cond, &tree->lock);
+    }
+    // another writer might have frozen it in the meantime
+    if (tree->bg_error || (tree->active == mt && freeze_active(tree) != 0)) {
+      res = LSM_FAILED;
+    }
+    pthread_mutex_unlock(&tree->lock);
+  }
+
+  // the log is synced without the tree lock so concurrent writers get
+  // committed together.
+  if (res == LSM_OK && memtable_sync(mt, ticket) != MEMTABLE_OK) {
+    res = LSM_FAILED;
+  }
+  memtable_unref(mt);
+
+  return res;
+}
+
+// lsm_tree_put numbers and logs the write under tree->lock, then adds it to
+// the memtable and syncs the log without it, so writers only serialize on
+// the cheap part.
+lsm_res
+lsm_tree_put(lsm_tree* tree, slice key, slice value)
+{
+  lsm_res res = LSM_OK;
+  uint64_t ticket = 0;
+  uint64_t seq;
+
+  pthread_mutex_lock(&tree->lock);
+  if (tree->bg_error) {
+    pthread_mutex_unlock(&tree->lock);
+    return LSM_FAILED;
+  }
+  memtable* mt = begin_write(tree, 1, &seq);
+  tree->stats.user_bytes_written += key.size + value.size;
+  if (memtable_log_put(mt, key, value, &ticket) != MEMTABLE_OK) {
+    res = LSM_FAILED;
+  }
+  pthread_mutex_unlock(&tree->lock);
+
+  if (res == LSM_OK && memtable_put(mt, key, value, seq) != MEMTABLE_OK) {
+    res = LSM_FAILED;
+  }
+  return end_write(tree, mt, seq, 1, ticket, res);
+}
+
+// lsm_tree_write applies the puts and deletes of the batch in order. The
+// batch is logged as a single record with one checksum and synced once, so
+// after a crash either all of it is recovered or none of it. It takes the
+// same path as lsm_tree_put, the operations get consecutive sequence numbers
+// and reads see them once all of them are applied.
+lsm_res
+lsm_tree_write(lsm_tree* tree, write_batch* batch)
+{
+  if (batch->error) {
+    return LSM_FAILED;
+  }
+  if (batch->count == 0) {
+    return LSM_OK;
+  }
+
+  lsm_res res = LSM_OK;
+  uint64_t ticket = 0;
+  uint64_t first_seq;
+
+  pthread_mutex_lock(&tree->lock);
+  if (tree->bg_error) {
+    pthread_mutex_unlock(&tree->lock);
+    return LSM_FAILED;
+  }
+  memtable* mt = begin_write(tree, batch->count, &first_seq);
+  tree->stats.user_bytes_written += batch->data_size;
+  if (memtable_log_batch(mt, batch, &ticket) != MEMTABLE_OK) {
+    res = LSM_FAILED;
+  }
+  pthread_mutex_unlock(&tree->lock);
+
+  if (res == LSM_OK && memtable_apply_batch(mt, batch, first_seq) != MEMTABLE_OK) {
+    res = LSM_FAILED;
+  }
+  return end_write(tree, mt, first_seq, batch->count, ticket, res);
+}
+
+// lsm_tree_delete removes key, it's written as a batch of one. The deletion
+// is kept as a tombstone that hides older values until compaction drops it
+// together with them.
+lsm_res
+lsm_tree_delete(lsm_tree* tree, slice key)
+{
+  write_batch* batch = write_batch_new();
+  if (batch == NULL) {
+    return LSM_FAILED;
+  }
+
+  lsm_res res = LSM_FAILED;
+  if (write_batch_delete(batch, key) == 0) {
+    res = lsm_tree_write(tree, batch);
+  }
+  write_batch_free(batch);
+  return res;
+}
+
+// lsm_tree_delete_range removes every key in [start, end) with a single
+// range deletion, however many keys that is. Reads and compactions apply it
+// lazily, compaction drops the keys it covers as it reaches them.
+lsm_res
+lsm_tree_delete_range(lsm_tree* tree, slice start, slice end)
+{
+  if (slice_compare(start, end) >= 0) {
+    return LSM_OK;
+  }
+  write_batch* batch = write_batch_new();
+  if (batch == NULL) {
+    return LSM_FAILED;
+  }
+
+  lsm_res res = LSM_FAILED;
+  if (write_batch_delete_range(batch, start, end) == 0) {
+    res = lsm_tree_write(tree, batch);
+  }
+  write_batch_free(batch);
+  return res;
+}
+
+// collect_tables references every table that might hold key, in the order
+// they have to be searched. Called with tree->lock held.
+static size_t
+collect_tables(lsm_tree* tree, slice key, sstable** out)
+{
+  size_t n = 0;
+  lsm_level* l0 = &tree->levels[0];
+  for (size_t i = 0; i < l0->num_tables; i++) {
+    sstable* sst = l0->tables[i];
+    if (slice_compare(sst->smallest, key) <= 0 && slice_compare(sst->largest, key) >= 0) {
+      out[n++] = sst;
+    }
+  }
+
+  for (int l = 1; l < LSM_NUM_LEVELS; l++) {
+    lsm_level* level = &tree->levels[l];
+    size_t lo = 0, hi = level->num_tables;
+    while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      if (slice_compare(level->tables[mid]->largest, key) < 0) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    if (lo < level->num_tables && slice_compare(level->tables[lo]->smallest, key) <= 0) {
+      out[n++] = level->tables[lo];
+    }
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    sstable_ref(out[i]);
+  }
+  return n;
+}
+
+// lsm_tree_get_pinned points value at the newest value stored for key without
+// copying it, the memtable or block holding it is kept alive until the caller
+// calls pinned_slice_release.
+lsm_res
+lsm_tree_get_pinned(lsm_tree* tree, slice key, pinned_slice* value)
+{
+  pthread_mutex_lock(&tree->lock);
+  // the memtables and tables are referenced so they stay around while they're
+  // searched without the lock, even if they're flushed or compacted away.
+  memtable** mems = malloc((tree->num_old_memtables + 1) * sizeof(memtable*));
+  sstable** tables = malloc((tree->levels[0].num_tables + LSM_NUM_LEVELS) * sizeof(sstable*));
+  if (mems == NULL || tables == NULL) {
+    pthread_mutex_unlock(&tree->lock);
+    free(mems);
+    free(tables);
+    return LSM_FAILED;
+  }
+  size_t num_mems = 0;
+  mems[num_mems++] = tree->active;
+  for (memtable* mt = tree->old_memtables; mt != NULL; mt = mt->next) {
+    mems[num_mems++] = mt;
+  }
+  for (size_t i = 0; i < num_mems; i++) {
+    memtable_ref(mems[i]);
+  }
+  size_t num_tables = collect_tables(tree, key, tables);
+  // writes that aren't published yet are skipped, the tables only hold
+  // published ones
+  uint64_t seq = tree->visible_seq;
+  pthread_mutex_unlock(&tree->lock);
+
+  // a deletion hides the older values below it
+  lsm_res res = LSM_NOT_FOUND;
+  bool done = false;
+  for (size_t i = 0; i < num_mems && !done; i++) {
+    memtable_res mres = memtable_get_pinned(mems[i], key, seq, value);
+    if (mres != MEMTABLE_FAILED) {
+      res = mres == MEMTABLE_OK ? LSM_OK : LSM_NOT_FOUND;
+      done = true;
+    }
+  }
+
+  for (size_t i = 0; i < num_tables && !done; i++) {
+    sstable_res sres = sstable_get_pinned(tables[i], key, value);
+    if (sres != SSTABLE_NOT_FOUND) {
+      res = sres == SSTABLE_OK ? LSM_OK : sres == SSTABLE_DELETED ? LSM_NOT_FOUND : LSM_FAILED;
+      done = true;
+    }
+  }
+
+  for (size_t i = 0; i < num_mems; i++) {
+    memtable_unref(mems[i]);
+  }
+  for (size_t i = 0; i < num_tables; i++) {
+    sstable_unref(tables[i]);
+  }
+  free(mems);
+  free(tables);
+  return res;
+}
+
+// lsm_tree_get sets value to a copy of the newest value stored for key, the
+// caller frees it with slice_free.
+lsm_res
+lsm_tree_get(lsm_tree* tree, slice key, slice* value)
+{
+  pinned_slice pinned;
+  lsm_res res = lsm_tree_get_pinned(tree, key, &pinned);
+  if (res != LSM_OK) {
+    return res;
+  }
+
+  *value = slice_copy(pinned.value);
+  pinned_slice_release(&pinned);
+  return value->data != NULL ? LSM_OK : LSM_FAILED;
+}
+
+// mget_batch holds the keys of a multi get that are still being looked for,
+// sorted by key.
+typedef struct mget_batch_s {
+  slice* keys;
+  uint64_t* hashes;
+  size_t* idx; // position of the key in the caller's arrays
+  slice* values;
+  lsm_res* res;
+  bool* done; // set for keys whose search is over, even if they weren't found
+  memtable_res* mres; // results of the memtable and table being searched
+  sstable_res* sres;
+  size_t len;
+} mget_batch;
+
+typedef struct mget_key_s {
+  slice key;
+  size_t idx;
+} mget_key;
+
+static int
+mget_key_compare(const void* a, const void* b)
+{
+  const mget_key* x = a;
+  const mget_key* y = b;
+  int cmp = slice_compare(x->key, y->key);
+  return cmp != 0 ? cmp : (x->idx > y->idx) - (x->idx < y->idx);
+}
+
+// mget_settle hands the keys in [lo, hi) that are done to the caller and
+// drops them from the batch.
+static void
+mget_settle(mget_batch* b, size_t lo, size_t hi, slice* values, lsm_res* results)
+{
+  size_t out = lo;
+  for (size_t i = lo; i < b->len; i++) {
+    if (i < hi && b->done[i]) {
+      results[b->idx[i]] = b->res[i];
+      if (b->res[i] == LSM_OK) {
+        values[b->idx[i]] = b->values[i];
+      }
+      continue;
+    }
+    b->keys[out] = b->keys[i];
+    b->hashes[out] = b->hashes[i];
+    b->idx[out] = b->idx[i];
+    out++;
+  }
+  b->len = out;
+}
+
+// mget_lower_bound returns the first key in the batch that is not smaller
+// than key, or the first that is larger when upper is set.
+static size_t
+mget_lower_bound(mget_batch* b, slice key, bool upper)
+{
+  size_t lo = 0, hi = b->len;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    int cmp = slice_compare(b->keys[mid], key);
+    if (cmp < 0 || (upper && cmp == 0)) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+// mget_search looks for the keys of the batch in every memtable and table,
+// in the same order lsm_tree_get searches them. Returns 1 if a lookup failed.
+static int
+mget_search(lsm_tree* tree, mget_batch* b, slice* values, lsm_res* results)
+{
+  pthread_mutex_lock(&tree->lock);
+  size_t max_tables = 0;
+  for (int l = 0; l < LSM_NUM_LEVELS; l++) {
+    max_tables += tree->levels[l].num_tables;
+  }
+  memtable** mems = malloc((tree->num_old_memtables + 1) * sizeof(memtable*));
+  sstable** tables = malloc((max_tables + 1) * sizeof(sstable*));
+  if (mems == NULL || tables == NULL) {
+    pthread_mutex_unlock(&tree->lock);
+    free(mems);
+    free(tables);
+    return 1;
+  }
+  size_t num_mems = 0, num_tables = 0;
+  mems[num_mems++] = tree->active;
+  for (memtable* mt = tree->old_memtables; mt != NULL; mt = mt->next) {
+    mems[num_mems++] = mt;
+  }
+  for (int l = 0; l < LSM_NUM_LEVELS; l++) {
+    for (size_t i = 0; i < tree->levels[l].num_tables; i++) {
+      tables[num_tables++] = tree->levels[l].tables[i];
+    }
+  }
+  for (size_t i = 0; i < num_mems; i++) {
+    memtable_ref(mems[i]);
+  }
+  for (size_t i = 0; i < num_tables; i++) {
+    sstable_ref(tables[i]);
+  }
+  uint64_t seq = tree->visible_seq;
+  pthread_mutex_unlock(&tree->lock);
+
+  int res = 0;
+  for (size_t i = 0; i < num_mems && b->len > 0; i++) {
+    res |= memtable_multi_get(mems[i], b->keys, b->hashes, b->len, seq, b->values, b->mres);
+    for (size_t j = 0; j < b->len; j++) {
+      b->res[j] = b->mres[j] == MEMTABLE_OK ? LSM_OK : LSM_NOT_FOUND;
+      b->done[j] = b->mres[j] != MEMTABLE_FAILED;
+    }
+    mget_settle(b, 0, b->len, values, results);
+  }
+
+  // only the keys inside the range of a table are looked for in it
+  for (size_t i = 0; i < num_tables && b->len > 0 && res == 0; i++) {
+    sstable* sst = tables[i];
+    size_t lo = mget_lower_bound(b, sst->smallest, false);
+    size_t hi = mget_lower_bound(b, sst->largest, true);
+    if (lo >= hi) {
+      continue;
+    }
+
+    sstable_multi_get(sst, b->keys + lo, b->hashes + lo, hi - lo, b->values + lo, b->sres + lo);
+    for (size_t j = lo; j < hi; j++) {
+      sstable_res r = b->sres[j];
+      b->res[j] = r == SSTABLE_OK ? LSM_OK : r == SSTABLE_FAILED ? LSM_FAILED : LSM_NOT_FOUND;
+      b->done[j] = r != SSTABLE_NOT_FOUND;
+      res |= b->res[j] == LSM_FAILED;
+    }
+    mget_settle(b, lo, hi, values, results);
+  }
+
+  for (size_t i = 0; i < num_mems; i++) {
+    memtable_unref(mems[i]);
+  }
+  for (size_t i = 0; i < num_tables; i++) {
+    sstable_unref(tables[i]);
+  }
+  free(mems);
+  free(tables);
+  return res;
+}
+
+// lsm_tree_multi_get looks up n keys at once, results[i] and values[i] are
+// set like lsm_tree_get would for keys[i]. The keys are sorted and hashed
+// once, a memtable is then searched with a single pass through its skiplist
+// and a table reads each block once for all the keys in it. Returns
+// LSM_FAILED if any lookup failed, every result is LSM_FAILED then.
+lsm_res
+lsm_tree_multi_get(lsm_tree* tree, const slice* keys, size_t n, slice* values, lsm_res* results)
+{
+  for (size_t i = 0; i < n; i++) {
+    results[i] = LSM_NOT_FOUND;
+  }
+  if (n == 0) {
+    return LSM_OK;
+  }
+
+  mget_key* sorted = malloc(n * sizeof(mget_key));
+  mget_batch b = {
+    .keys = malloc(n * sizeof(slice)),
+    .hashes = malloc(n * sizeof(uint64_t)),
+    .idx = malloc(n * sizeof(size_t)),
+    .values = malloc(n * sizeof(slice)),
+    .res = malloc(n * sizeof(lsm_res)),
+    .done = malloc(n * sizeof(bool)),
+    .mres = malloc(n * sizeof(memtable_res)),
+    .sres = malloc(n * sizeof(sstable_res)),
+    .len = n,
+  };
+
+  lsm_res res = LSM_FAILED;
+  if (sorted != NULL && b.keys != NULL && b.hashes != NULL && b.idx != NULL && b.values != NULL &&
+      b.res != NULL && b.done != NULL && b.mres != NULL && b.sres != NULL) {
+    for (size_t i = 0; i < n; i++) {
+      sorted[i].key = keys[i];
+      sorted[i].idx = i;
+    }
+    qsort(sorted, n, sizeof(mget_key), mget_key_compare);
+    for (size_t i = 0; i < n; i++) {
+      b.keys[i] = sorted[i].key;
+      b.idx[i] = sorted[i].idx;
+      b.hashes[i] = hash64(b.keys[i].data, b.keys[i].size, BLOOM_HASH_SEED);
+    }
+    res = mget_search(tree, &b, values, results) == 0 ? LSM_OK : LSM_FAILED;
+  }
+
+  if (res != LSM_OK) {
+    for (size_t i = 0; i < n; i++) {
+      if (results[i] == LSM_OK) {
+        slice_free(values[i]);
+      }
+      results[i] = LSM_FAILED;
+    }
+  }
+  free(sorted);
+  free(b.keys);
+  free(b.hashes);
+  free(b.idx);
+  free(b.values);
+  free(b.res);
+  free(b.done);
+  free(b.mres);
+  free(b.sres);
+  return res;
+}
+
+// lsm_tree_flush freezes the active memtable and waits until every unflushed
+// memtable is written to disk.
+lsm_res
+lsm_tree_flush(lsm_tree* tree)
+{
+  lsm_res res = LSM_OK;
+
+  pthread_mutex_lock(&tree->lock);
+  bool empty = memtable_empty(tree->active) &&
+      __atomic_load_n(&tree->active->writers, __ATOMIC_SEQ_CST) == 0;
+  if (!empty && freeze_active(tree) != 0) {
+    res = LSM_FAILED;
+  }
+  while (res == LSM_OK && tree->old_memtables != NULL && !tree->bg_error) {
+    pthread_cond_wait(&tree->done_cond, &tree->lock);
+  }
+  if (tree->bg_error) {
+    res = LSM_FAILED;
+  }
+  pthread_mutex_unlock(&tree->lock);
+
+  return res;
+}
+
+// lsm_tree_wait_for_compactions blocks until every level is within its target
+// and no compaction is running.
+lsm_res
+lsm_tree_wait_for_compactions(lsm_tree* tree)
+{
+  pthread_mutex_lock(&tree->lock);
+  while ((tree->running != NULL || tree->old_memtables != NULL || compaction_needed(tree)) &&
+      !tree->bg_error && tree->num_compaction_threads > 0) {
+    pthread_cond_wait(&tree->done_cond, &tree->lock);
+  }
+  lsm_res res = tree->bg_error ? LSM_FAILED : LSM_OK;
+  pthread_mutex_unlock(&tree->lock);
+
+  return res;
+}
+
+void
+lsm_tree_get_stats(lsm_tree* tree, lsm_stats* stats)
+{
+  pthread_mutex_lock(&tree->lock);
+  *stats = tree->stats;
+  pthread_mutex_unlock(&tree->lock);
+
+  stats->write_amplification = 0;
+  if (stats->user_bytes_written > 0) {
+    stats->write_amplification = (double)(stats->flush_bytes_written + stats->compaction_bytes_written) /
+        stats->user_bytes_written;
+  }
+}
@@ -1,12 +1,129 @@
+#ifndef __LSMT_H__
+#define __LSMT_H__
+
+#include "manifest.h"
 #include "memtable.h"
+#include "sstable.h"
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#define LSM_NUM_LEVELS         7
+#define LSM_MAX_OLD_MEMTABLES  4 // writers stall once this many memtables wait for a flush
+#define LSM_ENTRY_SIZE_GUESS   32 // bytes per key assumed until a memtable was frozen
+#define LSM_RECOVERY_THREADS   4 // logs replayed in parallel when a tree is opened
+#define LSM_MANIFEST_SNAPSHOT_SIZE  (1024 * 1024) // bytes of edits before the manifest is rewritten
+
+typedef enum {
+  LSM_OK,
+  LSM_NOT_FOUND,
+  LSM_FAILED,
+} lsm_res;
+
+typedef enum {
+  LSM_COMPACTION_LEVELED, // L1+ are single sorted runs kept under a size target
+  LSM_COMPACTION_TIERED, // every table is a sorted run in L0, runs of similar size are merged
+} lsm_compaction_style;
+
+typedef struct lsm_options_s {
+  lsm_compaction_style compaction_style;
+  size_t memtable_size; // bytes before the active memtable is frozen
+  size_t table_file_size; // compactions start a new table once this size is reached
+  size_t level0_compaction_trigger; // amount of L0 tables that triggers a compaction
+  size_t level0_stop_trigger; // writers stall once L0 holds this many tables
+  uint64_t level1_size; // target size of L1 in bytes
+  int level_size_ratio; // every level past L1 targets this many times the previous size
+  int compaction_threads;
+  wal_sync_mode wal_sync; // how far a put makes it to disk before it returns
+  int wal_sync_interval_ms; // how often the logs are synced with WAL_SYNC_PERIODIC
+  compress_codec compression[LSM_NUM_LEVELS]; // codec for the data blocks of the tables of each level
+  block_cache* block_cache; // shared by every tree of the process by default, NULL disables caching
+  bool use_mmap_reads; // tables are mapped and read without syscalls, uncompressed blocks without copies
+
+  // tiered compaction, level0_compaction_trigger is the amount of runs that
+  // starts a compaction
+  int tiered_size_ratio; // percent a run can be larger than the runs before it and still get merged
+  size_t tiered_min_merge_width;
+  size_t tiered_max_merge_width;
+  int tiered_max_size_amp; // percent the newer runs can take compared to the oldest one
+} lsm_options;
+
+typedef struct lsm_stats_s {
+  uint64_t user_bytes_written; // key and value bytes passed to lsm_tree_put and lsm_tree_write
+  uint64_t flush_bytes_written;
+  uint64_t compaction_bytes_read;
+  uint64_t compaction_bytes_written;
+  uint64_t num_flushes;
+  uint64_t num_compactions;
+  double write_amplification; // bytes written to tables per user byte
+} lsm_stats;
+
+typedef struct lsm_level_s {
+  sstable **tables; // L0 is ordered newest first, other levels by smallest key
+  size_t num_tables;
+  size_t cap;
+  uint64_t size; // sum of the table file sizes
+} lsm_level;
+
+struct compaction_s;
+
 typedef struct lsm_tree {
   char *data_dir_path;
+  lsm_options opts;
   memtable *active;
   memtable *old_memtables; // the memtables that are not yet flushed (linked list)
+  size_t num_old_memtables;
+  lsm_level levels[LSM_NUM_LEVELS]; // L0 holds flushed memtables, compactions push data down
+  slice compact_pointer[LSM_NUM_LEVELS]; // largest key of the last compaction picked from a level, owned
+  struct compaction_s *running; // compactions that are currently running (linked list)
+  manifest *manifest; // records the tables and logs that make up the tree
+  uint64_t next_file_num; // updated atomically
+  uint64_t last_seq; // sequence number of the last write
+  uint64_t visible_seq; // reads see the writes up to this sequence number, a prefix of them all
+  size_t entry_size; // memtable bytes per distinct key seen so far, sizes memtable filters
+  lsm_stats stats;
+
+  // lock protects the fields above. Frozen memtables and tables are immutable,
+  // so the background threads read them without holding it.
+  pthread_mutex_t lock;
+  pthread_cond_t flush_cond; // signaled when there is a memtable to flush
+  pthread_cond_t compaction_cond; // signaled when there might be something to compact
+  pthread_cond_t done_cond; // signaled when a flush or compaction finished
+  pthread_cond_t publish_cond; // signaled when visible_seq moved
+  pthread_t flush_thread;
+  pthread_t *compaction_threads;
+  int num_compaction_threads;
+  pthread_cond_t wal_sync_cond; // signaled when the tree is closing
+  pthread_t wal_sync_thread;
+  bool flush_thread_started;
+  bool wal_sync_thread_started;
+  bool closing;
+  int bg_error;
 } lsm_tree;
 
+void lsm_options_default(lsm_options *opts);
+lsm_tree *lsm_tree_open(const char *data_dir_path, const lsm_options *opts);
 lsm_tree *lsm_tree_new(const char *data_dir_path);
+void lsm_tree_free(lsm_tree *tree);
+lsm_res lsm_tree_put(lsm_tree *tree, slice key, slice value);
+lsm_res lsm_tree_write(lsm_tree *tree, write_batch *batch);
+lsm_res lsm_tree_delete(lsm_tree *tree, slice key);
+lsm_res lsm_tree_delete_range(lsm_tree *tree, slice start, slice end);
+lsm_res lsm_tree_get(lsm_tree *tree, slice key, slice *value);
+lsm_res lsm_tree_get_pinned(lsm_tree *tree, slice key, pinned_slice *value);
+lsm_res lsm_tree_multi_get(lsm_tree *tree, const slice *keys, size_t n, slice *values, lsm_res *results);
+lsm_res lsm_tree_flush(lsm_tree *tree);
+lsm_res lsm_tree_wait_for_compactions(lsm_tree *tree);
+void lsm_tree_get_stats(lsm_tree *tree, lsm_stats *stats);
+
+// helpers shared with compaction.c
+uint64_t lsm_tree_new_file_num(lsm_tree *tree);
+void lsm_tree_file_path(lsm_tree *tree, uint64_t file_num, const char *ext, char *buf, size_t size);
+int lsm_level_add(lsm_level *level, int level_num, sstable *sst);
+void lsm_level_remove(lsm_level *level, sstable *sst);
+void lsm_edit_add_table(manifest_edit *e, sstable *sst);
+int lsm_tree_log_edit(lsm_tree *tree, manifest_edit *e);
+
+#endif
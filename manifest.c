@@ -0,0 +1,484 @@
+#include "manifest.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MANIFEST_RECORD_HEADER_SIZE  (2 * sizeof(uint32_t))
+
+void
+manifest_edit_init(manifest_edit* e)
+{
+  memset(e, 0, sizeof(manifest_edit));
+}
+
+static void
+edit_put(manifest_edit* e, const void* data, size_t size)
+{
+  if (e->error) {
+    return;
+  }
+  if (e->len + size > e->cap) {
+    size_t new_cap = e->cap ? e->cap : 256;
+    while (new_cap < e->len + size) {
+      new_cap *= 2;
+    }
+    char* n = realloc(e->rep, new_cap);
+    if (n == NULL) {
+      e->error = 1;
+      return;
+    }
+    e->rep = n;
+    e->cap = new_cap;
+  }
+  memcpy(e->rep + e->len, data, size);
+  e->len += size;
+}
+
+static void
+edit_put_u64_field(manifest_edit* e, uint8_t tag, uint64_t v)
+{
+  edit_put(e, &tag, sizeof(tag));
+  edit_put(e, &v, sizeof(v));
+}
+
+static void
+edit_put_slice(manifest_edit* e, slice s)
+{
+  if (s.size > UINT16_MAX) {
+    e->error = 1;
+    return;
+  }
+  uint16_t size = s.size;
+  edit_put(e, &size, sizeof(size));
+  edit_put(e, s.data, s.size);
+}
+
+void
+manifest_edit_set_next_file_num(manifest_edit* e, uint64_t next_file_num)
+{
+  edit_put_u64_field(e, MANIFEST_TAG_NEXT_FILE_NUM, next_file_num);
+}
+
+void
+manifest_edit_set_last_seq(manifest_edit* e, uint64_t last_seq)
+{
+  edit_put_u64_field(e, MANIFEST_TAG_LAST_SEQ, last_seq);
+}
+
+void
+manifest_edit_add_table(manifest_edit* e, const manifest_table* t)
+{
+  uint8_t tag = MANIFEST_TAG_ADD_TABLE;
+  edit_put(e, &tag, sizeof(tag));
+  edit_put(e, &t->file_num, sizeof(uint64_t));
+  edit_put(e, &t->level, sizeof(uint32_t));
+  edit_put(e, &t->file_size, sizeof(uint64_t));
+  edit_put(e, &t->max_seq, sizeof(uint64_t));
+  edit_put_slice(e, t->smallest);
+  edit_put_slice(e, t->largest);
+}
+
+void
+manifest_edit_delete_table(manifest_edit* e, uint64_t file_num)
+{
+  edit_put_u64_field(e, MANIFEST_TAG_DELETE_TABLE, file_num);
+}
+
+void
+manifest_edit_add_log(manifest_edit* e, uint64_t file_num)
+{
+  edit_put_u64_field(e, MANIFEST_TAG_ADD_LOG, file_num);
+}
+
+void
+manifest_edit_delete_log(manifest_edit* e, uint64_t file_num)
+{
+  edit_put_u64_field(e, MANIFEST_TAG_DELETE_LOG, file_num);
+}
+
+void
+manifest_edit_free(manifest_edit* e)
+{
+  free(e->rep);
+  manifest_edit_init(e);
+}
+
+static int
+write_all(int fd, const char* buf, size_t size)
+{
+  while (size > 0) {
+    ssize_t n = write(fd, buf, size);
+    if (n <= 0) {
+      return 1;
+    }
+    buf += n;
+    size -= n;
+  }
+  return 0;
+}
+
+static int
+write_record(int fd, const manifest_edit* e)
+{
+  if (e->error || e->len > UINT32_MAX) {
+    return 1;
+  }
+
+  char header[MANIFEST_RECORD_HEADER_SIZE];
+  uint32_t size = e->len;
+  uint32_t checksum = crc32c(e->rep, e->len);
+  memcpy(header, &size, sizeof(uint32_t));
+  memcpy(header + sizeof(uint32_t), &checksum, sizeof(uint32_t));
+  if (write_all(fd, header, sizeof(header)) != 0 || write_all(fd, e->rep, e->len) != 0) {
+    return 1;
+  }
+  return fdatasync(fd);
+}
+
+static int
+sync_dir(const char* dir_path)
+{
+  int fd = open(dir_path, O_RDONLY);
+  if (fd < 0) {
+    return 1;
+  }
+  int res = fsync(fd);
+  close(fd);
+  return res;
+}
+
+// set_current points CURRENT at the manifest called name. The name is written
+// to a temporary file that is renamed over CURRENT, so a crash leaves either
+// the old or the new one.
+static int
+set_current(const char* dir_path, const char* name)
+{
+  char path[1024], tmp_path[1024];
+  snprintf(path, sizeof(path), "%s/%s", dir_path, MANIFEST_CURRENT);
+  snprintf(tmp_path, sizeof(tmp_path), "%s/%s.tmp", dir_path, MANIFEST_CURRENT);
+
+  int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    return 1;
+  }
+  int res = write_all(fd, name, strlen(name)) || write_all(fd, "\n", 1) || fsync(fd) != 0;
+  close(fd);
+  if (res != 0 || rename(tmp_path, path) != 0) {
+    unlink(tmp_path);
+    return 1;
+  }
+  return sync_dir(dir_path);
+}
+
+// manifest_create writes a new manifest called name that starts out with the
+// state in snapshot, and makes it the current one once it's synced.
+manifest*
+manifest_create(const char* dir_path, const char* name, const manifest_edit* snapshot)
+{
+  manifest* m = calloc(1, sizeof(manifest));
+  if (m == NULL) {
+    return NULL;
+  }
+
+  size_t path_len = strlen(dir_path) + strlen(name) + 2;
+  m->filename = malloc(path_len);
+  if (m->filename == NULL) {
+    free(m);
+    return NULL;
+  }
+  snprintf(m->filename, path_len, "%s/%s", dir_path, name);
+
+  m->fd = open(m->filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (m->fd < 0) {
+    free(m->filename);
+    free(m);
+    return NULL;
+  }
+
+  if (write_record(m->fd, snapshot) != 0 || set_current(dir_path, name) != 0) {
+    close(m->fd);
+    unlink(m->filename);
+    free(m->filename);
+    free(m);
+    return NULL;
+  }
+  m->size = MANIFEST_RECORD_HEADER_SIZE + snapshot->len;
+  return m;
+}
+
+// manifest_append writes the edit and syncs it. After a failed append the
+// end of the file is unknown, so the manifest refuses any further edits.
+int
+manifest_append(manifest* m, const manifest_edit* e)
+{
+  if (m->error || write_record(m->fd, e) != 0) {
+    m->error = 1;
+    return 1;
+  }
+  m->size += MANIFEST_RECORD_HEADER_SIZE + e->len;
+  return 0;
+}
+
+void
+manifest_close(manifest* m)
+{
+  if (m) {
+    close(m->fd);
+    free(m->filename);
+    free(m);
+  }
+}
+
+static int
+state_add_table(manifest_state* state, const manifest_table* t)
+{
+  if (state->num_tables == state->tables_cap) {
+    size_t new_cap = state->tables_cap ? state->tables_cap * 2 : 16;
+    manifest_table* n = realloc(state->tables, new_cap * sizeof(manifest_table));
+    if (n == NULL) {
+      return 1;
+    }
+    state->tables = n;
+    state->tables_cap = new_cap;
+  }
+
+  manifest_table* added = &state->tables[state->num_tables];
+  *added = *t;
+  added->smallest = slice_copy(t->smallest);
+  added->largest = slice_copy(t->largest);
+  if (added->smallest.data == NULL || added->largest.data == NULL) {
+    slice_free(added->smallest);
+    slice_free(added->largest);
+    return 1;
+  }
+  state->num_tables++;
+  return 0;
+}
+
+static void
+state_delete_table(manifest_state* state, uint64_t file_num)
+{
+  for (size_t i = 0; i < state->num_tables; i++) {
+    if (state->tables[i].file_num == file_num) {
+      slice_free(state->tables[i].smallest);
+      slice_free(state->tables[i].largest);
+      state->tables[i] = state->tables[--state->num_tables];
+      return;
+    }
+  }
+}
+
+static int
+state_add_log(manifest_state* state, uint64_t file_num)
+{
+  if (state->num_logs == state->logs_cap) {
+    size_t new_cap = state->logs_cap ? state->logs_cap * 2 : 8;
+    uint64_t* n = realloc(state->logs, new_cap * sizeof(uint64_t));
+    if (n == NULL) {
+      return 1;
+    }
+    state->logs = n;
+    state->logs_cap = new_cap;
+  }
+  state->logs[state->num_logs++] = file_num;
+  return 0;
+}
+
+static void
+state_delete_log(manifest_state* state, uint64_t file_num)
+{
+  for (size_t i = 0; i < state->num_logs; i++) {
+    if (state->logs[i] == file_num) {
+      memmove(&state->logs[i], &state->logs[i + 1], (state->num_logs - i - 1) * sizeof(uint64_t));
+      state->num_logs--;
+      return;
+    }
+  }
+}
+
+// reader walks the fields of an edit, ok is cleared once a read runs past
+// its end.
+typedef struct reader_s {
+  const char* p;
+  const char* end;
+  bool ok;
+} reader;
+
+static void
+read_bytes(reader* r, void* out, size_t size)
+{
+  if (!r->ok || (size_t)(r->end - r->p) < size) {
+    r->ok = false;
+    memset(out, 0, size);
+    return;
+  }
+  memcpy(out, r->p, size);
+  r->p += size;
+}
+
+static slice
+read_slice(reader* r)
+{
+  uint16_t size;
+  read_bytes(r, &size, sizeof(size));
+  if (!r->ok || (size_t)(r->end - r->p) < size) {
+    r->ok = false;
+    return slice_new("", 0);
+  }
+  slice s = slice_new(r->p, size);
+  r->p += size;
+  return s;
+}
+
+// state_apply applies the edit in rep to state, returns 1 if it doesn't parse.
+static int
+state_apply(manifest_state* state, const char* rep, size_t len)
+{
+  reader r = { .p = rep, .end = rep + len, .ok = true };
+  while (r.ok && r.p < r.end) {
+    uint8_t tag;
+    uint64_t v;
+    manifest_table t;
+    read_bytes(&r, &tag, sizeof(tag));
+    switch (tag) {
+    case MANIFEST_TAG_NEXT_FILE_NUM:
+      read_bytes(&r, &state->next_file_num, sizeof(uint64_t));
+      break;
+    case MANIFEST_TAG_LAST_SEQ:
+      read_bytes(&r, &state->last_seq, sizeof(uint64_t));
+      break;
+    case MANIFEST_TAG_ADD_TABLE:
+      read_bytes(&r, &t.file_num, sizeof(uint64_t));
+      read_bytes(&r, &t.level, sizeof(uint32_t));
+      read_bytes(&r, &t.file_size, sizeof(uint64_t));
+      read_bytes(&r, &t.max_seq, sizeof(uint64_t));
+      t.smallest = read_slice(&r);
+      t.largest = read_slice(&r);
+      if (r.ok && state_add_table(state, &t) != 0) {
+        return 1;
+      }
+      break;
+    case MANIFEST_TAG_DELETE_TABLE:
+      read_bytes(&r, &v, sizeof(v));
+      state_delete_table(state, v);
+      break;
+    case MANIFEST_TAG_ADD_LOG:
+      read_bytes(&r, &v, sizeof(v));
+      if (r.ok && state_add_log(state, v) != 0) {
+        return 1;
+      }
+      break;
+    case MANIFEST_TAG_DELETE_LOG:
+      read_bytes(&r, &v, sizeof(v));
+      state_delete_log(state, v);
+      break;
+    default:
+      r.ok = false;
+    }
+  }
+  return r.ok ? 0 : 1;
+}
+
+static char*
+read_file(const char* path, size_t* size)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+
+  struct stat st;
+  char* buf = NULL;
+  if (fstat(fd, &st) == 0) {
+    buf = malloc(st.st_size + 1);
+  }
+  if (buf != NULL && read(fd, buf, st.st_size) != st.st_size) {
+    free(buf);
+    buf = NULL;
+  }
+  close(fd);
+  if (buf != NULL) {
+    buf[st.st_size] = '\0';
+    *size = st.st_size;
+  }
+  return buf;
+}
+
+// manifest_load reads the manifest CURRENT points at into state. Edits are
+// applied up to the first one that is cut short or fails its checksum, that
+// one was never acknowledged. The first edit holds the full state, the
+// manifest is unusable without it.
+manifest_res
+manifest_load(const char* dir_path, manifest_state* state)
+{
+  memset(state, 0, sizeof(manifest_state));
+
+  char path[1024];
+  snprintf(path, sizeof(path), "%s/%s", dir_path, MANIFEST_CURRENT);
+  if (access(path, F_OK) != 0) {
+    return MANIFEST_NOT_FOUND;
+  }
+
+  size_t size;
+  char* current = read_file(path, &size);
+  if (current == NULL) {
+    return MANIFEST_FAILED;
+  }
+  current[strcspn(current, "\n")] = '\0';
+  if (current[0] == '\0' || strchr(current, '/') != NULL) {
+    fprintf(stderr, "%s: bad manifest name\n", path);
+    free(current);
+    return MANIFEST_FAILED;
+  }
+  snprintf(path, sizeof(path), "%s/%s", dir_path, current);
+  free(current);
+
+  char* data = read_file(path, &size);
+  if (data == NULL) {
+    fprintf(stderr, "failed to read manifest %s\n", path);
+    return MANIFEST_FAILED;
+  }
+
+  size_t offset = 0;
+  size_t num_edits = 0;
+  while (size - offset >= MANIFEST_RECORD_HEADER_SIZE) {
+    uint32_t len, checksum;
+    memcpy(&len, data + offset, sizeof(uint32_t));
+    memcpy(&checksum, data + offset + sizeof(uint32_t), sizeof(uint32_t));
+    const char* rep = data + offset + MANIFEST_RECORD_HEADER_SIZE;
+    if (len > size - offset - MANIFEST_RECORD_HEADER_SIZE || crc32c(rep, len) != checksum) {
+      fprintf(stderr, "%s: bad edit at %zu, ignoring the rest of the manifest\n", path, offset);
+      break;
+    }
+    if (state_apply(state, rep, len) != 0) {
+      free(data);
+      manifest_state_free(state);
+      return MANIFEST_FAILED;
+    }
+    offset += MANIFEST_RECORD_HEADER_SIZE + len;
+    num_edits++;
+  }
+  free(data);
+
+  if (num_edits == 0) {
+    fprintf(stderr, "%s: manifest has no snapshot\n", path);
+    manifest_state_free(state);
+    return MANIFEST_FAILED;
+  }
+  return MANIFEST_OK;
+}
+
+void
+manifest_state_free(manifest_state* state)
+{
+  for (size_t i = 0; i < state->num_tables; i++) {
+    slice_free(state->tables[i].smallest);
+    slice_free(state->tables[i].largest);
+  }
+  free(state->tables);
+  free(state->logs);
+  memset(state, 0, sizeof(manifest_state));
+}
@@ -0,0 +1,88 @@
+#ifndef __MANIFEST_H__
+#define __MANIFEST_H__
+
+#include "utils.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// The manifest records which tables and logs make up a tree, so opening it
+// doesn't have to guess from the files in its directory. It's a log of edits,
+// every edit is a record of
+//
+//   [u32 size][u32 crc32c of the payload][payload]
+//
+// and the payload is a sequence of tagged fields (MANIFEST_TAG_*). A new
+// manifest starts with a single edit that holds the full state, CURRENT names
+// the manifest in use and is replaced atomically once the new one is synced.
+// Files that no manifest edit mentions, like the outputs of a flush or
+// compaction that crashed halfway, are never opened.
+
+#define MANIFEST_CURRENT  "CURRENT"
+
+#define MANIFEST_TAG_NEXT_FILE_NUM  1 // [u64]
+#define MANIFEST_TAG_LAST_SEQ       2 // [u64]
+#define MANIFEST_TAG_ADD_TABLE      3 // [u64 file_num][u32 level][u64 file_size][u64 max_seq]
+                                      // [u16 size][smallest][u16 size][largest]
+#define MANIFEST_TAG_DELETE_TABLE   4 // [u64 file_num]
+#define MANIFEST_TAG_ADD_LOG        5 // [u64 file_num]
+#define MANIFEST_TAG_DELETE_LOG     6 // [u64 file_num]
+
+typedef enum {
+  MANIFEST_OK,
+  MANIFEST_NOT_FOUND, // the directory has no CURRENT file
+  MANIFEST_FAILED,
+} manifest_res;
+
+// manifest_edit is built up field by field and written as one record.
+typedef struct manifest_edit_s {
+  char* rep;
+  size_t len;
+  size_t cap;
+  int error; // set if a field couldn't be added
+} manifest_edit;
+
+typedef struct manifest_table_s {
+  uint64_t file_num;
+  uint32_t level;
+  uint64_t file_size;
+  uint64_t max_seq;
+  slice smallest; // owned copies
+  slice largest;
+} manifest_table;
+
+// manifest_state is what the edits of a manifest add up to.
+typedef struct manifest_state_s {
+  manifest_table* tables;
+  size_t num_tables;
+  size_t tables_cap;
+  uint64_t* logs; // file numbers of the logs, in the order they were added
+  size_t num_logs;
+  size_t logs_cap;
+  uint64_t next_file_num;
+  uint64_t last_seq;
+} manifest_state;
+
+typedef struct manifest_s {
+  int fd;
+  char* filename;
+  uint64_t size; // bytes written so far
+  int error; // set once an append failed, nothing is appended after it
+} manifest;
+
+void manifest_edit_init(manifest_edit* e);
+void manifest_edit_set_next_file_num(manifest_edit* e, uint64_t next_file_num);
+void manifest_edit_set_last_seq(manifest_edit* e, uint64_t last_seq);
+void manifest_edit_add_table(manifest_edit* e, const manifest_table* t);
+void manifest_edit_delete_table(manifest_edit* e, uint64_t file_num);
+void manifest_edit_add_log(manifest_edit* e, uint64_t file_num);
+void manifest_edit_delete_log(manifest_edit* e, uint64_t file_num);
+void manifest_edit_free(manifest_edit* e);
+
+manifest* manifest_create(const char* dir_path, const char* name, const manifest_edit* snapshot);
+int manifest_append(manifest* m, const manifest_edit* e);
+void manifest_close(manifest* m);
+
+manifest_res manifest_load(const char* dir_path, manifest_state* state);
+void manifest_state_free(manifest_state* state);
+
+#endif
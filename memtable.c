@@ -1,96 +1,446 @@
 #include "memtable.h"
 #include "bloom.h"
-#include "skiplist.h"
+#include "cskiplist.h"
+#include <errno.h>
 #include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 
+// memtable_new creates a memtable whose filter is sized for expected_keys
+// keys, it keeps working past that with a higher false positive rate.
 memtable*
-memtable_new(size_t size)
+memtable_new(size_t expected_keys)
 {
   memtable* mt = malloc(sizeof(memtable));
   if (mt == NULL) {
     return NULL;
   }
 
-  mt->bloom_filter = bloom_filter_new_default(size);
-  mt->skiplist = skiplist_new();
+  // the skiplist nodes live in the arena and are freed together with it
+  mt->arena = arena_new();
+  if (mt->arena == NULL) {
+    free(mt);
+    return NULL;
+  }
+  mt->skiplist = cskiplist_new(mt->arena);
+  if (mt->skiplist == NULL) {
+    arena_free(mt->arena);
+    free(mt);
+    return NULL;
+  }
+
+  mt->bloom_filter = bloom_filter_new_bits_per_key(expected_keys, MEMTABLE_BLOOM_BITS_PER_KEY);
+  mt->range_dels = NULL;
   mt->taken_size = 0;
+  mt->max_seq = 0;
+  mt->log_num = 0;
   mt->next = NULL;
+  mt->wal = NULL;
+  mt->refs = 1;
+  mt->writers = 0;
+  mt->frozen = false;
 
   return mt;
 }
 
 memtable*
-memtable_new_dir(size_t size, char* dir_path)
+memtable_new_dir(size_t expected_keys, char* dir_path)
 {
-  memtable* mt = memtable_new(size);
+  memtable* mt = memtable_new(expected_keys);
   mt->wal = wal_open(dir_path);
   return mt;
 }
 
+memtable*
+memtable_new_wal(size_t expected_keys, const char* wal_path)
+{
+  memtable* mt = memtable_new(expected_keys);
+  if (mt == NULL) {
+    return NULL;
+  }
+
+  mt->wal = wal_create(wal_path);
+  if (mt->wal == NULL) {
+    memtable_free(mt);
+    return NULL;
+  }
+  return mt;
+}
+
+// memtable_log_put appends the entry to the log without waiting for it to
+// reach the disk, ticket is set to pass to memtable_sync. Lets callers wait for
+// the log outside of their own locks.
 memtable_res
-memtable_insert(memtable* mt, const char* key, const char* value)
+memtable_log_put(memtable* mt, slice key, slice value, uint64_t* ticket)
+{
+  *ticket = 0;
+  if (key.size > UINT16_MAX || value.size > UINT32_MAX) {
+    return MEMTABLE_FAILED;
+  }
+  if (mt->wal && wal_append(mt->wal, WAL_PUT, key, value, ticket) != 0) {
+    return MEMTABLE_FAILED;
+  }
+  return MEMTABLE_OK;
+}
+
+static memtable_res
+memtable_add(memtable* mt, slice key, slice value, uint64_t seq, bool deleted)
 {
   // TODO: handle proper add to size of memtable for keys that are updated.
-  if (bloom_filter_test_str(mt->bloom_filter, key)) {
-    skiplist_remove(mt->skiplist, key);
+  __atomic_add_fetch(&mt->taken_size, 4 + key.size + value.size, __ATOMIC_RELAXED); // 4 bytes for 2 uint16_t representing key and value lengths
+  bloom_filter_put(mt->bloom_filter, key.data, key.size);
+  if (cskiplist_insert(mt->skiplist, key, value, seq, deleted) != 0) {
+    return MEMTABLE_FAILED;
   }
 
-  mt->taken_size += 4 + strlen(key) + strlen(value); // 4 bytes for 2 uint16_t representing key and value lengths
-  bloom_filter_put_str(mt->bloom_filter, key);
-  skiplist_insert(mt->skiplist, key, value);
+  return MEMTABLE_OK;
+}
 
-  if (mt->wal) {
-    int res = wal_put(mt->wal, key, strlen(key), value, strlen(value));
-    if (res != 0) {
-      return MEMTABLE_FAILED;
+// memtable_add_range links a range deletion in front of the others. Like a
+// skiplist node it lives in the arena and never changes once it's linked, so
+// readers walk the list without locks.
+static memtable_res
+memtable_add_range(memtable* mt, slice start, slice end, uint64_t seq)
+{
+  if (slice_compare(start, end) >= 0) {
+    return MEMTABLE_OK;
+  }
+
+  __atomic_add_fetch(&mt->taken_size, 4 + start.size + end.size, __ATOMIC_RELAXED);
+  mem_range_del* d = arena_alloc_concurrent(mt->arena, sizeof(mem_range_del) + start.size + end.size);
+  if (d == NULL) {
+    return MEMTABLE_FAILED;
+  }
+  char* p = (char*)(d + 1);
+  memcpy(p, start.data, start.size);
+  memcpy(p + start.size, end.data, end.size);
+  d->start = slice_new(p, start.size);
+  d->end = slice_new(p + start.size, end.size);
+  d->seq = seq;
+  d->next = __atomic_load_n(&mt->range_dels, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&mt->range_dels, &d->next, d, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+  }
+  return MEMTABLE_OK;
+}
+
+// memtable_range_dels returns the range deletions of the memtable, newest
+// first.
+mem_range_del*
+memtable_range_dels(memtable* mt)
+{
+  return __atomic_load_n(&mt->range_dels, __ATOMIC_ACQUIRE);
+}
+
+// memtable_range_seq returns the sequence number of the newest range deletion
+// that covers key and was written at or before seq, or 0 if there is none.
+// Entries of the memtable with a lower sequence number are deleted, as is
+// everything in older memtables and tables. Range deletions are rare, so
+// they're simply all checked.
+uint64_t
+memtable_range_seq(memtable* mt, slice key, uint64_t seq)
+{
+  uint64_t newest = 0;
+  for (mem_range_del* d = memtable_range_dels(mt); d != NULL; d = d->next) {
+    if (d->seq > newest && d->seq <= seq && slice_compare(d->start, key) <= 0 && slice_compare(key, d->end) < 0) {
+      newest = d->seq;
     }
   }
+  return newest;
+}
+
+// memtable_empty tells if nothing was written to the memtable, not even a
+// deletion.
+bool
+memtable_empty(memtable* mt)
+{
+  return cskiplist_count(mt->skiplist) == 0 && memtable_range_dels(mt) == NULL;
+}
+
+// memtable_put adds the entry without logging it. It can be called by several
+// threads at once, if they write the same key the write with the highest seq
+// wins.
+memtable_res
+memtable_put(memtable* mt, slice key, slice value, uint64_t seq)
+{
+  return memtable_add(mt, key, value, seq, false);
+}
+
+// memtable_log_batch appends the whole batch to the log as a single record,
+// recovery replays either all of its operations or none of them.
+memtable_res
+memtable_log_batch(memtable* mt, const write_batch* b, uint64_t* ticket)
+{
+  *ticket = 0;
+  if (b->error || b->len > UINT32_MAX) {
+    return MEMTABLE_FAILED;
+  }
+  if (b->count == 0) {
+    return MEMTABLE_OK;
+  }
+  if (mt->wal && wal_append(mt->wal, WAL_BATCH, slice_new("", 0), slice_new(b->rep, b->len), ticket) != 0) {
+    return MEMTABLE_FAILED;
+  }
+  return MEMTABLE_OK;
+}
+
+typedef struct batch_apply_s {
+  memtable* mt;
+  uint64_t seq; // sequence number of the next operation
+} batch_apply;
+
+static int
+batch_apply_op(void* arg, int type, slice key, slice value)
+{
+  batch_apply* a = arg;
+  if (type == WRITE_BATCH_DELETE_RANGE) {
+    return memtable_add_range(a->mt, key, value, a->seq++) != MEMTABLE_OK;
+  }
+  return memtable_add(a->mt, key, value, a->seq++, type == WRITE_BATCH_DELETE) != MEMTABLE_OK;
+}
+
+static int
+batch_count_op(void* arg, int type, slice key, slice value)
+{
+  (void)type;
+  (void)key;
+  (void)value;
+  (*(uint64_t*)arg)++;
+  return 0;
+}
+
+// memtable_apply_batch adds the operations of the batch without logging them,
+// the first one gets sequence number seq and every following one the next.
+// Like memtable_put it can be called by several threads at once.
+memtable_res
+memtable_apply_batch(memtable* mt, const write_batch* b, uint64_t seq)
+{
+  batch_apply a = { .mt = mt, .seq = seq };
+  if (b->error || write_batch_iterate(b->rep, b->len, batch_apply_op, &a) != 0) {
+    return MEMTABLE_FAILED;
+  }
+  return MEMTABLE_OK;
+}
 
+memtable_res
+memtable_sync(memtable* mt, uint64_t ticket)
+{
+  if (mt->wal && wal_sync(mt->wal, ticket) != 0) {
+    return MEMTABLE_FAILED;
+  }
   return MEMTABLE_OK;
 }
 
+// memtable_insert logs and adds the entry, numbering the writes itself. Only
+// for memtables with a single writer.
+memtable_res
+memtable_insert(memtable* mt, slice key, slice value)
+{
+  uint64_t ticket;
+  if (memtable_log_put(mt, key, value, &ticket) != MEMTABLE_OK ||
+      memtable_put(mt, key, value, ++mt->max_seq) != MEMTABLE_OK) {
+    return MEMTABLE_FAILED;
+  }
+  return memtable_sync(mt, ticket);
+}
+
+// memtable_delete logs the removal of key and hides any earlier value, with
+// the same single writer restriction as memtable_insert.
 memtable_res
-memtable_get(memtable* mt, const char* key, char** value)
+memtable_delete(memtable* mt, slice key)
+{
+  if (key.size > UINT16_MAX) {
+    return MEMTABLE_FAILED;
+  }
+
+  uint64_t ticket = 0;
+  if (mt->wal && wal_append(mt->wal, WAL_DELETE, key, slice_new("", 0), &ticket) != 0) {
+    return MEMTABLE_FAILED;
+  }
+  if (memtable_add(mt, key, slice_new("", 0), ++mt->max_seq, true) != MEMTABLE_OK) {
+    return MEMTABLE_FAILED;
+  }
+  return memtable_sync(mt, ticket);
+}
+
+// memtable_write logs and adds the batch, with the same single writer
+// restriction as memtable_insert.
+memtable_res
+memtable_write(memtable* mt, const write_batch* b)
+{
+  uint64_t ticket;
+  if (memtable_log_batch(mt, b, &ticket) != MEMTABLE_OK ||
+      memtable_apply_batch(mt, b, mt->max_seq + 1) != MEMTABLE_OK) {
+    return MEMTABLE_FAILED;
+  }
+  mt->max_seq += b->count;
+  return memtable_sync(mt, ticket);
+}
+
+// memtable_find returns the newest value stored for key at or before seq,
+// which might be a deletion, or NULL if the memtable has none.
+static csk_value*
+memtable_find(memtable* mt, slice key, uint64_t seq)
 {
   // not in bloom filter we can ignore this
-  if (!bloom_filter_test_str(mt->bloom_filter, key)) {
+  if (!bloom_filter_test(mt->bloom_filter, key.data, key.size)) {
+    return NULL;
+  }
+
+  csk_node* n = cskiplist_find(mt->skiplist, key);
+  if (n == NULL) {
+    return NULL;
+  }
+  return csk_node_value_at(n, seq);
+}
+
+// range_deleted tells if a range deletion of the memtable hides v, the newest
+// value of key or NULL if it has none.
+static bool
+range_deleted(memtable* mt, slice key, uint64_t seq, csk_value* v)
+{
+  uint64_t range_seq = memtable_range_seq(mt, key, seq);
+  return range_seq > 0 && (v == NULL || v->seq < range_seq);
+}
+
+// memtable_get sets value to a copy of the value stored at seq, writes with a
+// higher sequence number aren't seen. The caller frees it with slice_free.
+// Returns MEMTABLE_DELETED if the key was deleted, on its own or by a range
+// deletion, older values for it elsewhere mustn't be used then.
+memtable_res
+memtable_get(memtable* mt, slice key, uint64_t seq, slice* value)
+{
+  csk_value* v = memtable_find(mt, key, seq);
+  if (range_deleted(mt, key, seq, v)) {
+    return MEMTABLE_DELETED;
+  }
+  if (v == NULL) {
     return MEMTABLE_FAILED;
   }
+  if (v->deleted) {
+    return MEMTABLE_DELETED;
+  }
+  *value = slice_copy(slice_new(v->data, v->size));
+  return value->data != NULL ? MEMTABLE_OK : MEMTABLE_FAILED;
+}
 
-  skipnode* n = skiplist_search_by_key(mt->skiplist, key);
-  *value = strdup(n->value);
+static void
+release_memtable(void* arg)
+{
+  memtable_unref(arg);
+}
+
+// memtable_get_pinned points value at the value inside the arena without
+// copying it. Values are never changed in place, a newer write links a new
+// one, so the view stays valid for as long as the memtable is referenced.
+memtable_res
+memtable_get_pinned(memtable* mt, slice key, uint64_t seq, pinned_slice* value)
+{
+  csk_value* v = memtable_find(mt, key, seq);
+  if (range_deleted(mt, key, seq, v)) {
+    return MEMTABLE_DELETED;
+  }
+  if (v == NULL) {
+    return MEMTABLE_FAILED;
+  }
+  if (v->deleted) {
+    return MEMTABLE_DELETED;
+  }
+  memtable_ref(mt);
+  value->value = slice_new(v->data, v->size);
+  value->release = release_memtable;
+  value->arg = mt;
   return MEMTABLE_OK;
 }
 
+// memtable_multi_get looks up n keys sorted in increasing order at seq, hashes
+// are their hash64 values with BLOOM_HASH_SEED. results[i] is set like
+// memtable_get would, and values[i] to a copy of the value when it's found.
+// The filter is probed a batch at a time and every skiplist search resumes
+// where the previous one ended. Returns 1 if a value couldn't be copied, the
+// other keys are still looked up.
+int
+memtable_multi_get(memtable* mt, const slice* keys, const uint64_t* hashes, size_t n, uint64_t seq,
+    slice* values, memtable_res* results)
+{
+  int res = 0;
+  csk_finger finger;
+  cskiplist_finger_init(mt->skiplist, &finger);
+
+  for (size_t start = 0; start < n; start += MEMTABLE_MULTI_GET_BATCH) {
+    size_t len = n - start < MEMTABLE_MULTI_GET_BATCH ? n - start : MEMTABLE_MULTI_GET_BATCH;
+    bool maybe[MEMTABLE_MULTI_GET_BATCH];
+    bloom_filter_test_batch(mt->bloom_filter, hashes + start, len, maybe);
+
+    for (size_t i = start; i < start + len; i++) {
+      results[i] = MEMTABLE_FAILED;
+      csk_value* v = NULL;
+      if (maybe[i - start]) {
+        csk_node* n = cskiplist_seek_finger(mt->skiplist, &finger, keys[i]);
+        if (n != NULL && key_compare(n->key, n->key_size, keys[i].data, keys[i].size) == 0) {
+          v = csk_node_value_at(n, seq);
+        }
+      }
+      if (range_deleted(mt, keys[i], seq, v)) {
+        results[i] = MEMTABLE_DELETED;
+        continue;
+      }
+      if (v == NULL) {
+        continue;
+      }
+      if (v->deleted) {
+        results[i] = MEMTABLE_DELETED;
+        continue;
+      }
+      values[i] = slice_copy(slice_new(v->data, v->size));
+      if (values[i].data == NULL) {
+        res = 1;
+        continue;
+      }
+      results[i] = MEMTABLE_OK;
+    }
+  }
+  return res;
+}
+
+void
+memtable_ref(memtable* mt)
+{
+  __atomic_add_fetch(&mt->refs, 1, __ATOMIC_RELAXED);
+}
+
+void
+memtable_unref(memtable* mt)
+{
+  if (__atomic_sub_fetch(&mt->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    memtable_free(mt);
+  }
+}
+
 void
 memtable_free(memtable* mt)
 {
   bloom_filter_free(mt->bloom_filter);
-  skiplist_delete(mt->skiplist);
+  cskiplist_free(mt->skiplist);
+  arena_free(mt->arena);
   if (mt->wal) {
     wal_close(mt->wal);
   }
   free(mt);
 }
 
-#define WAL_PUT     1
-#define WAL_DELETE  2
-
 #define WAL_MAGIC   0x57CCCC48
-#define WAL_VERSION 1
+#define WAL_VERSION 2
+#define WAL_VERSION_UNCHECKED 1 // logs written before records had checksums
 
 wal*
 wal_open(char* dir_path)
 {
-  wal* wl = calloc(1, sizeof(wal));
-  if (!wl) {
-    return NULL;
-  }
-
   // Get Unix timestamp
   time_t now = time(NULL);
   char timestamp[32];
@@ -100,29 +450,75 @@ wal_open(char* dir_path)
   size_t path_len = strlen(dir_path) + strlen(timestamp) + 6; // +6 for '/', '.mem', and '\0'
   char* fname = malloc(path_len);
   if (!fname) {
-    free(wl);
     return NULL;
   }
   snprintf(fname, path_len, "%s/%s.mem", dir_path, timestamp);
 
-  wl->filename = fname;
+  wal* wl = wal_create(fname);
+  free(fname);
+  return wl;
+}
+
+// sync_parent_dir makes the entry of path in its directory durable.
+static int
+sync_parent_dir(const char* path)
+{
+  char dir_path[1024];
+  const char* slash = strrchr(path, '/');
+  if (slash == NULL) {
+    snprintf(dir_path, sizeof(dir_path), ".");
+  } else {
+    snprintf(dir_path, sizeof(dir_path), "%.*s", (int)(slash == path ? 1 : slash - path), path);
+  }
+
+  int fd = open(dir_path, O_RDONLY);
+  if (fd < 0) {
+    return 1;
+  }
+  int res = fsync(fd);
+  close(fd);
+  return res;
+}
+
+// wal_create opens the log at the given path, a header is written if the file
+// is new, otherwise new entries are appended to the existing ones. A new log
+// is durable with its header before this returns, so it can be recorded in the
+// manifest right away.
+wal*
+wal_create(const char* path)
+{
+  wal* wl = calloc(1, sizeof(wal));
+  if (!wl) {
+    return NULL;
+  }
+
+  wl->filename = strdup(path);
   wl->seq = 1;
+  if (!wl->filename) {
+    free(wl);
+    return NULL;
+  }
 
-  wl->fd = open(fname, O_RDWR | O_CREAT, 0644);
+  wl->fd = open(wl->filename, O_RDWR | O_CREAT, 0644);
   if (wl->fd < 0) {
     free(wl->filename);
     free(wl);
     return NULL;
   }
 
-  if (lseek(wl->fd, 0, SEEK_END) == 0) {
+  // a log cut short before its header was complete holds no records, it's
+  // started over
+  off_t end = lseek(wl->fd, 0, SEEK_END);
+  if (end < (off_t)sizeof(wal_header)) {
     wal_header header = {
       .magic = WAL_MAGIC,
       .version = WAL_VERSION,
       .seq = wl->seq
     };
 
-    if (write(wl->fd, &header, sizeof(header)) != sizeof(header)) {
+    if ((end != 0 && (ftruncate(wl->fd, 0) != 0 || lseek(wl->fd, 0, SEEK_SET) != 0)) ||
+        write(wl->fd, &header, sizeof(header)) != sizeof(header) || fdatasync(wl->fd) != 0 ||
+        sync_parent_dir(path) != 0) {
       close(wl->fd);
       free(wl->filename);
       free(wl);
@@ -130,58 +526,193 @@ wal_open(char* dir_path)
     }
   }
 
+  pthread_mutex_init(&wl->lock, NULL);
+  pthread_cond_init(&wl->cond, NULL);
+  wl->sync_mode = WAL_SYNC_ALWAYS;
+  wl->written_seq = wl->seq - 1;
+  wl->synced_seq = wl->seq - 1;
   return wl;
 }
 
-int
-wal_put(wal* wl, const char* key, uint16_t keysize, const char* value, uint32_t valsize)
+static int
+wal_buf_reserve(char** buf, size_t* cap, size_t needed)
 {
-  wal_entry_header header = {
-    .type = WAL_PUT,
-    .key_size = keysize,
-    .value_size = valsize,
-    .checksum = 0,
-  };
-  // TODO: calculate crc
+  if (needed <= *cap) {
+    return 0;
+  }
 
-  if (write(wl->fd, &header, sizeof(header)) != sizeof(header)) {
-    return 1;
+  size_t new_cap = *cap ? *cap : 4096;
+  while (new_cap < needed) {
+    new_cap *= 2;
   }
 
-  if (write(wl->fd, key, keysize) != keysize) {
+  char* n = realloc(*buf, new_cap);
+  if (n == NULL) {
     return 1;
   }
+  *buf = n;
+  *cap = new_cap;
+  return 0;
+}
 
-  if (write(wl->fd, value, valsize) != valsize) {
+// wal_append frames a record into the shared buffer without writing it, the
+// record is durable once wal_sync returns for the returned ticket.
+int
+wal_append(wal* wl, uint32_t type, slice key, slice value, uint64_t* ticket)
+{
+  // the header is zeroed so its padding doesn't end up in the checksum
+  wal_entry_header header;
+  memset(&header, 0, sizeof(header));
+  header.type = type;
+  header.key_size = key.size;
+  header.value_size = value.size;
+
+  pthread_mutex_lock(&wl->lock);
+  size_t size = sizeof(header) + key.size + value.size;
+  if (wl->error || wal_buf_reserve(&wl->buf, &wl->buf_cap, wl->buf_len + size) != 0) {
+    pthread_mutex_unlock(&wl->lock);
     return 1;
   }
-  fsync(wl->fd);
-  wl->seq++;
+
+  // the checksum covers the header, with the checksum itself set to 0, and
+  // the key and value.
+  char* p = wl->buf + wl->buf_len;
+  memcpy(p, &header, sizeof(header));
+  memcpy(p + sizeof(header), key.data, key.size);
+  memcpy(p + sizeof(header) + key.size, value.data, value.size);
+  header.checksum = crc32c(p, size);
+  memcpy(p + offsetof(wal_entry_header, checksum), &header.checksum, sizeof(uint32_t));
+  wl->buf_len += size;
+  *ticket = wl->seq++;
+  pthread_mutex_unlock(&wl->lock);
 
   return 0;
 }
 
+static int
+write_all(int fd, const char* buf, size_t size)
+{
+  while (size > 0) {
+    ssize_t n = write(fd, buf, size);
+    if (n <= 0) {
+      return 1;
+    }
+    buf += n;
+    size -= n;
+  }
+  return 0;
+}
+
+// wal_write_group returns once the record with the given ticket is written,
+// and synced when sync is set. The first writer to arrive becomes the leader
+// and writes everything that was appended so far in one go, writers arriving
+// in the meantime wait for it and the next one of them leads the following
+// group.
+static int
+wal_write_group(wal* wl, uint64_t ticket, bool sync)
+{
+  pthread_mutex_lock(&wl->lock);
+  while ((sync ? wl->synced_seq : wl->written_seq) < ticket && !wl->error) {
+    if (wl->syncing) {
+      pthread_cond_wait(&wl->cond, &wl->lock);
+      continue;
+    }
+
+    // swap the buffers so followers can keep appending while the group is
+    // written out.
+    char* buf = wl->buf;
+    size_t len = wl->buf_len;
+    size_t cap = wl->buf_cap;
+    uint64_t last = wl->seq - 1;
+    wl->buf = wl->sync_buf;
+    wl->buf_cap = wl->sync_buf_cap;
+    wl->buf_len = 0;
+    wl->syncing = true;
+    pthread_mutex_unlock(&wl->lock);
+
+    int res = write_all(wl->fd, buf, len);
+    if (res == 0 && sync) {
+      res = fdatasync(wl->fd);
+    }
+
+    pthread_mutex_lock(&wl->lock);
+    wl->sync_buf = buf;
+    wl->sync_buf_cap = cap;
+    wl->syncing = false;
+    if (res != 0) {
+      wl->error = 1;
+    } else {
+      wl->written_seq = last;
+      if (sync) {
+        wl->synced_seq = last;
+        wl->num_syncs++;
+      }
+    }
+    pthread_cond_broadcast(&wl->cond);
+  }
+  int res = wl->error;
+  pthread_mutex_unlock(&wl->lock);
+
+  return res;
+}
+
+// wal_sync makes the record with the given ticket as durable as the log's
+// sync mode asks for.
 int
-wal_delete(wal* wl, const char* key, uint16_t keysize)
+wal_sync(wal* wl, uint64_t ticket)
 {
-  wal_entry_header header = {
-    .type = WAL_DELETE,
-    .key_size = keysize,
-    .value_size = 0,
-    .checksum = 0,
-  };
+  switch (wl->sync_mode) {
+  case WAL_SYNC_ALWAYS:
+    return wal_write_group(wl, ticket, true);
+  case WAL_SYNC_OS:
+    return wal_write_group(wl, ticket, false);
+  case WAL_SYNC_PERIODIC:
+    break;
+  }
 
-  if (write(wl->fd, &header, sizeof(header)) != sizeof(header)) {
-    return 1;
+  // records stay buffered until wal_flush runs, unless the buffer grows too
+  // large.
+  pthread_mutex_lock(&wl->lock);
+  bool full = wl->buf_len >= WAL_BUFFER_SIZE;
+  uint64_t last = wl->seq - 1;
+  int res = wl->error;
+  pthread_mutex_unlock(&wl->lock);
+
+  if (res == 0 && full) {
+    res = wal_write_group(wl, last, false);
   }
+  return res;
+}
+
+// wal_flush writes and syncs every record appended so far.
+int
+wal_flush(wal* wl)
+{
+  pthread_mutex_lock(&wl->lock);
+  uint64_t last = wl->seq - 1;
+  pthread_mutex_unlock(&wl->lock);
 
-  if (write(wl->fd, &key, keysize) != keysize) {
+  return wal_write_group(wl, last, true);
+}
+
+int
+wal_put(wal* wl, slice key, slice value)
+{
+  uint64_t ticket;
+  if (wal_append(wl, WAL_PUT, key, value, &ticket) != 0) {
     return 1;
   }
+  return wal_sync(wl, ticket);
+}
 
-  fsync(wl->fd);
-  wl->seq++;
-  return 0;
+int
+wal_delete(wal* wl, slice key)
+{
+  uint64_t ticket;
+  if (wal_append(wl, WAL_DELETE, key, slice_new("", 0), &ticket) != 0) {
+    return 1;
+  }
+  return wal_sync(wl, ticket);
 }
 
 void
@@ -189,96 +720,132 @@ wal_close(wal* wl)
 {
   if (wl) {
     if (wl->fd >= 0) {
+      // records that were appended but never synced still reach the file
+      if (wl->buf_len > 0) {
+        write_all(wl->fd, wl->buf, wl->buf_len);
+      }
       close(wl->fd);
     }
+    pthread_mutex_destroy(&wl->lock);
+    pthread_cond_destroy(&wl->cond);
+    free(wl->buf);
+    free(wl->sync_buf);
     free(wl->filename);
     free(wl);
   }
 }
 
-memtable*
-memtable_recover_from_wal(size_t size, const char* wal_path)
+// wal_replay_record applies a single record, a batch has been counted
+// already. Returns 1 if the memtable couldn't take it.
+static int
+wal_replay_record(memtable* mt, uint32_t type, slice key, slice value, uint64_t batch_count)
 {
-  memtable* mt = memtable_new(size);
-  if (!mt) {
-    return NULL;
+  // the skiplist copies the key and value, so they are passed straight
+  // from the log.
+  memtable_res res = MEMTABLE_OK;
+  if (type == WAL_PUT) {
+    res = memtable_add(mt, key, value, ++mt->max_seq, false);
+  } else if (type == WAL_DELETE) {
+    res = memtable_add(mt, key, slice_new("", 0), ++mt->max_seq, true);
+  } else if (type == WAL_BATCH) {
+    write_batch batch = { .rep = (char*)value.data, .len = value.size, .count = batch_count };
+    res = memtable_apply_batch(mt, &batch, mt->max_seq + 1);
+    mt->max_seq += batch.count;
+  }
+  return res == MEMTABLE_OK ? 0 : 1;
+}
+
+// wal_replay parses the records of the mapped log in place and applies them
+// to mt, up to the first one that is cut short or fails its checksum. Records
+// of version 1 logs have no checksum to check. Returns 1 if a record couldn't
+// be applied, the memtable is missing writes then.
+static int
+wal_replay(memtable* mt, const char* wal_path, const char* data, size_t size, bool checked)
+{
+  size_t offset = sizeof(wal_header);
+  while (size - offset >= sizeof(wal_entry_header)) {
+    // records aren't aligned in the file, so the header is copied out
+    wal_entry_header entry_header;
+    memcpy(&entry_header, data + offset, sizeof(entry_header));
+    size_t record_size = sizeof(entry_header) + entry_header.key_size + entry_header.value_size;
+    if (record_size > size - offset) {
+      fprintf(stderr, "%s: record at %zu is cut short, ignoring the rest of the log\n", wal_path, offset);
+      return 0;
+    }
+
+    // the checksum covers the header, with the checksum itself set to 0, and
+    // the key and value.
+    uint32_t checksum = entry_header.checksum;
+    entry_header.checksum = 0;
+    const char* body = data + offset + sizeof(entry_header);
+    uint32_t crc = crc32c(&entry_header, sizeof(entry_header));
+    if (checked && crc32c_extend(crc, body, record_size - sizeof(entry_header)) != checksum) {
+      fprintf(stderr, "%s: bad record at %zu, ignoring the rest of the log\n", wal_path, offset);
+      return 0;
+    }
+
+    slice key = slice_new(body, entry_header.key_size);
+    slice value = slice_new(body + key.size, entry_header.value_size);
+    // the batch is checked before anything is applied, so it's never
+    // replayed halfway.
+    uint64_t batch_count = 0;
+    if (entry_header.type == WAL_BATCH && write_batch_iterate(value.data, value.size, batch_count_op, &batch_count) != 0) {
+      fprintf(stderr, "%s: bad batch at %zu, ignoring the rest of the log\n", wal_path, offset);
+      return 0;
+    }
+    if (wal_replay_record(mt, entry_header.type, key, value, batch_count) != 0) {
+      fprintf(stderr, "%s: failed to apply record at %zu\n", wal_path, offset);
+      return 1;
+    }
+    offset += record_size;
   }
+  return 0;
+}
 
+// memtable_recover_from_wal replays the log at wal_path into a new memtable.
+// Replay stops at the first record that is cut short or fails its checksum,
+// everything before it is kept. The log is mapped and read in place, nothing
+// is allocated per record. Logs can be recovered on several threads at once.
+// A log that's missing or shorter than its header was created but never
+// written to before a crash, it's recovered as an empty memtable. Returns NULL
+// if the file isn't a log of a known version or a record couldn't be applied.
+memtable*
+memtable_recover_from_wal(size_t expected_keys, const char* wal_path)
+{
   int fd = open(wal_path, O_RDONLY);
   if (fd < 0) {
-    memtable_free(mt);
-    return NULL;
+    return errno == ENOENT ? memtable_new(expected_keys) : NULL;
   }
 
-  wal_header header;
-  if (read(fd, &header, sizeof(header)) != sizeof(header)) {
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
     close(fd);
-    memtable_free(mt);
     return NULL;
   }
-
-  if (header.magic != WAL_MAGIC || header.version != WAL_VERSION) {
+  if (st.st_size < (off_t)sizeof(wal_header)) {
     close(fd);
-    memtable_free(mt);
+    return memtable_new(expected_keys);
+  }
+  char* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
     return NULL;
   }
+  madvise(data, st.st_size, MADV_SEQUENTIAL);
 
-  while (1) {
-    wal_entry_header entry_header;
-    ssize_t read_size = read(fd, &entry_header, sizeof(entry_header));
-
-    if (read_size == 0) { // EOF
-      break;
-    }
-    if (read_size != sizeof(entry_header)) {
-      close(fd);
-      memtable_free(mt);
-      return NULL;
-    }
-
-    char* key = malloc(entry_header.key_size + 1);
-    char* value = NULL;
-    if (!key) {
-      close(fd);
-      memtable_free(mt);
-      return NULL;
-    }
-
-    if (read(fd, key, entry_header.key_size) != entry_header.key_size) {
-      free(key);
-      close(fd);
-      memtable_free(mt);
-      return NULL;
-    }
-    key[entry_header.key_size] = '\0';
-
-    if (entry_header.type == WAL_PUT) {
-      value = malloc(entry_header.value_size + 1);
-      if (!value) {
-        free(key);
-        close(fd);
-        memtable_free(mt);
-        return NULL;
-      }
-
-      if (read(fd, value, entry_header.value_size) != entry_header.value_size) {
-        free(key);
-        free(value);
-        close(fd);
-        memtable_free(mt);
-        return NULL;
-      }
-      value[entry_header.value_size] = '\0';
-
-      memtable_insert(mt, key, value);
-      free(value);
-    } else if (entry_header.type == WAL_DELETE) {
-      skiplist_remove(mt->skiplist, key);
-    }
-
-    free(key);
+  wal_header header;
+  memcpy(&header, data, sizeof(header));
+  memtable* mt = NULL;
+  if (header.magic != WAL_MAGIC || (header.version != WAL_VERSION && header.version != WAL_VERSION_UNCHECKED)) {
+    fprintf(stderr, "%s: not a log or unknown version %u\n", wal_path, header.version);
+  } else {
+    mt = memtable_new(expected_keys);
+  }
+  if (mt != NULL && wal_replay(mt, wal_path, data, st.st_size, header.version != WAL_VERSION_UNCHECKED) != 0) {
+    memtable_free(mt);
+    mt = NULL;
   }
 
-  close(fd);
+  munmap(data, st.st_size);
   return mt;
 }
@@ -1,33 +1,100 @@
 #ifndef __MEMTABLE_H__
 #define __MEMTABLE_H__
 
+#include "arena.h"
 #include "bloom.h"
-#include "skiplist.h"
+#include "cskiplist.h"
 #include "utils.h"
+#include "write_batch.h"
+#include <pthread.h>
+#include <stdbool.h>
 
 // TODO: make this better
 typedef enum {
   MEMTABLE_OK,
   MEMTABLE_FAILED,
+  MEMTABLE_DELETED, // the newest entry for the key is a deletion
 } memtable_res;
 
+#define MEMTABLE_BLOOM_BITS_PER_KEY  10
+#define MEMTABLE_MULTI_GET_BATCH     16 // keys whose filter probes are prefetched together
+#define MEMTABLE_SEQ_MAX             UINT64_MAX // reads at this sequence number see every write
+
+#define WAL_PUT          1
+#define WAL_DELETE       2
+#define WAL_BATCH        3 // the value is the encoding of a write_batch
+#define WAL_BUFFER_SIZE  (64 * 1024) // periodic mode writes the buffer out once it's this large
+
+typedef enum {
+  WAL_SYNC_ALWAYS, // every write is synced before it returns
+  WAL_SYNC_PERIODIC, // writes are buffered, wal_flush writes and syncs them
+  WAL_SYNC_OS, // every write reaches the OS before it returns but is never synced
+} wal_sync_mode;
+
 typedef struct wal_s {
   int fd;
   char* filename;
-  uint64_t seq;
+  uint64_t seq; // sequence number of the next appended record
+  wal_sync_mode sync_mode;
+
+  // group commit state, records are appended to buf and written out by
+  // whichever writer syncs first.
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  char* buf;
+  size_t buf_len;
+  size_t buf_cap;
+  char* sync_buf; // spare buffer swapped in while a group is being written
+  size_t sync_buf_cap;
+  uint64_t written_seq; // records up to this sequence number reached the OS
+  uint64_t synced_seq; // records up to this sequence number are durable
+  uint64_t num_syncs;
+  bool syncing;
+  int error;
 } wal;
 
+// mem_range_del is a range deletion in a memtable, it hides the keys in
+// [start, end) that were written before it.
+typedef struct mem_range_del_s {
+  slice start; // point into the arena
+  slice end;
+  uint64_t seq;
+  struct mem_range_del_s* next;
+} mem_range_del;
+
 typedef struct memtable_s {
   bloom_filter* bloom_filter; // we can have this to speed up look ups.
-  skiplist* skiplist;
-  size_t taken_size;
+  cskiplist* skiplist; // safe for concurrent readers and writers
+  arena* arena; // backs the skiplist nodes, keys and values
+  mem_range_del* range_dels; // newest first, updated atomically
+  size_t taken_size; // updated atomically
+  uint64_t max_seq; // sequence number of the newest write, assigned by the tree
+  uint64_t log_num; // file number of the log in the tree's directory
   struct memtable_s* next;
   wal* wal;
+  int refs;
+  int writers; // puts that are still adding to the memtable, updated atomically
+  bool frozen; // set once no new puts can start, updated atomically
 } memtable;
 
-memtable* memtable_new(size_t size);
-memtable_res memtable_insert(memtable* mt, const char* key, const char* value);
-memtable_res memtable_get(memtable* mt, const char* key, char** value);
+memtable* memtable_new(size_t expected_keys);
+memtable_res memtable_insert(memtable* mt, slice key, slice value);
+memtable_res memtable_delete(memtable* mt, slice key);
+memtable_res memtable_log_put(memtable* mt, slice key, slice value, uint64_t* ticket);
+memtable_res memtable_put(memtable* mt, slice key, slice value, uint64_t seq);
+memtable_res memtable_write(memtable* mt, const write_batch* b);
+memtable_res memtable_log_batch(memtable* mt, const write_batch* b, uint64_t* ticket);
+memtable_res memtable_apply_batch(memtable* mt, const write_batch* b, uint64_t seq);
+memtable_res memtable_sync(memtable* mt, uint64_t ticket);
+memtable_res memtable_get(memtable* mt, slice key, uint64_t seq, slice* value);
+memtable_res memtable_get_pinned(memtable* mt, slice key, uint64_t seq, pinned_slice* value);
+int memtable_multi_get(memtable* mt, const slice* keys, const uint64_t* hashes, size_t n, uint64_t seq,
+    slice* values, memtable_res* results);
+mem_range_del* memtable_range_dels(memtable* mt);
+uint64_t memtable_range_seq(memtable* mt, slice key, uint64_t seq);
+bool memtable_empty(memtable* mt);
+void memtable_ref(memtable* mt);
+void memtable_unref(memtable* mt);
 void memtable_free(memtable* mt);
 
 typedef struct wal_entry_header_s {
@@ -43,11 +110,16 @@ typedef struct wal_header_s {
   uint64_t seq;
 } wal_header;
 
-wal* wal_open(char* filename);
-int wal_put(wal* wl, const char* key, uint16_t key_size, const char* value, uint32_t value_size);
-int wal_delete(wal* wl, const char* key, uint16_t key_size);
+wal* wal_open(char* dir_path);
+wal* wal_create(const char* path);
+int wal_append(wal* wl, uint32_t type, slice key, slice value, uint64_t* ticket);
+int wal_sync(wal* wl, uint64_t ticket);
+int wal_flush(wal* wl);
+int wal_put(wal* wl, slice key, slice value);
+int wal_delete(wal* wl, slice key);
 void wal_close(wal* wl);
-memtable* memtable_new_dir(size_t size, char* dir_path);
-memtable* memtable_recover_from_wal(size_t size, const char* wal_path);
+memtable* memtable_new_dir(size_t expected_keys, char* dir_path);
+memtable* memtable_new_wal(size_t expected_keys, const char* wal_path);
+memtable* memtable_recover_from_wal(size_t expected_keys, const char* wal_path);
 
 #endif
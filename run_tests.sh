@@ -3,7 +3,7 @@ tests_dir="tests"
 # compile each file in the test_dir and then run each compiled binary
 for test in $(ls $tests_dir); do
   echo "compiling test: $test"
-  gcc -o $test $tests_dir/$test bloom.c utils.c memtable.c lsmt.c
+  gcc -o $test $tests_dir/$test arena.c bloom.c cskiplist.c utils.c memtable.c sstable.c compaction.c lsmt.c iterator.c write_batch.c manifest.c compress.c cache.c uring.c -pthread
 
   echo "running test: $test"
   echo "--------------------------------"
@@ -1,6 +1,7 @@
 #ifndef _SKIPLIST_H
 #define _SKIPLIST_H
 
+#include "arena.h"
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -80,6 +81,7 @@ typedef struct {
 typedef struct skiplist_s {
   int level;
   int count;
+  arena* arena; // owns the nodes if set, otherwise they are malloced one by one
   sk_link head[MAX_LEVEL];
 } skiplist;
 
@@ -90,8 +92,23 @@ typedef struct skipnode_s {
 } skipnode;
 
 static skipnode*
-skipnode_new(int level, const char* key, const char* value)
+skipnode_new(skiplist* list, int level, const char* key, const char* value)
 {
+  if (list->arena != NULL) {
+    // the node, key and value are laid out next to each other
+    size_t node_size = sizeof(skipnode) + level * sizeof(sk_link);
+    size_t key_size = strlen(key) + 1;
+    size_t value_size = strlen(value) + 1;
+    skipnode* node = arena_alloc(list->arena, node_size + key_size + value_size);
+    if (node != NULL) {
+      node->key = (char*)node + node_size;
+      node->value = node->key + key_size;
+      memcpy(node->key, key, key_size);
+      memcpy(node->value, value, value_size);
+    }
+    return node;
+  }
+
   skipnode* node = (skipnode*)malloc(sizeof(*node) + level * sizeof(sk_link));
   if (node != NULL) {
     node->key = strdup(key);
@@ -107,21 +124,27 @@ skipnode_new(int level, const char* key, const char* value)
 }
 
 static void
-skipnode_delete(skipnode* node)
+skipnode_delete(skiplist* list, skipnode* node)
 {
+  if (list->arena != NULL) {
+    return; // released with the arena
+  }
   free(node->key);
   free(node->value);
   free(node);
 }
 
+// skiplist_new_arena creates a list whose nodes are allocated from a, which
+// has to outlive the list.
 static skiplist*
-skiplist_new(void)
+skiplist_new_arena(arena* a)
 {
   int i;
   skiplist* list = (skiplist*)malloc(sizeof(*list));
   if (list != NULL) {
     list->level = 1;
     list->count = 0;
+    list->arena = a;
     for (i = 0; i < sizeof(list->head) / sizeof(list->head[0]); i++) {
       list_init(&list->head[i]);
       list->head[i].span = 0;
@@ -130,16 +153,24 @@ skiplist_new(void)
   return list;
 }
 
+static skiplist*
+skiplist_new(void)
+{
+  return skiplist_new_arena(NULL);
+}
+
 static void
 skiplist_delete(skiplist* list)
 {
   sk_link* n;
   skipnode* node;
   sk_link* pos = list->head[0].next;
-  skiplist_foreach_forward_safe(pos, n, &list->head[0])
-  {
-    node = list_entry(pos, skipnode, link[0]);
-    skipnode_delete(node);
+  if (list->arena == NULL) {
+    skiplist_foreach_forward_safe(pos, n, &list->head[0])
+    {
+      node = list_entry(pos, skipnode, link[0]);
+      skipnode_delete(list, node);
+    }
   }
   free(list);
 }
@@ -176,7 +207,7 @@ __remove(skiplist* list, skipnode* node, int level, sk_link** update)
     }
   }
 
-  skipnode_delete(node);
+  skipnode_delete(list, node);
   list->count--;
   list->level = remain_level;
 }
@@ -193,7 +224,7 @@ skiplist_insert(skiplist* list, const char* key, const char* value)
     list->level = level;
   }
 
-  skipnode* node = skipnode_new(level, key, value);
+  skipnode* node = skipnode_new(list, level, key, value);
   if (node != NULL) {
     int i = list->level - 1;
     sk_link* pos = &list->head[i];
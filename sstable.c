@@ -0,0 +1,1703 @@
+#include "sstable.h"
+#include "bloom.h"
+#include "compress.h"
+#include "memtable.h"
+#include "cskiplist.h"
+#include "uring.h"
+#include "utils.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define ENTRY_HEADER_SIZE (2 * sizeof(uint16_t) + sizeof(uint32_t) + sizeof(uint8_t))
+
+static int
+write_all(int fd, const char* buf, size_t size)
+{
+  while (size > 0) {
+    ssize_t n = write(fd, buf, size);
+    if (n <= 0) {
+      return 1;
+    }
+    buf += n;
+    size -= n;
+  }
+  return 0;
+}
+
+static int
+read_all(int fd, char* buf, size_t size, uint64_t offset)
+{
+  while (size > 0) {
+    ssize_t n = pread(fd, buf, size, offset);
+    if (n <= 0) {
+      return 1;
+    }
+    buf += n;
+    size -= n;
+    offset += n;
+  }
+  return 0;
+}
+
+static int
+buf_reserve(char** buf, size_t* cap, size_t needed)
+{
+  if (needed <= *cap) {
+    return 0;
+  }
+
+  size_t new_cap = *cap ? *cap : 64;
+  while (new_cap < needed) {
+    new_cap *= 2;
+  }
+
+  char* n = realloc(*buf, new_cap);
+  if (n == NULL) {
+    return 1;
+  }
+  *buf = n;
+  *cap = new_cap;
+  return 0;
+}
+
+sstable_writer*
+sstable_writer_new(const char* path, size_t expected_entries)
+{
+  sstable_writer* w = calloc(1, sizeof(sstable_writer));
+  if (w == NULL) {
+    return NULL;
+  }
+
+  // the table is written under a temporary name and renamed once it is
+  // complete, so a crash never leaves a half written .sst behind.
+  size_t path_len = strlen(path) + 5;
+  w->filename = strdup(path);
+  w->tmp_filename = malloc(path_len);
+  if (w->filename == NULL || w->tmp_filename == NULL) {
+    free(w->filename);
+    free(w->tmp_filename);
+    free(w);
+    return NULL;
+  }
+  snprintf(w->tmp_filename, path_len, "%s.tmp", path);
+
+  w->fd = open(w->tmp_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (w->fd < 0) {
+    free(w->filename);
+    free(w->tmp_filename);
+    free(w);
+    return NULL;
+  }
+
+  w->filter = blocked_bloom_new(expected_entries, SSTABLE_BITS_PER_KEY);
+
+  return w;
+}
+
+// writer_write_block writes buf followed by its trailer. The block is stored
+// compressed with codec unless that saves less than an eighth of its size.
+static int
+writer_write_block(sstable_writer* w, const char* buf, size_t size, compress_codec codec)
+{
+  uint8_t stored_codec = COMPRESS_NONE;
+  if (codec != COMPRESS_NONE && size <= UINT32_MAX) {
+    if (buf_reserve(&w->compressed, &w->compressed_cap, sizeof(uint32_t) + compress_bound(size)) != 0) {
+      return 1;
+    }
+    uint32_t raw_size = size;
+    memcpy(w->compressed, &raw_size, sizeof(uint32_t));
+    size_t n = sizeof(uint32_t) + compress_block(codec, buf, size, w->compressed + sizeof(uint32_t));
+    if (n < size - size / 8) {
+      buf = w->compressed;
+      size = n;
+      stored_codec = codec;
+    }
+  }
+
+  char trailer[SSTABLE_BLOCK_TRAILER_SIZE];
+  uint32_t checksum = crc32c_extend(crc32c(buf, size), &stored_codec, sizeof(stored_codec));
+  trailer[0] = stored_codec;
+  memcpy(trailer + sizeof(stored_codec), &checksum, sizeof(checksum));
+  if (write_all(w->fd, buf, size) != 0 || write_all(w->fd, trailer, sizeof(trailer)) != 0) {
+    return 1;
+  }
+  w->offset += size + SSTABLE_BLOCK_TRAILER_SIZE;
+  return 0;
+}
+
+static int
+writer_flush_block(sstable_writer* w)
+{
+  if (w->block_len == 0) {
+    return 0;
+  }
+
+  if (w->num_blocks == w->index_cap) {
+    size_t new_cap = w->index_cap ? w->index_cap * 2 : 16;
+    sstable_index_entry* n = realloc(w->index, new_cap * sizeof(sstable_index_entry));
+    if (n == NULL) {
+      return 1;
+    }
+    w->index = n;
+    w->index_cap = new_cap;
+  }
+
+  // the restart array goes after the entries
+  uint32_t num_restarts = w->num_restarts;
+  size_t restarts_size = num_restarts * sizeof(uint32_t);
+  if (buf_reserve(&w->block, &w->block_cap, w->block_len + restarts_size + sizeof(num_restarts)) != 0) {
+    return 1;
+  }
+  memcpy(w->block + w->block_len, w->restarts, restarts_size);
+  memcpy(w->block + w->block_len + restarts_size, &num_restarts, sizeof(num_restarts));
+  w->block_len += restarts_size + sizeof(num_restarts);
+
+  uint64_t offset = w->offset;
+  if (writer_write_block(w, w->block, w->block_len, w->codec) != 0) {
+    return 1;
+  }
+
+  sstable_index_entry* e = &w->index[w->num_blocks++];
+  e->last_key = slice_copy(w->last_key);
+  e->offset = offset;
+  e->size = w->offset - offset - SSTABLE_BLOCK_TRAILER_SIZE;
+
+  w->block_len = 0;
+  w->num_restarts = 0;
+  w->restart_entries = 0;
+  return e->last_key.data == NULL;
+}
+
+static int
+writer_add(sstable_writer* w, slice key, slice value, uint8_t type)
+{
+  if (key.size > UINT16_MAX || value.size > UINT32_MAX) {
+    return 1;
+  }
+  if (w->last_key.data != NULL && slice_compare(w->last_key, key) >= 0) {
+    return 1;
+  }
+
+  // the first entry of a block always starts a restart, the others only
+  // store what their key doesn't share with the previous one
+  uint16_t shared = 0;
+  if (w->block_len == 0 || w->restart_entries == SSTABLE_RESTART_INTERVAL) {
+    if (w->num_restarts == w->restarts_cap) {
+      size_t new_cap = w->restarts_cap ? w->restarts_cap * 2 : 16;
+      uint32_t* n = realloc(w->restarts, new_cap * sizeof(uint32_t));
+      if (n == NULL) {
+        return 1;
+      }
+      w->restarts = n;
+      w->restarts_cap = new_cap;
+    }
+    w->restarts[w->num_restarts++] = w->block_len;
+    w->restart_entries = 0;
+  } else {
+    while (shared < w->last_key.size && shared < key.size && w->last_key.data[shared] == key.data[shared]) {
+      shared++;
+    }
+  }
+
+  uint16_t unshared = key.size - shared;
+  uint32_t value_size = value.size;
+  size_t entry_size = ENTRY_HEADER_SIZE + unshared + value_size;
+  if (buf_reserve(&w->block, &w->block_cap, w->block_len + entry_size) != 0) {
+    return 1;
+  }
+
+  char* p = w->block + w->block_len;
+  memcpy(p, &shared, sizeof(uint16_t));
+  memcpy(p + sizeof(uint16_t), &unshared, sizeof(uint16_t));
+  memcpy(p + 2 * sizeof(uint16_t), &value_size, sizeof(uint32_t));
+  p[2 * sizeof(uint16_t) + sizeof(uint32_t)] = type;
+  memcpy(p + ENTRY_HEADER_SIZE, key.data + shared, unshared);
+  memcpy(p + ENTRY_HEADER_SIZE + unshared, value.data, value_size);
+  w->block_len += entry_size;
+  w->restart_entries++;
+
+  slice_free(w->last_key);
+  w->last_key = slice_copy(key);
+  if (w->last_key.data == NULL) {
+    return 1;
+  }
+
+  blocked_bloom_put(w->filter, key.data, key.size);
+  w->num_entries++;
+
+  if (w->block_len >= SSTABLE_BLOCK_SIZE) {
+    return writer_flush_block(w);
+  }
+  return 0;
+}
+
+// sstable_writer_add appends an entry to the table, keys need to be added in
+// a strictly increasing order.
+int
+sstable_writer_add(sstable_writer* w, slice key, slice value)
+{
+  return writer_add(w, key, value, SSTABLE_ENTRY_VALUE);
+}
+
+// sstable_writer_delete appends a deletion of key, in the same order as the
+// entries.
+int
+sstable_writer_delete(sstable_writer* w, slice key)
+{
+  return writer_add(w, key, slice_new("", 0), SSTABLE_ENTRY_DELETION);
+}
+
+// sstable_writer_delete_range records a deletion of the keys in [start, end)
+// of older tables. Ranges can be added in any order and may overlap, they're
+// merged when the table is finished.
+int
+sstable_writer_delete_range(sstable_writer* w, slice start, slice end)
+{
+  if (start.size > UINT16_MAX || end.size > UINT16_MAX) {
+    return 1;
+  }
+  if (slice_compare(start, end) >= 0) {
+    return 0;
+  }
+
+  if (w->num_range_dels == w->range_dels_cap) {
+    size_t new_cap = w->range_dels_cap ? w->range_dels_cap * 2 : 4;
+    range_del* n = realloc(w->range_dels, new_cap * sizeof(range_del));
+    if (n == NULL) {
+      return 1;
+    }
+    w->range_dels = n;
+    w->range_dels_cap = new_cap;
+  }
+  range_del* d = &w->range_dels[w->num_range_dels];
+  d->start = slice_copy(start);
+  d->end = slice_copy(end);
+  if (d->start.data == NULL || d->end.data == NULL) {
+    slice_free(d->start);
+    slice_free(d->end);
+    return 1;
+  }
+  w->num_range_dels++;
+  return 0;
+}
+
+static void
+writer_free(sstable_writer* w)
+{
+  for (size_t i = 0; i < w->num_blocks; i++) {
+    slice_free(w->index[i].last_key);
+  }
+  free(w->index);
+  free(w->block);
+  free(w->compressed);
+  free(w->restarts);
+  for (size_t i = 0; i < w->num_range_dels; i++) {
+    slice_free(w->range_dels[i].start);
+    slice_free(w->range_dels[i].end);
+  }
+  free(w->range_dels);
+  slice_free(w->last_key);
+  blocked_bloom_free(w->filter);
+  free(w->filename);
+  free(w->tmp_filename);
+  free(w);
+}
+
+static int
+writer_write_meta(sstable_writer* w)
+{
+  sstable_footer footer = {
+    .num_entries = w->num_entries,
+    .max_seq = w->max_seq,
+    .version = SSTABLE_VERSION,
+    .level = w->level,
+    .magic = SSTABLE_MAGIC,
+  };
+
+  footer.filter_offset = w->offset;
+  footer.filter_size = blocked_bloom_encoded_size(w->filter);
+  char* filter_buf = malloc(footer.filter_size);
+  if (filter_buf == NULL) {
+    return 1;
+  }
+  blocked_bloom_encode(w->filter, filter_buf);
+  int res = writer_write_block(w, filter_buf, footer.filter_size, COMPRESS_NONE);
+  free(filter_buf);
+  if (res != 0) {
+    return 1;
+  }
+
+  // the data block buffer is reused for the range deletion and index blocks,
+  // the ranges are merged in a shallow copy that points into the owned ones
+  range_del* dels = malloc((w->num_range_dels + 1) * sizeof(range_del));
+  if (dels == NULL) {
+    return 1;
+  }
+  if (w->num_range_dels > 0) {
+    memcpy(dels, w->range_dels, w->num_range_dels * sizeof(range_del));
+  }
+  size_t num_dels = range_dels_merge(dels, w->num_range_dels);
+  w->block_len = 0;
+  for (size_t i = 0; i < num_dels; i++) {
+    uint16_t start_size = dels[i].start.size, end_size = dels[i].end.size;
+    size_t size = 2 * sizeof(uint16_t) + start_size + end_size;
+    if (buf_reserve(&w->block, &w->block_cap, w->block_len + size) != 0) {
+      free(dels);
+      return 1;
+    }
+
+    char* p = w->block + w->block_len;
+    memcpy(p, &start_size, sizeof(uint16_t));
+    p += sizeof(uint16_t);
+    memcpy(p, dels[i].start.data, start_size);
+    p += start_size;
+    memcpy(p, &end_size, sizeof(uint16_t));
+    p += sizeof(uint16_t);
+    memcpy(p, dels[i].end.data, end_size);
+    w->block_len += size;
+  }
+  free(dels);
+
+  footer.range_del_offset = w->offset;
+  footer.range_del_size = w->block_len;
+  if (writer_write_block(w, w->block, w->block_len, COMPRESS_NONE) != 0) {
+    return 1;
+  }
+
+  w->block_len = 0;
+  for (size_t i = 0; i < w->num_blocks; i++) {
+    sstable_index_entry* e = &w->index[i];
+    uint16_t key_size = e->last_key.size;
+    size_t size = sizeof(uint16_t) + key_size + sizeof(uint64_t) + sizeof(uint32_t);
+    if (buf_reserve(&w->block, &w->block_cap, w->block_len + size) != 0) {
+      return 1;
+    }
+
+    char* p = w->block + w->block_len;
+    memcpy(p, &key_size, sizeof(uint16_t));
+    p += sizeof(uint16_t);
+    memcpy(p, e->last_key.data, key_size);
+    p += key_size;
+    memcpy(p, &e->offset, sizeof(uint64_t));
+    p += sizeof(uint64_t);
+    memcpy(p, &e->size, sizeof(uint32_t));
+    w->block_len += size;
+  }
+
+  footer.index_offset = w->offset;
+  footer.index_size = w->block_len;
+  if (writer_write_block(w, w->block, w->block_len, COMPRESS_NONE) != 0) {
+    return 1;
+  }
+
+  return write_all(w->fd, (const char*)&footer, sizeof(footer));
+}
+
+// sstable_writer_size returns the amount of bytes written so far, including
+// the block that is still buffered.
+uint64_t
+sstable_writer_size(sstable_writer* w)
+{
+  return w->offset + w->block_len;
+}
+
+// sstable_writer_finish writes the remaining data together with the filter,
+// index and footer. The table is synced to disk and moved to its final name.
+// The writer is freed in both the success and the failure case.
+int
+sstable_writer_finish(sstable_writer* w)
+{
+  if (writer_flush_block(w) != 0 || writer_write_meta(w) != 0 || fsync(w->fd) != 0) {
+    sstable_writer_abandon(w);
+    return 1;
+  }
+
+  close(w->fd);
+  if (rename(w->tmp_filename, w->filename) != 0) {
+    unlink(w->tmp_filename);
+    writer_free(w);
+    return 1;
+  }
+
+  writer_free(w);
+  return 0;
+}
+
+// sstable_writer_abandon removes the partially written table.
+void
+sstable_writer_abandon(sstable_writer* w)
+{
+  close(w->fd);
+  unlink(w->tmp_filename);
+  writer_free(w);
+}
+
+// sstable_flush_memtable writes the contents of a frozen memtable into a new
+// table at path, its data blocks are compressed with codec. The skiplist's
+// level 0 links already hold every node in sorted order, so the table is built
+// by a single walk over them. Deletions are kept to hide older tables, entries
+// a newer range deletion of the memtable covers are dropped.
+int
+sstable_flush_memtable(memtable* mt, const char* path, compress_codec codec)
+{
+  sstable_writer* w = sstable_writer_new(path, cskiplist_count(mt->skiplist));
+  if (w == NULL) {
+    return 1;
+  }
+  w->max_seq = mt->max_seq;
+  w->codec = codec;
+
+  for (csk_node* node = cskiplist_first(mt->skiplist); node != NULL; node = cskiplist_next(node)) {
+    csk_value* v = csk_node_value(node);
+    slice key = slice_new(node->key, node->key_size);
+    if (memtable_range_seq(mt, key, MEMTABLE_SEQ_MAX) > v->seq) {
+      continue;
+    }
+    int res = v->deleted ? sstable_writer_delete(w, key) : sstable_writer_add(w, key, slice_new(v->data, v->size));
+    if (res != 0) {
+      sstable_writer_abandon(w);
+      return 1;
+    }
+  }
+
+  for (mem_range_del* d = memtable_range_dels(mt); d != NULL; d = d->next) {
+    if (sstable_writer_delete_range(w, d->start, d->end) != 0) {
+      sstable_writer_abandon(w);
+      return 1;
+    }
+  }
+  return sstable_writer_finish(w);
+}
+
+// parse_index decodes the index block into a single allocation of the
+// entries followed by their keys, its size is set in alloc_size.
+static int
+parse_index(const char* buf, size_t size, sstable_index_entry** index, size_t* num_blocks, size_t* alloc_size)
+{
+  // the first pass validates the block and sizes the allocation
+  size_t n = 0, keys_size = 0;
+  const char* p = buf;
+  const char* end = buf + size;
+  while (p < end) {
+    uint16_t key_size;
+    if ((size_t)(end - p) < sizeof(uint16_t)) {
+      return 1;
+    }
+    memcpy(&key_size, p, sizeof(uint16_t));
+    p += sizeof(uint16_t);
+    if ((size_t)(end - p) < key_size + sizeof(uint64_t) + sizeof(uint32_t)) {
+      return 1;
+    }
+    p += key_size + sizeof(uint64_t) + sizeof(uint32_t);
+    n++;
+    keys_size += key_size + 1;
+  }
+
+  *alloc_size = n * sizeof(sstable_index_entry) + keys_size + 1;
+  *index = malloc(*alloc_size);
+  if (*index == NULL) {
+    return 1;
+  }
+  char* keys = (char*)(*index + n);
+  p = buf;
+  for (size_t i = 0; i < n; i++) {
+    uint16_t key_size;
+    memcpy(&key_size, p, sizeof(uint16_t));
+    p += sizeof(uint16_t);
+
+    sstable_index_entry* e = &(*index)[i];
+    memcpy(keys, p, key_size);
+    keys[key_size] = '\0';
+    e->last_key = slice_new(keys, key_size);
+    keys += key_size + 1;
+    p += key_size;
+    memcpy(&e->offset, p, sizeof(uint64_t));
+    p += sizeof(uint64_t);
+    memcpy(&e->size, p, sizeof(uint32_t));
+    p += sizeof(uint32_t);
+  }
+  *num_blocks = n;
+  return 0;
+}
+
+static int
+range_del_compare(const void* a, const void* b)
+{
+  return slice_compare(((const range_del*)a)->start, ((const range_del*)b)->start);
+}
+
+// range_dels_merge sorts the ranges by their start and merges the ones that
+// overlap or touch, so every key is covered by at most one of them. The
+// slices are moved around but never copied or freed. Returns the number of
+// ranges left.
+size_t
+range_dels_merge(range_del* dels, size_t n)
+{
+  if (n == 0) {
+    return 0;
+  }
+
+  qsort(dels, n, sizeof(range_del), range_del_compare);
+  size_t out = 0;
+  for (size_t i = 1; i < n; i++) {
+    if (slice_compare(dels[i].start, dels[out].end) <= 0) {
+      if (slice_compare(dels[i].end, dels[out].end) > 0) {
+        dels[out].end = dels[i].end;
+      }
+    } else {
+      dels[++out] = dels[i];
+    }
+  }
+  return out + 1;
+}
+
+// range_dels_cover tells if key is in one of the sorted and disjoint ranges.
+bool
+range_dels_cover(const range_del* dels, size_t n, slice key)
+{
+  // the last range that starts at or before key is the only candidate
+  size_t lo = 0, hi = n;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (slice_compare(dels[mid].start, key) <= 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo > 0 && slice_compare(key, dels[lo - 1].end) < 0;
+}
+
+// parse_range_dels decodes the range deletion block, the ranges have to be
+// sorted and disjoint.
+static int
+parse_range_dels(sstable* sst, const char* buf, size_t size)
+{
+  const char* p = buf;
+  const char* end = buf + size;
+  size_t cap = 0;
+  while (p < end) {
+    slice bounds[2];
+    for (int i = 0; i < 2; i++) {
+      uint16_t n;
+      if ((size_t)(end - p) < sizeof(uint16_t)) {
+        return 1;
+      }
+      memcpy(&n, p, sizeof(uint16_t));
+      p += sizeof(uint16_t);
+      if (end - p < n) {
+        return 1;
+      }
+      bounds[i] = slice_new(p, n);
+      p += n;
+    }
+    if (slice_compare(bounds[0], bounds[1]) >= 0 ||
+        (sst->num_range_dels > 0 && slice_compare(sst->range_dels[sst->num_range_dels - 1].end, bounds[0]) >= 0)) {
+      return 1;
+    }
+
+    if (sst->num_range_dels == cap) {
+      cap = cap ? cap * 2 : 4;
+      range_del* n = realloc(sst->range_dels, cap * sizeof(range_del));
+      if (n == NULL) {
+        return 1;
+      }
+      sst->range_dels = n;
+    }
+    range_del* d = &sst->range_dels[sst->num_range_dels];
+    d->start = slice_copy(bounds[0]);
+    d->end = slice_copy(bounds[1]);
+    if (d->start.data == NULL || d->end.data == NULL) {
+      slice_free(d->start);
+      slice_free(d->end);
+      return 1;
+    }
+    sst->num_range_dels++;
+  }
+  return 0;
+}
+
+// read_at copies size bytes at offset of the table, from its mapping if it
+// has one.
+static int
+read_at(sstable* sst, char* buf, size_t size, uint64_t offset)
+{
+  if (sst->map == NULL) {
+    return read_all(sst->fd, buf, size, offset);
+  }
+  if (offset > sst->file_size || sst->file_size - offset < size) {
+    return 1;
+  }
+  memcpy(buf, sst->map + offset, size);
+  return 0;
+}
+
+// decode_block checks the stored block at p, followed by its trailer,
+// against its checksum and decompresses it if needed. buf is the malloc'd
+// buffer p points into, b takes it over, or NULL if p points into the
+// mapping of the table.
+static int
+decode_block(sstable* sst, uint64_t offset, const char* p, size_t size, char* buf, sstable_block* b)
+{
+  b->handle = NULL;
+  b->owned = false;
+  uint8_t codec = p[size];
+  uint32_t checksum;
+  memcpy(&checksum, p + size + sizeof(codec), sizeof(checksum));
+  if (crc32c_extend(crc32c(p, size), &codec, sizeof(codec)) != checksum) {
+    fprintf(stderr, "%s: bad checksum for block at %llu\n", sst->filename, (unsigned long long)offset);
+    free(buf);
+    return 1;
+  }
+
+  if (codec == COMPRESS_NONE) {
+    b->data = buf != NULL ? buf : (char*)p;
+    b->size = size;
+    b->owned = buf != NULL;
+    return 0;
+  }
+
+  uint32_t n;
+  if (size < sizeof(n) || (codec != COMPRESS_FAST && codec != COMPRESS_HIGH)) {
+    fprintf(stderr, "%s: bad block at %llu\n", sst->filename, (unsigned long long)offset);
+    free(buf);
+    return 1;
+  }
+  memcpy(&n, p, sizeof(n));
+  char* raw = malloc(n > 0 ? n : 1);
+  if (raw == NULL) {
+    free(buf);
+    return 1;
+  }
+  if (decompress_block(p + sizeof(n), size - sizeof(n), raw, n) != 0) {
+    fprintf(stderr, "%s: bad block at %llu\n", sst->filename, (unsigned long long)offset);
+    free(raw);
+    free(buf);
+    return 1;
+  }
+  free(buf);
+  b->data = raw;
+  b->size = n;
+  b->owned = true;
+  return 0;
+}
+
+// read_block reads the block at offset and decodes it. An uncompressed
+// block of a mapped table points into the mapping, otherwise it's read into
+// a new buffer that b owns.
+static int
+read_block(sstable* sst, uint64_t offset, size_t size, sstable_block* b)
+{
+  if (offset > sst->file_size || sst->file_size - offset < size + SSTABLE_BLOCK_TRAILER_SIZE) {
+    return 1;
+  }
+  if (sst->map != NULL) {
+    return decode_block(sst, offset, sst->map + offset, size, NULL, b);
+  }
+
+  char* buf = malloc(size + SSTABLE_BLOCK_TRAILER_SIZE);
+  if (buf == NULL || read_all(sst->fd, buf, size + SSTABLE_BLOCK_TRAILER_SIZE, offset) != 0) {
+    free(buf);
+    return 1;
+  }
+  return decode_block(sst, offset, buf, size, buf, b);
+}
+
+static void
+release_block(sstable_block* b)
+{
+  if (b->handle != NULL) {
+    block_cache_release(b->handle);
+  } else if (b->owned) {
+    free(b->data);
+  }
+  b->data = NULL;
+  b->handle = NULL;
+  b->owned = false;
+}
+
+static int
+read_index(sstable* sst, sstable_index_entry** index, size_t* num_blocks, size_t* alloc_size)
+{
+  sstable_block b;
+  if (read_block(sst, sst->index_offset, sst->index_size, &b) != 0) {
+    return 1;
+  }
+  int res = parse_index(b.data, b.size, index, num_blocks, alloc_size);
+  release_block(&b);
+  return res;
+}
+
+static blocked_bloom*
+read_filter(sstable* sst)
+{
+  sstable_block b;
+  if (read_block(sst, sst->filter_offset, sst->filter_size, &b) != 0) {
+    return NULL;
+  }
+  blocked_bloom* filter = blocked_bloom_decode(b.data, b.size);
+  release_block(&b);
+  return filter;
+}
+
+// table_index returns the index of the table. If it's kept in the cache h is
+// set to the handle pinning it until release_meta, and the index is read
+// again if it was evicted. Returns NULL if that fails.
+static sstable_index_entry*
+table_index(sstable* sst, block_cache_handle** h)
+{
+  *h = NULL;
+  if (sst->index != NULL) {
+    return sst->index;
+  }
+  *h = block_cache_lookup(sst->cache, sst->cache_id, sst->index_offset);
+  if (*h == NULL) {
+    sstable_index_entry* index;
+    size_t num_blocks, size;
+    if (read_index(sst, &index, &num_blocks, &size) != 0) {
+      return NULL;
+    }
+    if (num_blocks != sst->num_blocks) {
+      free(index);
+      return NULL;
+    }
+    *h = block_cache_insert(sst->cache, sst->cache_id, sst->index_offset, (char*)index, size, true);
+    if (*h == NULL) {
+      free(index);
+      return NULL;
+    }
+  }
+  return (sstable_index_entry*)(*h)->data;
+}
+
+// table_filter sets filter to the filter of the table, the same way
+// table_index returns the index.
+static int
+table_filter(sstable* sst, blocked_bloom* filter, block_cache_handle** h)
+{
+  *h = NULL;
+  if (sst->filter != NULL) {
+    *filter = *sst->filter;
+    return 0;
+  }
+  *h = block_cache_lookup(sst->cache, sst->cache_id, sst->filter_offset);
+  if (*h == NULL) {
+    blocked_bloom* f = read_filter(sst);
+    if (f == NULL) {
+      return 1;
+    }
+    *h = block_cache_insert(sst->cache, sst->cache_id, sst->filter_offset, (char*)f->blocks,
+        f->num_blocks * BLOCKED_BLOOM_BLOCK_SIZE, true);
+    if (*h == NULL) {
+      blocked_bloom_free(f);
+      return 1;
+    }
+    // the blocks belong to the cache now
+    free(f);
+  }
+  *filter = (blocked_bloom){ (uint64_t*)(*h)->data, (*h)->size / BLOCKED_BLOOM_BLOCK_SIZE, 0 };
+  return 0;
+}
+
+static void
+release_meta(block_cache_handle* h)
+{
+  if (h != NULL) {
+    block_cache_release(h);
+  }
+}
+
+// block_restarts locates the restart array at the end of a data block, size
+// is set to where the entries end.
+static int
+block_restarts(const char* block, size_t* size, const char** restarts, uint32_t* num_restarts)
+{
+  uint32_t n;
+  if (*size < sizeof(n)) {
+    return 1;
+  }
+  memcpy(&n, block + *size - sizeof(n), sizeof(n));
+  if (n == 0 || n > (*size - sizeof(n)) / sizeof(uint32_t)) {
+    return 1;
+  }
+  *size -= sizeof(n) + n * sizeof(uint32_t);
+  *restarts = block + *size;
+  *num_restarts = n;
+  return 0;
+}
+
+static uint32_t
+restart_offset(const char* restarts, uint32_t i)
+{
+  uint32_t offset;
+  memcpy(&offset, restarts + i * sizeof(uint32_t), sizeof(offset));
+  return offset;
+}
+
+// restart_key points key at the key of the entry at a restart, which is
+// stored whole.
+static int
+restart_key(const char* block, size_t size, uint32_t offset, slice* key)
+{
+  uint16_t shared, unshared;
+  if (offset > size || size - offset < ENTRY_HEADER_SIZE) {
+    return 1;
+  }
+  memcpy(&shared, block + offset, sizeof(uint16_t));
+  memcpy(&unshared, block + offset + sizeof(uint16_t), sizeof(uint16_t));
+  if (shared != 0 || size - offset - ENTRY_HEADER_SIZE < unshared) {
+    return 1;
+  }
+  *key = slice_new(block + offset + ENTRY_HEADER_SIZE, unshared);
+  return 0;
+}
+
+// find_restart sets idx to the last restart with a key smaller than key, or
+// to the first one if there is none. The entries from there on are the only
+// ones that need to be scanned for key.
+static int
+find_restart(const char* block, size_t size, const char* restarts, uint32_t num_restarts, slice key,
+    uint32_t* idx)
+{
+  uint32_t lo = 0, hi = num_restarts - 1;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo + 1) / 2;
+    slice k;
+    if (restart_key(block, size, restart_offset(restarts, mid), &k) != 0) {
+      return 1;
+    }
+    if (slice_compare(k, key) < 0) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  *idx = lo;
+  return 0;
+}
+
+// decode_entry decodes the entry at offset of a block whose entries end at
+// size. key_buf holds the previous key of key_size bytes and is replaced by
+// the entry's key, deleted is set for a deletion. Returns the offset of the
+// next entry, or 0 if the entry is corrupt.
+static size_t
+decode_entry(const char* block, size_t size, size_t offset, char** key_buf, size_t* key_cap,
+    uint16_t* key_size, const char** value, uint32_t* value_size, bool* deleted)
+{
+  uint16_t shared, unshared;
+  if (offset > size || size - offset < ENTRY_HEADER_SIZE) {
+    return 0;
+  }
+  const char* p = block + offset;
+  memcpy(&shared, p, sizeof(uint16_t));
+  memcpy(&unshared, p + sizeof(uint16_t), sizeof(uint16_t));
+  memcpy(value_size, p + 2 * sizeof(uint16_t), sizeof(uint32_t));
+  uint8_t type = p[2 * sizeof(uint16_t) + sizeof(uint32_t)];
+  p += ENTRY_HEADER_SIZE;
+  if (shared > *key_size || (size_t)shared + unshared > UINT16_MAX ||
+      (type != SSTABLE_ENTRY_VALUE && type != SSTABLE_ENTRY_DELETION) ||
+      size - offset - ENTRY_HEADER_SIZE < (size_t)unshared + *value_size) {
+    return 0;
+  }
+  if (buf_reserve(key_buf, key_cap, (size_t)shared + unshared + 1) != 0) {
+    return 0;
+  }
+
+  memcpy(*key_buf + shared, p, unshared);
+  *key_size = shared + unshared;
+  *value = p + unshared;
+  *deleted = type == SSTABLE_ENTRY_DELETION;
+  return offset + ENTRY_HEADER_SIZE + unshared + *value_size;
+}
+
+// sstable_open loads the footer, index and filter of the table at path. The
+// data blocks stay on disk and are read on demand, through cache unless it's
+// NULL. With use_mmap the file is mapped and blocks are read from the
+// mapping instead, uncompressed ones without a copy.
+sstable*
+sstable_open(const char* path, uint64_t file_num, block_cache* cache, bool use_mmap)
+{
+  sstable* sst = calloc(1, sizeof(sstable));
+  if (sst == NULL) {
+    return NULL;
+  }
+
+  sst->file_num = file_num;
+  sst->cache = cache;
+  if (cache != NULL) {
+    sst->cache_id = block_cache_new_id(cache);
+  }
+  sst->refs = 1;
+  sst->filename = strdup(path);
+  sst->fd = open(path, O_RDONLY);
+  if (sst->filename == NULL || sst->fd < 0) {
+    sstable_close(sst);
+    return NULL;
+  }
+
+  struct stat st;
+  sstable_footer footer;
+  if (fstat(sst->fd, &st) != 0 || (size_t)st.st_size < sizeof(footer)) {
+    sstable_close(sst);
+    return NULL;
+  }
+  sst->file_size = st.st_size;
+
+  if (use_mmap) {
+    void* map = mmap(NULL, sst->file_size, PROT_READ, MAP_SHARED, sst->fd, 0);
+    if (map == MAP_FAILED) {
+      sstable_close(sst);
+      return NULL;
+    }
+    // lookups touch a block here and there, scans ask for readahead
+    // themselves
+    madvise(map, sst->file_size, MADV_RANDOM);
+    sst->map = map;
+  }
+
+  if (read_at(sst, (char*)&footer, sizeof(footer), sst->file_size - sizeof(footer)) != 0 ||
+      footer.magic != SSTABLE_MAGIC || footer.version != SSTABLE_VERSION ||
+      footer.index_offset + footer.index_size + SSTABLE_BLOCK_TRAILER_SIZE > sst->file_size ||
+      footer.filter_offset + footer.filter_size + SSTABLE_BLOCK_TRAILER_SIZE > sst->file_size ||
+      footer.range_del_offset + footer.range_del_size + SSTABLE_BLOCK_TRAILER_SIZE > sst->file_size) {
+    sstable_close(sst);
+    return NULL;
+  }
+  sst->num_entries = footer.num_entries;
+  sst->max_seq = footer.max_seq;
+  sst->level = footer.level;
+  sst->index_offset = footer.index_offset;
+  sst->index_size = footer.index_size;
+  sst->filter_offset = footer.filter_offset;
+  sst->filter_size = footer.filter_size;
+
+  sstable_block b;
+  size_t index_size;
+  sst->filter = read_filter(sst);
+  if (sst->filter == NULL || read_block(sst, footer.range_del_offset, footer.range_del_size, &b) != 0) {
+    sstable_close(sst);
+    return NULL;
+  }
+  int res = parse_range_dels(sst, b.data, b.size);
+  release_block(&b);
+  if (res != 0 || read_index(sst, &sst->index, &sst->num_blocks, &index_size) != 0) {
+    sstable_close(sst);
+    return NULL;
+  }
+
+  slice smallest = slice_new(NULL, 0);
+  slice largest = slice_new(NULL, 0);
+  sstable_block first_block = { 0 };
+  if (sst->num_blocks > 0) {
+    // the first key of the table is the first entry of the first block
+    size_t size;
+    const char* restarts;
+    uint32_t num_restarts;
+    if (read_block(sst, sst->index[0].offset, sst->index[0].size, &first_block) != 0) {
+      sstable_close(sst);
+      return NULL;
+    }
+    size = first_block.size;
+    if (block_restarts(first_block.data, &size, &restarts, &num_restarts) != 0 ||
+        restart_key(first_block.data, size, 0, &smallest) != 0) {
+      release_block(&first_block);
+      sstable_close(sst);
+      return NULL;
+    }
+    largest = sst->index[sst->num_blocks - 1].last_key;
+  }
+
+  // the bounds cover the ranges too, a table can hold nothing but ranges
+  if (sst->num_range_dels > 0) {
+    slice start = sst->range_dels[0].start;
+    slice end = sst->range_dels[sst->num_range_dels - 1].end;
+    if (smallest.data == NULL || slice_compare(start, smallest) < 0) {
+      smallest = start;
+    }
+    if (largest.data == NULL || slice_compare(end, largest) > 0) {
+      largest = end;
+    }
+  }
+
+  if (smallest.data != NULL) {
+    sst->smallest = slice_copy(smallest);
+    sst->largest = slice_copy(largest);
+  }
+  release_block(&first_block);
+  if (smallest.data != NULL && (sst->smallest.data == NULL || sst->largest.data == NULL)) {
+    sstable_close(sst);
+    return NULL;
+  }
+
+  // with a cache the index and filter are kept in it at high priority, so
+  // they count against its budget, and can be evicted like any other block
+  if (cache != NULL) {
+    block_cache_handle* h = block_cache_insert(cache, sst->cache_id, sst->index_offset, (char*)sst->index,
+        index_size, true);
+    if (h != NULL) {
+      block_cache_release(h);
+      sst->index = NULL;
+    }
+    h = block_cache_insert(cache, sst->cache_id, sst->filter_offset, (char*)sst->filter->blocks,
+        sst->filter->num_blocks * BLOCKED_BLOOM_BLOCK_SIZE, true);
+    if (h != NULL) {
+      block_cache_release(h);
+      free(sst->filter);
+      sst->filter = NULL;
+    }
+  }
+
+  return sst;
+}
+
+// find_block returns the first block that could hold key, or -1 if the key is
+// larger than every key in the table.
+static ssize_t
+find_block(const sstable_index_entry* index, size_t num_blocks, slice key)
+{
+  size_t lo = 0, hi = num_blocks;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (slice_compare(index[mid].last_key, key) < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  return lo == num_blocks ? -1 : (ssize_t)lo;
+}
+
+// block_search looks for key in a data block, value points into the block on
+// a hit. Returns SSTABLE_DELETED if the entry is a deletion. Only the entries
+// after the restart found by find_restart are decoded.
+static sstable_res
+block_search(const char* block, size_t size, slice key, slice* value)
+{
+  const char* restarts;
+  uint32_t num_restarts, idx;
+  if (block_restarts(block, &size, &restarts, &num_restarts) != 0 ||
+      find_restart(block, size, restarts, num_restarts, key, &idx) != 0) {
+    return SSTABLE_FAILED;
+  }
+
+  char* key_buf = NULL;
+  size_t key_cap = 0;
+  uint16_t key_size = 0;
+  size_t offset = restart_offset(restarts, idx);
+  sstable_res res = SSTABLE_NOT_FOUND;
+  while (offset < size) {
+    const char* v;
+    uint32_t value_size;
+    bool deleted;
+    offset = decode_entry(block, size, offset, &key_buf, &key_cap, &key_size, &v, &value_size, &deleted);
+    if (offset == 0) {
+      res = SSTABLE_FAILED;
+      break;
+    }
+
+    int cmp = key_compare(key_buf, key_size, key.data, key.size);
+    if (cmp == 0) {
+      *value = slice_new(v, value_size);
+      res = deleted ? SSTABLE_DELETED : SSTABLE_OK;
+      break;
+    }
+    if (cmp > 0) {
+      break;
+    }
+  }
+  free(key_buf);
+  return res;
+}
+
+// load_blocks gets the data blocks idxs[0..n) into blocks, from the cache
+// where it has them. The others are read in one batch so their reads are in
+// flight together, and added to the cache if fill_cache is set.
+// Uncompressed blocks of a mapped table are used in place and never cached.
+// A block that couldn't be loaded has its data set to NULL, returns 1 if
+// any of them failed.
+static int
+load_blocks(sstable* sst, const sstable_index_entry* index, const size_t* idxs, size_t n, bool fill_cache,
+    sstable_block* blocks)
+{
+  for (size_t i = 0; i < n; i++) {
+    blocks[i] = (sstable_block) { 0 };
+  }
+
+  // a point lookup reads a single block, it doesn't need the arrays on the
+  // heap
+  io_read one_read;
+  size_t one_pending;
+  io_read* reads = &one_read;
+  size_t* pending = &one_pending; // positions in blocks of the reads
+  if (n > 1 && sst->map == NULL) {
+    reads = malloc(n * sizeof(io_read));
+    pending = malloc(n * sizeof(size_t));
+    if (reads == NULL || pending == NULL) {
+      free(reads);
+      free(pending);
+      return 1;
+    }
+  }
+
+  size_t num_reads = 0;
+  int res = 0;
+  for (size_t i = 0; i < n; i++) {
+    const sstable_index_entry* e = &index[idxs[i]];
+    sstable_block* b = &blocks[i];
+    if (e->offset > sst->file_size || sst->file_size - e->offset < e->size + SSTABLE_BLOCK_TRAILER_SIZE) {
+      res = 1;
+      continue;
+    }
+    if (sst->map != NULL && sst->map[e->offset + e->size] == COMPRESS_NONE) {
+      res |= read_block(sst, e->offset, e->size, b);
+      continue;
+    }
+
+    if (sst->cache != NULL) {
+      b->handle = block_cache_lookup(sst->cache, sst->cache_id, e->offset);
+      if (b->handle != NULL) {
+        b->data = b->handle->data;
+        b->size = b->handle->size;
+        continue;
+      }
+    }
+    if (sst->map != NULL) {
+      res |= read_block(sst, e->offset, e->size, b);
+      continue;
+    }
+
+    char* buf = malloc(e->size + SSTABLE_BLOCK_TRAILER_SIZE);
+    if (buf == NULL) {
+      res = 1;
+      continue;
+    }
+    reads[num_reads] = (io_read) { sst->fd, e->offset, buf, e->size + SSTABLE_BLOCK_TRAILER_SIZE, 0 };
+    pending[num_reads++] = i;
+  }
+
+  if (num_reads > 0) {
+    io_read_batch(reads, num_reads);
+  }
+  for (size_t r = 0; r < num_reads; r++) {
+    sstable_block* b = &blocks[pending[r]];
+    const sstable_index_entry* e = &index[idxs[pending[r]]];
+    if (reads[r].done != reads[r].size) {
+      free(reads[r].buf);
+      res = 1;
+      continue;
+    }
+    if (decode_block(sst, e->offset, reads[r].buf, e->size, reads[r].buf, b) != 0) {
+      b->data = NULL;
+      res = 1;
+    }
+  }
+  if (reads != &one_read) {
+    free(reads);
+    free(pending);
+  }
+
+  for (size_t i = 0; fill_cache && sst->cache != NULL && i < n; i++) {
+    sstable_block* b = &blocks[i];
+    if (b->owned) {
+      b->handle = block_cache_insert(sst->cache, sst->cache_id, index[idxs[i]].offset, b->data, b->size, false);
+      if (b->handle != NULL) {
+        b->data = b->handle->data;
+        b->owned = false;
+      }
+    }
+  }
+  return res;
+}
+
+static int
+load_block(sstable* sst, const sstable_index_entry* index, size_t idx, bool fill_cache, sstable_block* b)
+{
+  return load_blocks(sst, index, &idx, 1, fill_cache, b);
+}
+
+static void
+release_pinned_block(void* arg)
+{
+  block_cache_release(arg);
+}
+
+static void
+release_pinned_table(void* arg)
+{
+  sstable_unref(arg);
+}
+
+// sstable_range_deleted tells if key is in one of the table's range
+// deletions, which hide it in older tables.
+bool
+sstable_range_deleted(sstable* sst, slice key)
+{
+  return range_dels_cover(sst->range_dels, sst->num_range_dels, key);
+}
+
+// table_lookup searches the block that could hold key. On a hit block is set
+// to the block value points into, the caller releases it with release_block.
+// Entries of the table are newer than its range deletions, so the ranges
+// only count when the key has none.
+static sstable_res
+table_lookup(sstable* sst, slice key, sstable_block* block, slice* value)
+{
+  sstable_res not_found = sstable_range_deleted(sst, key) ? SSTABLE_DELETED : SSTABLE_NOT_FOUND;
+  blocked_bloom filter;
+  block_cache_handle* meta;
+  if (table_filter(sst, &filter, &meta) != 0) {
+    return SSTABLE_FAILED;
+  }
+  bool maybe = blocked_bloom_test(&filter, key.data, key.size);
+  release_meta(meta);
+  if (!maybe) {
+    return not_found;
+  }
+
+  sstable_index_entry* index = table_index(sst, &meta);
+  if (index == NULL) {
+    return SSTABLE_FAILED;
+  }
+  ssize_t idx = find_block(index, sst->num_blocks, key);
+  sstable_block b;
+  int loaded = idx < 0 ? 1 : load_block(sst, index, idx, true, &b);
+  release_meta(meta);
+  if (idx < 0) {
+    return not_found;
+  }
+  if (loaded != 0) {
+    return SSTABLE_FAILED;
+  }
+
+  sstable_res res = block_search(b.data, b.size, key, value);
+  if (res == SSTABLE_NOT_FOUND) {
+    res = not_found;
+  }
+  if (res == SSTABLE_OK) {
+    *block = b;
+  } else {
+    release_block(&b);
+  }
+  return res;
+}
+
+// sstable_get sets value to a copy of the value stored for key, the caller
+// frees it with slice_free.
+sstable_res
+sstable_get(sstable* sst, slice key, slice* value)
+{
+  sstable_block block;
+  slice v;
+  sstable_res res = table_lookup(sst, key, &block, &v);
+  if (res != SSTABLE_OK) {
+    return res;
+  }
+
+  *value = slice_copy(v);
+  release_block(&block);
+  return value->data != NULL ? SSTABLE_OK : SSTABLE_FAILED;
+}
+
+// sstable_get_pinned points value into the block it was read from without a
+// copy. The pin holds the block's cache handle, the block itself if it isn't
+// cached, or a reference to the table if the block is in its mapping.
+sstable_res
+sstable_get_pinned(sstable* sst, slice key, pinned_slice* value)
+{
+  sstable_block block;
+  sstable_res res = table_lookup(sst, key, &block, &value->value);
+  if (res != SSTABLE_OK) {
+    return res;
+  }
+
+  if (block.handle != NULL) {
+    value->release = release_pinned_block;
+    value->arg = block.handle;
+  } else if (block.owned) {
+    value->release = free;
+    value->arg = block.data;
+  } else {
+    sstable_ref(sst);
+    value->release = release_pinned_table;
+    value->arg = sst;
+  }
+  return SSTABLE_OK;
+}
+
+// sstable_multi_get looks up n keys sorted in increasing order, hashes are
+// their hash64 values with BLOOM_HASH_SEED. results[i] is set like
+// sstable_get would, and values[i] to a copy of the value on a hit. The
+// filter is probed a batch at a time, then every block a key can be in is
+// loaded at once, so the reads of the blocks that aren't cached are in flight
+// together. Keys that fall into the same block share a single read of it.
+void
+sstable_multi_get(sstable* sst, const slice* keys, const uint64_t* hashes, size_t n, slice* values,
+    sstable_res* results)
+{
+  ssize_t* key_blocks = malloc(n * sizeof(ssize_t));
+  size_t* idxs = malloc(n * sizeof(size_t));
+  sstable_block* blocks = malloc(n * sizeof(sstable_block));
+  blocked_bloom filter;
+  block_cache_handle* filter_handle = NULL;
+  block_cache_handle* index_handle = NULL;
+  sstable_index_entry* index = NULL;
+  if (key_blocks != NULL && idxs != NULL && blocks != NULL && table_filter(sst, &filter, &filter_handle) == 0) {
+    index = table_index(sst, &index_handle);
+  }
+  if (index == NULL) {
+    for (size_t i = 0; i < n; i++) {
+      results[i] = SSTABLE_FAILED;
+    }
+    release_meta(filter_handle);
+    free(key_blocks);
+    free(idxs);
+    free(blocks);
+    return;
+  }
+
+  // sorted keys give the blocks in order, each is listed once
+  size_t num_blocks = 0;
+  for (size_t start = 0; start < n; start += SSTABLE_MULTI_GET_BATCH) {
+    size_t len = n - start < SSTABLE_MULTI_GET_BATCH ? n - start : SSTABLE_MULTI_GET_BATCH;
+    bool maybe[SSTABLE_MULTI_GET_BATCH];
+    blocked_bloom_test_batch(&filter, hashes + start, len, maybe);
+
+    for (size_t i = start; i < start + len; i++) {
+      results[i] = sstable_range_deleted(sst, keys[i]) ? SSTABLE_DELETED : SSTABLE_NOT_FOUND;
+      key_blocks[i] = maybe[i - start] ? find_block(index, sst->num_blocks, keys[i]) : -1;
+      if (key_blocks[i] >= 0 && (num_blocks == 0 || idxs[num_blocks - 1] != (size_t)key_blocks[i])) {
+        idxs[num_blocks++] = key_blocks[i];
+      }
+    }
+  }
+  release_meta(filter_handle);
+
+  if (num_blocks > 0) {
+    load_blocks(sst, index, idxs, num_blocks, true, blocks);
+  }
+  release_meta(index_handle);
+
+  size_t b = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (key_blocks[i] < 0) {
+      continue;
+    }
+    while (idxs[b] != (size_t)key_blocks[i]) {
+      b++;
+    }
+    if (blocks[b].data == NULL) {
+      results[i] = SSTABLE_FAILED;
+      continue;
+    }
+
+    slice v;
+    sstable_res res = block_search(blocks[b].data, blocks[b].size, keys[i], &v);
+    if (res != SSTABLE_NOT_FOUND) {
+      results[i] = res;
+    }
+    if (results[i] == SSTABLE_OK) {
+      values[i] = slice_copy(v);
+      if (values[i].data == NULL) {
+        results[i] = SSTABLE_FAILED;
+      }
+    }
+  }
+
+  for (size_t i = 0; i < num_blocks; i++) {
+    release_block(&blocks[i]);
+  }
+  free(key_blocks);
+  free(idxs);
+  free(blocks);
+}
+
+void
+sstable_ref(sstable* sst)
+{
+  __atomic_add_fetch(&sst->refs, 1, __ATOMIC_RELAXED);
+}
+
+// sstable_unref drops a reference, the table is closed once the last one is
+// gone and its file removed if a compaction made it obsolete.
+void
+sstable_unref(sstable* sst)
+{
+  if (__atomic_sub_fetch(&sst->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    if (sst->obsolete) {
+      unlink(sst->filename);
+    }
+    sstable_close(sst);
+  }
+}
+
+void
+sstable_close(sstable* sst)
+{
+  if (sst->map != NULL) {
+    munmap((void*)sst->map, sst->file_size);
+  }
+  if (sst->fd >= 0) {
+    close(sst->fd);
+  }
+  // an index or filter kept in the cache is of no use to anyone anymore
+  if (sst->index != NULL) {
+    free(sst->index);
+  } else if (sst->cache != NULL) {
+    block_cache_erase(sst->cache, sst->cache_id, sst->index_offset);
+  }
+  if (sst->filter != NULL) {
+    blocked_bloom_free(sst->filter);
+  } else if (sst->cache != NULL) {
+    block_cache_erase(sst->cache, sst->cache_id, sst->filter_offset);
+  }
+  for (size_t i = 0; i < sst->num_range_dels; i++) {
+    slice_free(sst->range_dels[i].start);
+    slice_free(sst->range_dels[i].end);
+  }
+  free(sst->range_dels);
+  slice_free(sst->smallest);
+  slice_free(sst->largest);
+  free(sst->filename);
+  free(sst);
+}
+
+sstable_iter*
+sstable_iter_new(sstable* sst)
+{
+  sstable_iter* it = calloc(1, sizeof(sstable_iter));
+  if (it == NULL) {
+    return NULL;
+  }
+  it->sst = sst;
+  it->fill_cache = true;
+  it->index = table_index(sst, &it->index_handle);
+  if (it->index == NULL) {
+    free(it);
+    return NULL;
+  }
+  return it;
+}
+
+// iter_parse_entry points the iterator at the entry at offset inside the
+// current block, key_size has to be that of the previous entry or 0 at a
+// restart.
+static void
+iter_parse_entry(sstable_iter* it, size_t offset)
+{
+  size_t next = decode_entry(it->block.data, it->block_size, offset, &it->key_buf, &it->key_cap, &it->key_size,
+      &it->value, &it->value_size, &it->deleted);
+  if (next == 0) {
+    it->valid = false;
+    it->error = 1;
+    return;
+  }
+
+  it->key = it->key_buf;
+  it->offset = offset;
+  it->next_offset = next;
+  it->valid = true;
+}
+
+static void
+iter_drop_readahead(sstable_iter* it)
+{
+  for (size_t i = it->readahead_pos; i < it->readahead_len; i++) {
+    release_block(&it->readahead[i]);
+  }
+  it->readahead_pos = 0;
+  it->readahead_len = 0;
+}
+
+// iter_read_block loads block block_idx. Once a scan has read
+// SSTABLE_READAHEAD_AFTER blocks in order, the next SSTABLE_READAHEAD_BLOCKS
+// are read in the same batch and used by the loads that follow. A mapped
+// table asks the kernel for readahead instead.
+static int
+iter_read_block(sstable_iter* it, size_t block_idx)
+{
+  if (it->readahead_pos < it->readahead_len && block_idx == it->block_idx + 1) {
+    it->block = it->readahead[it->readahead_pos++];
+    if (it->block.data != NULL) {
+      return 0;
+    }
+    return load_block(it->sst, it->index, block_idx, it->fill_cache, &it->block);
+  }
+
+  iter_drop_readahead(it);
+  if (it->sst->map != NULL || it->sequential < SSTABLE_READAHEAD_AFTER) {
+    return load_block(it->sst, it->index, block_idx, it->fill_cache, &it->block);
+  }
+
+  size_t idxs[SSTABLE_READAHEAD_BLOCKS + 1];
+  sstable_block blocks[SSTABLE_READAHEAD_BLOCKS + 1];
+  size_t n = 1;
+  idxs[0] = block_idx;
+  while (n < SSTABLE_READAHEAD_BLOCKS + 1 && block_idx + n < it->sst->num_blocks) {
+    idxs[n] = block_idx + n;
+    n++;
+  }
+  load_blocks(it->sst, it->index, idxs, n, it->fill_cache, blocks);
+  it->block = blocks[0];
+  for (size_t i = 1; i < n; i++) {
+    it->readahead[i - 1] = blocks[i];
+  }
+  it->readahead_len = n - 1;
+  return it->block.data != NULL ? 0 : 1;
+}
+
+static void
+iter_load_block(sstable_iter* it, size_t block_idx)
+{
+  release_block(&it->block);
+  it->valid = false;
+  it->sequential = block_idx == it->block_idx + 1 ? it->sequential + 1 : 0;
+  if (block_idx >= it->sst->num_blocks) {
+    iter_drop_readahead(it);
+    it->block_idx = block_idx;
+    return;
+  }
+
+  int res = iter_read_block(it, block_idx);
+  it->block_idx = block_idx;
+  if (res != 0) {
+    it->error = 1;
+    return;
+  }
+  it->block_size = it->block.size;
+  if (it->sst->map != NULL && block_idx + 1 < it->sst->num_blocks) {
+    // scans go through the blocks in order, start reading the next one
+    sstable_index_entry* next = &it->index[block_idx + 1];
+    uint64_t page = next->offset & ~((uint64_t)sysconf(_SC_PAGESIZE) - 1);
+    madvise((void*)(it->sst->map + page), next->offset + next->size - page, MADV_WILLNEED);
+  }
+  if (block_restarts(it->block.data, &it->block_size, &it->restarts, &it->num_restarts) != 0) {
+    it->error = 1;
+    return;
+  }
+  it->key_size = 0;
+  iter_parse_entry(it, 0);
+}
+
+void
+sstable_iter_seek_to_first(sstable_iter* it)
+{
+  it->error = 0;
+  iter_load_block(it, 0);
+}
+
+// iter_parse_before points the iterator at the last entry of the current
+// block that starts before limit. Entries only link forward, so the scan
+// starts at the last restart before limit.
+static void
+iter_parse_before(sstable_iter* it, size_t limit)
+{
+  uint32_t lo = 0, hi = it->num_restarts - 1;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo + 1) / 2;
+    if (restart_offset(it->restarts, mid) < limit) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+
+  it->key_size = 0;
+  iter_parse_entry(it, restart_offset(it->restarts, lo));
+  while (it->valid && it->next_offset < limit) {
+    iter_parse_entry(it, it->next_offset);
+  }
+}
+
+void
+sstable_iter_seek_to_last(sstable_iter* it)
+{
+  it->error = 0;
+  if (it->sst->num_blocks == 0) {
+    iter_load_block(it, 0);
+    return;
+  }
+
+  iter_load_block(it, it->sst->num_blocks - 1);
+  if (it->valid) {
+    iter_parse_before(it, it->block_size);
+  }
+}
+
+// sstable_iter_seek moves to the first entry with a key that is not smaller
+// than key.
+void
+sstable_iter_seek(sstable_iter* it, slice key)
+{
+  it->error = 0;
+  ssize_t idx = find_block(it->index, it->sst->num_blocks, key);
+  if (idx < 0) {
+    iter_load_block(it, it->sst->num_blocks);
+    return;
+  }
+
+  // the last key of the block is not smaller than key, so the scan stops
+  // inside of it.
+  iter_load_block(it, idx);
+  uint32_t restart;
+  if (it->valid) {
+    if (find_restart(it->block.data, it->block_size, it->restarts, it->num_restarts, key, &restart) != 0) {
+      it->valid = false;
+      it->error = 1;
+      return;
+    }
+    it->key_size = 0;
+    iter_parse_entry(it, restart_offset(it->restarts, restart));
+  }
+  while (it->valid && key_compare(it->key, it->key_size, key.data, key.size) < 0) {
+    sstable_iter_next(it);
+  }
+}
+
+void
+sstable_iter_next(sstable_iter* it)
+{
+  if (!it->valid) {
+    return;
+  }
+
+  if (it->next_offset < it->block_size) {
+    iter_parse_entry(it, it->next_offset);
+  } else {
+    iter_load_block(it, it->block_idx + 1);
+  }
+}
+
+void
+sstable_iter_prev(sstable_iter* it)
+{
+  if (!it->valid) {
+    return;
+  }
+
+  if (it->offset > 0) {
+    iter_parse_before(it, it->offset);
+  } else if (it->block_idx == 0) {
+    iter_load_block(it, it->sst->num_blocks);
+  } else {
+    iter_load_block(it, it->block_idx - 1);
+    if (it->valid) {
+      iter_parse_before(it, it->block_size);
+    }
+  }
+}
+
+void
+sstable_iter_free(sstable_iter* it)
+{
+  release_block(&it->block);
+  iter_drop_readahead(it);
+  release_meta(it->index_handle);
+  free(it->key_buf);
+  free(it);
+}
@@ -1,4 +1,211 @@
 #ifndef __SSTABLE_H__
 #define __SSTABLE_H__
 
-#endif 
+#include "bloom.h"
+#include "cache.h"
+#include "compress.h"
+#include "memtable.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// On-disk layout of a table file:
+//
+//   [data block 0] ... [data block n-1] [filter block] [range deletion block]
+//   [index block] [footer]
+//
+// every block is followed by a trailer of [u8 codec][u32 crc32c], the crc
+// covers the block as stored and the codec byte. The sizes stored in the index
+// and footer are the stored sizes without the trailer. A block compressed with
+// a codec other than COMPRESS_NONE is stored as [u32 raw_size][compressed], so
+// tables that mix codecs stay readable.
+//
+// data block:  sorted entries of [u16 shared][u16 unshared][u32 value_size]
+//              [u8 type][key suffix][value], followed by [u32 offset] per restart and
+//              [u32 num_restarts]. An entry's key is the first shared bytes of
+//              the previous key followed by the suffix. Every
+//              SSTABLE_RESTART_INTERVAL entries a restart stores the whole key
+//              (shared is 0), lookups binary search the restarts and only scan
+//              the entries after one. Compressed with the writer's codec.
+//              A deletion is an entry of type SSTABLE_ENTRY_DELETION without a
+//              value, it hides the key in older tables.
+// filter:      blocked bloom filter over every key in the table (blocked_bloom_encode)
+// range deletion block: [u16 size][start][u16 size][end] per range, sorted and
+//              disjoint. A range hides the keys in [start, end) of older
+//              tables, never the entries of its own table, which are all newer.
+// index block: one [u16 key_size][key][u64 offset][u32 size] per data block,
+//              where key is the last key stored in that block
+// footer:      fixed size, locates the filter and index blocks
+
+#define SSTABLE_BLOCK_SIZE     4096
+#define SSTABLE_BITS_PER_KEY   10
+#define SSTABLE_RESTART_INTERVAL 16
+#define SSTABLE_MULTI_GET_BATCH 16 // keys whose filter probes are prefetched together
+#define SSTABLE_READAHEAD_AFTER 2 // blocks a scan reads in order before it reads ahead
+#define SSTABLE_READAHEAD_BLOCKS 8 // blocks read ahead in the same batch as the next one
+#define SSTABLE_MAGIC          0x4C534D5453535442ULL
+#define SSTABLE_VERSION        8
+#define SSTABLE_BLOCK_TRAILER_SIZE  (sizeof(uint8_t) + sizeof(uint32_t))
+
+#define SSTABLE_ENTRY_VALUE     0
+#define SSTABLE_ENTRY_DELETION  1
+
+typedef enum {
+  SSTABLE_OK,
+  SSTABLE_NOT_FOUND,
+  SSTABLE_FAILED,
+  SSTABLE_DELETED, // the key is deleted in the table, older tables mustn't be searched
+} sstable_res;
+
+typedef struct sstable_footer_s {
+  uint64_t filter_offset;
+  uint64_t filter_size;
+  uint64_t index_offset;
+  uint64_t index_size;
+  uint64_t range_del_offset;
+  uint64_t range_del_size;
+  uint64_t num_entries;
+  uint64_t max_seq; // sequence number of the newest write in the table
+  uint32_t version;
+  uint32_t level;
+  uint64_t magic;
+} sstable_footer;
+
+typedef struct sstable_index_entry_s {
+  slice last_key;
+  uint64_t offset;
+  uint32_t size;
+} sstable_index_entry;
+
+// range_del is a deleted key range [start, end).
+typedef struct range_del_s {
+  slice start;
+  slice end;
+} range_del;
+
+// sstable_block is a decoded data block. It's owned by the reader, pinned in
+// the block cache or points into the mapping of the table.
+typedef struct sstable_block_s {
+  char* data;
+  size_t size;
+  block_cache_handle* handle; // set if the block is pinned in the cache
+  bool owned; // data is freed on release
+} sstable_block;
+
+typedef struct sstable_s {
+  int fd;
+  char* filename;
+  uint64_t file_num;
+  uint64_t file_size;
+  uint64_t num_entries;
+  uint64_t max_seq;
+  uint32_t level;
+  size_t num_blocks;
+  // the index and filter are owned by the table without a cache. With one
+  // they're kept in it at high priority, unpinned, and these are NULL.
+  sstable_index_entry* index; // one allocation with the keys
+  blocked_bloom* filter;
+  uint64_t index_offset; // where they're read from again once evicted
+  uint64_t index_size;
+  uint64_t filter_offset;
+  uint64_t filter_size;
+  slice smallest; // owned copies, empty for a table without entries, cover the range deletions
+  slice largest;
+  range_del* range_dels; // sorted and disjoint, owned copies
+  size_t num_range_dels;
+  block_cache* cache; // NULL if the data blocks aren't cached
+  uint64_t cache_id;
+  const char* map; // the whole file if it's read through mmap, else NULL
+
+  int refs;
+  bool obsolete; // the file is removed once the last reference is dropped
+  bool compacting;
+} sstable;
+
+typedef struct sstable_writer_s {
+  int fd;
+  char* filename;
+  char* tmp_filename;
+  char* block;
+  size_t block_len;
+  size_t block_cap;
+  sstable_index_entry* index;
+  size_t num_blocks;
+  size_t index_cap;
+  slice last_key; // owned copy, data is NULL before the first add
+  uint32_t* restarts; // offsets of the restarts of the buffered block
+  size_t num_restarts;
+  size_t restarts_cap;
+  size_t restart_entries; // entries added since the last restart
+  uint64_t offset;
+  uint64_t num_entries;
+  uint64_t max_seq;
+  uint32_t level;
+  compress_codec codec; // used for the data blocks, COMPRESS_NONE by default
+  range_del* range_dels; // owned copies in the order they were added
+  size_t num_range_dels;
+  size_t range_dels_cap;
+  char* compressed; // scratch buffer for compressed blocks
+  size_t compressed_cap;
+  blocked_bloom* filter;
+} sstable_writer;
+
+typedef struct sstable_iter_s {
+  sstable* sst;
+  sstable_index_entry* index; // the table's index, pinned while the iterator exists
+  block_cache_handle* index_handle; // NULL if the table owns its index
+  size_t block_idx;
+  sstable_block block;
+  size_t block_size; // where the entries of the block end
+  const char* restarts;
+  uint32_t num_restarts;
+  size_t offset; // offset of the current entry
+  size_t next_offset; // offset of the entry after the current one
+  const char* key; // points into key_buf
+  uint16_t key_size;
+  char* key_buf; // the current key, rebuilt from the previous one
+  size_t key_cap;
+  const char* value;
+  uint32_t value_size;
+  bool deleted; // the current entry is a deletion
+  bool valid;
+  bool fill_cache; // blocks read from disk are added to the cache, set by default
+  int error;
+  size_t sequential; // blocks loaded in order right before the current one
+  sstable_block readahead[SSTABLE_READAHEAD_BLOCKS]; // blocks after the current one, read with it
+  size_t readahead_pos; // next block of readahead to use
+  size_t readahead_len;
+} sstable_iter;
+
+sstable_writer* sstable_writer_new(const char* path, size_t expected_entries);
+int sstable_writer_add(sstable_writer* w, slice key, slice value);
+int sstable_writer_delete(sstable_writer* w, slice key);
+int sstable_writer_delete_range(sstable_writer* w, slice start, slice end);
+uint64_t sstable_writer_size(sstable_writer* w);
+int sstable_writer_finish(sstable_writer* w);
+void sstable_writer_abandon(sstable_writer* w);
+
+int sstable_flush_memtable(memtable* mt, const char* path, compress_codec codec);
+
+sstable* sstable_open(const char* path, uint64_t file_num, block_cache* cache, bool use_mmap);
+sstable_res sstable_get(sstable* sst, slice key, slice* value);
+sstable_res sstable_get_pinned(sstable* sst, slice key, pinned_slice* value);
+void sstable_multi_get(sstable* sst, const slice* keys, const uint64_t* hashes, size_t n, slice* values,
+    sstable_res* results);
+bool sstable_range_deleted(sstable* sst, slice key);
+void sstable_ref(sstable* sst);
+void sstable_unref(sstable* sst);
+void sstable_close(sstable* sst);
+
+size_t range_dels_merge(range_del* dels, size_t n);
+bool range_dels_cover(const range_del* dels, size_t n, slice key);
+
+sstable_iter* sstable_iter_new(sstable* sst);
+void sstable_iter_seek_to_first(sstable_iter* it);
+void sstable_iter_seek_to_last(sstable_iter* it);
+void sstable_iter_seek(sstable_iter* it, slice key);
+void sstable_iter_next(sstable_iter* it);
+void sstable_iter_prev(sstable_iter* it);
+void sstable_iter_free(sstable_iter* it);
+
+#endif
@@ -0,0 +1,149 @@
+#include "../arena.h"
+#include "../skiplist.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+void
+test_alloc()
+{
+  printf("Testing arena allocations...\n");
+
+  arena* a = arena_new();
+  assert(a != NULL && "Arena creation failed");
+
+  char* prev = NULL;
+  for (int i = 1; i < 5000; i++) {
+    char* p = arena_alloc(a, i % 37 + 1);
+    assert(p != NULL && "Allocation failed");
+    assert((uintptr_t)p % ARENA_ALIGN == 0 && "Allocation is not aligned");
+    memset(p, 'x', i % 37 + 1);
+    assert(p != prev && "Allocation handed out twice");
+    prev = p;
+  }
+
+  // a large allocation doesn't throw away the rest of the current block
+  char* small = arena_alloc(a, 8);
+  char* large = arena_alloc(a, ARENA_BLOCK_SIZE);
+  char* next = arena_alloc(a, 8);
+  assert(large != NULL && "Large allocation failed");
+  memset(large, 'y', ARENA_BLOCK_SIZE);
+  assert(next == small + 8 && "Large allocation moved the bump pointer");
+
+  char* str = arena_strdup(a, "hello arena");
+  assert(strcmp(str, "hello arena") == 0 && "Strdup doesn't match");
+  assert(a->memory_usage >= ARENA_BLOCK_SIZE * 2 && "Memory usage not tracked");
+
+  arena_free(a);
+  printf("All arena allocation tests passed!\n\n");
+}
+
+void
+test_skiplist_arena()
+{
+  printf("Testing skiplist backed by an arena...\n");
+
+  arena* a = arena_new();
+  skiplist* list = skiplist_new_arena(a);
+  assert(list != NULL && "Skiplist creation failed");
+
+  char key[32], value[32];
+  for (int i = 0; i < 10000; i++) {
+    snprintf(key, sizeof(key), "key%05d", (i * 7919) % 10000);
+    snprintf(value, sizeof(value), "value%d", i);
+    assert(skiplist_insert(list, key, value) != NULL && "Insert failed");
+  }
+  skiplist_remove(list, "key00042");
+  assert(list->count == 9999 && "Count doesn't match");
+  assert(skiplist_search_by_key(list, "key00042") == NULL && "Removed key found");
+
+  skipnode* node = skiplist_search_by_key(list, "key00043");
+  assert(node != NULL && "Key not found");
+  assert((char*)node < node->key && node->key < node->value && "Node is not contiguous");
+
+  // nodes come out in key order
+  sk_link* pos = list->head[0].next;
+  const char* last = "";
+  skiplist_foreach_forward(pos, &list->head[0])
+  {
+    node = list_entry(pos, skipnode, link[0]);
+    assert(strcmp(last, node->key) < 0 && "Skiplist is not sorted");
+    last = node->key;
+  }
+
+  skiplist_delete(list);
+  arena_free(a);
+  printf("All skiplist arena tests passed!\n\n");
+}
+
+#define ALLOCS_PER_THREAD 20000
+
+typedef struct alloc_arg_s {
+  arena* a;
+  int id;
+  char* ptrs[ALLOCS_PER_THREAD];
+} alloc_arg;
+
+static size_t
+alloc_size(int i)
+{
+  // every 1000th allocation is large and gets a block of its own
+  return i % 1000 == 999 ? ARENA_BLOCK_SIZE / 2 : (size_t)(i % 61 + 1);
+}
+
+static void*
+alloc_thread(void* p)
+{
+  alloc_arg* arg = p;
+  for (int i = 0; i < ALLOCS_PER_THREAD; i++) {
+    arg->ptrs[i] = arena_alloc_concurrent(arg->a, alloc_size(i));
+    assert(arg->ptrs[i] != NULL && (uintptr_t)arg->ptrs[i] % ARENA_ALIGN == 0 && "Allocation failed");
+    memset(arg->ptrs[i], arg->id, alloc_size(i));
+  }
+  return NULL;
+}
+
+void
+test_concurrent_alloc()
+{
+  printf("Testing concurrent arena allocations...\n");
+
+  // no two threads get overlapping memory, which the fills would show
+  arena* a = arena_new();
+  enum { NUM_THREADS = 8 };
+  static alloc_arg args[NUM_THREADS];
+  pthread_t threads[NUM_THREADS];
+  for (int t = 0; t < NUM_THREADS; t++) {
+    args[t].a = a;
+    args[t].id = t + 1;
+    pthread_create(&threads[t], NULL, alloc_thread, &args[t]);
+  }
+  for (int t = 0; t < NUM_THREADS; t++) {
+    pthread_join(threads[t], NULL);
+  }
+  for (int t = 0; t < NUM_THREADS; t++) {
+    for (int i = 0; i < ALLOCS_PER_THREAD; i++) {
+      for (size_t j = 0; j < alloc_size(i); j++) {
+        assert(args[t].ptrs[i][j] == args[t].id && "Allocations overlap");
+      }
+    }
+  }
+
+  arena_free(a);
+  printf("All concurrent arena allocation tests passed!\n\n");
+}
+
+int
+main()
+{
+  printf("Starting arena tests...\n\n");
+
+  test_alloc();
+  test_skiplist_arena();
+  test_concurrent_alloc();
+
+  printf("All tests passed successfully!\n");
+  return 0;
+}
@@ -1,7 +1,119 @@
+#include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "../bloom.h"
 
+static void
+test_bits_per_key()
+{
+  printf("\nTesting filters sized from bits per key...\n");
+
+  const int num_keys = 100000;
+  size_t bits_per_key[] = { 5, 10, 20 };
+  double max_fpr[] = { 0.15, 0.02, 0.001 };
+  char key[32];
+  for (int b = 0; b < 3; b++) {
+    bloom_filter* filter = bloom_filter_new_bits_per_key(num_keys, bits_per_key[b]);
+    assert(filter->vec->size == num_keys * bits_per_key[b] && "Filter size doesn't match");
+    for (int i = 0; i < num_keys; i++) {
+      snprintf(key, sizeof(key), "key%d", i);
+      bloom_filter_put(filter, key, strlen(key));
+    }
+    for (int i = 0; i < num_keys; i++) {
+      snprintf(key, sizeof(key), "key%d", i);
+      assert(bloom_filter_test(filter, key, strlen(key)) && "False negative");
+    }
+
+    int false_positives = 0;
+    for (int i = 0; i < num_keys; i++) {
+      snprintf(key, sizeof(key), "missing%d", i);
+      false_positives += bloom_filter_test(filter, key, strlen(key));
+    }
+    double fpr = (double)false_positives / num_keys;
+    printf("%zu bits per key, %zu probes: false positive rate %.4f\n", bits_per_key[b], filter->num_probes, fpr);
+    assert(fpr < max_fpr[b] && "False positive rate too high");
+    bloom_filter_free(filter);
+  }
+  printf("Bits per key tests passed\n");
+}
+
+static void
+test_blocked_bloom()
+{
+  printf("\nTesting blocked bloom filter...\n");
+
+  const int num_keys = 100000;
+  blocked_bloom* filter = blocked_bloom_new(num_keys, 10);
+  assert(filter != NULL && "Filter creation failed");
+  assert((uintptr_t)filter->blocks % BLOCKED_BLOOM_BLOCK_SIZE == 0 && "Blocks are not aligned");
+
+  char key[32];
+  for (int i = 0; i < num_keys; i++) {
+    snprintf(key, sizeof(key), "key%d", i);
+    blocked_bloom_put(filter, key, strlen(key));
+  }
+  for (int i = 0; i < num_keys; i++) {
+    snprintf(key, sizeof(key), "key%d", i);
+    assert(blocked_bloom_test(filter, key, strlen(key)) && "False negative");
+  }
+
+  int false_positives = 0;
+  for (int i = 0; i < num_keys; i++) {
+    snprintf(key, sizeof(key), "missing%d", i);
+    false_positives += blocked_bloom_test(filter, key, strlen(key));
+  }
+  double fpr = (double)false_positives / num_keys;
+  printf("false positive rate at 10 bits per key: %.4f\n", fpr);
+  assert(fpr < 0.03 && "False positive rate too high");
+
+  // batched probes give the same answers as single ones
+  uint64_t hashes[64];
+  bool batch[64];
+  for (int i = 0; i < 64; i++) {
+    snprintf(key, sizeof(key), i % 2 ? "key%d" : "missing%d", i);
+    hashes[i] = hash64(key, strlen(key), BLOOM_HASH_SEED);
+  }
+  blocked_bloom_test_batch(filter, hashes, 64, batch);
+  for (int i = 0; i < 64; i++) {
+    assert(batch[i] == blocked_bloom_test_hash(filter, hashes[i]) && "Batch probe doesn't match");
+    assert((batch[i] || i % 2 == 0) && "False negative in batch");
+  }
+
+  size_t size = blocked_bloom_encoded_size(filter);
+  char* buf = malloc(size);
+  blocked_bloom_encode(filter, buf);
+  blocked_bloom* decoded = blocked_bloom_decode(buf, size);
+  assert(decoded != NULL && "Decode failed");
+  assert(decoded->num_items == (size_t)num_keys && "Item count doesn't match");
+  assert(memcmp(decoded->blocks, filter->blocks, filter->num_blocks * BLOCKED_BLOOM_BLOCK_SIZE) == 0);
+  assert(blocked_bloom_decode(buf, size - 1) == NULL && "Truncated filter decoded");
+  free(buf);
+
+  blocked_bloom_free(decoded);
+  blocked_bloom_free(filter);
+  printf("Blocked bloom filter tests passed\n");
+}
+
+static void
+test_old_dump()
+{
+  printf("\nTesting filter dumps without a header...\n");
+
+  // the layout dumps had before they got a magic and version, its bits were
+  // set with another hash
+  FILE* fp = fopen("test_bloom_old.filter", "wb");
+  assert(fp != NULL && "Failed to create file");
+  size_t fields[3] = { 7, 1, 64 };
+  uint32_t words[2] = { 0xFFFFFFFF, 0xFFFFFFFF };
+  assert(fwrite(fields, sizeof(fields), 1, fp) == 1 && fwrite(words, sizeof(words), 1, fp) == 1);
+  fclose(fp);
+  assert(bloom_filter_from_file("test_bloom_old.filter") == NULL && "Old dump was loaded");
+  remove("test_bloom_old.filter");
+  printf("Old dump tests passed\n");
+}
+
 int
 main(int argc, char* argv[])
 {
@@ -42,5 +154,9 @@ main(int argc, char* argv[])
   remove("test_bloom.filter");
   printf("\nTest file cleaned up\n");
 
+  test_bits_per_key();
+  test_blocked_bloom();
+  test_old_dump();
+
   return 0;
 }
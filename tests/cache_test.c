@@ -0,0 +1,157 @@
+#include "../cache.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static char*
+block(size_t size, char fill)
+{
+  char* data = malloc(size);
+  memset(data, fill, size);
+  return data;
+}
+
+void
+test_lookup_and_evict()
+{
+  printf("Testing block cache lookups and eviction...\n");
+
+  // 16 shards of 4KB each
+  block_cache* cache = block_cache_new(64 * 1024);
+  assert(cache != NULL && "Cache creation failed");
+  uint64_t id = block_cache_new_id(cache);
+  assert(block_cache_new_id(cache) != id && "Ids repeat");
+
+  assert(block_cache_lookup(cache, id, 0) == NULL && "Empty cache had a hit");
+  block_cache_handle* h = block_cache_insert(cache, id, 0, block(1024, 'a'), 1024, false);
+  assert(h != NULL && h->data[0] == 'a' && "Insert failed");
+
+  // a second insert of the same block keeps the first copy
+  block_cache_handle* dup = block_cache_insert(cache, id, 0, block(1024, 'b'), 1024, false);
+  assert(dup == h && "Duplicate block was cached");
+  block_cache_release(dup);
+
+  block_cache_handle* hit = block_cache_lookup(cache, id, 0);
+  assert(hit == h && hit->data[0] == 'a' && "Cached block not found");
+  block_cache_release(hit);
+  assert(block_cache_lookup(cache, id + 1, 0) == NULL && "Other table's block found");
+
+  // far more blocks than fit, the pinned one stays
+  for (uint64_t off = 1; off < 1000; off++) {
+    block_cache_release(block_cache_insert(cache, id, off * 4096, block(1024, 'c'), 1024, false));
+  }
+  block_cache_stats stats;
+  block_cache_get_stats(cache, &stats);
+  assert(stats.usage <= stats.capacity + 1024 && "Cache went over its capacity");
+  assert(stats.evictions > 0 && stats.hits == 1 && stats.misses == 2 && "Counters don't match");
+  hit = block_cache_lookup(cache, id, 0);
+  assert(hit == h && "Pinned block was evicted");
+  block_cache_release(hit);
+  block_cache_release(h);
+
+  block_cache_set_capacity(cache, 0);
+  block_cache_get_stats(cache, &stats);
+  assert(stats.usage == 0 && stats.count == 0 && "Shrinking didn't evict");
+
+  block_cache_free(cache);
+  printf("All lookup and eviction tests passed!\n\n");
+}
+
+void
+test_priority()
+{
+  printf("Testing block cache priorities...\n");
+
+  // a scan of low priority blocks can't push out the high priority ones while
+  // they fit in the reserved part of the cache
+  block_cache* cache = block_cache_new(16 * 64 * 1024);
+  uint64_t id = block_cache_new_id(cache);
+  for (uint64_t off = 0; off < 32; off++) {
+    block_cache_release(block_cache_insert(cache, id, off, block(4096, 'i'), 4096, true));
+  }
+  uint64_t scan_id = block_cache_new_id(cache);
+  for (uint64_t off = 0; off < 1024; off++) {
+    block_cache_release(block_cache_insert(cache, scan_id, off, block(4096, 'd'), 4096, false));
+  }
+
+  int kept = 0;
+  for (uint64_t off = 0; off < 32; off++) {
+    block_cache_handle* h = block_cache_lookup(cache, id, off);
+    if (h != NULL) {
+      kept++;
+      block_cache_release(h);
+    }
+  }
+  printf("%d of 32 high priority blocks kept\n", kept);
+  assert(kept == 32 && "High priority blocks were evicted");
+
+  // blocks the scan didn't reach again are gone
+  block_cache_handle* h = block_cache_lookup(cache, scan_id, 0);
+  assert(h == NULL && "Old scan block was kept");
+
+  block_cache_free(cache);
+  printf("All priority tests passed!\n\n");
+}
+
+typedef struct reader_arg_s {
+  block_cache* cache;
+  uint64_t id;
+  int seed;
+} reader_arg;
+
+static void*
+reader_thread(void* p)
+{
+  reader_arg* arg = p;
+  unsigned int seed = arg->seed;
+  for (int i = 0; i < 20000; i++) {
+    uint64_t off = rand_r(&seed) % 512;
+    block_cache_handle* h = block_cache_lookup(arg->cache, arg->id, off);
+    if (h == NULL) {
+      h = block_cache_insert(arg->cache, arg->id, off, block(256, (char)off), 256, false);
+    }
+    assert(h->size == 256 && h->data[255] == (char)off && "Wrong block");
+    block_cache_release(h);
+  }
+  return NULL;
+}
+
+void
+test_concurrent_readers()
+{
+  printf("Testing concurrent block cache readers...\n");
+
+  block_cache* cache = block_cache_new(64 * 1024);
+  uint64_t id = block_cache_new_id(cache);
+  pthread_t threads[4];
+  reader_arg args[4];
+  for (int i = 0; i < 4; i++) {
+    args[i] = (reader_arg) { cache, id, i };
+    pthread_create(&threads[i], NULL, reader_thread, &args[i]);
+  }
+  for (int i = 0; i < 4; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  block_cache_stats stats;
+  block_cache_get_stats(cache, &stats);
+  assert(stats.hits + stats.misses == 80000 && "Lookups weren't counted");
+  assert(stats.hits > 0 && stats.evictions > 0 && "Cache wasn't used");
+  block_cache_free(cache);
+  printf("All concurrent reader tests passed!\n\n");
+}
+
+int
+main()
+{
+  printf("Starting block cache tests...\n\n");
+
+  test_lookup_and_evict();
+  test_priority();
+  test_concurrent_readers();
+
+  printf("All tests passed successfully!\n");
+  return 0;
+}
@@ -0,0 +1,102 @@
+#include "../compress.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static size_t
+round_trip(compress_codec codec, const char* src, size_t size)
+{
+  char* compressed = malloc(compress_bound(size));
+  char* out = malloc(size + 1);
+  size_t n = compress_block(codec, src, size, compressed);
+  assert(n <= compress_bound(size) && "Output exceeds the bound");
+  assert(decompress_block(compressed, n, out, size) == 0 && "Decompression failed");
+  assert(memcmp(out, src, size) == 0 && "Round trip doesn't match");
+  free(compressed);
+  free(out);
+  return n;
+}
+
+void
+test_round_trip()
+{
+  printf("Testing compression round trips...\n");
+
+  // records that repeat their field names, like the values of a document store
+  size_t size = 0;
+  char* json = malloc(64 * 1024);
+  for (int i = 0; size < 60 * 1024; i++) {
+    size += snprintf(json + size, 64 * 1024 - size, "{\"id\": %d, \"name\": \"user%d\", \"tags\": [\"a\", \"b\"]}\n", i,
+        i % 37);
+  }
+  size_t fast = round_trip(COMPRESS_FAST, json, size);
+  size_t high = round_trip(COMPRESS_HIGH, json, size);
+  printf("%zu bytes: fast %zu, high %zu\n", size, fast, high);
+  assert(fast < size / 2 && "Fast level barely compressed");
+  assert(high <= fast && "High level compressed worse than the fast one");
+  free(json);
+
+  // incompressible input, runs and inputs shorter than a match
+  char* noise = malloc(8192);
+  srand(7);
+  for (int i = 0; i < 8192; i++) {
+    noise[i] = rand();
+  }
+  char run[5000];
+  memset(run, 'x', sizeof(run));
+  for (int codec = COMPRESS_FAST; codec <= COMPRESS_HIGH; codec++) {
+    assert(round_trip(codec, noise, 8192) <= compress_bound(8192));
+    assert(round_trip(codec, run, sizeof(run)) < 64 && "Run was not compressed");
+    for (size_t n = 0; n < 20; n++) {
+      round_trip(codec, run, n);
+    }
+  }
+  free(noise);
+
+  printf("All round trip tests passed!\n\n");
+}
+
+void
+test_corrupt_input()
+{
+  printf("Testing corrupt input...\n");
+
+  char src[2048];
+  for (size_t i = 0; i < sizeof(src); i++) {
+    src[i] = "abcdefgh"[i % 8] + (i / 512);
+  }
+  char compressed[4096];
+  char out[2048];
+  size_t n = compress_block(COMPRESS_FAST, src, sizeof(src), compressed);
+
+  // a wrong size, a cut and every flipped byte is caught or stays in bounds
+  assert(decompress_block(compressed, n, out, sizeof(src) - 1) != 0 && "Short output accepted");
+  for (size_t cut = 0; cut < n; cut++) {
+    decompress_block(compressed, cut, out, sizeof(out));
+  }
+  for (size_t i = 0; i < n; i++) {
+    compressed[i] ^= 0x5a;
+    decompress_block(compressed, n, out, sizeof(out));
+    compressed[i] ^= 0x5a;
+  }
+  assert(decompress_block(compressed, n, out, sizeof(out)) == 0 && "Intact input rejected");
+
+  // a match that reaches back before the start of the output
+  const char bad[] = { 0x10, 'a', 0x05, 0x00 };
+  assert(decompress_block(bad, sizeof(bad), out, 5) != 0 && "Offset before the output accepted");
+
+  printf("All corrupt input tests passed!\n\n");
+}
+
+int
+main()
+{
+  printf("Starting compression tests...\n\n");
+
+  test_round_trip();
+  test_corrupt_input();
+
+  printf("All tests passed successfully!\n");
+  return 0;
+}
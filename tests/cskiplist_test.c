@@ -0,0 +1,181 @@
+#include "../cskiplist.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void
+test_insert_and_find()
+{
+  printf("Testing insert and find...\n");
+
+  arena* a = arena_new();
+  cskiplist* list = cskiplist_new(a);
+  assert(list != NULL && "Skiplist creation failed");
+
+  char key[32], value[32];
+  for (int i = 0; i < 10000; i++) {
+    int k = (i * 7919) % 10000;
+    snprintf(key, sizeof(key), "key%05d", k);
+    snprintf(value, sizeof(value), "value%d", k);
+    assert(cskiplist_insert(list, slice_from_str(key), slice_from_str(value), i + 1, false) == 0 && "Insert failed");
+  }
+  assert(cskiplist_count(list) == 10000 && "Count doesn't match");
+
+  csk_node* node = cskiplist_find(list, slice_from_str("key00042"));
+  assert(node != NULL && strcmp(csk_node_value(node)->data, "value42") == 0 && "Find failed");
+  assert(cskiplist_find(list, slice_from_str("key0004")) == NULL && "Prefix of a key found");
+  node = cskiplist_seek(list, slice_from_str("key0004"));
+  assert(node != NULL && strcmp(node->key, "key00040") == 0 && "Seek failed");
+
+  // a newer write replaces the value, an older one goes behind it. Reads at
+  // an older seq still find the value written then.
+  assert(cskiplist_insert(list, slice_from_str("key00042"), slice_from_str("newer"), 20000, false) == 0);
+  assert(cskiplist_insert(list, slice_from_str("key00042"), slice_from_str("older"), 15000, false) == 0);
+  node = cskiplist_find(list, slice_from_str("key00042"));
+  csk_value* v = csk_node_value(node);
+  assert(strcmp(v->data, "newer") == 0 && v->seq == 20000 && "Update didn't keep the newest write");
+  v = csk_node_value_at(node, 19999);
+  assert(v != NULL && strcmp(v->data, "older") == 0 && "Older write lost");
+  v = csk_node_value_at(node, 14999);
+  assert(v != NULL && strcmp(v->data, "value42") == 0 && "First write lost");
+  assert(csk_node_value_at(node, v->seq - 1) == NULL && "Value seen before it was written");
+  assert(cskiplist_count(list) == 10000 && "Update added a node");
+
+  const char* last = "";
+  size_t n = 0;
+  for (node = cskiplist_first(list); node != NULL; node = cskiplist_next(node), n++) {
+    assert(strcmp(last, node->key) < 0 && "Skiplist is not sorted");
+    last = node->key;
+  }
+  assert(n == 10000 && "Iteration missed nodes");
+
+  cskiplist_free(list);
+  arena_free(a);
+  printf("All insert and find tests passed!\n\n");
+}
+
+#define NUM_WRITERS      4
+#define KEYS_PER_WRITER  20000
+
+typedef struct {
+  cskiplist* list;
+  int id;
+} writer_arg;
+
+static void*
+writer_main(void* arg)
+{
+  writer_arg* w = arg;
+  char key[32], value[32];
+  for (int i = 0; i < KEYS_PER_WRITER; i++) {
+    // every writer also writes a shared key, the highest seq has to win
+    snprintf(key, sizeof(key), "key%02d_%06d", w->id, i);
+    snprintf(value, sizeof(value), "value%d", i);
+    uint64_t seq = (uint64_t)i * NUM_WRITERS + w->id + 1;
+    assert(cskiplist_insert(w->list, slice_from_str(key), slice_from_str(value), seq, false) == 0);
+    assert(cskiplist_insert(w->list, slice_from_str("shared"), slice_from_str(key), seq, false) == 0);
+  }
+  return NULL;
+}
+
+static void*
+reader_main(void* arg)
+{
+  cskiplist* list = arg;
+  for (int round = 0; round < 20; round++) {
+    const char* last = "";
+    for (csk_node* node = cskiplist_first(list); node != NULL; node = cskiplist_next(node)) {
+      assert(strcmp(last, node->key) < 0 && "Reader saw an unsorted list");
+      last = node->key;
+    }
+  }
+  return NULL;
+}
+
+void
+test_finger_search()
+{
+  printf("Testing finger search...\n");
+
+  arena* a = arena_new();
+  cskiplist* list = cskiplist_new(a);
+  char key[32];
+  for (int i = 0; i < 5000; i++) {
+    snprintf(key, sizeof(key), "key%05d", i * 2);
+    assert(cskiplist_insert(list, slice_from_str(key), slice_from_str("v"), i + 1, false) == 0);
+  }
+
+  // the finger has to land where a search from the head does, for keys that
+  // are present, missing, repeated and far apart.
+  csk_finger f;
+  cskiplist_finger_init(list, &f);
+  for (int i = 0; i < 10100; i += 1 + i % 7) {
+    snprintf(key, sizeof(key), "key%05d", i);
+    for (int repeat = 0; repeat < 1 + i % 2; repeat++) {
+      csk_node* expected = cskiplist_seek(list, slice_from_str(key));
+      assert(cskiplist_seek_finger(list, &f, slice_from_str(key)) == expected && "Finger search went wrong");
+    }
+  }
+
+  cskiplist_free(list);
+  arena_free(a);
+  printf("All finger search tests passed!\n\n");
+}
+
+void
+test_concurrent_inserts()
+{
+  printf("Testing concurrent inserts...\n");
+
+  arena* a = arena_new();
+  cskiplist* list = cskiplist_new(a);
+
+  pthread_t writers[NUM_WRITERS], reader;
+  writer_arg args[NUM_WRITERS];
+  pthread_create(&reader, NULL, reader_main, list);
+  for (int i = 0; i < NUM_WRITERS; i++) {
+    args[i].list = list;
+    args[i].id = i;
+    pthread_create(&writers[i], NULL, writer_main, &args[i]);
+  }
+  for (int i = 0; i < NUM_WRITERS; i++) {
+    pthread_join(writers[i], NULL);
+  }
+  pthread_join(reader, NULL);
+
+  assert(cskiplist_count(list) == NUM_WRITERS * KEYS_PER_WRITER + 1 && "Count doesn't match");
+  char key[32];
+  for (int w = 0; w < NUM_WRITERS; w++) {
+    for (int i = 0; i < KEYS_PER_WRITER; i++) {
+      snprintf(key, sizeof(key), "key%02d_%06d", w, i);
+      assert(cskiplist_find(list, slice_from_str(key)) != NULL && "Key lost");
+    }
+  }
+  snprintf(key, sizeof(key), "key%02d_%06d", NUM_WRITERS - 1, KEYS_PER_WRITER - 1);
+  csk_value* v = csk_node_value(cskiplist_find(list, slice_from_str("shared")));
+  assert(strcmp(v->data, key) == 0 && "Newest write to the shared key lost");
+  size_t num_values = 0;
+  for (; v != NULL; v = v->prev, num_values++) {
+    assert((v->prev == NULL || v->prev->seq < v->seq) && "Values out of order");
+  }
+  assert(num_values == NUM_WRITERS * KEYS_PER_WRITER && "Write to the shared key lost");
+
+  cskiplist_free(list);
+  arena_free(a);
+  printf("All concurrent insert tests passed!\n\n");
+}
+
+int
+main()
+{
+  printf("Starting concurrent skiplist tests...\n\n");
+
+  test_insert_and_find();
+  test_finger_search();
+  test_concurrent_inserts();
+
+  printf("All tests passed successfully!\n");
+  return 0;
+}
@@ -0,0 +1,239 @@
+#include "../iterator.h"
+#include "../lsmt.h"
+#include <assert.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define NUM_KEYS 3000
+
+static void
+remove_dir(const char* path)
+{
+  DIR* dir = opendir(path);
+  if (dir == NULL) {
+    return;
+  }
+
+  struct dirent* entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+      char file[1024];
+      snprintf(file, sizeof(file), "%s/%s", path, entry->d_name);
+      remove(file);
+    }
+  }
+  closedir(dir);
+  rmdir(path);
+}
+
+static char expected[NUM_KEYS][32]; // empty if the key isn't in the tree
+
+static void
+put(lsm_tree* tree, int i, const char* value)
+{
+  char key[32];
+  snprintf(key, sizeof(key), "key%06d", i);
+  assert(lsm_tree_put(tree, slice_from_str(key), slice_from_str(value)) == LSM_OK && "Put failed");
+  snprintf(expected[i], sizeof(expected[i]), "%s", value);
+}
+
+// check_entry asserts that the iterator is on key i with its newest value
+static void
+check_entry(lsm_iter* it, int i)
+{
+  char key[32];
+  snprintf(key, sizeof(key), "key%06d", i);
+  assert(it->valid && "Iterator ended early");
+  assert(slice_compare(it->key, slice_from_str(key)) == 0 && "Wrong key");
+  assert(slice_compare(it->value, slice_from_str(expected[i])) == 0 && "Wrong value");
+}
+
+static int
+next_live(int i, int step)
+{
+  for (i += step; i >= 0 && i < NUM_KEYS; i += step) {
+    if (expected[i][0] != '\0') {
+      return i;
+    }
+  }
+  return i;
+}
+
+static lsm_tree*
+build_tree(const char* test_dir)
+{
+  remove_dir(test_dir);
+  lsm_options opts;
+  lsm_options_default(&opts);
+  opts.memtable_size = 8 * 1024;
+  opts.table_file_size = 16 * 1024;
+  opts.level1_size = 64 * 1024;
+  lsm_tree* tree = lsm_tree_open(test_dir, &opts);
+  assert(tree != NULL && "Tree creation failed");
+
+  // every other key first, then the rest, so the versions of neighbouring
+  // keys end up in different tables and levels.
+  char value[32];
+  for (int pass = 0; pass < 2; pass++) {
+    for (int i = pass; i < NUM_KEYS; i += 2) {
+      snprintf(value, sizeof(value), "value%d", i);
+      put(tree, i, value);
+    }
+  }
+  assert(lsm_tree_wait_for_compactions(tree) == LSM_OK && "Compaction failed");
+
+  // newer versions in the memtables shadow the ones in the tables
+  for (int i = 0; i < NUM_KEYS; i += 3) {
+    snprintf(value, sizeof(value), "new%d", i);
+    put(tree, i, value);
+  }
+
+  for (int i = 0; i < NUM_KEYS; i += 5) {
+    char key[32];
+    snprintf(key, sizeof(key), "key%06d", i);
+    assert(lsm_tree_delete(tree, slice_from_str(key)) == LSM_OK && "Delete failed");
+    expected[i][0] = '\0';
+  }
+  return tree;
+}
+
+void
+test_scan()
+{
+  printf("Testing forward and backward scans...\n");
+
+  const char* test_dir = "test_iter_scan";
+  lsm_tree* tree = build_tree(test_dir);
+  assert(tree->levels[0].num_tables + tree->levels[1].num_tables > 1 && "Data should span tables");
+
+  lsm_iter* it = lsm_iter_new(tree);
+  assert(it != NULL && "Iterator creation failed");
+
+  int n = 0;
+  int i = next_live(-1, 1);
+  for (lsm_iter_seek_to_first(it); it->valid; lsm_iter_next(it)) {
+    check_entry(it, i);
+    i = next_live(i, 1);
+    n++;
+  }
+  assert(i >= NUM_KEYS && "Forward scan missed keys");
+  assert(it->error == 0 && "Forward scan failed");
+  printf("Forward scan returned %d keys\n", n);
+
+  i = next_live(NUM_KEYS, -1);
+  for (lsm_iter_seek_to_last(it); it->valid; lsm_iter_prev(it)) {
+    check_entry(it, i);
+    i = next_live(i, -1);
+  }
+  assert(i < 0 && "Backward scan missed keys");
+  assert(it->error == 0 && "Backward scan failed");
+  printf("Backward scan passed\n");
+
+  lsm_iter_free(it);
+  lsm_tree_free(tree);
+  remove_dir(test_dir);
+  printf("All scan tests passed!\n\n");
+}
+
+void
+test_seek_and_switch_direction()
+{
+  printf("Testing seeks and direction changes...\n");
+
+  const char* test_dir = "test_iter_seek";
+  lsm_tree* tree = build_tree(test_dir);
+  lsm_iter* it = lsm_iter_new(tree);
+  assert(it != NULL && "Iterator creation failed");
+
+  // a range scan over [key001000, key001100)
+  int i = next_live(999, 1);
+  for (lsm_iter_seek(it, slice_from_str("key001000"));
+       it->valid && slice_compare(it->key, slice_from_str("key001100")) < 0; lsm_iter_next(it)) {
+    check_entry(it, i);
+    i = next_live(i, 1);
+  }
+  assert(i == next_live(1099, 1) && "Range scan missed keys");
+
+  // a deleted key seeks to the next live one, a key past the end is invalid
+  lsm_iter_seek(it, slice_from_str("key000500"));
+  check_entry(it, 501);
+  lsm_iter_seek(it, slice_from_str("zzz"));
+  assert(!it->valid && "Seek past the end is valid");
+
+  // walk back and forth around the same position
+  lsm_iter_seek(it, slice_from_str("key002000a"));
+  i = next_live(2000, 1);
+  check_entry(it, i);
+  for (int step = 0; step < 50; step++) {
+    lsm_iter_prev(it);
+    i = next_live(i, -1);
+    check_entry(it, i);
+    lsm_iter_prev(it);
+    i = next_live(i, -1);
+    check_entry(it, i);
+    lsm_iter_next(it);
+    i = next_live(i, 1);
+    check_entry(it, i);
+  }
+
+  lsm_iter_seek_to_first(it);
+  lsm_iter_prev(it);
+  assert(!it->valid && "Moved before the first key");
+
+  lsm_iter_free(it);
+  lsm_tree_free(tree);
+  remove_dir(test_dir);
+  printf("All seek tests passed!\n\n");
+}
+
+void
+test_stable_view()
+{
+  printf("Testing the iterator across flushes...\n");
+
+  const char* test_dir = "test_iter_stable";
+  lsm_tree* tree = build_tree(test_dir);
+  lsm_iter* it = lsm_iter_new(tree);
+  assert(it != NULL && "Iterator creation failed");
+  lsm_iter_seek_to_first(it);
+
+  // flushing and compacting replaces the memtables and tables the iterator
+  // holds, it keeps reading the ones it started with. The memtable is frozen
+  // first, the writes after that go to one the iterator doesn't know about.
+  assert(lsm_tree_flush(tree) == LSM_OK && "Flush failed");
+  for (int i = 1; i < NUM_KEYS; i += 2) {
+    char key[32];
+    snprintf(key, sizeof(key), "key%06d", i);
+    assert(lsm_tree_put(tree, slice_from_str(key), slice_from_str("later")) == LSM_OK && "Put failed");
+  }
+  assert(lsm_tree_flush(tree) == LSM_OK && "Flush failed");
+  assert(lsm_tree_wait_for_compactions(tree) == LSM_OK && "Compaction failed");
+
+  int i = next_live(-1, 1);
+  for (; it->valid; lsm_iter_next(it)) {
+    check_entry(it, i);
+    i = next_live(i, 1);
+  }
+  assert(i >= NUM_KEYS && it->error == 0 && "Scan over the old state failed");
+
+  lsm_iter_free(it);
+  lsm_tree_free(tree);
+  remove_dir(test_dir);
+  printf("All stable view tests passed!\n\n");
+}
+
+int
+main()
+{
+  printf("Starting iterator tests...\n\n");
+
+  test_scan();
+  test_seek_and_switch_direction();
+  test_stable_view();
+
+  printf("All tests passed successfully!\n");
+  return 0;
+}
@@ -0,0 +1,1184 @@
+#include "../compaction.h"
+#include "../iterator.h"
+#include "../lsmt.h"
+#include <assert.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static void
+remove_dir(const char* path)
+{
+  DIR* dir = opendir(path);
+  if (dir == NULL) {
+    return;
+  }
+
+  struct dirent* entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+      char file[1024];
+      snprintf(file, sizeof(file), "%s/%s", path, entry->d_name);
+      remove(file);
+    }
+  }
+  closedir(dir);
+  rmdir(path);
+}
+
+static int
+count_files(const char* path, const char* ext)
+{
+  DIR* dir = opendir(path);
+  struct dirent* entry;
+  int count = 0;
+  while ((entry = readdir(dir)) != NULL) {
+    const char* dot = strchr(entry->d_name, '.');
+    if (dot && strcmp(dot + 1, ext) == 0) {
+      count++;
+    }
+  }
+  closedir(dir);
+  return count;
+}
+
+void
+test_flush_and_reopen()
+{
+  printf("Testing flush and reopen...\n");
+
+  const char* test_dir = "test_lsmt_dir";
+  remove_dir(test_dir);
+
+  lsm_options opts;
+  lsm_options_default(&opts);
+  opts.memtable_size = 16 * 1024;
+  lsm_tree* tree = lsm_tree_open(test_dir, &opts);
+  assert(tree != NULL && "Tree creation failed");
+
+  char key[32], value[64];
+  const int num_entries = 5000;
+  for (int i = 0; i < num_entries; i++) {
+    snprintf(key, sizeof(key), "key%06d", i);
+    snprintf(value, sizeof(value), "value%d", i);
+    assert(lsm_tree_put(tree, slice_from_str(key), slice_from_str(value)) == LSM_OK && "Put failed");
+  }
+  assert(lsm_tree_put(tree, slice_from_str("key000000"), slice_from_str("updated")) == LSM_OK && "Update failed");
+
+  for (int i = 0; i < num_entries; i++) {
+    slice retrieved;
+    snprintf(key, sizeof(key), "key%06d", i);
+    snprintf(value, sizeof(value), "value%d", i);
+    assert(lsm_tree_get(tree, slice_from_str(key), &retrieved) == LSM_OK && "Get failed");
+    assert(strcmp(retrieved.data, i == 0 ? "updated" : value) == 0 && "Value doesn't match");
+    slice_free(retrieved);
+  }
+
+  slice retrieved;
+  assert(lsm_tree_get(tree, slice_from_str("missing"), &retrieved) == LSM_NOT_FOUND && "Missing key found");
+  printf("Reads across memtables and tables passed\n");
+
+  assert(lsm_tree_flush(tree) == LSM_OK && "Flush failed");
+  assert(tree->levels[0].num_tables > 0 && "Nothing was flushed");
+  // the filter of the new memtable is sized after the keys the old ones held
+  size_t expected_keys = opts.memtable_size / tree->entry_size;
+  assert(tree->entry_size < LSM_ENTRY_SIZE_GUESS && "Entry size wasn't learned");
+  assert(tree->active->bloom_filter->vec->size >= expected_keys * MEMTABLE_BLOOM_BITS_PER_KEY &&
+      "Memtable filter is too small");
+  assert(tree->old_memtables == NULL && "Frozen memtables were not flushed");
+  assert(count_files(test_dir, "mem") == 1 && "Flushed logs were not removed");
+  assert(lsm_tree_put(tree, slice_from_str("key000001"), slice_from_str("unflushed")) == LSM_OK && "Put failed");
+
+  lsm_tree_free(tree);
+
+  // the last write is only in the log, reopening replays and flushes it
+  tree = lsm_tree_open(test_dir, &opts);
+  assert(tree != NULL && "Reopen failed");
+  assert(lsm_tree_flush(tree) == LSM_OK && "Flush after reopen failed");
+  assert(count_files(test_dir, "mem") == 1 && "Recovered logs were not removed");
+
+  for (int i = 0; i < num_entries; i++) {
+    snprintf(key, sizeof(key), "key%06d", i);
+    snprintf(value, sizeof(value), "value%d", i);
+    assert(lsm_tree_get(tree, slice_from_str(key), &retrieved) == LSM_OK && "Get after reopen failed");
+    const char* expected = i == 0 ? "updated" : i == 1 ? "unflushed" : value;
+    assert(strcmp(retrieved.data, expected) == 0 && "Value doesn't match after reopen");
+    slice_free(retrieved);
+  }
+  printf("Reopen test passed\n");
+
+  lsm_tree_free(tree);
+  remove_dir(test_dir);
+  printf("All flush and reopen tests passed!\n\n");
+}
+
+void
+test_recover_many_logs()
+{
+  printf("Testing recovery of several logs...\n");
+
+  const char* test_dir = "test_lsmt_recover";
+  remove_dir(test_dir);
+  mkdir(test_dir, 0755);
+
+  // logs left behind by memtables that were never flushed, later ones
+  // overwrite keys of earlier ones.
+  enum { NUM_LOGS = 6, KEYS_PER_LOG = 2000 };
+  char path[1024], key[32], value[32];
+  for (int l = 0; l < NUM_LOGS; l++) {
+    snprintf(path, sizeof(path), "%s/%06d.mem", test_dir, l + 1);
+    memtable* mt = memtable_new_wal(KEYS_PER_LOG, path);
+    assert(mt != NULL && "Failed to create log");
+    for (int i = 0; i < KEYS_PER_LOG; i++) {
+      snprintf(key, sizeof(key), "key%06d", l * KEYS_PER_LOG / 2 + i);
+      snprintf(value, sizeof(value), "log%d", l);
+      assert(memtable_insert(mt, slice_from_str(key), slice_from_str(value)) == MEMTABLE_OK && "Insert failed");
+    }
+    memtable_free(mt);
+  }
+
+  lsm_options opts;
+  lsm_options_default(&opts);
+  lsm_tree* tree = lsm_tree_open(test_dir, &opts);
+  assert(tree != NULL && "Reopen failed");
+  assert(tree->last_seq == NUM_LOGS * KEYS_PER_LOG && "Recovered writes weren't numbered");
+
+  int num_keys = (NUM_LOGS + 1) * KEYS_PER_LOG / 2;
+  for (int i = 0; i < num_keys; i++) {
+    snprintf(key, sizeof(key), "key%06d", i);
+    int newest = i / (KEYS_PER_LOG / 2);
+    snprintf(value, sizeof(value), "log%d", newest < NUM_LOGS ? newest : NUM_LOGS - 1);
+    slice retrieved;
+    assert(lsm_tree_get(tree, slice_from_str(key), &retrieved) == LSM_OK && "Recovered key missing");
+    assert(strcmp(retrieved.data, value) == 0 && "Older log won");
+    slice_free(retrieved);
+  }
+
+  // the recovered memtables are flushed like any other
+  assert(lsm_tree_flush(tree) == LSM_OK && "Flush failed");
+  assert(count_files(test_dir, "mem") == 1 && "Recovered logs were not removed");
+
+  lsm_tree_free(tree);
+  remove_dir(test_dir);
+  printf("All log recovery tests passed!\n\n");
+}
+
+// find_file sets path to the first file in dir with extension ext.
+static void
+find_file(const char* dir_path, const char* ext, char* path, size_t size)
+{
+  DIR* dir = opendir(dir_path);
+  struct dirent* entry;
+  path[0] = '\0';
+  while (path[0] == '\0' && (entry = readdir(dir)) != NULL) {
+    const char* dot = strchr(entry->d_name, '.');
+    if (dot && strcmp(dot + 1, ext) == 0) {
+      snprintf(path, size, "%s/%s", dir_path, entry->d_name);
+    }
+  }
+  closedir(dir);
+  assert(path[0] != '\0' && "File not found");
+}
+
+// reopen_with_log opens the tree in dir after its only log went through
+// damage, which is applied to the log's path. The tree is left with one log
+// again that holds the key "unflushed".
+static lsm_tree*
+reopen_with_log(const char* dir, lsm_options* opts, void (*damage)(const char* path))
+{
+  char path[1024];
+  assert(count_files(dir, "mem") == 1 && "Expected a single log");
+  find_file(dir, "mem", path, sizeof(path));
+  damage(path);
+
+  lsm_tree* tree = lsm_tree_open(dir, opts);
+  if (tree == NULL) {
+    return NULL;
+  }
+  assert(lsm_tree_flush(tree) == LSM_OK && "Flush failed");
+  assert(lsm_tree_put(tree, slice_from_str("unflushed"), slice_from_str("value")) == LSM_OK && "Put failed");
+  return tree;
+}
+
+static void
+empty_log(const char* path)
+{
+  assert(truncate(path, 0) == 0 && "Truncate failed");
+}
+
+static void
+short_log(const char* path)
+{
+  assert(truncate(path, sizeof(wal_header) - 1) == 0 && "Truncate failed");
+}
+
+static void
+missing_log(const char* path)
+{
+  assert(remove(path) == 0 && "Remove failed");
+}
+
+static void
+foreign_log(const char* path)
+{
+  FILE* f = fopen(path, "r+b");
+  assert(f != NULL && fwrite("junk", 1, 4, f) == 4 && "Write failed");
+  fclose(f);
+}
+
+void
+test_damaged_logs()
+{
+  printf("Testing recovery of damaged logs...\n");
+
+  const char* test_dir = "test_lsmt_damaged_logs";
+  remove_dir(test_dir);
+
+  lsm_options opts;
+  lsm_options_default(&opts);
+  lsm_tree* tree = lsm_tree_open(test_dir, &opts);
+  assert(tree != NULL && "Tree creation failed");
+  char key[32];
+  for (int i = 0; i < 1000; i++) {
+    snprintf(key, sizeof(key), "key%06d", i);
+    assert(lsm_tree_put(tree, slice_from_str(key), slice_from_str("value")) == LSM_OK && "Put failed");
+  }
+  assert(lsm_tree_flush(tree) == LSM_OK && "Flush failed");
+  assert(lsm_tree_put(tree, slice_from_str("unflushed"), slice_from_str("value")) == LSM_OK && "Put failed");
+  lsm_tree_free(tree);
+
+  // a crash can leave a log the manifest lists empty, cut short in its header
+  // or not there at all. Such a log held no writes.
+  void (*damages[])(const char*) = { empty_log, short_log, missing_log };
+  for (size_t d = 0; d < sizeof(damages) / sizeof(damages[0]); d++) {
+    tree = reopen_with_log(test_dir, &opts, damages[d]);
+    assert(tree != NULL && "Reopen with a damaged log failed");
+    slice retrieved;
+    assert(lsm_tree_get(tree, slice_from_str("key000500"), &retrieved) == LSM_OK && "Flushed key missing");
+    slice_free(retrieved);
+    lsm_tree_free(tree);
+  }
+
+  // a log that isn't one is still an error
+  tree = reopen_with_log(test_dir, &opts, foreign_log);
+  assert(tree == NULL && "Foreign log was accepted");
+
+  remove_dir(test_dir);
+  printf("All damaged log tests passed!\n\n");
+}
+
+static void
+copy_file(const char* from, const char* to)
+{
+  FILE* in = fopen(from, "rb");
+  FILE* out = fopen(to, "wb");
+  assert(in != NULL && out != NULL && "Failed to copy file");
+  char buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+    assert(fwrite(buf, 1, n, out) == n && "Failed to copy file");
+  }
+  fclose(in);
+  fclose(out);
+}
+
+void
+test_manifest()
+{
+  printf("Testing the manifest...\n");
+
+  const char* test_dir = "test_lsmt_manifest";
+  remove_dir(test_dir);
+
+  lsm_options opts;
+  lsm_options_default(&opts);
+  opts.memtable_size = 8 * 1024;
+  opts.table_file_size = 16 * 1024;
+  opts.level1_size = 64 * 1024;
+  lsm_tree* tree = lsm_tree_open(test_dir, &opts);
+  assert(tree != NULL && "Tree creation failed");
+
+  char key[32], value[32];
+  for (int i = 0; i < 5000; i++) {
+    snprintf(key, sizeof(key), "key%06d", i % 3000);
+    snprintf(value, sizeof(value), "value%d", i);
+    assert(lsm_tree_put(tree, slice_from_str(key), slice_from_str(value)) == LSM_OK && "Put failed");
+  }
+  assert(lsm_tree_flush(tree) == LSM_OK && "Flush failed");
+  assert(lsm_tree_wait_for_compactions(tree) == LSM_OK && "Compaction failed");
+  assert(tree->levels[1].num_tables > 0 && "Nothing was compacted");
+
+  // leftovers of a compaction that crashed before it was recorded: a copy of
+  // a live table that overlaps it, and a table that was never finished.
+  char path[1024];
+  snprintf(path, sizeof(path), "%s/900000.sst", test_dir);
+  copy_file(tree->levels[1].tables[0]->filename, path);
+  snprintf(path, sizeof(path), "%s/900001.sst.tmp", test_dir);
+  copy_file(tree->levels[1].tables[0]->filename, path);
+  size_t num_tables[LSM_NUM_LEVELS];
+  for (int l = 0; l < LSM_NUM_LEVELS; l++) {
+    num_tables[l] = tree->levels[l].num_tables;
+  }
+  lsm_tree_free(tree);
+
+  // everything was flushed, so the reopened tree has nothing to flush or
+  // compact.
+  tree = lsm_tree_open(test_dir, &opts);
+  assert(tree != NULL && "Reopen failed");
+  pthread_mutex_lock(&tree->lock);
+  for (int l = 0; l < LSM_NUM_LEVELS; l++) {
+    assert(tree->levels[l].num_tables == num_tables[l] && "Tables don't match the manifest");
+  }
+  assert(tree->next_file_num < 900000 && "File numbers of unrecorded files were reused");
+  pthread_mutex_unlock(&tree->lock);
+  assert(access(path, F_OK) != 0 && "Unfinished table wasn't removed");
+  snprintf(path, sizeof(path), "%s/900000.sst", test_dir);
+  assert(access(path, F_OK) != 0 && "Unrecorded table wasn't removed");
+  snprintf(path, sizeof(path), "%s/CURRENT", test_dir);
+  assert(access(path, F_OK) == 0 && "CURRENT is missing");
+  assert(count_files(test_dir, "manifest") == 1 && "Old manifests were not removed");
+
+  for (int i = 0; i < 3000; i++) {
+    snprintf(key, sizeof(key), "key%06d", i);
+    snprintf(value, sizeof(value), "value%d", i < 2000 ? i + 3000 : i);
+    slice retrieved;
+    assert(lsm_tree_get(tree, slice_from_str(key), &retrieved) == LSM_OK && "Get after reopen failed");
+    assert(strcmp(retrieved.data, value) == 0 && "Value doesn't match after reopen");
+    slice_free(retrieved);
+  }
+
+  lsm_tree_free(tree);
+  remove_dir(test_dir);
+  printf("All manifest tests passed!\n\n");
+}
+
+typedef struct {
+  lsm_tree* tree;
+  int id;
+} writer_arg;
+
+static void*
+writer_main(void* arg)
+{
+  writer_arg* w = arg;
+  char key[32], value[32];
+  for (int i = 0; i < 2000; i++) {
+    snprintf(key, sizeof(key), "w%d-%06d", w->id, i);
+    snprintf(value, sizeof(value), "%d", i);
+    assert(lsm_tree_put(w->tree, slice_from_str(key), slice_from_str(value)) == LSM_OK && "Concurrent put failed");
+  }
+  return NULL;
+}
+
+void
+test_binary_keys()
+{
+  printf("Testing binary keys and values...\n");
+
+  const char* test_dir = "test_lsmt_binary";
+  remove_dir(test_dir);
+
+  lsm_options opts;
+  lsm_options_default(&opts);
+  opts.memtable_size = 16 * 1024;
+  lsm_tree* tree = lsm_tree_open(test_dir, &opts);
+  assert(tree != NULL && "Tree creation failed");
+
+  // big endian integers sort in numeric order and are full of zero bytes
+  const uint32_t num_entries = 3000;
+  for (uint32_t i = 0; i < num_entries; i++) {
+    char key[4] = { i >> 24, i >> 16, i >> 8, i };
+    char value[8] = { 0, 'v', 0, 0, i >> 24, i >> 16, i >> 8, i };
+    assert(lsm_tree_put(tree, slice_new(key, sizeof(key)), slice_new(value, sizeof(value))) == LSM_OK &&
+        "Put failed");
+  }
+  // a key and the same key followed by a zero byte are different keys
+  assert(lsm_tree_put(tree, slice_new("a", 1), slice_new("1", 1)) == LSM_OK && "Put failed");
+  assert(lsm_tree_put(tree, slice_new("a\0", 2), slice_new("2", 1)) == LSM_OK && "Put failed");
+
+  for (int pass = 0; pass < 2; pass++) {
+    for (uint32_t i = 0; i < num_entries; i++) {
+      char key[4] = { i >> 24, i >> 16, i >> 8, i };
+      char value[8] = { 0, 'v', 0, 0, i >> 24, i >> 16, i >> 8, i };
+      slice retrieved;
+      assert(lsm_tree_get(tree, slice_new(key, sizeof(key)), &retrieved) == LSM_OK && "Get failed");
+      assert(retrieved.size == sizeof(value) && memcmp(retrieved.data, value, sizeof(value)) == 0 &&
+          "Value doesn't match");
+      slice_free(retrieved);
+    }
+
+    slice retrieved;
+    assert(lsm_tree_get(tree, slice_new("a", 1), &retrieved) == LSM_OK && retrieved.size == 1 &&
+        retrieved.data[0] == '1' && "Prefix key doesn't match");
+    slice_free(retrieved);
+    assert(lsm_tree_get(tree, slice_new("a\0", 2), &retrieved) == LSM_OK && retrieved.size == 1 &&
+        retrieved.data[0] == '2' && "Zero terminated key doesn't match");
+    slice_free(retrieved);
+    assert(lsm_tree_get(tree, slice_new("\0\0", 2), &retrieved) == LSM_NOT_FOUND && "Missing key found");
+
+    // read everything again from the tables of a reopened tree
+    assert(lsm_tree_flush(tree) == LSM_OK && "Flush failed");
+    lsm_tree_free(tree);
+    tree = lsm_tree_open(test_dir, &opts);
+    assert(tree != NULL && "Reopen failed");
+  }
+
+  lsm_tree_free(tree);
+  remove_dir(test_dir);
+  printf("All binary key tests passed!\n\n");
+}
+
+void
+test_pinned_get()
+{
+  printf("Testing pinned gets...\n");
+
+  const char* test_dir = "test_lsmt_pinned";
+  remove_dir(test_dir);
+
+  lsm_options opts;
+  lsm_options_default(&opts);
+  opts.memtable_size = 64 * 1024;
+  lsm_tree* tree = lsm_tree_open(test_dir, &opts);
+  assert(tree != NULL && "Tree creation failed");
+
+  char value[16 * 1024];
+  memset(value, 'v', sizeof(value));
+  assert(lsm_tree_put(tree, slice_from_str("big"), slice_new(value, sizeof(value))) == LSM_OK && "Put failed");
+
+  pinned_slice from_mem;
+  assert(lsm_tree_get_pinned(tree, slice_from_str("big"), &from_mem) == LSM_OK && "Pinned get failed");
+  assert(from_mem.value.size == sizeof(value) && memcmp(from_mem.value.data, value, sizeof(value)) == 0 &&
+      "Pinned value doesn't match");
+
+  // flushing drops the tree's reference to the memtable, the pin keeps it
+  // alive and a newer write doesn't change the pinned value.
+  assert(lsm_tree_flush(tree) == LSM_OK && "Flush failed");
+  assert(lsm_tree_put(tree, slice_from_str("big"), slice_from_str("small")) == LSM_OK && "Put failed");
+  assert(memcmp(from_mem.value.data, value, sizeof(value)) == 0 && "Pinned value changed");
+  pinned_slice_release(&from_mem);
+
+  assert(lsm_tree_flush(tree) == LSM_OK && "Flush failed");
+  pinned_slice from_table;
+  assert(lsm_tree_get_pinned(tree, slice_from_str("big"), &from_table) == LSM_OK && "Pinned get failed");
+  assert(from_table.value.size == 5 && memcmp(from_table.value.data, "small", 5) == 0 &&
+      "Pinned value doesn't match");
+  lsm_tree_free(tree);
+  assert(memcmp(from_table.value.data, "small", 5) == 0 && "Pinned value changed");
+  pinned_slice_release(&from_table);
+
+  // a value read from a mapped table keeps the mapping alive
+  opts.use_mmap_reads = true;
+  tree = lsm_tree_open(test_dir, &opts);
+  assert(tree != NULL && "Reopen failed");
+  assert(lsm_tree_get_pinned(tree, slice_from_str("big"), &from_table) == LSM_OK && "Pinned get failed");
+  lsm_tree_free(tree);
+  assert(from_table.value.size == 5 && memcmp(from_table.value.data, "small", 5) == 0 &&
+      "Mapped value doesn't match");
+  pinned_slice_release(&from_table);
+
+  remove_dir(test_dir);
+  printf("All pinned get tests passed!\n\n");
+}
+
+void
+test_multi_get()
+{
+  printf("Testing multi get...\n");
+
+  const char* test_dir = "test_lsmt_multi_get";
+  remove_dir(test_dir);
+
+  lsm_options opts;
+  lsm_options_default(&opts);
+  opts.memtable_size = 8 * 1024;
+  lsm_tree* tree = lsm_tree_open(test_dir, &opts);
+  assert(tree != NULL && "Tree creation failed");
+
+  // versions spread over the tables and the memtables
+  char key[32], value[32];
+  for (int i = 0; i < 4000; i += 2) {
+    snprintf(key, sizeof(key), "key%06d", i);
+    snprintf(value, sizeof(value), "old%d", i);
+    assert(lsm_tree_put(tree, slice_from_str(key), slice_from_str(value)) == LSM_OK && "Put failed");
+  }
+  assert(lsm_tree_wait_for_compactions(tree) == LSM_OK && "Compaction failed");
+  for (int i = 0; i < 4000; i += 6) {
+    snprintf(key, sizeof(key), "key%06d", i);
+    snprintf(value, sizeof(value), "new%d", i);
+    assert(lsm_tree_put(tree, slice_from_str(key), slice_from_str(value)) == LSM_OK && "Put failed");
+  }
+
+  // unsorted, with odd keys that are missing and a duplicate
+  enum { N = 500 };
+  char key_bufs[N][32];
+  slice keys[N];
+  slice values[N];
+  lsm_res results[N];
+  for (int i = 0; i < N; i++) {
+    snprintf(key_bufs[i], sizeof(key_bufs[i]), "key%06d", (i * 7919) % 4001);
+    keys[i] = slice_from_str(key_bufs[i]);
+  }
+  keys[N - 1] = keys[0];
+  assert(lsm_tree_multi_get(tree, keys, N, values, results) == LSM_OK && "Multi get failed");
+
+  int found = 0;
+  for (int i = 0; i < N; i++) {
+    slice expected;
+    lsm_res res = lsm_tree_get(tree, keys[i], &expected);
+    assert(results[i] == res && "Multi get and get disagree");
+    if (res == LSM_OK) {
+      assert(slice_compare(values[i], expected) == 0 && "Multi get value doesn't match");
+      slice_free(expected);
+      slice_free(values[i]);
+      found++;
+    }
+  }
+  printf("%d of %d keys found\n", found, N);
+  assert(found > 0 && found < N && "Expected both hits and misses");
+
+  lsm_tree_free(tree);
+  remove_dir(test_dir);
+  printf("All multi get tests passed!\n\n");
+}
+
+void
+test_write_batch()
+{
+  printf("Testing write batches...\n");
+
+  const char* test_dir = "test_lsmt_batch";
+  remove_dir(test_dir);
+
+  lsm_options opts;
+  lsm_options_default(&opts);
+  lsm_tree* tree = lsm_tree_open(test_dir, &opts);
+  assert(tree != NULL && "Tree creation failed");
+  assert(lsm_tree_put(tree, slice_from_str("from"), slice_from_str("100")) == LSM_OK && "Put failed");
+  assert(lsm_tree_put(tree, slice_from_str("temp"), slice_from_str("x")) == LSM_OK && "Put failed");
+
+  // move the balance in one write
+  write_batch* b = write_batch_new();
+  assert(b != NULL && "Batch creation failed");
+  assert(write_batch_put(b, slice_from_str("from"), slice_from_str("60")) == 0 && "Batch put failed");
+  assert(write_batch_put(b, slice_from_str("to"), slice_from_str("40")) == 0 && "Batch put failed");
+  assert(write_batch_delete(b, slice_from_str("temp")) == 0 && "Batch delete failed");
+  uint64_t seq = tree->last_seq;
+  assert(lsm_tree_write(tree, b) == LSM_OK && "Batch write failed");
+  assert(tree->last_seq == seq + 3 && "Batch operations weren't numbered");
+  assert(tree->active->wal->seq == 4 && "Batch took more than one log record");
+
+  // an empty batch writes nothing, an oversized key fails the whole batch
+  write_batch_clear(b);
+  assert(lsm_tree_write(tree, b) == LSM_OK && tree->last_seq == seq + 3 && "Empty batch was written");
+  char big_key[UINT16_MAX + 1];
+  memset(big_key, 'k', sizeof(big_key));
+  assert(write_batch_put(b, slice_from_str("lost"), slice_from_str("1")) == 0 && "Batch put failed");
+  assert(write_batch_put(b, slice_new(big_key, sizeof(big_key)), slice_from_str("1")) != 0 && "Oversized key added");
+  assert(lsm_tree_write(tree, b) == LSM_FAILED && "Broken batch was written");
+  write_batch_free(b);
+
+  assert(lsm_tree_delete(tree, slice_from_str("to")) == LSM_OK && "Delete failed");
+  assert(lsm_tree_put(tree, slice_from_str("to"), slice_from_str("40")) == LSM_OK && "Put failed");
+  lsm_tree_free(tree);
+
+  // the batch is replayed from the log
+  tree = lsm_tree_open(test_dir, &opts);
+  assert(tree != NULL && "Reopen failed");
+  const char* keys[] = { "from", "to", "temp", "lost" };
+  const char* expected[] = { "60", "40", NULL, NULL };
+  for (int i = 0; i < 4; i++) {
+    slice value;
+    lsm_res res = lsm_tree_get(tree, slice_from_str(keys[i]), &value);
+    if (expected[i] == NULL) {
+      assert(res == LSM_NOT_FOUND && "Deleted or failed key found");
+      continue;
+    }
+    assert(res == LSM_OK && strcmp(value.data, expected[i]) == 0 && "Batch value doesn't match");
+    slice_free(value);
+  }
+
+  lsm_tree_free(tree);
+  remove_dir(test_dir);
+  printf("All write batch tests passed!\n\n");
+}
+
+void
+test_concurrent_writers()
+{
+  printf("Testing concurrent writers...\n");
+
+  const char* test_dir = "test_lsmt_concurrent";
+  remove_dir(test_dir);
+
+  lsm_options opts;
+  lsm_options_default(&opts);
+  opts.memtable_size = 8 * 1024;
+  lsm_tree* tree = lsm_tree_open(test_dir, &opts);
+  assert(tree != NULL && "Tree creation failed");
+
+  pthread_t threads[4];
+  writer_arg args[4];
+  for (int i = 0; i < 4; i++) {
+    args[i].tree = tree;
+    args[i].id = i;
+    pthread_create(&threads[i], NULL, writer_main, &args[i]);
+  }
+  for (int i = 0; i < 4; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  assert(lsm_tree_flush(tree) == LSM_OK && "Flush failed");
+
+  char key[32], value[32];
+  for (int t = 0; t < 4; t++) {
+    for (int i = 0; i < 2000; i++) {
+      slice retrieved;
+      snprintf(key, sizeof(key), "w%d-%06d", t, i);
+      snprintf(value, sizeof(value), "%d", i);
+      assert(lsm_tree_get(tree, slice_from_str(key), &retrieved) == LSM_OK && "Get failed");
+      assert(strcmp(retrieved.data, value) == 0 && "Value doesn't match");
+      slice_free(retrieved);
+    }
+  }
+
+  lsm_tree_free(tree);
+  remove_dir(test_dir);
+  printf("All concurrent writer tests passed!\n\n");
+}
+
+enum { NUM_BATCH_WRITERS = 3, BATCHES_PER_WRITER = 2000 };
+
+typedef struct {
+  lsm_tree* tree;
+  int id;
+  int* done; // set by the last writer, updated atomically
+} batch_writer_arg;
+
+// batch_writer_main writes a<id> and b<id> together, with the number of the
+// batch as their value.
+static void*
+batch_writer_main(void* arg)
+{
+  batch_writer_arg* w = arg;
+  write_batch* batch = write_batch_new();
+  assert(batch != NULL && "Batch creation failed");
+  char a[16], b[16], value[16];
+  snprintf(a, sizeof(a), "a%d", w->id);
+  snprintf(b, sizeof(b), "b%d", w->id);
+  for (int i = 1; i <= BATCHES_PER_WRITER; i++) {
+    snprintf(value, sizeof(value), "%08d", i);
+    write_batch_clear(batch);
+    assert(write_batch_put(batch, slice_from_str(a), slice_from_str(value)) == 0 &&
+        write_batch_put(batch, slice_from_str(b), slice_from_str(value)) == 0 && "Batch put failed");
+    assert(lsm_tree_write(w->tree, batch) == LSM_OK && "Write failed");
+  }
+  write_batch_free(batch);
+  __atomic_add_fetch(w->done, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+// batch_reader_main checks that every read sees both keys of a batch or
+// neither, until the writers are done.
+static void*
+batch_reader_main(void* arg)
+{
+  batch_writer_arg* r = arg;
+  char a[16], b[16];
+  while (__atomic_load_n(r->done, __ATOMIC_ACQUIRE) < NUM_BATCH_WRITERS) {
+    for (int w = 0; w < NUM_BATCH_WRITERS; w++) {
+      snprintf(a, sizeof(a), "a%d", w);
+      snprintf(b, sizeof(b), "b%d", w);
+
+      // b is written after a in every batch, so once a batch's a is seen
+      // its b is too
+      slice va, vb;
+      lsm_res ra = lsm_tree_get(r->tree, slice_from_str(a), &va);
+      lsm_res rb = lsm_tree_get(r->tree, slice_from_str(b), &vb);
+      assert(ra != LSM_FAILED && rb != LSM_FAILED && "Get failed");
+      assert((ra == LSM_NOT_FOUND || rb == LSM_OK) && "Half a batch was seen");
+      if (ra == LSM_OK) {
+        assert(strcmp(vb.data, va.data) >= 0 && "Half a batch was seen");
+        slice_free(va);
+      }
+      if (rb == LSM_OK) {
+        slice_free(vb);
+      }
+
+      slice keys[2] = { slice_from_str(a), slice_from_str(b) };
+      slice values[2];
+      lsm_res results[2];
+      assert(lsm_tree_multi_get(r->tree, keys, 2, values, results) == LSM_OK && "Multi get failed");
+      assert(results[0] == results[1] && "Half a batch was seen");
+      if (results[0] == LSM_OK) {
+        assert(strcmp(values[0].data, values[1].data) == 0 && "Half a batch was seen");
+        slice_free(values[0]);
+        slice_free(values[1]);
+      }
+    }
+
+    // a scan sees the keys a0.. then b0..
+    char seen[2 * NUM_BATCH_WRITERS][16] = { { 0 } };
+    lsm_iter* it = lsm_iter_new(r->tree);
+    assert(it != NULL && "Iterator creation failed");
+    for (lsm_iter_seek_to_first(it); it->valid; lsm_iter_next(it)) {
+      int w = it->key.data[1] - '0';
+      int k = (it->key.data[0] == 'b') * NUM_BATCH_WRITERS + w;
+      assert(it->value.size < sizeof(seen[k]) && "Unexpected value");
+      memcpy(seen[k], it->value.data, it->value.size);
+    }
+    assert(it->error == 0 && "Scan failed");
+    lsm_iter_free(it);
+    for (int w = 0; w < NUM_BATCH_WRITERS; w++) {
+      assert(strcmp(seen[w], seen[NUM_BATCH_WRITERS + w]) == 0 && "Scan saw half a batch");
+    }
+  }
+  return NULL;
+}
+
+void
+test_batch_visibility()
+{
+  printf("Testing batch visibility...\n");
+
+  const char* test_dir = "test_lsmt_batch_visibility";
+  remove_dir(test_dir);
+
+  lsm_options opts;
+  lsm_options_default(&opts);
+  opts.memtable_size = 8 * 1024;
+  opts.wal_sync = WAL_SYNC_OS;
+  lsm_tree* tree = lsm_tree_open(test_dir, &opts);
+  assert(tree != NULL && "Tree creation failed");
+
+  // the writers finish their batches out of order, readers must still never
+  // see one of them in part
+  int done = 0;
+  pthread_t writers[NUM_BATCH_WRITERS], reader;
+  batch_writer_arg args[NUM_BATCH_WRITERS + 1];
+  for (int i = 0; i <= NUM_BATCH_WRITERS; i++) {
+    args[i].tree = tree;
+    args[i].id = i;
+    args[i].done = &done;
+  }
+  pthread_create(&reader, NULL, batch_reader_main, &args[NUM_BATCH_WRITERS]);
+  for (int i = 0; i < NUM_BATCH_WRITERS; i++) {
+    pthread_create(&writers[i], NULL, batch_writer_main, &args[i]);
+  }
+  for (int i = 0; i < NUM_BATCH_WRITERS; i++) {
+    pthread_join(writers[i], NULL);
+  }
+  pthread_join(reader, NULL);
+  assert(tree->visible_seq == tree->last_seq && "Writes were left unpublished");
+
+  lsm_tree_free(tree);
+  remove_dir(test_dir);
+  printf("All batch visibility tests passed!\n\n");
+}
+
+static void
+check_levels(lsm_tree* tree)
+{
+  for (uint32_t l = 1; l < LSM_NUM_LEVELS; l++) {
+    lsm_level* level = &tree->levels[l];
+    for (size_t i = 0; i < level->num_tables; i++) {
+      assert(level->tables[i]->level == l && "Table is in the wrong level");
+      if (i > 0) {
+        assert(slice_compare(level->tables[i - 1]->largest, level->tables[i]->smallest) < 0 &&
+            "Tables overlap");
+      }
+    }
+  }
+}
+
+void
+test_leveled_compaction()
+{
+  printf("Testing leveled compaction...\n");
+
+  const char* test_dir = "test_lsmt_compaction";
+  remove_dir(test_dir);
+
+  lsm_options opts;
+  lsm_options_default(&opts);
+  opts.memtable_size = 8 * 1024;
+  opts.table_file_size = 16 * 1024;
+  opts.level1_size = 64 * 1024;
+  opts.level_size_ratio = 4;
+  opts.level0_compaction_trigger = 2;
+  // the sizes above assume uncompressed tables until L2 is reached, the
+  // colder levels use the heavier codec
+  for (int l = 0; l < LSM_NUM_LEVELS; l++) {
+    opts.compression[l] = l < 2 ? COMPRESS_NONE : COMPRESS_HIGH;
+  }
+  lsm_tree* tree = lsm_tree_open(test_dir, &opts);
+  assert(tree != NULL && "Tree creation failed");
+
+  char key[32], value[64];
+  const int num_keys = 4000;
+  for (int round = 0; round < 3; round++) {
+    for (int i = 0; i < num_keys; i++) {
+      snprintf(key, sizeof(key), "key%06d", (i * 7919) % num_keys);
+      snprintf(value, sizeof(value), "value%d-%d", (i * 7919) % num_keys, round);
+      assert(lsm_tree_put(tree, slice_from_str(key), slice_from_str(value)) == LSM_OK && "Put failed");
+    }
+  }
+  assert(lsm_tree_flush(tree) == LSM_OK && "Flush failed");
+  assert(lsm_tree_wait_for_compactions(tree) == LSM_OK && "Compaction failed");
+
+  assert(tree->levels[0].num_tables < opts.level0_compaction_trigger && "L0 was not compacted");
+  assert(tree->levels[1].num_tables > 0 && "Nothing was compacted into L1");
+  assert(tree->levels[2].num_tables > 0 && "Nothing was compacted into L2");
+  for (int l = 1; l < LSM_NUM_LEVELS - 1; l++) {
+    assert(compaction_score(tree, l) < 1 && "Level is over its target");
+  }
+  check_levels(tree);
+  printf("Level shape test passed\n");
+
+  for (int i = 0; i < num_keys; i++) {
+    slice retrieved;
+    snprintf(key, sizeof(key), "key%06d", i);
+    snprintf(value, sizeof(value), "value%d-2", i);
+    assert(lsm_tree_get(tree, slice_from_str(key), &retrieved) == LSM_OK && "Get failed");
+    assert(strcmp(retrieved.data, value) == 0 && "Compaction kept an old version");
+    slice_free(retrieved);
+  }
+  lsm_tree_free(tree);
+
+  tree = lsm_tree_open(test_dir, &opts);
+  assert(tree != NULL && "Reopen failed");
+  check_levels(tree);
+  for (int i = 0; i < num_keys; i += 97) {
+    slice retrieved;
+    snprintf(key, sizeof(key), "key%06d", i);
+    snprintf(value, sizeof(value), "value%d-2", i);
+    assert(lsm_tree_get(tree, slice_from_str(key), &retrieved) == LSM_OK && "Get after reopen failed");
+    assert(strcmp(retrieved.data, value) == 0 && "Value doesn't match after reopen");
+    slice_free(retrieved);
+  }
+  printf("Reopen after compaction test passed\n");
+
+  lsm_tree_free(tree);
+  remove_dir(test_dir);
+  printf("All leveled compaction tests passed!\n\n");
+}
+
+// check_deletes compares get, multi get and a scan of the tree with the
+// expected values, an empty one means the key is deleted.
+static void
+check_deletes(lsm_tree* tree, char (*expected)[32], int num_keys)
+{
+  enum { N = 256 };
+  char key_bufs[N][32];
+  slice keys[N];
+  slice values[N];
+  lsm_res results[N];
+
+  int live = 0;
+  for (int start = 0; start < num_keys; start += N) {
+    int n = num_keys - start < N ? num_keys - start : N;
+    for (int i = 0; i < n; i++) {
+      snprintf(key_bufs[i], sizeof(key_bufs[i]), "key%06d", start + i);
+      keys[i] = slice_from_str(key_bufs[i]);
+    }
+    assert(lsm_tree_multi_get(tree, keys, n, values, results) == LSM_OK && "Multi get failed");
+
+    for (int i = 0; i < n; i++) {
+      const char* want = expected[start + i];
+      slice retrieved;
+      lsm_res res = lsm_tree_get(tree, keys[i], &retrieved);
+      assert(results[i] == res && "Multi get and get disagree");
+      if (want[0] == '\0') {
+        assert(res == LSM_NOT_FOUND && "Deleted key found");
+        continue;
+      }
+      assert(res == LSM_OK && "Live key not found");
+      assert(strcmp(retrieved.data, want) == 0 && "Value doesn't match");
+      assert(slice_compare(values[i], retrieved) == 0 && "Multi get value doesn't match");
+      slice_free(retrieved);
+      slice_free(values[i]);
+      live++;
+    }
+  }
+
+  lsm_iter* it = lsm_iter_new(tree);
+  int scanned = 0;
+  for (lsm_iter_seek_to_first(it); it->valid; lsm_iter_next(it)) {
+    char scanned_key[32];
+    snprintf(scanned_key, sizeof(scanned_key), "%.*s", (int)it->key.size, it->key.data);
+    int i = atoi(scanned_key + 3);
+    assert(expected[i][0] != '\0' && "Scan returned a deleted key");
+    scanned++;
+  }
+  assert(it->error == 0 && scanned == live && "Scan doesn't match");
+  lsm_iter_free(it);
+}
+
+static void
+delete_range(lsm_tree* tree, char (*expected)[32], int start, int end)
+{
+  char start_key[32], end_key[32];
+  snprintf(start_key, sizeof(start_key), "key%06d", start);
+  snprintf(end_key, sizeof(end_key), "key%06d", end);
+  assert(lsm_tree_delete_range(tree, slice_from_str(start_key), slice_from_str(end_key)) == LSM_OK &&
+      "Range delete failed");
+  for (int i = start; i < end; i++) {
+    expected[i][0] = '\0';
+  }
+}
+
+void
+test_deletes()
+{
+  printf("Testing deletes and range deletes...\n");
+
+  const char* test_dir = "test_lsmt_deletes";
+  remove_dir(test_dir);
+
+  lsm_options opts;
+  lsm_options_default(&opts);
+  opts.memtable_size = 8 * 1024;
+  opts.table_file_size = 16 * 1024;
+  opts.level1_size = 64 * 1024;
+  opts.level_size_ratio = 4;
+  opts.level0_compaction_trigger = 2;
+  lsm_tree* tree = lsm_tree_open(test_dir, &opts);
+  assert(tree != NULL && "Tree creation failed");
+
+  enum { NUM_KEYS = 4000 };
+  static char expected[NUM_KEYS][32];
+  char key[32];
+  for (int i = 0; i < NUM_KEYS; i++) {
+    snprintf(key, sizeof(key), "key%06d", i);
+    snprintf(expected[i], sizeof(expected[i]), "value%d", i);
+    assert(lsm_tree_put(tree, slice_from_str(key), slice_from_str(expected[i])) == LSM_OK && "Put failed");
+  }
+  assert(lsm_tree_flush(tree) == LSM_OK && "Flush failed");
+  assert(lsm_tree_wait_for_compactions(tree) == LSM_OK && "Compaction failed");
+
+  // point deletes of keys in the tables, and ranges over keys in the tables
+  // and in the memtable
+  for (int i = 0; i < NUM_KEYS; i += 7) {
+    snprintf(key, sizeof(key), "key%06d", i);
+    assert(lsm_tree_delete(tree, slice_from_str(key)) == LSM_OK && "Delete failed");
+    expected[i][0] = '\0';
+  }
+  delete_range(tree, expected, 1000, 2000);
+  for (int i = 3000; i < 3100; i++) {
+    snprintf(key, sizeof(key), "key%06d", i);
+    snprintf(expected[i], sizeof(expected[i]), "new%d", i);
+    assert(lsm_tree_put(tree, slice_from_str(key), slice_from_str(expected[i])) == LSM_OK && "Put failed");
+  }
+  delete_range(tree, expected, 3050, 3150);
+
+  // writes after a range are visible again
+  for (int i = 1500; i < 1510; i++) {
+    snprintf(key, sizeof(key), "key%06d", i);
+    snprintf(expected[i], sizeof(expected[i]), "revived%d", i);
+    assert(lsm_tree_put(tree, slice_from_str(key), slice_from_str(expected[i])) == LSM_OK && "Put failed");
+  }
+  // an empty range deletes nothing
+  assert(lsm_tree_delete_range(tree, slice_from_str("key002000"), slice_from_str("key002000")) == LSM_OK &&
+      "Empty range failed");
+  check_deletes(tree, expected, NUM_KEYS);
+  printf("Deletes in the memtables passed\n");
+
+  // the deletions are flushed and compacted down with the keys they hide
+  assert(lsm_tree_flush(tree) == LSM_OK && "Flush failed");
+  assert(lsm_tree_wait_for_compactions(tree) == LSM_OK && "Compaction failed");
+  check_deletes(tree, expected, NUM_KEYS);
+  for (int round = 0; round < 3; round++) {
+    for (int i = 2000; i < NUM_KEYS; i += 3) {
+      snprintf(key, sizeof(key), "key%06d", i);
+      snprintf(expected[i], sizeof(expected[i]), "round%d-%d", round, i);
+      assert(lsm_tree_put(tree, slice_from_str(key), slice_from_str(expected[i])) == LSM_OK && "Put failed");
+    }
+    delete_range(tree, expected, 2500 + round * 100, 2550 + round * 100);
+  }
+  assert(lsm_tree_flush(tree) == LSM_OK && "Flush failed");
+  assert(lsm_tree_wait_for_compactions(tree) == LSM_OK && "Compaction failed");
+  check_levels(tree);
+  check_deletes(tree, expected, NUM_KEYS);
+  printf("Deletes after compaction passed\n");
+
+  // a range that is only in the log comes back on reopen
+  delete_range(tree, expected, 0, 100);
+  lsm_tree_free(tree);
+  tree = lsm_tree_open(test_dir, &opts);
+  assert(tree != NULL && "Reopen failed");
+  check_levels(tree);
+  check_deletes(tree, expected, NUM_KEYS);
+  printf("Deletes after reopen passed\n");
+
+  lsm_tree_free(tree);
+  remove_dir(test_dir);
+  printf("All delete tests passed!\n\n");
+}
+
+static void
+run_workload(lsm_tree* tree, int num_keys, int rounds)
+{
+  char key[32], value[64];
+  for (int round = 0; round < rounds; round++) {
+    for (int i = 0; i < num_keys; i++) {
+      snprintf(key, sizeof(key), "key%06d", (i * 7919) % num_keys);
+      snprintf(value, sizeof(value), "value%d-%d", (i * 7919) % num_keys, round);
+      assert(lsm_tree_put(tree, slice_from_str(key), slice_from_str(value)) == LSM_OK && "Put failed");
+    }
+  }
+  assert(lsm_tree_flush(tree) == LSM_OK && "Flush failed");
+  assert(lsm_tree_wait_for_compactions(tree) == LSM_OK && "Compaction failed");
+
+  for (int i = 0; i < num_keys; i++) {
+    slice retrieved;
+    snprintf(key, sizeof(key), "key%06d", i);
+    snprintf(value, sizeof(value), "value%d-%d", i, rounds - 1);
+    assert(lsm_tree_get(tree, slice_from_str(key), &retrieved) == LSM_OK && "Get failed");
+    assert(strcmp(retrieved.data, value) == 0 && "Compaction kept an old version");
+    slice_free(retrieved);
+  }
+}
+
+void
+test_tiered_compaction()
+{
+  printf("Testing tiered compaction...\n");
+
+  const char* test_dir = "test_lsmt_tiered";
+  lsm_options opts;
+  lsm_options_default(&opts);
+  opts.memtable_size = 8 * 1024;
+  opts.table_file_size = 16 * 1024;
+  opts.level1_size = 64 * 1024;
+  opts.level_size_ratio = 4;
+  opts.level0_compaction_trigger = 4;
+  opts.level0_stop_trigger = 16;
+
+  lsm_stats stats[2];
+  for (int style = 0; style < 2; style++) {
+    remove_dir(test_dir);
+    opts.compaction_style = style == 0 ? LSM_COMPACTION_LEVELED : LSM_COMPACTION_TIERED;
+    lsm_tree* tree = lsm_tree_open(test_dir, &opts);
+    assert(tree != NULL && "Tree creation failed");
+
+    run_workload(tree, 4000, 4);
+    lsm_tree_get_stats(tree, &stats[style]);
+    assert(stats[style].num_compactions > 0 && "Nothing was compacted");
+    assert(stats[style].compaction_bytes_read > 0 && stats[style].compaction_bytes_written > 0 &&
+        "Compaction bytes not counted");
+    assert(stats[style].write_amplification > 1 && "Write amplification not reported");
+
+    if (opts.compaction_style == LSM_COMPACTION_TIERED) {
+      for (int l = 1; l < LSM_NUM_LEVELS; l++) {
+        assert(tree->levels[l].num_tables == 0 && "Tiered compaction wrote below L0");
+      }
+      assert(tree->levels[0].num_tables < opts.level0_stop_trigger && "Too many runs left");
+      for (size_t i = 1; i < tree->levels[0].num_tables; i++) {
+        assert(tree->levels[0].tables[i - 1]->max_seq > tree->levels[0].tables[i]->max_seq &&
+            "Runs are out of order");
+      }
+    }
+    lsm_tree_free(tree);
+  }
+
+  printf("Write amplification leveled: %.2f, tiered: %.2f\n", stats[0].write_amplification,
+      stats[1].write_amplification);
+
+  // reopening keeps the runs in the order of their writes
+  lsm_tree* tree = lsm_tree_open(test_dir, &opts);
+  assert(tree != NULL && "Reopen failed");
+  run_workload(tree, 4000, 1);
+  lsm_tree_free(tree);
+
+  remove_dir(test_dir);
+  printf("All tiered compaction tests passed!\n\n");
+}
+
+void
+test_wal_sync_modes()
+{
+  printf("Testing WAL sync modes...\n");
+
+  const char* test_dir = "test_lsmt_wal_dir";
+  wal_sync_mode modes[] = { WAL_SYNC_PERIODIC, WAL_SYNC_OS };
+  const int num_entries = 2000;
+  char key[32], value[64];
+
+  for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+    remove_dir(test_dir);
+
+    lsm_options opts;
+    lsm_options_default(&opts);
+    opts.wal_sync = modes[m];
+    opts.wal_sync_interval_ms = 10;
+    lsm_tree* tree = lsm_tree_open(test_dir, &opts);
+    assert(tree != NULL && "Tree creation failed");
+
+    for (int i = 0; i < num_entries; i++) {
+      snprintf(key, sizeof(key), "key%06d", i);
+      snprintf(value, sizeof(value), "value%d", i);
+      assert(lsm_tree_put(tree, slice_from_str(key), slice_from_str(value)) == LSM_OK && "Put failed");
+    }
+
+    wal* wl = tree->active->wal;
+    if (modes[m] == WAL_SYNC_PERIODIC) {
+      // the background thread syncs everything within a few intervals
+      bool synced = false;
+      for (int i = 0; i < 200 && !synced; i++) {
+        usleep(10 * 1000);
+        pthread_mutex_lock(&wl->lock);
+        synced = wl->synced_seq == wl->seq - 1;
+        pthread_mutex_unlock(&wl->lock);
+      }
+      assert(synced && "Periodic sync didn't sync the log");
+    } else {
+      assert(wl->written_seq == wl->seq - 1 && "Writes didn't reach the OS");
+      assert(wl->num_syncs == 0 && "OS mode synced the log");
+    }
+    pthread_mutex_lock(&wl->lock);
+    assert(wl->num_syncs < (uint64_t)num_entries && "Log was synced per write");
+    pthread_mutex_unlock(&wl->lock);
+    lsm_tree_free(tree);
+
+    tree = lsm_tree_open(test_dir, &opts);
+    assert(tree != NULL && "Reopen failed");
+    for (int i = 0; i < num_entries; i++) {
+      slice retrieved;
+      snprintf(key, sizeof(key), "key%06d", i);
+      snprintf(value, sizeof(value), "value%d", i);
+      assert(lsm_tree_get(tree, slice_from_str(key), &retrieved) == LSM_OK && "Get after reopen failed");
+      assert(strcmp(retrieved.data, value) == 0 && "Value doesn't match after reopen");
+      slice_free(retrieved);
+    }
+    lsm_tree_free(tree);
+  }
+
+  remove_dir(test_dir);
+  printf("All WAL sync mode tests passed!\n\n");
+}
+
+int
+main()
+{
+  printf("Starting lsm tree tests...\n\n");
+
+  test_flush_and_reopen();
+  test_binary_keys();
+  test_pinned_get();
+  test_multi_get();
+  test_write_batch();
+  test_recover_many_logs();
+  test_damaged_logs();
+  test_manifest();
+  test_wal_sync_modes();
+  test_concurrent_writers();
+  test_batch_visibility();
+  test_leveled_compaction();
+  test_tiered_compaction();
+  test_deletes();
+
+  printf("All tests passed successfully!\n");
+  return 0;
+}
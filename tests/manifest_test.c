@@ -0,0 +1,125 @@
+#include "../manifest.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char* test_dir = "test_manifest_dir";
+
+static void
+cleanup()
+{
+  char path[1024];
+  const char* names[] = { MANIFEST_CURRENT, "000001.manifest", "000002.manifest" };
+  for (int i = 0; i < 3; i++) {
+    snprintf(path, sizeof(path), "%s/%s", test_dir, names[i]);
+    unlink(path);
+  }
+  rmdir(test_dir);
+}
+
+static manifest_table
+table(uint64_t file_num, uint32_t level, const char* smallest, const char* largest)
+{
+  manifest_table t = {
+    .file_num = file_num,
+    .level = level,
+    .file_size = file_num * 100,
+    .max_seq = file_num * 10,
+    .smallest = slice_from_str(smallest),
+    .largest = slice_from_str(largest),
+  };
+  return t;
+}
+
+void
+test_edits()
+{
+  printf("Testing manifest edits...\n");
+  cleanup();
+  mkdir(test_dir, 0755);
+
+  manifest_state state;
+  assert(manifest_load(test_dir, &state) == MANIFEST_NOT_FOUND && "Found a manifest in an empty directory");
+
+  manifest_edit e;
+  manifest_edit_init(&e);
+  manifest_table t1 = table(1, 0, "a", "m");
+  manifest_table t2 = table(2, 1, "c", "z");
+  manifest_edit_add_table(&e, &t1);
+  manifest_edit_add_table(&e, &t2);
+  manifest_edit_add_log(&e, 3);
+  manifest_edit_set_next_file_num(&e, 4);
+  manifest* m = manifest_create(test_dir, "000001.manifest", &e);
+  assert(m != NULL && "Manifest creation failed");
+  manifest_edit_free(&e);
+
+  // a flush replaces the log with a table, a compaction replaces two tables
+  manifest_table t5 = table(5, 0, "b", "d");
+  manifest_edit_init(&e);
+  manifest_edit_add_table(&e, &t5);
+  manifest_edit_delete_log(&e, 3);
+  manifest_edit_add_log(&e, 4);
+  assert(manifest_append(m, &e) == 0 && "Append failed");
+  manifest_edit_free(&e);
+
+  manifest_table t6 = table(6, 1, "a", "z");
+  manifest_edit_init(&e);
+  manifest_edit_delete_table(&e, 1);
+  manifest_edit_delete_table(&e, 2);
+  manifest_edit_add_table(&e, &t6);
+  manifest_edit_set_next_file_num(&e, 7);
+  manifest_edit_set_last_seq(&e, 60);
+  assert(manifest_append(m, &e) == 0 && "Append failed");
+  manifest_edit_free(&e);
+  off_t intact = m->size;
+
+  // an edit that is cut short by a crash is ignored
+  manifest_table t8 = table(8, 2, "x", "y");
+  manifest_edit_init(&e);
+  manifest_edit_add_table(&e, &t8);
+  assert(manifest_append(m, &e) == 0 && "Append failed");
+  manifest_edit_free(&e);
+  assert(truncate(m->filename, intact + 10) == 0);
+  manifest_close(m);
+
+  assert(manifest_load(test_dir, &state) == MANIFEST_OK && "Load failed");
+  assert(state.next_file_num == 7 && state.last_seq == 60 && "Counters don't match");
+  assert(state.num_logs == 1 && state.logs[0] == 4 && "Logs don't match");
+  assert(state.num_tables == 2 && "Tables don't match");
+  for (size_t i = 0; i < state.num_tables; i++) {
+    manifest_table* t = &state.tables[i];
+    manifest_table* expected = t->file_num == 5 ? &t5 : &t6;
+    assert(t->file_num == expected->file_num && t->level == expected->level && "Wrong table");
+    assert(t->file_size == expected->file_size && t->max_seq == expected->max_seq && "Wrong table size");
+    assert(slice_compare(t->smallest, expected->smallest) == 0 && "Wrong smallest key");
+    assert(slice_compare(t->largest, expected->largest) == 0 && "Wrong largest key");
+  }
+  manifest_state_free(&state);
+
+  // a new manifest takes over through CURRENT
+  manifest_edit_init(&e);
+  manifest_edit_add_log(&e, 9);
+  m = manifest_create(test_dir, "000002.manifest", &e);
+  assert(m != NULL && "Manifest creation failed");
+  manifest_edit_free(&e);
+  manifest_close(m);
+  assert(manifest_load(test_dir, &state) == MANIFEST_OK && "Load failed");
+  assert(state.num_tables == 0 && state.num_logs == 1 && state.logs[0] == 9 && "Old manifest was read");
+  manifest_state_free(&state);
+
+  cleanup();
+  printf("All manifest edit tests passed!\n\n");
+}
+
+int
+main()
+{
+  printf("Starting manifest tests...\n\n");
+
+  test_edits();
+
+  printf("All tests passed successfully!\n");
+  return 0;
+}
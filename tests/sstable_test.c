@@ -0,0 +1,587 @@
+#include "../sstable.h"
+#include "../uring.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define ENTRY_SIZE(k, v) (sizeof(uint16_t) + sizeof(uint32_t) + strlen(k) + strlen(v))
+
+void
+test_write_and_read()
+{
+  printf("Testing table write and read...\n");
+
+  const char* path = "test_table.sst";
+  const int num_entries = 5000;
+  sstable_writer* w = sstable_writer_new(path, num_entries);
+  assert(w != NULL && "Writer creation failed");
+
+  char key[32], value[64];
+  for (int i = 0; i < num_entries; i++) {
+    snprintf(key, sizeof(key), "key%08d", i);
+    snprintf(value, sizeof(value), "value%d", i);
+    assert(sstable_writer_add(w, slice_from_str(key), slice_from_str(value)) == 0 && "Add failed");
+  }
+  assert(sstable_writer_add(w, slice_from_str("key0"), slice_from_str("x")) != 0 && "Out of order add should fail");
+  assert(sstable_writer_finish(w) == 0 && "Finish failed");
+
+  sstable* sst = sstable_open(path, 1, NULL, false);
+  assert(sst != NULL && "Open failed");
+  assert(sst->num_entries == (uint64_t)num_entries && "Entry count doesn't match");
+  assert(sst->num_blocks > 1 && "Table should span multiple blocks");
+  assert(strcmp(sst->smallest.data, "key00000000") == 0 && "Smallest key doesn't match");
+  assert(strcmp(sst->largest.data, "key00004999") == 0 && "Largest key doesn't match");
+
+  for (int i = 0; i < num_entries; i++) {
+    slice retrieved;
+    snprintf(key, sizeof(key), "key%08d", i);
+    snprintf(value, sizeof(value), "value%d", i);
+    assert(sstable_get(sst, slice_from_str(key), &retrieved) == SSTABLE_OK && "Get failed");
+    assert(strcmp(retrieved.data, value) == 0 && "Retrieved value doesn't match");
+    slice_free(retrieved);
+  }
+  printf("All entries found\n");
+
+  slice retrieved;
+  assert(sstable_get(sst, slice_from_str("key"), &retrieved) == SSTABLE_NOT_FOUND && "Missing key found");
+  assert(sstable_get(sst, slice_from_str("zzz"), &retrieved) == SSTABLE_NOT_FOUND && "Missing key found");
+  assert(sstable_get(sst, slice_from_str("key00000000a"), &retrieved) == SSTABLE_NOT_FOUND && "Missing key found");
+  printf("Missing keys test passed\n");
+
+  sstable_close(sst);
+  remove(path);
+  printf("All table read/write tests passed!\n\n");
+}
+
+void
+test_flush_memtable()
+{
+  printf("Testing memtable flush...\n");
+
+  memtable* mt = memtable_new(1024);
+  const char* keys[] = { "delta", "alpha", "charlie", "bravo" };
+  const char* values[] = { "4", "1", "3", "2" };
+  for (int i = 0; i < 4; i++) {
+    assert(memtable_insert(mt, slice_from_str(keys[i]), slice_from_str(values[i])) == MEMTABLE_OK && "Insert failed");
+  }
+
+  const char* path = "test_flush.sst";
+  assert(sstable_flush_memtable(mt, path, COMPRESS_FAST) == 0 && "Flush failed");
+  memtable_free(mt);
+  assert(access("test_flush.sst.tmp", F_OK) != 0 && "Temporary file left behind");
+
+  sstable* sst = sstable_open(path, 2, NULL, false);
+  assert(sst != NULL && "Open failed");
+  assert(strcmp(sst->smallest.data, "alpha") == 0 && "Table is not sorted");
+  assert(strcmp(sst->largest.data, "delta") == 0 && "Table is not sorted");
+
+  for (int i = 0; i < 4; i++) {
+    slice value;
+    assert(sstable_get(sst, slice_from_str(keys[i]), &value) == SSTABLE_OK && "Get failed");
+    assert(strcmp(value.data, values[i]) == 0 && "Flushed value doesn't match");
+    slice_free(value);
+  }
+
+  sstable_close(sst);
+  remove(path);
+  printf("All flush tests passed!\n\n");
+}
+
+void
+test_corrupt_block()
+{
+  printf("Testing block checksums...\n");
+
+  const char* path = "test_corrupt.sst";
+  sstable_writer* w = sstable_writer_new(path, 2000);
+  char key[32], value[64];
+  for (int i = 0; i < 2000; i++) {
+    snprintf(key, sizeof(key), "key%08d", i);
+    snprintf(value, sizeof(value), "value%d", i);
+    assert(sstable_writer_add(w, slice_from_str(key), slice_from_str(value)) == 0 && "Add failed");
+  }
+  assert(sstable_writer_finish(w) == 0 && "Finish failed");
+
+  sstable* sst = sstable_open(path, 3, NULL, false);
+  assert(sst != NULL && "Open failed");
+  uint64_t second_block = sst->index[1].offset;
+  sstable_close(sst);
+
+  // flip a byte inside the second data block
+  int fd = open(path, O_RDWR);
+  char c;
+  assert(pread(fd, &c, 1, second_block + 10) == 1);
+  c ^= 0xff;
+  assert(pwrite(fd, &c, 1, second_block + 10) == 1);
+  close(fd);
+
+  // both read paths check the block
+  for (int use_mmap = 0; use_mmap < 2; use_mmap++) {
+    sst = sstable_open(path, 3, NULL, use_mmap);
+    assert(sst != NULL && "Open failed");
+    slice retrieved;
+    assert(sstable_get(sst, slice_from_str("key00000000"), &retrieved) == SSTABLE_OK && "Intact block unreadable");
+    slice_free(retrieved);
+    assert(sstable_get(sst, sst->index[1].last_key, &retrieved) == SSTABLE_FAILED &&
+        "Corrupt block was not detected");
+    sstable_close(sst);
+  }
+
+  remove(path);
+  printf("All block checksum tests passed!\n\n");
+}
+
+void
+test_mixed_codecs()
+{
+  printf("Testing compressed blocks...\n");
+
+  // the codec changes while the table is written, every block records its own
+  const char* path = "test_codecs.sst";
+  const compress_codec codecs[] = { COMPRESS_NONE, COMPRESS_FAST, COMPRESS_HIGH };
+  const int num_entries = 3000;
+  sstable_writer* w = sstable_writer_new(path, num_entries);
+  assert(w != NULL && "Writer creation failed");
+
+  char key[32], value[128];
+  uint64_t raw_bytes = 0;
+  for (int i = 0; i < num_entries; i++) {
+    w->codec = codecs[i * 3 / num_entries];
+    snprintf(key, sizeof(key), "key%08d", i);
+    snprintf(value, sizeof(value), "{\"id\": %d, \"name\": \"user%d\", \"active\": true}", i, i % 100);
+    raw_bytes += ENTRY_SIZE(key, value);
+    assert(sstable_writer_add(w, slice_from_str(key), slice_from_str(value)) == 0 && "Add failed");
+  }
+  assert(sstable_writer_finish(w) == 0 && "Finish failed");
+
+  sstable* sst = sstable_open(path, 4, NULL, false);
+  assert(sst != NULL && "Open failed");
+  uint64_t stored_bytes = 0;
+  for (size_t i = 0; i < sst->num_blocks; i++) {
+    stored_bytes += sst->index[i].size;
+  }
+  assert(stored_bytes < raw_bytes * 3 / 4 && "Blocks were not compressed");
+  printf("%llu bytes of entries stored in %llu bytes\n", (unsigned long long)raw_bytes,
+      (unsigned long long)stored_bytes);
+
+  for (int i = 0; i < num_entries; i++) {
+    slice retrieved;
+    snprintf(key, sizeof(key), "key%08d", i);
+    snprintf(value, sizeof(value), "{\"id\": %d, \"name\": \"user%d\", \"active\": true}", i, i % 100);
+    assert(sstable_get(sst, slice_from_str(key), &retrieved) == SSTABLE_OK && "Get failed");
+    assert(retrieved.size == strlen(value) && memcmp(retrieved.data, value, retrieved.size) == 0 &&
+        "Retrieved value doesn't match");
+    slice_free(retrieved);
+  }
+
+  sstable_iter* it = sstable_iter_new(sst);
+  int count = 0;
+  for (sstable_iter_seek_to_first(it); it->valid; sstable_iter_next(it)) {
+    count++;
+  }
+  assert(it->error == 0 && count == num_entries && "Scan doesn't match");
+  sstable_iter_free(it);
+
+  sstable_close(sst);
+  remove(path);
+  printf("All compressed block tests passed!\n\n");
+}
+
+void
+test_prefix_keys()
+{
+  printf("Testing prefix compressed keys...\n");
+
+  // keys that share long prefixes only store what differs from the previous
+  // one, the restarts still allow seeking and stepping backwards
+  const char* path = "test_prefix.sst";
+  const int num_entries = 2000;
+  sstable_writer* w = sstable_writer_new(path, num_entries);
+  assert(w != NULL && "Writer creation failed");
+
+  char key[64];
+  uint64_t raw_bytes = 0;
+  for (int i = 0; i < num_entries; i++) {
+    snprintf(key, sizeof(key), "tenant%04d/table%02d/row%08d", i / 500, (i / 50) % 10, i * 2);
+    raw_bytes += ENTRY_SIZE(key, "v");
+    assert(sstable_writer_add(w, slice_from_str(key), slice_from_str("v")) == 0 && "Add failed");
+  }
+  assert(sstable_writer_finish(w) == 0 && "Finish failed");
+
+  sstable* sst = sstable_open(path, 5, NULL, false);
+  assert(sst != NULL && "Open failed");
+  assert(strcmp(sst->smallest.data, "tenant0000/table00/row00000000") == 0 && "Smallest key doesn't match");
+  uint64_t stored_bytes = 0;
+  for (size_t i = 0; i < sst->num_blocks; i++) {
+    stored_bytes += sst->index[i].size;
+  }
+  printf("%llu bytes of entries stored in %llu bytes\n", (unsigned long long)raw_bytes,
+      (unsigned long long)stored_bytes);
+  assert(stored_bytes < raw_bytes / 2 && "Shared prefixes were stored");
+
+  sstable_iter* it = sstable_iter_new(sst);
+  for (int i = 0; i < num_entries; i++) {
+    slice retrieved;
+    snprintf(key, sizeof(key), "tenant%04d/table%02d/row%08d", i / 500, (i / 50) % 10, i * 2);
+    assert(sstable_get(sst, slice_from_str(key), &retrieved) == SSTABLE_OK && "Get failed");
+    slice_free(retrieved);
+
+    // a key between two entries lands on the next one
+    snprintf(key, sizeof(key), "tenant%04d/table%02d/row%08d", i / 500, (i / 50) % 10, i * 2 - 1);
+    assert(sstable_get(sst, slice_from_str(key), &retrieved) == SSTABLE_NOT_FOUND && "Missing key found");
+    sstable_iter_seek(it, slice_from_str(key));
+    snprintf(key, sizeof(key), "tenant%04d/table%02d/row%08d", i / 500, (i / 50) % 10, i * 2);
+    assert(it->valid && it->key_size == strlen(key) && memcmp(it->key, key, it->key_size) == 0 &&
+        "Seek landed on the wrong key");
+  }
+
+  int count = 0;
+  for (sstable_iter_seek_to_last(it); it->valid; sstable_iter_prev(it)) {
+    int i = num_entries - 1 - count++;
+    snprintf(key, sizeof(key), "tenant%04d/table%02d/row%08d", i / 500, (i / 50) % 10, i * 2);
+    assert(it->key_size == strlen(key) && memcmp(it->key, key, it->key_size) == 0 && "Reverse scan doesn't match");
+  }
+  assert(it->error == 0 && count == num_entries && "Reverse scan missed entries");
+  sstable_iter_free(it);
+
+  sstable_close(sst);
+  remove(path);
+  printf("All prefix compressed key tests passed!\n\n");
+}
+
+void
+test_block_cache()
+{
+  printf("Testing cached block reads...\n");
+
+  const char* path = "test_cached.sst";
+  sstable_writer* w = sstable_writer_new(path, 2000);
+  char key[32], value[64];
+  for (int i = 0; i < 2000; i++) {
+    snprintf(key, sizeof(key), "key%08d", i);
+    snprintf(value, sizeof(value), "value%d", i);
+    assert(sstable_writer_add(w, slice_from_str(key), slice_from_str(value)) == 0 && "Add failed");
+  }
+  assert(sstable_writer_finish(w) == 0 && "Finish failed");
+
+  // two opens of the same file don't share cache keys
+  block_cache* cache = block_cache_new(1024 * 1024);
+  sstable* sst = sstable_open(path, 6, cache, false);
+  sstable* other = sstable_open(path, 6, cache, false);
+  assert(sst != NULL && other != NULL && sst->cache_id != other->cache_id && "Open failed");
+
+  // the index and filter of an open table are kept in the cache at high
+  // priority, they count against its budget
+  block_cache_stats stats;
+  block_cache_get_stats(cache, &stats);
+  assert(stats.count == 4 && sst->index == NULL && sst->filter == NULL && "Index and filter weren't cached");
+  assert(stats.high_priority_usage == stats.usage && stats.usage > 0 && "Index and filter weren't charged");
+
+  slice retrieved;
+  assert(sstable_get(sst, slice_from_str("key00000010"), &retrieved) == SSTABLE_OK && "Get failed");
+  slice_free(retrieved);
+  assert(sstable_get(sst, slice_from_str("key00000011"), &retrieved) == SSTABLE_OK && "Get failed");
+  slice_free(retrieved);
+  // each get also looks up the filter and the index
+  block_cache_get_stats(cache, &stats);
+  assert(stats.misses == 1 && stats.hits == 1 + 2 * 2 && "Second read of the block missed the cache");
+
+  // a pinned value points into the cached block
+  pinned_slice pinned;
+  assert(sstable_get_pinned(other, slice_from_str("key00000012"), &pinned) == SSTABLE_OK && "Get failed");
+  assert(pinned.value.size == strlen("value12") && memcmp(pinned.value.data, "value12", pinned.value.size) == 0 &&
+      "Pinned value doesn't match");
+  sstable_iter* it = sstable_iter_new(other);
+  block_cache_handle* h = block_cache_lookup(cache, other->cache_id, it->index[0].offset);
+  assert(h != NULL && pinned.value.data >= h->data && pinned.value.data < h->data + h->size &&
+      "Value was copied");
+  block_cache_release(h);
+  sstable_iter_free(it);
+  pinned_slice_release(&pinned);
+
+  // a scan that doesn't fill the cache only uses what's there
+  it = sstable_iter_new(sst);
+  it->fill_cache = false;
+  int count = 0;
+  for (sstable_iter_seek_to_first(it); it->valid; sstable_iter_next(it)) {
+    count++;
+  }
+  assert(count == 2000 && "Scan doesn't match");
+  sstable_iter_free(it);
+  block_cache_get_stats(cache, &stats);
+  assert(stats.count == 4 + 2 && "Scan filled the cache");
+
+  // the index and filter are evicted like any other block once the cache is
+  // full of them, and read again by the next lookup
+  block_cache_set_capacity(cache, 0);
+  block_cache_get_stats(cache, &stats);
+  assert(stats.count == 0 && "Index or filter was pinned");
+  block_cache_set_capacity(cache, 1024 * 1024);
+  assert(sstable_get(sst, slice_from_str("key00000010"), &retrieved) == SSTABLE_OK && "Get after eviction failed");
+  slice_free(retrieved);
+  block_cache_get_stats(cache, &stats);
+  assert(stats.count == 3 && stats.high_priority_usage > 0 && "Index and filter weren't read again");
+
+  // closing the tables takes their index and filter out of the cache
+  sstable_close(sst);
+  sstable_close(other);
+  block_cache_get_stats(cache, &stats);
+  assert(stats.count == 1 && stats.high_priority_usage == 0 && "Index or filter was left in the cache");
+  block_cache_free(cache);
+  remove(path);
+  printf("All cached block read tests passed!\n\n");
+}
+
+void
+test_mmap_reads()
+{
+  printf("Testing mapped table reads...\n");
+
+  // the first half of the blocks is stored uncompressed
+  const char* path = "test_mmap.sst";
+  const int num_entries = 4000;
+  sstable_writer* w = sstable_writer_new(path, num_entries);
+  char key[32], value[64];
+  for (int i = 0; i < num_entries; i++) {
+    w->codec = i < num_entries / 2 ? COMPRESS_NONE : COMPRESS_FAST;
+    snprintf(key, sizeof(key), "key%08d", i);
+    snprintf(value, sizeof(value), "value%d", i);
+    assert(sstable_writer_add(w, slice_from_str(key), slice_from_str(value)) == 0 && "Add failed");
+  }
+  assert(sstable_writer_finish(w) == 0 && "Finish failed");
+
+  block_cache* cache = block_cache_new(1024 * 1024);
+  sstable* sst = sstable_open(path, 7, cache, true);
+  assert(sst != NULL && sst->map != NULL && "Open failed");
+
+  for (int i = 0; i < num_entries; i++) {
+    slice retrieved;
+    snprintf(key, sizeof(key), "key%08d", i);
+    snprintf(value, sizeof(value), "value%d", i);
+    assert(sstable_get(sst, slice_from_str(key), &retrieved) == SSTABLE_OK && "Get failed");
+    assert(strcmp(retrieved.data, value) == 0 && "Retrieved value doesn't match");
+    slice_free(retrieved);
+  }
+
+  // uncompressed values point into the mapping, which the pin keeps alive
+  pinned_slice pinned;
+  assert(sstable_get_pinned(sst, slice_from_str("key00000001"), &pinned) == SSTABLE_OK && "Get failed");
+  assert(pinned.value.data > sst->map && pinned.value.data < sst->map + sst->file_size &&
+      "Value wasn't read from the mapping");
+  assert(sst->refs == 2 && "Pin doesn't hold the table");
+  pinned_slice_release(&pinned);
+  assert(sst->refs == 1 && "Pin didn't drop the table");
+
+  // only decompressed data blocks go to the cache, next to the index and
+  // filter
+  block_cache_stats stats;
+  block_cache_get_stats(cache, &stats);
+  assert(stats.count > 2 && stats.count < 2 + sst->num_blocks && "Mapped blocks were cached");
+
+  sstable_iter* it = sstable_iter_new(sst);
+  int count = 0;
+  for (sstable_iter_seek_to_first(it); it->valid; sstable_iter_next(it)) {
+    count++;
+  }
+  assert(it->error == 0 && count == num_entries && "Scan doesn't match");
+  sstable_iter_free(it);
+
+  sstable_close(sst);
+  block_cache_free(cache);
+  remove(path);
+  printf("All mapped read tests passed!\n\n");
+}
+
+void
+test_batched_reads()
+{
+  printf("Testing batched block reads...\n");
+
+  const char* path = "test_batched.sst";
+  const int num_entries = 6000;
+  sstable_writer* w = sstable_writer_new(path, num_entries);
+  char key[32], value[64];
+  for (int i = 0; i < num_entries; i++) {
+    snprintf(key, sizeof(key), "key%08d", i * 2);
+    snprintf(value, sizeof(value), "value%d", i * 2);
+    assert(sstable_writer_add(w, slice_from_str(key), slice_from_str(value)) == 0 && "Add failed");
+  }
+  assert(sstable_writer_finish(w) == 0 && "Finish failed");
+
+  // the same reads through the ring and through pread
+  for (int uring = 0; uring < 2; uring++) {
+    io_read_set_uring(uring);
+    sstable* sst = sstable_open(path, 8, NULL, false);
+    assert(sst != NULL && sst->num_blocks > SSTABLE_READAHEAD_BLOCKS && "Open failed");
+
+    // sorted keys over most blocks, every other one missing
+    enum { N = 1000 };
+    char key_bufs[N][32];
+    slice keys[N];
+    uint64_t hashes[N];
+    slice values[N];
+    sstable_res results[N];
+    for (int i = 0; i < N; i++) {
+      snprintf(key_bufs[i], sizeof(key_bufs[i]), "key%08d", i * 11);
+      keys[i] = slice_from_str(key_bufs[i]);
+      hashes[i] = hash64(keys[i].data, keys[i].size, BLOOM_HASH_SEED);
+    }
+    sstable_multi_get(sst, keys, hashes, N, values, results);
+    for (int i = 0; i < N; i++) {
+      if ((i * 11) % 2 != 0) {
+        assert(results[i] == SSTABLE_NOT_FOUND && "Missing key found");
+        continue;
+      }
+      snprintf(value, sizeof(value), "value%d", i * 11);
+      assert(results[i] == SSTABLE_OK && strcmp(values[i].data, value) == 0 && "Multi get value doesn't match");
+      slice_free(values[i]);
+    }
+
+    // a scan reads ahead once it goes through the blocks in order
+    sstable_iter* it = sstable_iter_new(sst);
+    int count = 0;
+    bool read_ahead = false;
+    for (sstable_iter_seek_to_first(it); it->valid; sstable_iter_next(it)) {
+      snprintf(key, sizeof(key), "key%08d", count * 2);
+      assert(it->key_size == strlen(key) && memcmp(it->key, key, it->key_size) == 0 && "Scan out of order");
+      read_ahead |= it->readahead_len > 0;
+      count++;
+    }
+    assert(it->error == 0 && count == num_entries && read_ahead && "Scan doesn't match");
+
+    // going back drops what was read ahead
+    sstable_iter_seek(it, slice_from_str("key00004000"));
+    for (int i = 0; i < 500; i++) {
+      sstable_iter_next(it);
+    }
+    for (int i = 0; i < 700; i++) {
+      sstable_iter_prev(it);
+    }
+    assert(it->valid && it->error == 0 && "Iterator lost its place");
+    snprintf(key, sizeof(key), "key%08d", 4000 - 400);
+    assert(it->key_size == strlen(key) && memcmp(it->key, key, it->key_size) == 0 && "Wrong key after prev");
+    sstable_iter_free(it);
+    sstable_close(sst);
+  }
+  io_read_set_uring(true);
+
+  remove(path);
+  printf("All batched read tests passed!\n\n");
+}
+
+static sstable_res
+deletion_result(int i)
+{
+  if (i % 10 == 0) {
+    return SSTABLE_DELETED;
+  }
+  if (i % 2 == 0) {
+    return SSTABLE_OK;
+  }
+  return i >= 100 && i < 300 ? SSTABLE_DELETED : SSTABLE_NOT_FOUND;
+}
+
+void
+test_deletions()
+{
+  printf("Testing deletions and range deletions...\n");
+
+  // even keys are written, every fifth of them as a deletion. The ranges
+  // overlap and are merged, the last one is past every key.
+  const char* path = "test_deletions.sst";
+  const int num_keys = 1000;
+  sstable_writer* w = sstable_writer_new(path, num_keys);
+  assert(w != NULL && "Writer creation failed");
+  char key[32], value[32];
+  for (int i = 0; i < num_keys; i += 2) {
+    snprintf(key, sizeof(key), "key%08d", i);
+    snprintf(value, sizeof(value), "value%d", i);
+    int res = i % 10 == 0 ? sstable_writer_delete(w, slice_from_str(key))
+                          : sstable_writer_add(w, slice_from_str(key), slice_from_str(value));
+    assert(res == 0 && "Add failed");
+  }
+  assert(sstable_writer_delete_range(w, slice_from_str("key00000150"), slice_from_str("key00000300")) == 0);
+  assert(sstable_writer_delete_range(w, slice_from_str("key00000100"), slice_from_str("key00000200")) == 0);
+  assert(sstable_writer_delete_range(w, slice_from_str("zz0"), slice_from_str("zz9")) == 0);
+  assert(sstable_writer_delete_range(w, slice_from_str("zz5"), slice_from_str("zz5")) == 0);
+  assert(sstable_writer_finish(w) == 0 && "Finish failed");
+
+  sstable* sst = sstable_open(path, 8, NULL, false);
+  assert(sst != NULL && "Open failed");
+  assert(sst->num_range_dels == 2 && "Ranges weren't merged");
+  assert(strcmp(sst->largest.data, "zz9") == 0 && "Largest key doesn't cover the ranges");
+
+  // entries of a table are newer than its ranges
+  enum { N = 1000 };
+  static char key_bufs[N][32];
+  slice keys[N];
+  uint64_t hashes[N];
+  slice values[N];
+  sstable_res results[N];
+  for (int i = 0; i < N; i++) {
+    snprintf(key_bufs[i], sizeof(key_bufs[i]), "key%08d", i);
+    keys[i] = slice_from_str(key_bufs[i]);
+    hashes[i] = hash64(keys[i].data, keys[i].size, BLOOM_HASH_SEED);
+  }
+  sstable_multi_get(sst, keys, hashes, N, values, results);
+  for (int i = 0; i < N; i++) {
+    sstable_res expected = deletion_result(i);
+    slice retrieved;
+    assert(sstable_get(sst, keys[i], &retrieved) == expected && "Get doesn't match");
+    assert(results[i] == expected && "Multi get doesn't match");
+    if (expected == SSTABLE_OK) {
+      assert(slice_compare(values[i], retrieved) == 0 && "Multi get value doesn't match");
+      slice_free(retrieved);
+      slice_free(values[i]);
+    }
+  }
+  slice retrieved;
+  assert(sstable_get(sst, slice_from_str("zz1"), &retrieved) == SSTABLE_DELETED && "Range past the keys missed");
+  assert(sstable_get(sst, slice_from_str("zz9"), &retrieved) == SSTABLE_NOT_FOUND && "Range end is deleted");
+
+  // a scan returns the deletions, the caller skips them
+  sstable_iter* it = sstable_iter_new(sst);
+  int count = 0, deleted = 0;
+  for (sstable_iter_seek_to_first(it); it->valid; sstable_iter_next(it)) {
+    count++;
+    deleted += it->deleted;
+  }
+  assert(it->error == 0 && count == num_keys / 2 && deleted == num_keys / 10 && "Scan doesn't match");
+  sstable_iter_free(it);
+  sstable_close(sst);
+
+  // a table can hold nothing but ranges
+  w = sstable_writer_new(path, 1);
+  assert(sstable_writer_delete_range(w, slice_from_str("a"), slice_from_str("c")) == 0);
+  assert(sstable_writer_finish(w) == 0 && "Finish failed");
+  sst = sstable_open(path, 9, NULL, false);
+  assert(sst != NULL && sst->num_entries == 0 && "Open failed");
+  assert(strcmp(sst->smallest.data, "a") == 0 && strcmp(sst->largest.data, "c") == 0 && "Bounds don't match");
+  assert(sstable_get(sst, slice_from_str("b"), &retrieved) == SSTABLE_DELETED && "Range missed");
+  assert(sstable_get(sst, slice_from_str("c"), &retrieved) == SSTABLE_NOT_FOUND && "Range end is deleted");
+  sstable_close(sst);
+
+  remove(path);
+  printf("All deletion tests passed!\n\n");
+}
+
+int
+main()
+{
+  printf("Starting sstable tests...\n\n");
+
+  test_write_and_read();
+  test_flush_memtable();
+  test_corrupt_block();
+  test_mixed_codecs();
+  test_prefix_keys();
+  test_block_cache();
+  test_mmap_reads();
+  test_batched_reads();
+  test_deletions();
+
+  printf("All tests passed successfully!\n");
+  return 0;
+}
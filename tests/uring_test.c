@@ -0,0 +1,106 @@
+#include "../uring.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define FILE_SIZE (1024 * 1024)
+
+static int
+create_file(const char* path, char* contents)
+{
+  for (int i = 0; i < FILE_SIZE; i++) {
+    contents[i] = (char)(i * 31 + i / 4096);
+  }
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  assert(fd >= 0 && "File creation failed");
+  assert(write(fd, contents, FILE_SIZE) == FILE_SIZE && "Write failed");
+  return fd;
+}
+
+// read_ranges reads n ranges of the file in one batch and checks them
+// against contents.
+static void
+read_ranges(int fd, const char* contents, size_t n)
+{
+  io_read* reads = calloc(n, sizeof(io_read));
+  unsigned int seed = n;
+  for (size_t i = 0; i < n; i++) {
+    reads[i].fd = fd;
+    reads[i].size = 1 + rand_r(&seed) % 8192;
+    reads[i].offset = rand_r(&seed) % (FILE_SIZE - reads[i].size);
+    reads[i].buf = malloc(reads[i].size);
+  }
+
+  assert(io_read_batch(reads, n) == 0 && "Batch failed");
+  for (size_t i = 0; i < n; i++) {
+    assert(reads[i].done == reads[i].size && "Short read");
+    assert(memcmp(reads[i].buf, contents + reads[i].offset, reads[i].size) == 0 && "Read doesn't match");
+    free(reads[i].buf);
+  }
+  free(reads);
+}
+
+void
+test_batch_reads()
+{
+  printf("Testing batched reads...\n");
+
+  const char* path = "test_uring.dat";
+  char* contents = malloc(FILE_SIZE);
+  int fd = create_file(path, contents);
+
+  printf("io_uring %s\n", io_read_uses_uring() ? "available" : "unavailable, using pread");
+  read_ranges(fd, contents, 1);
+  read_ranges(fd, contents, 16);
+  // more reads than fit in the ring at once
+  read_ranges(fd, contents, 3 * IO_URING_QUEUE_DEPTH + 5);
+
+  // a read past the end comes back short
+  io_read past = { fd, FILE_SIZE - 10, malloc(100), 100, 0 };
+  io_read reads[2] = { past, { fd, 0, malloc(100), 100, 0 } };
+  assert(io_read_batch(reads, 2) != 0 && "Read past the end succeeded");
+  assert(reads[0].done == 10 && reads[1].done == 100 && "Wrong read sizes");
+  free(reads[0].buf);
+  free(reads[1].buf);
+
+  close(fd);
+  free(contents);
+  remove(path);
+  printf("All batched read tests passed!\n\n");
+}
+
+void
+test_pread_fallback()
+{
+  printf("Testing pread fallback...\n");
+
+  const char* path = "test_uring_fallback.dat";
+  char* contents = malloc(FILE_SIZE);
+  int fd = create_file(path, contents);
+
+  io_read_set_uring(false);
+  assert(!io_read_uses_uring() && "Ring still used");
+  read_ranges(fd, contents, 100);
+  io_read_set_uring(true);
+  read_ranges(fd, contents, 100);
+
+  close(fd);
+  free(contents);
+  remove(path);
+  printf("All pread fallback tests passed!\n\n");
+}
+
+int
+main()
+{
+  printf("Starting io_uring tests...\n\n");
+
+  test_batch_reads();
+  test_pread_fallback();
+
+  printf("All tests passed successfully!\n");
+  return 0;
+}
@@ -0,0 +1,77 @@
+#include "../write_batch.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+typedef struct {
+  int n;
+  int types[8];
+  char keys[8][16];
+  char values[8][16];
+} collected;
+
+static int
+collect(void* arg, int type, slice key, slice value)
+{
+  collected* c = arg;
+  c->types[c->n] = type;
+  memcpy(c->keys[c->n], key.data, key.size);
+  c->keys[c->n][key.size] = '\0';
+  memcpy(c->values[c->n], value.data, value.size);
+  c->values[c->n][value.size] = '\0';
+  c->n++;
+  return 0;
+}
+
+void
+test_iterate()
+{
+  printf("Testing batch encoding...\n");
+
+  write_batch* b = write_batch_new();
+  assert(b != NULL && "Batch creation failed");
+  assert(write_batch_put(b, slice_from_str("k1"), slice_from_str("v1")) == 0 && "Put failed");
+  assert(write_batch_delete(b, slice_from_str("k2")) == 0 && "Delete failed");
+  assert(write_batch_put(b, slice_from_str("k3"), slice_new("", 0)) == 0 && "Put failed");
+  assert(b->count == 3 && b->data_size == 8 && "Wrong batch size");
+
+  collected c = { 0 };
+  assert(write_batch_iterate(b->rep, b->len, collect, &c) == 0 && "Iterate failed");
+  assert(c.n == 3 && "Wrong number of operations");
+  assert(c.types[0] == WRITE_BATCH_PUT && strcmp(c.keys[0], "k1") == 0 && strcmp(c.values[0], "v1") == 0);
+  assert(c.types[1] == WRITE_BATCH_DELETE && strcmp(c.keys[1], "k2") == 0);
+  assert(c.types[2] == WRITE_BATCH_PUT && strcmp(c.keys[2], "k3") == 0 && c.values[2][0] == '\0');
+
+  // the last operation takes 9 bytes, cutting it anywhere is rejected
+  for (size_t len = b->len - 8; len < b->len; len++) {
+    c.n = 0;
+    assert(write_batch_iterate(b->rep, len, collect, &c) != 0 && "Truncated batch accepted");
+  }
+
+  // clearing keeps the buffer
+  char* rep = b->rep;
+  write_batch_clear(b);
+  assert(b->count == 0 && b->len == 0 && b->rep == rep && "Clear failed");
+  assert(write_batch_iterate(b->rep, b->len, collect, &c) == 0 && "Empty batch failed");
+
+  // a range deletion carries its end as the value
+  assert(write_batch_delete_range(b, slice_from_str("k1"), slice_from_str("k5")) == 0 && "Range delete failed");
+  c.n = 0;
+  assert(write_batch_iterate(b->rep, b->len, collect, &c) == 0 && "Iterate failed");
+  assert(c.n == 1 && c.types[0] == WRITE_BATCH_DELETE_RANGE && strcmp(c.keys[0], "k1") == 0 &&
+      strcmp(c.values[0], "k5") == 0 && "Range delete doesn't match");
+
+  write_batch_free(b);
+  printf("All batch encoding tests passed!\n\n");
+}
+
+int
+main()
+{
+  printf("Starting write batch tests...\n\n");
+
+  test_iterate();
+
+  printf("All tests passed successfully!\n");
+  return 0;
+}
@@ -0,0 +1,248 @@
+#include "uring.h"
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+typedef struct uring_s {
+  int fd;
+  unsigned entries;
+  unsigned* sq_tail;
+  unsigned* sq_mask;
+  unsigned* sq_array;
+  struct io_uring_sqe* sqes;
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned* cq_mask;
+  struct io_uring_cqe* cqes;
+  void* sq_ring;
+  size_t sq_ring_size;
+  void* cq_ring; // the same mapping as sq_ring on kernels with IORING_FEAT_SINGLE_MMAP
+  size_t cq_ring_size;
+  size_t sqes_size;
+} uring;
+
+static bool uring_enabled = true; // cleared once a ring couldn't be set up
+static pthread_key_t uring_key;
+static pthread_once_t uring_key_once = PTHREAD_ONCE_INIT;
+
+static void
+uring_free(void* arg)
+{
+  uring* r = arg;
+  if (r->sqes != NULL) {
+    munmap(r->sqes, r->sqes_size);
+  }
+  if (r->cq_ring != NULL && r->cq_ring != r->sq_ring) {
+    munmap(r->cq_ring, r->cq_ring_size);
+  }
+  if (r->sq_ring != NULL) {
+    munmap(r->sq_ring, r->sq_ring_size);
+  }
+  close(r->fd);
+  free(r);
+}
+
+static void
+uring_key_init()
+{
+  pthread_key_create(&uring_key, uring_free);
+}
+
+static void*
+ring_map(int fd, size_t size, off_t offset)
+{
+  void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+  return p == MAP_FAILED ? NULL : p;
+}
+
+static uring*
+uring_new(unsigned entries)
+{
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  int fd = syscall(__NR_io_uring_setup, entries, &p);
+  if (fd < 0) {
+    return NULL;
+  }
+
+  uring* r = calloc(1, sizeof(uring));
+  if (r == NULL) {
+    close(fd);
+    return NULL;
+  }
+  r->fd = fd;
+  r->entries = p.sq_entries;
+  r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (r->cq_ring_size > r->sq_ring_size) {
+      r->sq_ring_size = r->cq_ring_size;
+    }
+    r->cq_ring_size = r->sq_ring_size;
+  }
+  r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+  r->sq_ring = ring_map(fd, r->sq_ring_size, IORING_OFF_SQ_RING);
+  if (r->sq_ring != NULL) {
+    r->cq_ring = (p.features & IORING_FEAT_SINGLE_MMAP) ? r->sq_ring
+                                                        : ring_map(fd, r->cq_ring_size, IORING_OFF_CQ_RING);
+  }
+  r->sqes = ring_map(fd, r->sqes_size, IORING_OFF_SQES);
+  if (r->sq_ring == NULL || r->cq_ring == NULL || r->sqes == NULL) {
+    uring_free(r);
+    return NULL;
+  }
+
+  char* sq = r->sq_ring;
+  char* cq = r->cq_ring;
+  r->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+  r->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+  r->sq_array = (unsigned*)(sq + p.sq_off.array);
+  r->cq_head = (unsigned*)(cq + p.cq_off.head);
+  r->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+  r->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+  return r;
+}
+
+// thread_ring returns the calling thread's ring, NULL if reads have to use
+// pread.
+static uring*
+thread_ring()
+{
+  if (!__atomic_load_n(&uring_enabled, __ATOMIC_RELAXED)) {
+    return NULL;
+  }
+
+  pthread_once(&uring_key_once, uring_key_init);
+  uring* r = pthread_getspecific(uring_key);
+  if (r == NULL) {
+    r = uring_new(IO_URING_QUEUE_DEPTH);
+    if (r == NULL || pthread_setspecific(uring_key, r) != 0) {
+      if (r != NULL) {
+        uring_free(r);
+      }
+      __atomic_store_n(&uring_enabled, false, __ATOMIC_RELAXED);
+      return NULL;
+    }
+  }
+  return r;
+}
+
+static int
+uring_enter(uring* r, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+  return syscall(__NR_io_uring_enter, r->fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+// uring_read submits up to r->entries reads and waits for all of them.
+// Returns 1 if the ring failed and can't be used anymore.
+static int
+uring_read(uring* r, io_read* reads, unsigned n)
+{
+  unsigned tail = *r->sq_tail;
+  for (unsigned i = 0; i < n; i++) {
+    unsigned idx = tail & *r->sq_mask;
+    struct io_uring_sqe* sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = reads[i].fd;
+    sqe->off = reads[i].offset + reads[i].done;
+    sqe->addr = (uint64_t)(uintptr_t)(reads[i].buf + reads[i].done);
+    sqe->len = reads[i].size - reads[i].done;
+    sqe->user_data = i;
+    r->sq_array[idx] = idx;
+    tail++;
+  }
+  __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+
+  unsigned submitted = 0;
+  while (submitted < n) {
+    int ret = uring_enter(r, n - submitted, 0, 0);
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+    if (ret <= 0) {
+      break;
+    }
+    submitted += ret;
+  }
+
+  // only what the kernel took gets a completion
+  unsigned head = *r->cq_head;
+  for (unsigned reaped = 0; reaped < submitted;) {
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+      if (uring_enter(r, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+        return 1;
+      }
+      continue;
+    }
+
+    struct io_uring_cqe* cqe = &r->cqes[head & *r->cq_mask];
+    if (cqe->res > 0) {
+      reads[cqe->user_data].done += cqe->res;
+    }
+    head++;
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    reaped++;
+  }
+  return submitted == n ? 0 : 1;
+}
+
+static int
+pread_rest(io_read* rd)
+{
+  while (rd->done < rd->size) {
+    ssize_t n = pread(rd->fd, rd->buf + rd->done, rd->size - rd->done, rd->offset + rd->done);
+    if (n <= 0) {
+      return 1;
+    }
+    rd->done += n;
+  }
+  return 0;
+}
+
+// io_read_batch reads every range in reads. Returns 1 if one of them
+// couldn't be read completely, its done field says how far it got.
+int
+io_read_batch(io_read* reads, size_t n)
+{
+  // a single read gains nothing from the ring
+  uring* r = n > 1 ? thread_ring() : NULL;
+  for (size_t start = 0; r != NULL && start < n; start += r->entries) {
+    unsigned len = n - start < r->entries ? n - start : r->entries;
+    if (uring_read(r, reads + start, len) != 0) {
+      // the ring is in an unknown state, this thread goes back to pread
+      pthread_setspecific(uring_key, NULL);
+      uring_free(r);
+      r = NULL;
+    }
+  }
+
+  int res = 0;
+  for (size_t i = 0; i < n; i++) {
+    res |= pread_rest(&reads[i]);
+  }
+  return res;
+}
+
+// io_read_set_uring switches every thread between io_uring and pread, for
+// benchmarks and tests of the fallback.
+void
+io_read_set_uring(bool enabled)
+{
+  __atomic_store_n(&uring_enabled, enabled, __ATOMIC_RELAXED);
+}
+
+// io_read_uses_uring tells if batches of the calling thread go through a
+// ring.
+bool
+io_read_uses_uring()
+{
+  return thread_ring() != NULL;
+}
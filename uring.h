@@ -0,0 +1,28 @@
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define IO_URING_QUEUE_DEPTH  64 // reads in flight at once per thread
+
+// io_read_batch issues a batch of reads through an io_uring so they're in
+// flight together, which is what it takes to keep an NVMe device busy from a
+// single thread. Every thread gets its own ring on first use, created with
+// raw syscalls. Reads fall back to pread when the kernel has no io_uring, it
+// was disabled, or a read comes back short.
+
+typedef struct io_read_s {
+  int fd;
+  uint64_t offset;
+  char* buf;
+  size_t size;
+  size_t done; // bytes read so far
+} io_read;
+
+int io_read_batch(io_read* reads, size_t n);
+void io_read_set_uring(bool enabled);
+bool io_read_uses_uring();
+
+#endif
@@ -15,7 +15,7 @@ bit_vec_new(size_t num_bits)
   }
 
   size_t mem_size = num_bits / BITS_IN_TYPE(uint32_t);
-  if (!(num_bits % BITS_IN_TYPE(u_int32_t))) {
+  if (num_bits % BITS_IN_TYPE(uint32_t)) {
     mem_size++;
   }
 
@@ -46,7 +46,9 @@ bit_vec_get(bit_vec* vec, size_t bit_idx)
   }
   size_t chunk_offset = bit_idx / BITS_IN_TYPE(uint32_t);
   size_t bit_offset = bit_idx & (BITS_IN_TYPE(uint32_t) - 1);
-  uint32_t byte = vec->mem[chunk_offset];
+  // bits are read and set atomically so a memtable's filter can be updated
+  // by concurrent writers
+  uint32_t byte = __atomic_load_n(&vec->mem[chunk_offset], __ATOMIC_RELAXED);
   return (byte >> bit_offset) & 1;
 }
 
@@ -62,12 +64,24 @@ bit_vec_set(bit_vec* vec, size_t bit_idx, bool val)
   size_t bit_offset = bit_idx & (BITS_IN_TYPE(uint32_t) - 1);
   uint32_t* byte = &(vec->mem[chunk_offset]);
   if (val) {
-    *byte |= ((uint32_t)1) << bit_offset;
+    __atomic_fetch_or(byte, ((uint32_t)1) << bit_offset, __ATOMIC_RELAXED);
   } else {
-    *byte &= ~(1 << bit_offset);
+    __atomic_fetch_and(byte, ~(((uint32_t)1) << bit_offset), __ATOMIC_RELAXED);
   }
 }
 
+// key_compare orders keys bytewise, a key sorts before every longer key that
+// it is a prefix of.
+int
+key_compare(const char* a, size_t a_len, const char* b, size_t b_len)
+{
+  int cmp = memcmp(a, b, a_len < b_len ? a_len : b_len);
+  if (cmp != 0) {
+    return cmp;
+  }
+  return (a_len > b_len) - (a_len < b_len);
+}
+
 bool
 dir_exists(const char* path)
 {
@@ -90,3 +104,159 @@ get_file_ext(const char* filename)
 
   return dot + 1;
 }
+
+int
+slice_compare(slice a, slice b)
+{
+  return key_compare(a.data, a.size, b.data, b.size);
+}
+
+// slice_copy returns an owned copy of s, the data is followed by a terminator
+// so copies of text keys can still be printed. data is NULL when out of
+// memory.
+slice
+slice_copy(slice s)
+{
+  char* data = malloc(s.size + 1);
+  if (data != NULL) {
+    memcpy(data, s.data, s.size);
+    data[s.size] = '\0';
+  }
+  return slice_new(data, s.size);
+}
+
+void
+slice_free(slice s)
+{
+  free((char*)s.data);
+}
+
+void
+pinned_slice_release(pinned_slice* p)
+{
+  if (p->release != NULL) {
+    p->release(p->arg);
+  }
+  p->release = NULL;
+  p->arg = NULL;
+}
+
+// hash64 is a multiply-mix hash in the style of wyhash, it consumes 16 bytes
+// per round and folds each 128-bit product into 64 bits.
+static inline uint64_t
+hash_mum(uint64_t a, uint64_t b)
+{
+  __uint128_t r = (__uint128_t)a * b;
+  return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+static inline uint64_t
+hash_read64(const uint8_t* p)
+{
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+#define HASH_P0 0xa0761d6478bd642fULL
+#define HASH_P1 0xe7037ed1a0b428dbULL
+#define HASH_P2 0x8ebc6af09c88c6e3ULL
+#define HASH_P3 0x589965cc75374cc3ULL
+
+uint64_t
+hash64(const void* data, size_t len, uint64_t seed)
+{
+  const uint8_t* p = data;
+  uint64_t h = seed ^ HASH_P0 ^ hash_mum(len ^ HASH_P1, HASH_P2);
+
+  size_t n = len;
+  for (; n > 16; n -= 16, p += 16) {
+    h = hash_mum(hash_read64(p) ^ HASH_P1, hash_read64(p + 8) ^ h);
+  }
+
+  // the last 1-16 bytes, read as two possibly overlapping words
+  uint64_t a = 0, b = 0;
+  if (n >= 8) {
+    a = hash_read64(p);
+    b = hash_read64(p + n - 8);
+  } else if (n >= 4) {
+    uint32_t lo, hi;
+    memcpy(&lo, p, sizeof(lo));
+    memcpy(&hi, p + n - 4, sizeof(hi));
+    a = lo;
+    b = hi;
+  } else if (n > 0) {
+    a = ((uint64_t)p[0] << 16) | ((uint64_t)p[n >> 1] << 8) | p[n - 1];
+  }
+
+  h = hash_mum(a ^ HASH_P1, b ^ h);
+  return hash_mum(h ^ HASH_P3, len ^ HASH_P1);
+}
+
+// crc32c uses the Castagnoli polynomial (reflected 0x82F63B78), the SSE4.2
+// crc32 instruction computes the same checksum when the cpu has it.
+static uint32_t crc32c_table[256];
+static uint32_t (*crc32c_impl)(uint32_t crc, const unsigned char* p, size_t len);
+
+static uint32_t
+crc32c_sw(uint32_t crc, const unsigned char* p, size_t len)
+{
+  while (len--) {
+    crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  }
+  return crc;
+}
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+
+__attribute__((target("sse4.2"))) static uint32_t
+crc32c_hw(uint32_t crc, const unsigned char* p, size_t len)
+{
+  uint64_t c = crc;
+  for (; len >= sizeof(uint64_t); len -= sizeof(uint64_t), p += sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    c = _mm_crc32_u64(c, word);
+  }
+  crc = c;
+  while (len--) {
+    crc = _mm_crc32_u8(crc, *p++);
+  }
+  return crc;
+}
+#endif
+
+__attribute__((constructor)) static void
+crc32c_init(void)
+{
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (int j = 0; j < 8; j++) {
+      crc = (crc >> 1) ^ (0x82F63B78 & -(crc & 1));
+    }
+    crc32c_table[i] = crc;
+  }
+
+  crc32c_impl = crc32c_sw;
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.2")) {
+    crc32c_impl = crc32c_hw;
+  }
+#endif
+}
+
+// crc32c_extend continues a checksum started with crc32c, so a record that is
+// split over several buffers can be checksummed without copying it.
+uint32_t
+crc32c_extend(uint32_t crc, const void* data, size_t len)
+{
+  return ~crc32c_impl(~crc, data, len);
+}
+
+uint32_t
+crc32c(const void* data, size_t len)
+{
+  return crc32c_extend(0, data, len);
+}
@@ -5,6 +5,7 @@
 #include <stdint.h>
 #include <limits.h>
 #include <stdbool.h>
+#include <string.h>
 
 #define BITS_IN_TYPE(ty) (CHAR_BIT * (sizeof(ty)))
 
@@ -18,6 +19,46 @@ void bit_vec_free(bit_vec *vec);
 bool bit_vec_get(bit_vec *vec, size_t idx);
 void bit_vec_set(bit_vec *vec, size_t idx, bool val);
 
+uint64_t hash64(const void *data, size_t len, uint64_t seed);
+uint32_t crc32c(const void *data, size_t len);
+uint32_t crc32c_extend(uint32_t crc, const void *data, size_t len);
+
+int key_compare(const char *a, size_t a_len, const char *b, size_t b_len);
+
+// slice is a length prefixed view of bytes that may contain zeros. It only
+// owns its data if it came from slice_copy.
+typedef struct slice_s {
+    const char *data;
+    size_t size;
+} slice;
+
+static inline slice
+slice_new(const char *data, size_t size)
+{
+    slice s = { data, size };
+    return s;
+}
+
+static inline slice
+slice_from_str(const char *str)
+{
+    return slice_new(str, strlen(str));
+}
+
+int slice_compare(slice a, slice b);
+slice slice_copy(slice s);
+void slice_free(slice s);
+
+// pinned_slice points into memory owned by a memtable or a table block. The
+// owner is kept alive until pinned_slice_release runs release.
+typedef struct pinned_slice_s {
+    slice value;
+    void (*release)(void *arg);
+    void *arg;
+} pinned_slice;
+
+void pinned_slice_release(pinned_slice *p);
+
 bool dir_exists(const char *path);
 const char *get_file_ext(const char *filename);
 
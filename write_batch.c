@@ -0,0 +1,129 @@
+#include "write_batch.h"
+#include <stdlib.h>
+#include <string.h>
+
+write_batch*
+write_batch_new(void)
+{
+  return calloc(1, sizeof(write_batch));
+}
+
+static int
+batch_add(write_batch* b, uint8_t type, slice key, slice value)
+{
+  if (b->error) {
+    return 1;
+  }
+  if (key.size > UINT16_MAX || value.size > UINT32_MAX) {
+    b->error = 1;
+    return 1;
+  }
+
+  size_t needed = b->len + WRITE_BATCH_OP_HEADER_SIZE + key.size + value.size;
+  if (needed > b->cap) {
+    size_t new_cap = b->cap ? b->cap : 256;
+    while (new_cap < needed) {
+      new_cap *= 2;
+    }
+    char* n = realloc(b->rep, new_cap);
+    if (n == NULL) {
+      b->error = 1;
+      return 1;
+    }
+    b->rep = n;
+    b->cap = new_cap;
+  }
+
+  uint16_t key_size = key.size;
+  uint32_t value_size = value.size;
+  char* p = b->rep + b->len;
+  *p++ = type;
+  memcpy(p, &key_size, sizeof(uint16_t));
+  p += sizeof(uint16_t);
+  memcpy(p, &value_size, sizeof(uint32_t));
+  p += sizeof(uint32_t);
+  memcpy(p, key.data, key.size);
+  memcpy(p + key.size, value.data, value.size);
+
+  b->len = needed;
+  b->count++;
+  b->data_size += key.size + value.size;
+  return 0;
+}
+
+int
+write_batch_put(write_batch* b, slice key, slice value)
+{
+  return batch_add(b, WRITE_BATCH_PUT, key, value);
+}
+
+int
+write_batch_delete(write_batch* b, slice key)
+{
+  return batch_add(b, WRITE_BATCH_DELETE, key, slice_new("", 0));
+}
+
+// write_batch_delete_range deletes every key in [start, end) with a single
+// operation, whatever is stored there.
+int
+write_batch_delete_range(write_batch* b, slice start, slice end)
+{
+  if (end.size > UINT16_MAX) {
+    b->error = 1;
+    return 1;
+  }
+  return batch_add(b, WRITE_BATCH_DELETE_RANGE, start, end);
+}
+
+// write_batch_clear empties the batch but keeps its buffer for reuse
+void
+write_batch_clear(write_batch* b)
+{
+  b->len = 0;
+  b->count = 0;
+  b->data_size = 0;
+  b->error = 0;
+}
+
+void
+write_batch_free(write_batch* b)
+{
+  if (b) {
+    free(b->rep);
+    free(b);
+  }
+}
+
+// write_batch_iterate calls fn for every operation encoded in rep, in the
+// order they were added. It stops at the first call that returns non zero and
+// returns that, or 1 if the encoding is cut short.
+int
+write_batch_iterate(const char* rep, size_t len, write_batch_handler fn, void* arg)
+{
+  const char* p = rep;
+  const char* end = rep + len;
+  while (p < end) {
+    if ((size_t)(end - p) < WRITE_BATCH_OP_HEADER_SIZE) {
+      return 1;
+    }
+
+    uint8_t type = *p++;
+    uint16_t key_size;
+    uint32_t value_size;
+    memcpy(&key_size, p, sizeof(uint16_t));
+    p += sizeof(uint16_t);
+    memcpy(&value_size, p, sizeof(uint32_t));
+    p += sizeof(uint32_t);
+    if ((size_t)(end - p) < (size_t)key_size + value_size ||
+        (type != WRITE_BATCH_PUT && type != WRITE_BATCH_DELETE && type != WRITE_BATCH_DELETE_RANGE)) {
+      return 1;
+    }
+
+    int res = fn(arg, type, slice_new(p, key_size), slice_new(p + key_size, value_size));
+    if (res != 0) {
+      return res;
+    }
+    p += key_size + value_size;
+  }
+  return 0;
+}
@@ -0,0 +1,40 @@
+#ifndef __WRITE_BATCH_H__
+#define __WRITE_BATCH_H__
+
+#include "utils.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// write_batch collects puts and deletes that are logged as a single WAL
+// record and applied together, a crash either keeps all of them or none.
+//
+// The operations are encoded back to back as
+//   [u8 type][u16 key_size][u32 value_size][key][value]
+// and the encoding is what ends up in the log. A range deletion stores the
+// start of the range as its key and the end as its value.
+
+#define WRITE_BATCH_PUT     1
+#define WRITE_BATCH_DELETE  2
+#define WRITE_BATCH_DELETE_RANGE  3
+#define WRITE_BATCH_OP_HEADER_SIZE  (sizeof(uint8_t) + sizeof(uint16_t) + sizeof(uint32_t))
+
+typedef struct write_batch_s {
+  char* rep;
+  size_t len;
+  size_t cap;
+  uint32_t count; // operations in the batch
+  uint64_t data_size; // key and value bytes, counted in the write stats
+  int error; // set if an operation couldn't be added, the batch can't be written then
+} write_batch;
+
+typedef int (*write_batch_handler)(void* arg, int type, slice key, slice value);
+
+write_batch* write_batch_new(void);
+int write_batch_put(write_batch* b, slice key, slice value);
+int write_batch_delete(write_batch* b, slice key);
+int write_batch_delete_range(write_batch* b, slice start, slice end);
+void write_batch_clear(write_batch* b);
+void write_batch_free(write_batch* b);
+int write_batch_iterate(const char* rep, size_t len, write_batch_handler fn, void* arg);
+
+#endif